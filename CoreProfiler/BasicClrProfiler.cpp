@@ -4,10 +4,70 @@
 #include "BasicClrProfiler.h"
 
 #include "ClrModule.h"
+#include "ILRewriter.h"
 #include "Constants.h"
+#include "EventTrace.h"
+#include "ProbeRegistry.h"
+#include "Misc.h"
+#include "RewriteCache.h"
+#include "Sampling.h"
+#include "CommandPipe.h"
+
+#include <algorithm>
+
+// Modules loaded within this long of each other have their methods re-JITted together
+#define REJIT_BATCH_INTERVAL_MS 100
+
+// How long the runtime should expect a detach to take
+#define DETACH_EXPECTED_COMPLETION_MS 5000
+
+static double millisecondsSince(INT64 startTimestamp)
+{
+    return (getTimestamp() - startTimestamp) * 1000.0 / getTimestampFrequency();
+}
 
 // CBasicClrProfiler
 
+#ifndef _WIN32
+
+HRESULT CBasicClrProfiler::QueryInterface(REFIID riid, void ** ppvObject)
+{
+    if (ppvObject == nullptr)
+    {
+        return E_POINTER;
+    }
+
+    if (IsEqualIID(riid, IID_IUnknown) || IsEqualIID(riid, IID_ICorProfilerCallback) ||
+        IsEqualIID(riid, IID_ICorProfilerCallback2) || IsEqualIID(riid, IID_ICorProfilerCallback3) ||
+        IsEqualIID(riid, IID_ICorProfilerCallback4))
+    {
+        *ppvObject = static_cast<ICorProfilerCallback4 *>(this);
+        AddRef();
+        return S_OK;
+    }
+
+    *ppvObject = nullptr;
+    return E_NOINTERFACE;
+}
+
+ULONG CBasicClrProfiler::AddRef()
+{
+    return m_cRef.fetch_add(1) + 1;
+}
+
+ULONG CBasicClrProfiler::Release()
+{
+    ULONG cRef = m_cRef.fetch_sub(1) - 1;
+    if (cRef == 0)
+    {
+        delete this;
+    }
+
+    return cRef;
+}
+
+#endif
+
 HRESULT CBasicClrProfiler::Initialize(IUnknown * pICorProfilerInfoUnk)
 {
 	if (pICorProfilerInfoUnk == NULL)
@@ -19,62 +79,339 @@ HRESULT CBasicClrProfiler::Initialize(IUnknown * pICorProfilerInfoUnk)
 
 	DWORD dwEventMask = COR_PRF_MONITOR_MODULE_LOADS | COR_PRF_MONITOR_JIT_COMPILATION 
         | COR_PRF_DISABLE_INLINING | COR_PRF_USE_PROFILE_IMAGES;
-	m_pICorProfilerInfo2->SetEventMask(dwEventMask);
 
-    copyInteropHelperDll();
+    // Commands switch the instrumentation of methods by ReJIT, which has to be asked for
+    // at startup
+    if (g_commandPipe.IsEnabled() == true)
+    {
+        m_pICorProfilerInfo4 = pICorProfilerInfoUnk;
+    }
+
+    if (m_pICorProfilerInfo4 == nullptr ||
+        FAILED(m_pICorProfilerInfo2->SetEventMask(dwEventMask | COR_PRF_ENABLE_REJIT)))
+    {
+        m_pICorProfilerInfo4.Release();
+        m_pICorProfilerInfo2->SetEventMask(dwEventMask);
+    }
 
+    start();
 	return S_OK;
 }
 
+// Attached by ICLRProfiling::AttachProfiler or DiagnosticsClient.AttachProfiler. Inlining
+// can't be disabled after startup, so a method inlined into another one keeps running
+// without probes there.
+//
+// Where the runtime allows ReJIT after attach, the methods the filter selects are
+// instrumented by ReJIT only, whether jitted already or not, which lets the detach
+// command revert all of them. Otherwise methods jitted after the attach are
+// instrumented as usual and the profiler can't detach.
+HRESULT CBasicClrProfiler::InitializeForAttach(IUnknown * pICorProfilerInfoUnk, void * pvClientData, UINT cbClientData)
+{
+    UNREFERENCED_PARAMETER(pvClientData);
+    UNREFERENCED_PARAMETER(cbClientData);
+
+    m_attachTimestamp = getTimestamp();
+
+    m_pICorProfilerInfo2 = pICorProfilerInfoUnk;
+    m_pICorProfilerInfo3 = pICorProfilerInfoUnk;
+    if (m_pICorProfilerInfo3 == nullptr)
+    {
+        return E_FAIL;
+    }
+
+    // The process rarely runs with the variables of the profiler set, so the command
+    // pipe is always served after an attach
+    g_commandPipe.UseDefaultName();
+
+    DWORD dwEventMask = COR_PRF_MONITOR_MODULE_LOADS | COR_PRF_MONITOR_JIT_COMPILATION;
+
+    m_pICorProfilerInfo4 = pICorProfilerInfoUnk;
+    if (m_pICorProfilerInfo4 != nullptr &&
+        SUCCEEDED(m_pICorProfilerInfo2->SetEventMask(dwEventMask | COR_PRF_ENABLE_REJIT)))
+    {
+        m_fInstrumentByReJit = true;
+    }
+    else
+    {
+        m_pICorProfilerInfo4.Release();
+
+        HRESULT hr = m_pICorProfilerInfo2->SetEventMask(dwEventMask);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+    }
+
+    start();
+    return S_OK;
+}
+
+// Modules loaded before the attach aren't reported by ModuleLoadFinished
+HRESULT CBasicClrProfiler::ProfilerAttachComplete()
+{
+    std::vector<std::pair<ModuleID, ModuleContext *>> modules;
+    ModuleIDToInfoMap::ReadHolder readHolder(&m_moduleIDToInfoMap);
+
+    CComPtr<ICorProfilerModuleEnum> pModuleEnum;
+    if (SUCCEEDED(m_pICorProfilerInfo3->EnumModules(&pModuleEnum)))
+    {
+        ModuleID moduleIds[64];
+        ULONG cModuleIds = 0;
+
+        while (SUCCEEDED(pModuleEnum->Next(_countof(moduleIds), moduleIds, &cModuleIds)) && cModuleIds > 0)
+        {
+            for (ULONG i = 0; i < cModuleIds; i++)
+            {
+                ModuleContext * pContext = trackModule(moduleIds[i]);
+                if (pContext != nullptr)
+                {
+                    modules.push_back(std::make_pair(moduleIds[i], pContext));
+                }
+            }
+        }
+    }
+
+    ULONG cMethods = 0;
+    double pauseMs = 0;
+    if (m_fInstrumentByReJit == true)
+    {
+        switchInstrumentation(modules, g_methodFilter, true, cMethods, pauseMs);
+    }
+
+    g_probeRegistry.WriteReport("[Profiler] attached to %zu modules in %.1f ms; ReJIT of %lu methods paused the runtime %.1f ms\n",
+        modules.size(), millisecondsSince(m_attachTimestamp), (unsigned long)cMethods, pauseMs);
+    return S_OK;
+}
+
+// The runtime is done with the profiler; the DLL stays loaded, see detach
+HRESULT CBasicClrProfiler::ProfilerDetachSucceeded()
+{
+    stop();
+
+    g_probeRegistry.WriteReport("[Profiler] detached\n");
+    return S_OK;
+}
+
+// Shared by both ways of loading the profiler, once the event mask is set
+void CBasicClrProfiler::start()
+{
+    copyInteropHelperDll();
+
+    // A ReJIT mustn't define metadata, so what the probes reference is defined at load
+    // whenever methods may be re-JITted: after an attach that got ReJIT, or with the
+    // command pipe served on a runtime that supports it
+    WSTRING eagerPrepare;
+    m_fEagerPrepare = (getEnvironmentString(ENV_EAGER_PREPARE, eagerPrepare) && eagerPrepare == W("1")) ||
+        m_fInstrumentByReJit == true || (g_commandPipe.IsEnabled() == true && m_pICorProfilerInfo4 != nullptr);
+
+    g_eventTrace.Start();
+    g_samplingControl.Start();
+    g_commandPipe.Start([this](const std::string &command) { return executeCommand(command); });
+
+    if (m_fInstrumentByReJit == true)
+    {
+        m_reJitBatchStop.Reset();
+        m_reJitBatcher = std::thread(&CBasicClrProfiler::reJitBatchThread, this);
+    }
+}
+
+void CBasicClrProfiler::stop()
+{
+    if (m_reJitBatcher.joinable() == true)
+    {
+        m_reJitBatchStop.Set();
+        m_reJitBatcher.join();
+    }
+
+    g_commandPipe.Stop();
+    g_samplingControl.Stop();
+    g_eventTrace.Stop();
+    g_probeRegistry.UnregisterAll();
+    g_rewriteCache.Flush();
+}
+
+HRESULT CBasicClrProfiler::Shutdown()
+{
+    stop();
+    return S_OK;
+}
+
 void CBasicClrProfiler::copyInteropHelperDll()
 {
-    wchar_t exeFilePath[MAX_PATH];
-    wchar_t dllFilePath[MAX_PATH];
+    std::filesystem::path exeFilePath;
+    std::filesystem::path dllFilePath;
 
-    if (GetModuleFileName(nullptr, exeFilePath, MAX_PATH) == 0)
+#ifdef _WIN32
+    WCHAR wszExeFilePath[MAX_PATH];
+    if (GetModuleFileName(nullptr, wszExeFilePath, MAX_PATH) == 0)
     {
         return;
     }
 
-    HINSTANCE hInst = (HINSTANCE)_AtlBaseModule.m_hInst;
-    if (GetModuleFileName(hInst, dllFilePath, MAX_PATH) == 0)
+    exeFilePath = wszExeFilePath;
+#else
+    std::error_code error;
+    exeFilePath = std::filesystem::read_symlink("/proc/self/exe", error);
+    if (error)
     {
         return;
     }
+#endif
 
-    ::PathRemoveFileSpec(exeFilePath);
-    ::PathRemoveFileSpec(dllFilePath);
-
-    ::PathCombine(exeFilePath, exeFilePath, NAME_HELPER_DLL);
-    ::PathCombine(dllFilePath, dllFilePath, NAME_HELPER_DLL);
+    if (getProfilerModulePath(dllFilePath) == false)
+    {
+        return;
+    }
 
-    ::CopyFile(dllFilePath, exeFilePath, FALSE);
+    std::error_code copyError;
+    std::filesystem::copy_file(dllFilePath.parent_path() / NAME_HELPER_DLL, exeFilePath.parent_path() / NAME_HELPER_DLL,
+        std::filesystem::copy_options::overwrite_existing, copyError);
 }
 
 HRESULT CBasicClrProfiler::ModuleLoadFinished(ModuleID moduleId, HRESULT hrStatus)
 {
+    if (m_fDetaching.load() == true)
+    {
+        return S_OK;
+    }
+
+    ModuleContext * pContext = trackModule(moduleId);
+    if (pContext != nullptr && m_fInstrumentByReJit == true)
+    {
+        // Every RequestReJIT suspends the runtime, so loads are batched by reJitBatchThread
+        CSHolder csHolder(&m_pendingLock);
+        m_pendingReJitModules.push_back(std::make_pair(moduleId, pContext));
+    }
+
+	return S_OK;
+}
+
+// Instruments the methods of the modules loaded since its last round with one ReJIT request
+void CBasicClrProfiler::reJitBatchThread()
+{
+    while (m_reJitBatchStop.Wait(REJIT_BATCH_INTERVAL_MS) == false)
+    {
+        // Held before the swap: a module unloaded after it is only freed once the round is over
+        std::vector<std::pair<ModuleID, ModuleContext *>> modules;
+        ModuleIDToInfoMap::ReadHolder readHolder(&m_moduleIDToInfoMap);
+        {
+            CSHolder csHolder(&m_pendingLock);
+            modules.swap(m_pendingReJitModules);
+        }
+
+        if (modules.empty() == false)
+        {
+            ULONG cMethods = 0;
+            double pauseMs = 0;
+            switchInstrumentation(modules, g_methodFilter, true, cMethods, pauseMs);
+
+            g_probeRegistry.WriteReport("[Profiler] ReJIT of %lu methods in %zu loaded modules paused the runtime %.1f ms\n",
+                (unsigned long)cMethods, modules.size(), pauseMs);
+        }
+    }
+}
+
+// Creates the context of a module with something to instrument in it
+ModuleContext * CBasicClrProfiler::trackModule(ModuleID moduleId)
+{
+    // Right after an attach, a module can be both enumerated and reported as loaded
+    CSHolder csHolder(&m_trackLock);
+
+    if (m_moduleIDToInfoMap.Find(moduleId) != nullptr)
+    {
+        return nullptr;
+    }
+
     ClrModule clrModule(m_pICorProfilerInfo2, moduleId);
 
     if (clrModule.Initialize() == false)
     {
-        return S_OK;
+        return nullptr;
     }
 
-    ModuleContext context;
-    clrModule.PrepareModuleContext(context);
+    ModuleContext * pContext = new ModuleContext();
+    if (clrModule.ApplyFilter(*pContext) == false)
+    {
+        delete pContext;
+        return nullptr;
+    }
 
-    m_moduleIDToInfoMap.Update(moduleId, context);    
-	return S_OK;
+    // Otherwise no metadata is defined in the module until one of its methods is rewritten
+    if (m_fEagerPrepare == true)
+    {
+        bool fPrepared = clrModule.PrepareModuleContext(*pContext);
+        pContext->m_prepareState.store(fPrepared ? ModuleContext::Prepared : ModuleContext::PrepareFailed,
+            std::memory_order_relaxed);
+    }
+
+    m_moduleIDToInfoMap.Adopt(moduleId, pContext);
+    return pContext;
+}
+
+bool CBasicClrProfiler::prepareModuleContext(ModuleID moduleId, ModuleContext &context)
+{
+    int state = context.m_prepareState.load(std::memory_order_acquire);
+    if (state == ModuleContext::Unprepared)
+    {
+        CSHolder csHolder(&context.m_prepareLock);
+
+        state = context.m_prepareState.load(std::memory_order_relaxed);
+        if (state == ModuleContext::Unprepared)
+        {
+            ClrModule clrModule(m_pICorProfilerInfo2, moduleId);
+
+            bool fPrepared = clrModule.Initialize() && clrModule.PrepareModuleContext(context);
+            state = fPrepared ? ModuleContext::Prepared : ModuleContext::PrepareFailed;
+
+            context.m_prepareState.store(state, std::memory_order_release);
+        }
+    }
+
+    return state == ModuleContext::Prepared;
 }
 
 HRESULT CBasicClrProfiler::ModuleUnloadStarted(ModuleID moduleId)
 {
+    {
+        ModuleIDToInfoMap::ReadHolder readHolder(&m_moduleIDToInfoMap);
+
+        ModuleContext * pContext = m_moduleIDToInfoMap.Find(moduleId);
+        if (pContext != nullptr)
+        {
+            // A rewrite on another thread may be preparing the module, which registers it
+            CSHolder csHolder(&pContext->m_prepareLock);
+            g_probeRegistry.Unregister(pContext->m_moduleCookie);
+        }
+    }
+
+    {
+        CSHolder csHolder(&m_pendingLock);
+        m_pendingReJitModules.erase(std::remove_if(m_pendingReJitModules.begin(), m_pendingReJitModules.end(),
+            [moduleId](const std::pair<ModuleID, ModuleContext *> &module) { return module.first == moduleId; }),
+            m_pendingReJitModules.end());
+    }
+
+    if (m_pICorProfilerInfo4 != nullptr)
+    {
+        CSHolder csHolder(&m_reJitLock);
+        m_reJitInstrumented.erase(m_reJitInstrumented.lower_bound(std::make_pair(moduleId, (mdMethodDef)0)),
+            m_reJitInstrumented.upper_bound(std::make_pair(moduleId, (mdMethodDef)~0u)));
+        m_reJitBodies.erase(m_reJitBodies.lower_bound(std::make_pair(moduleId, (mdMethodDef)0)),
+            m_reJitBodies.upper_bound(std::make_pair(moduleId, (mdMethodDef)~0u)));
+    }
+
     m_moduleIDToInfoMap.EraseIfExists(moduleId);
     return S_OK;
 }
 
 HRESULT CBasicClrProfiler::JITCompilationStarted(FunctionID functionId, BOOL fIsSafeToBlock)
 {
+    if (m_fInstrumentByReJit == true)
+    {
+        return S_OK;
+    }
+
     mdToken methodToken = 0;
     ModuleID moduleId = 0;
     ClassID classId;
@@ -85,15 +422,377 @@ HRESULT CBasicClrProfiler::JITCompilationStarted(FunctionID functionId, BOOL fIs
         return S_OK;
     }
 
-    ModuleContext context;
-    if (m_moduleIDToInfoMap.LookupIfExists(moduleId, &context) == FALSE)
+    // Keeps the context alive through the rewrite if the module unloads meanwhile
+    ModuleIDToInfoMap::ReadHolder readHolder(&m_moduleIDToInfoMap);
+
+    ModuleContext * pContext = m_moduleIDToInfoMap.Find(moduleId);
+    if (pContext == nullptr || pContext->m_methodFilter.IsIncluded(methodToken) == false)
+    {
+        return S_OK;
+    }
+
+    if (prepareModuleContext(moduleId, *pContext) == false || pContext->IsValid() == false)
     {
         return S_OK;
     }
 
+    if (SUCCEEDED(RewriteIL(m_pICorProfilerInfo2, NULL, moduleId, methodToken, *pContext)))
+    {
+        reportFirstInstrumented();
+    }
+
+    return S_OK;
+}
+
+// How long after the attach the first instrumented method was compiled
+void CBasicClrProfiler::reportFirstInstrumented()
+{
+    if (m_attachTimestamp != 0 && m_fFirstInstrumentedSeen.load(std::memory_order_relaxed) == false &&
+        m_fFirstInstrumentedSeen.exchange(true) == false)
+    {
+        g_probeRegistry.WriteReport("[Profiler] first method instrumented %.1f ms after the attach\n",
+            millisecondsSince(m_attachTimestamp));
+    }
+}
+
+HRESULT CBasicClrProfiler::GetReJITParameters(ModuleID moduleId, mdMethodDef methodId, ICorProfilerFunctionControl * pFunctionControl)
+{
+    bool fInstrument = false;
+    std::vector<BYTE> body;
+    {
+        CSHolder csHolder(&m_reJitLock);
+
+        auto key = std::make_pair(moduleId, methodId);
+        auto iterator = m_reJitInstrumented.find(key);
+        if (iterator == m_reJitInstrumented.end())
+        {
+            return S_OK;
+        }
+
+        fInstrument = iterator->second;
+
+        if (fInstrument == true)
+        {
+            auto bodyIterator = m_reJitBodies.find(key);
+            if (bodyIterator == m_reJitBodies.end())
+            {
+                return E_FAIL;
+            }
+
+            body = bodyIterator->second;
+        }
+    }
+
+    // No metadata may be defined here, so the body with probes was rewritten beforehand
+    if (fInstrument == true)
+    {
+        return pFunctionControl->SetILFunctionBody((ULONG)body.size(), body.data());
+    }
+
+    // Without a body of ours the ReJIT would compile the one the first JIT was given
     ClrModule clrModule(m_pICorProfilerInfo2, moduleId);
+    LPCBYTE pBody = nullptr;
+    ULONG cbBody = 0;
+    if (clrModule.Initialize() == false || clrModule.GetImageILBody(methodId, pBody, cbBody) == false)
+    {
+        return E_FAIL;
+    }
 
-    clrModule.Rewrite(context, classId, functionId, methodToken);
+    return pFunctionControl->SetILFunctionBody(cbBody, pBody);
+}
 
+HRESULT CBasicClrProfiler::ReJITCompilationFinished(FunctionID functionId, ReJITID rejitId, HRESULT hrStatus, BOOL fIsSafeToBlock)
+{
+    UNREFERENCED_PARAMETER(functionId);
+    UNREFERENCED_PARAMETER(rejitId);
+    UNREFERENCED_PARAMETER(fIsSafeToBlock);
+
+    if (SUCCEEDED(hrStatus))
+    {
+        reportFirstInstrumented();
+    }
+
+    return S_OK;
+}
+
+HRESULT CBasicClrProfiler::ReJITError(ModuleID moduleId, mdMethodDef methodId, FunctionID functionId, HRESULT hrStatus)
+{
+    UNREFERENCED_PARAMETER(functionId);
+
+    outputDebugText("CoreProfiler: ReJIT of method 0x%08x in module 0x%p failed (0x%08x)\n", methodId, (void *)moduleId, hrStatus);
     return S_OK;
 }
+
+// enable <rules>      instruments the methods the filter rules select
+// disable <rules>     removes the probes from them
+// sampling <n>        sets the sampling interval, see Sampling.h
+// detach              removes every probe and unloads an attached profiler
+//
+// Rules are written as for COREPROFILER_FILTER. Only modules that have methods
+// instrumented by the startup filter are considered.
+std::string CBasicClrProfiler::executeCommand(const std::string &command)
+{
+    size_t space = command.find(' ');
+    std::string verb = command.substr(0, space);
+    std::string argument = space == std::string::npos ? std::string() : command.substr(space + 1);
+
+    if (verb == "sampling")
+    {
+        int interval = atoi(argument.c_str());
+        if (interval < 1)
+        {
+            return "error the interval must be positive";
+        }
+
+        g_samplingControl.SetInterval(interval);
+        return "ok";
+    }
+
+    if (verb == "detach")
+    {
+        return detach();
+    }
+
+    if (verb != "enable" && verb != "disable")
+    {
+        return "error unknown command " + verb;
+    }
+
+    if (m_pICorProfilerInfo4 == nullptr)
+    {
+        return "error the runtime doesn't support ReJIT";
+    }
+
+    if (m_fDetaching.load() == true)
+    {
+        return "error detaching";
+    }
+
+    WSTRING rules = fromUtf8(argument);
+    if (rules.empty() == true)
+    {
+        return "error no rules";
+    }
+
+    ULONG cMethods = 0;
+    HRESULT hr = setInstrumentation(rules, verb == "enable", cMethods);
+    if (FAILED(hr))
+    {
+        char szReply[64];
+        snprintf(szReply, sizeof(szReply), "error 0x%08x", hr);
+        return szReply;
+    }
+
+    return "ok " + std::to_string(cMethods);
+}
+
+HRESULT CBasicClrProfiler::setInstrumentation(const WSTRING &rules, bool fInstrument, ULONG &cMethods)
+{
+    std::vector<std::pair<ModuleID, ModuleContext *>> modules;
+    ModuleIDToInfoMap::ReadHolder readHolder(&m_moduleIDToInfoMap);
+    m_moduleIDToInfoMap.ForEach([&](ModuleID moduleId, ModuleContext * pContext)
+    {
+        modules.push_back(std::make_pair(moduleId, pContext));
+    });
+
+    double pauseMs = 0;
+    return switchInstrumentation(modules, MethodFilter(rules), fInstrument, cMethods, pauseMs);
+}
+
+// A method goes back to the code of its first JIT by a revert when that had the
+// instrumentation asked for, and is re-JITted with or without probes otherwise
+HRESULT CBasicClrProfiler::switchInstrumentation(const std::vector<std::pair<ModuleID, ModuleContext *>> &modules,
+    const MethodFilter &filter, bool fInstrument, ULONG &cMethods, double &pauseMs)
+{
+    CSHolder switchHolder(&m_switchLock);
+
+    std::vector<std::vector<mdMethodDef>> selectedMethods(modules.size());
+    for (size_t i = 0; i < modules.size(); i++)
+    {
+        ClrModule clrModule(m_pICorProfilerInfo2, modules[i].first);
+        if (clrModule.Initialize() == true)
+        {
+            clrModule.SelectMethods(filter, selectedMethods[i]);
+        }
+    }
+
+    std::vector<ModuleID> reJitModules;
+    std::vector<mdMethodDef> reJitMethods;
+    std::vector<ModuleContext *> reJitContexts;
+    std::vector<ModuleID> revertModules;
+    std::vector<mdMethodDef> revertMethods;
+
+    {
+        CSHolder csHolder(&m_reJitLock);
+
+        for (size_t i = 0; i < modules.size(); i++)
+        {
+            for (mdMethodDef tkMethod : selectedMethods[i])
+            {
+                bool fInstrumentedByJit = m_fInstrumentByReJit == false && modules[i].second->m_methodFilter.IsIncluded(tkMethod);
+
+                auto iterator = m_reJitInstrumented.find(std::make_pair(modules[i].first, tkMethod));
+                bool fInstrumented = iterator != m_reJitInstrumented.end() ? iterator->second : fInstrumentedByJit;
+                if (fInstrumented == fInstrument)
+                {
+                    continue;
+                }
+
+                if (fInstrument == fInstrumentedByJit)
+                {
+                    revertModules.push_back(modules[i].first);
+                    revertMethods.push_back(tkMethod);
+                }
+                else
+                {
+                    reJitModules.push_back(modules[i].first);
+                    reJitMethods.push_back(tkMethod);
+                    reJitContexts.push_back(modules[i].second);
+                }
+            }
+        }
+    }
+
+    // Rewritten now, while tokens can still be defined; a method whose rewrite fails
+    // keeps the code it has
+    std::vector<std::vector<BYTE>> reJitBodies(reJitMethods.size());
+    if (fInstrument == true)
+    {
+        size_t cRewritten = 0;
+        for (size_t i = 0; i < reJitMethods.size(); i++)
+        {
+            ModuleContext * pContext = reJitContexts[i];
+            if (prepareModuleContext(reJitModules[i], *pContext) == false || pContext->IsValid() == false ||
+                FAILED(RewriteIL(m_pICorProfilerInfo2, &reJitBodies[i], reJitModules[i], reJitMethods[i], *pContext)))
+            {
+                continue;
+            }
+
+            reJitModules[cRewritten] = reJitModules[i];
+            reJitMethods[cRewritten] = reJitMethods[i];
+            reJitBodies[cRewritten].swap(reJitBodies[i]);
+            cRewritten++;
+        }
+
+        reJitModules.resize(cRewritten);
+        reJitMethods.resize(cRewritten);
+        reJitBodies.resize(cRewritten);
+    }
+
+    {
+        CSHolder csHolder(&m_reJitLock);
+
+        for (size_t i = 0; i < revertMethods.size(); i++)
+        {
+            auto key = std::make_pair(revertModules[i], revertMethods[i]);
+            m_reJitInstrumented.erase(key);
+            m_reJitBodies.erase(key);
+        }
+
+        for (size_t i = 0; i < reJitMethods.size(); i++)
+        {
+            auto key = std::make_pair(reJitModules[i], reJitMethods[i]);
+            m_reJitInstrumented[key] = fInstrument;
+
+            if (fInstrument == true)
+            {
+                m_reJitBodies[key].swap(reJitBodies[i]);
+            }
+            else
+            {
+                m_reJitBodies.erase(key);
+            }
+        }
+    }
+
+    cMethods = (ULONG)(reJitMethods.size() + revertMethods.size());
+
+    // Both requests suspend the runtime
+    HRESULT hr = S_OK;
+    INT64 requestTimestamp = getTimestamp();
+    if (reJitMethods.empty() == false)
+    {
+        hr = m_pICorProfilerInfo4->RequestReJIT((ULONG)reJitMethods.size(), reJitModules.data(), reJitMethods.data());
+    }
+
+    if (SUCCEEDED(hr) && revertMethods.empty() == false)
+    {
+        std::vector<HRESULT> status(revertMethods.size());
+        hr = m_pICorProfilerInfo4->RequestRevert((ULONG)revertMethods.size(), revertModules.data(), revertMethods.data(), status.data());
+    }
+
+    pauseMs = millisecondsSince(requestTimestamp);
+    return hr;
+}
+
+// Reverts every ReJIT, so no method runs probes any more, and asks the runtime to detach.
+// Frames that entered instrumented code before may still call the probes, so the DLL
+// is pinned rather than unloaded.  If the runtime refuses, the profiler stays without
+// probes until an enable command.
+std::string CBasicClrProfiler::detach()
+{
+    if (m_attachTimestamp == 0 || m_fInstrumentByReJit == false)
+    {
+        return "error only a profiler attached with ReJIT can detach";
+    }
+
+    if (m_fDetaching.exchange(true) == true)
+    {
+        return "error detaching already";
+    }
+
+    // No module is queued any more, and none is once the loads see the flag
+    m_reJitBatchStop.Set();
+    m_reJitBatcher.join();
+
+    CSHolder switchHolder(&m_switchLock);
+
+    std::vector<ModuleID> revertModules;
+    std::vector<mdMethodDef> revertMethods;
+    {
+        CSHolder csHolder(&m_reJitLock);
+
+        for (const auto &entry : m_reJitInstrumented)
+        {
+            revertModules.push_back(entry.first.first);
+            revertMethods.push_back(entry.first.second);
+        }
+
+        m_reJitInstrumented.clear();
+        m_reJitBodies.clear();
+    }
+
+    HRESULT hr = S_OK;
+    INT64 revertTimestamp = getTimestamp();
+    if (revertMethods.empty() == false)
+    {
+        std::vector<HRESULT> status(revertMethods.size());
+        hr = m_pICorProfilerInfo4->RequestRevert((ULONG)revertMethods.size(), revertModules.data(), revertMethods.data(), status.data());
+    }
+
+    g_probeRegistry.WriteReport("[Profiler] detach: revert of %zu methods paused the runtime %.1f ms\n",
+        revertMethods.size(), millisecondsSince(revertTimestamp));
+
+    if (SUCCEEDED(hr) && pinProfilerModule() == false)
+    {
+        hr = E_FAIL;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pICorProfilerInfo3->RequestProfilerDetach(DETACH_EXPECTED_COMPLETION_MS);
+    }
+
+    if (FAILED(hr))
+    {
+        m_reJitBatchStop.Reset();
+        m_reJitBatcher = std::thread(&CBasicClrProfiler::reJitBatchThread, this);
+        m_fDetaching.store(false);
+
+        char szReply[64];
+        snprintf(szReply, sizeof(szReply), "error 0x%08x", hr);
+        return szReply;
+    }
+
+    return "ok " + std::to_string(revertMethods.size());
+}
@@ -1,32 +1,65 @@
 // BasicClrProfiler.h : Declaration of the CBasicClrProfiler
 
 #pragma once
+
+#ifdef _WIN32
 #include "resource.h"       // main symbols
 
 #include "CoreProfiler_i.h"
+#endif
 
 #include "ProfilerData.h"
-#include "ICorProfilerCallback3Impl.h"
-
-#if defined(_WIN32_WCE) && !defined(_CE_DCOM) && !defined(_CE_ALLOW_SINGLE_THREADED_OBJECTS_IN_MTA)
-#error "Single-threaded COM objects are not properly supported on Windows CE platform, such as the Windows Mobile platforms that do not include full DCOM support. Define _CE_ALLOW_SINGLE_THREADED_OBJECTS_IN_MTA to force ATL to support creating single-thread COM object's and allow use of it's single-threaded COM object implementations. The threading model in your rgs file was set to 'Free' as that is the only threading model supported in non DCOM Windows CE platforms."
-#endif
+#include "Misc.h"
+#include "ICorProfilerCallback4Impl.h"
 
 using namespace ATL;
 
 // CBasicClrProfiler
-
+//
+// The CLR calls back on whatever thread triggers the event, so JITCompilationStarted
+// runs on many threads at once, concurrently with module loads and unloads.
+//
+//  - Ref counting is interlocked (CComMultiThreadModel).
+//  - m_moduleIDToInfoMap is read without locks; only module load/unload take its lock.
+//  - A ModuleContext is immutable once prepared, apart from its GenericSpecIndex and
+//    ByRefLikeIndex, which have their own locks.  Preparation itself runs once under the
+//    context's lock, which unload takes to read the cookie preparation registers.  An
+//    unloaded module's context is retired with its interfaces, and freed by a later
+//    load or unload once no thread holds a ReadHolder of the map from before; rewrites
+//    and ReJIT switches hold one for as long as they use a context.
+//  - Each rewrite owns its ILRewriter; instruction memory comes from a thread_local arena.
+//  - Filter rules are read-only after construction; the fast probe registry and the
+//    body dump sink lock only off the hot path.
+//  - Commands from the command pipe run on its own thread; the ReJIT state they change
+//    is guarded by m_reJitLock, which GetReJITParameters takes too.  Switches run one at
+//    a time under m_switchLock, which also covers the metadata reads and rewrites that
+//    m_reJitLock is never held across.
+//
+// Outside Windows the runtime gets the profiler from the class factory of
+// ClassFactory.cpp, and the profiler implements IUnknown itself.
+
+#ifdef _WIN32
 class ATL_NO_VTABLE CBasicClrProfiler :
-	public CComObjectRootEx<CComSingleThreadModel>,
+	public CComObjectRootEx<CComMultiThreadModel>,
 	public CComCoClass<CBasicClrProfiler, &CLSID_BasicClrProfiler>,
 	public IDispatchImpl<IBasicClrProfiler, &IID_IBasicClrProfiler, &LIBID_CoreProfilerLib, /*wMajor =*/ 1, /*wMinor =*/ 0>,
-	public ICorProfilerCallback3Impl<CBasicClrProfiler>
+	public ICorProfilerCallback4Impl<CBasicClrProfiler>
+#else
+class CBasicClrProfiler :
+	public ICorProfilerCallback4Impl<CBasicClrProfiler>
+#endif
 {
 public:
 	CBasicClrProfiler()
 	{
+		m_fDetaching.store(false);
+		m_fFirstInstrumentedSeen.store(false);
+#ifndef _WIN32
+		m_cRef.store(0);
+#endif
 	}
 
+#ifdef _WIN32
 DECLARE_REGISTRY_RESOURCEID(IDR_BASICCLRPROFILER)
 
 BEGIN_COM_MAP(CBasicClrProfiler)
@@ -35,13 +68,27 @@ BEGIN_COM_MAP(CBasicClrProfiler)
 	COM_INTERFACE_ENTRY(ICorProfilerCallback)
 	COM_INTERFACE_ENTRY(ICorProfilerCallback2)
 	COM_INTERFACE_ENTRY(ICorProfilerCallback3)
+	COM_INTERFACE_ENTRY(ICorProfilerCallback4)
 END_COM_MAP()
+#else
+    STDMETHOD(QueryInterface)(REFIID riid, void ** ppvObject);
+    STDMETHOD_(ULONG, AddRef)();
+    STDMETHOD_(ULONG, Release)();
+#endif
 
     STDMETHOD(Initialize)(IUnknown * pICorProfilerInfoUnk);
+    STDMETHOD(InitializeForAttach)(IUnknown * pICorProfilerInfoUnk, void * pvClientData, UINT cbClientData);
+    STDMETHOD(ProfilerAttachComplete)();
+    STDMETHOD(ProfilerDetachSucceeded)();
+    STDMETHOD(Shutdown)();
     STDMETHOD(ModuleLoadFinished)(ModuleID moduleId, HRESULT hrStatus);
     STDMETHOD(ModuleUnloadStarted)(ModuleID moduleId);
     STDMETHOD(JITCompilationStarted)(FunctionID functionId, BOOL fIsSafeToBlock);
+    STDMETHOD(GetReJITParameters)(ModuleID moduleId, mdMethodDef methodId, ICorProfilerFunctionControl * pFunctionControl);
+    STDMETHOD(ReJITCompilationFinished)(FunctionID functionId, ReJITID rejitId, HRESULT hrStatus, BOOL fIsSafeToBlock);
+    STDMETHOD(ReJITError)(ModuleID moduleId, mdMethodDef methodId, FunctionID functionId, HRESULT hrStatus);
 
+#ifdef _WIN32
 	DECLARE_PROTECT_FINAL_CONSTRUCT()
 
 	HRESULT FinalConstruct()
@@ -52,12 +99,63 @@ END_COM_MAP()
 	void FinalRelease()
 	{
 	}
+#endif
 
 private:
-    IDToInfoMap<ModuleID, ModuleContext> m_moduleIDToInfoMap;
+    ModuleIDToInfoMap m_moduleIDToInfoMap;
+
+    // Prepare every module at load instead of on the first rewrite in it
+    bool m_fEagerPrepare = false;
 
     CComQIPtr<ICorProfilerInfo2> m_pICorProfilerInfo2;
+    void start();
+    void stop();
     void copyInteropHelperDll();
+    ModuleContext * trackModule(ModuleID moduleId);
+    bool prepareModuleContext(ModuleID moduleId, ModuleContext &context);
+
+    std::recursive_mutex m_trackLock;
+
+    // Set when the command pipe is enabled and the runtime accepted COR_PRF_ENABLE_REJIT
+    CComQIPtr<ICorProfilerInfo4> m_pICorProfilerInfo4;
+
+    // Set by an attach, as are the rest
+    CComQIPtr<ICorProfilerInfo3> m_pICorProfilerInfo3;
+    INT64 m_attachTimestamp = 0;
+
+    // Methods are instrumented by ReJIT instead of at their first JIT
+    bool m_fInstrumentByReJit = false;
+    std::atomic<bool> m_fDetaching;
+    std::atomic<bool> m_fFirstInstrumentedSeen;
+    void reportFirstInstrumented();
+
+    // Methods whose instrumentation a command switched away from what the first JIT
+    // did, and whether they are instrumented now
+    std::recursive_mutex m_switchLock;
+    std::recursive_mutex m_reJitLock;
+    std::map<std::pair<ModuleID, mdMethodDef>, bool> m_reJitInstrumented;
+
+    // The bodies of the instrumented ones, rewritten before their ReJIT was requested
+    std::map<std::pair<ModuleID, mdMethodDef>, std::vector<BYTE>> m_reJitBodies;
+
+    // Modules loaded since the last ReJIT batch, with ReJIT instrumentation
+    std::recursive_mutex m_pendingLock;
+    std::vector<std::pair<ModuleID, ModuleContext *>> m_pendingReJitModules;
+    std::thread m_reJitBatcher;
+    StopSignal m_reJitBatchStop;
+    void reJitBatchThread();
+
+    std::string executeCommand(const std::string &command);
+    std::string detach();
+    HRESULT setInstrumentation(const WSTRING &rules, bool fInstrument, ULONG &cMethods);
+    HRESULT switchInstrumentation(const std::vector<std::pair<ModuleID, ModuleContext *>> &modules,
+        const MethodFilter &filter, bool fInstrument, ULONG &cMethods, double &pauseMs);
+
+#ifndef _WIN32
+    std::atomic<ULONG> m_cRef;
+#endif
 };
 
+#ifdef _WIN32
 OBJECT_ENTRY_AUTO(__uuidof(BasicClrProfiler), CBasicClrProfiler)
+#endif
@@ -0,0 +1,98 @@
+// ClassFactory.cpp : DllGetClassObject outside Windows, where the runtime loads the
+// profiler from CORECLR_PROFILER_PATH without COM registration or ATL
+
+#include "stdafx.h"
+#include "BasicClrProfiler.h"
+
+#ifndef _WIN32
+
+// The BasicClrProfiler coclass of CoreProfiler.idl, to be set as CORECLR_PROFILER
+const CLSID CLSID_BasicClrProfiler = { 0xf89ddf6b, 0x9451, 0x4ea9, { 0x8e, 0x02, 0x79, 0x02, 0xe6, 0x1c, 0x0b, 0xcc } };
+
+// The PAL of the runtime defines these, but the profiler isn't linked against it
+extern "C" const IID IID_IUnknown = { 0x00000000, 0x0000, 0x0000, { 0xc0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46 } };
+extern "C" const IID IID_IClassFactory = { 0x00000001, 0x0000, 0x0000, { 0xc0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46 } };
+
+// Lives as long as the module, so it isn't reference counted
+class CBasicClrProfilerFactory : public IClassFactory
+{
+public:
+    STDMETHOD(QueryInterface)(REFIID riid, void ** ppvObject)
+    {
+        if (ppvObject == nullptr)
+        {
+            return E_POINTER;
+        }
+
+        if (IsEqualIID(riid, IID_IUnknown) || IsEqualIID(riid, IID_IClassFactory))
+        {
+            *ppvObject = static_cast<IClassFactory *>(this);
+            return S_OK;
+        }
+
+        *ppvObject = nullptr;
+        return E_NOINTERFACE;
+    }
+
+    STDMETHOD_(ULONG, AddRef)()
+    {
+        return 2;
+    }
+
+    STDMETHOD_(ULONG, Release)()
+    {
+        return 1;
+    }
+
+    STDMETHOD(CreateInstance)(IUnknown * pUnkOuter, REFIID riid, void ** ppvObject)
+    {
+        if (ppvObject == nullptr)
+        {
+            return E_POINTER;
+        }
+
+        *ppvObject = nullptr;
+        if (pUnkOuter != nullptr)
+        {
+            return CLASS_E_NOAGGREGATION;
+        }
+
+        CBasicClrProfiler * pProfiler = new (std::nothrow) CBasicClrProfiler();
+        if (pProfiler == nullptr)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        pProfiler->AddRef();
+        HRESULT hr = pProfiler->QueryInterface(riid, ppvObject);
+        pProfiler->Release();
+
+        return hr;
+    }
+
+    STDMETHOD(LockServer)(BOOL fLock)
+    {
+        UNREFERENCED_PARAMETER(fLock);
+        return S_OK;
+    }
+};
+
+static CBasicClrProfilerFactory s_classFactory;
+
+extern "C" HRESULT STDMETHODCALLTYPE DllGetClassObject(REFCLSID rclsid, REFIID riid, LPVOID * ppv)
+{
+    if (ppv == nullptr)
+    {
+        return E_POINTER;
+    }
+
+    *ppv = nullptr;
+    if (IsEqualCLSID(rclsid, CLSID_BasicClrProfiler) == FALSE)
+    {
+        return CLASS_E_CLASSNOTAVAILABLE;
+    }
+
+    return s_classFactory.QueryInterface(riid, ppv);
+}
+
+#endif
@@ -3,7 +3,11 @@
 #include "ClrModule.h"
 #include "Misc.h"
 #include "Constants.h"
-#include "ILRewriter.h"
+#include "EventTrace.h"
+#include "ProbeRegistry.h"
+#include "Filter.h"
+
+#include <algorithm>
 
 bool ClrModule::Initialize()
 {
@@ -41,11 +45,116 @@ bool ClrModule::Initialize()
     return true;
 }
 
+bool ClrModule::ApplyFilter(ModuleContext &moduleContext)
+{
+    WSTRING assemblyName;
+    retrieveAssemblyName(assemblyName);
+
+    return g_methodFilter.BuildModuleFilter(assemblyName.c_str(), m_pMetaDataImport, moduleContext.m_methodFilter);
+}
+
+void ClrModule::SelectMethods(const MethodFilter &filter, std::vector<mdMethodDef> &methods)
+{
+    WSTRING assemblyName;
+    retrieveAssemblyName(assemblyName);
+
+    ModuleMethodFilter moduleFilter;
+    if (filter.BuildModuleFilter(assemblyName.c_str(), m_pMetaDataImport, moduleFilter) == false)
+    {
+        return;
+    }
+
+    HCORENUM typeEnum = 0;
+    mdTypeDef typeDefs[64];
+    ULONG cTypeDefs = 0;
+
+    while (m_pMetaDataImport->EnumTypeDefs(&typeEnum, typeDefs, _countof(typeDefs), &cTypeDefs) == S_OK && cTypeDefs > 0)
+    {
+        for (ULONG typeIndex = 0; typeIndex < cTypeDefs; typeIndex++)
+        {
+            HCORENUM methodEnum = 0;
+            mdMethodDef methodDefs[64];
+            ULONG cMethodDefs = 0;
+
+            while (m_pMetaDataImport->EnumMethods(&methodEnum, typeDefs[typeIndex], methodDefs, _countof(methodDefs), &cMethodDefs) == S_OK && cMethodDefs > 0)
+            {
+                for (ULONG methodIndex = 0; methodIndex < cMethodDefs; methodIndex++)
+                {
+                    ULONG rva = 0;
+                    if (moduleFilter.IsIncluded(methodDefs[methodIndex]) == false ||
+                        m_pMetaDataImport->GetMethodProps(methodDefs[methodIndex], nullptr, nullptr, 0, nullptr,
+                            nullptr, nullptr, nullptr, &rva, nullptr) != S_OK || rva == 0)
+                    {
+                        continue;
+                    }
+
+                    methods.push_back(methodDefs[methodIndex]);
+                }
+            }
+
+            if (methodEnum != 0)
+            {
+                m_pMetaDataImport->CloseEnum(methodEnum);
+            }
+        }
+    }
+
+    if (typeEnum != 0)
+    {
+        m_pMetaDataImport->CloseEnum(typeEnum);
+    }
+}
+
+bool ClrModule::GetImageILBody(mdMethodDef tkMethod, LPCBYTE &pBody, ULONG &cbBody)
+{
+    ULONG rva = 0;
+    if (m_pMetaDataImport->GetMethodProps(tkMethod, nullptr, nullptr, 0, nullptr,
+        nullptr, nullptr, nullptr, &rva, nullptr) != S_OK || rva == 0)
+    {
+        return false;
+    }
+
+    // Modules the CLR maps as images only; a module loaded from bytes isn't laid out by RVA
+    LPCBYTE pBaseLoadAddress = nullptr;
+    if (m_pICorProfilerInfo2->GetModuleInfo(m_moduleId, &pBaseLoadAddress, 0, nullptr, nullptr, nullptr) != S_OK ||
+        pBaseLoadAddress == nullptr)
+    {
+        return false;
+    }
+
+    COR_ILMETHOD_DECODER decoder((COR_ILMETHOD *)(pBaseLoadAddress + rva));
+
+    pBody = pBaseLoadAddress + rva;
+    cbBody = decoder.GetOnDiskSize((const COR_ILMETHOD *)pBody);
+    return cbBody != 0;
+}
+
+bool ClrModule::cacheInterfaces(ModuleContext &context)
+{
+    context.m_pMetaDataImport = m_pMetaDataImport;
+    context.m_pMetaDataEmit = m_pEmit;
+
+    // Identifies the module across runs for the rewrite cache
+    m_pMetaDataImport->GetScopeProps(nullptr, 0, nullptr, &context.m_mvid);
+
+    // Optional; only the typed probes and methods calling generic methods need them
+    m_pMetaDataImport->QueryInterface(IID_IMetaDataEmit2, (LPVOID *)&context.m_pMetaDataEmit2);
+    m_pMetaDataImport->QueryInterface(IID_IMetaDataImport2, (LPVOID *)&context.m_pMetaDataImport2);
+
+    HRESULT hr = m_pICorProfilerInfo2->GetILFunctionBodyAllocator(m_moduleId, &context.m_pMethodMalloc);
+    if (hr != S_OK)
+    {
+        return false;
+    }
+
+    return true;
+}
+
 bool ClrModule::retrieveObjectToken(ModuleContext &context)
 {
     mdToken tkObject = mdTokenNil;
 
-    wchar_t *objectTypeName = L"System.Object";
+    const WCHAR *objectTypeName = W("System.Object");
     m_pMetaDataImport->FindTypeDefByName(objectTypeName, 0, &tkObject);
     if (IsNilToken(tkObject) == true)
     {
@@ -63,7 +172,7 @@ bool ClrModule::retrieveObjectToken(ModuleContext &context)
 
 bool ClrModule::makeHelperAssemblyRef(ModuleContext &context)
 {
-    WCHAR wszLocale[] = { L"neutral" };
+    WCHAR wszLocale[] = { W("neutral") };
 
     ASSEMBLYMETADATA assemblyMetaData;
     ZeroMemory(&assemblyMetaData, sizeof(assemblyMetaData));
@@ -74,9 +183,9 @@ bool ClrModule::makeHelperAssemblyRef(ModuleContext &context)
     assemblyMetaData.szLocale = wszLocale;
     assemblyMetaData.cbLocale = _countof(wszLocale);
 
-    mdAssemblyRef assemblyRef = NULL;
+    mdAssemblyRef assemblyRef = mdAssemblyRefNil;
     HRESULT hr = m_pAssemblyEmit->DefineAssemblyRef((void *)g_rgbPublicKeyToken, sizeof(g_rgbPublicKeyToken),
-        NAME_HELPER_ASSEMBLY, &assemblyMetaData, NULL, NULL, 0, &assemblyRef);
+        NAME_HELPER_ASSEMBLY, &assemblyMetaData, nullptr, 0, 0, &assemblyRef);
     if (hr != S_OK || IsNilToken(assemblyRef))
     {
         return false;
@@ -108,133 +217,248 @@ bool ClrModule::makeHelperAssemblyRef(ModuleContext &context)
 
     context.m_mdEnterProbeRef = mdEnterProbeRef;
 
+    if (makeTypedProbeRefs(typeRef, context) == false)
+    {
+        return false;
+    }
+
+    if (makeExitProbeRefs(typeRef, context) == false)
+    {
+        return false;
+    }
+
+    if (makeFastProbeRef(typeRef, context) == false)
+    {
+        return false;
+    }
+
+    // Without a cookie the module still gets the reflection based enter probes
+    context.m_moduleCookie = g_probeRegistry.Register(m_moduleId, m_szModule, m_pMetaDataImport);
     return true;
 }
 
-bool ClrModule::makePrimitiveTypeRef(ModuleContext &context)
+bool ClrModule::makeTypedProbeRefs(mdTypeRef helperTypeRef, ModuleContext &context)
 {
-    for (int i = ELEMENT_TYPE_BOOLEAN; i < (ELEMENT_TYPE_BOOLEAN + PRIMITIVE_COUNT); i++)
+    for (int argCount = 0; argCount <= TYPED_PROBE_MAX_ARGS; argCount++)
     {
-        wchar_t *typeName = m_primitiveNames[i - ELEMENT_TYPE_BOOLEAN];
+        // Enter(int, int, object) or Enter<T1, ..., Tn>(int, int, object, !!0, ..., !!n-1)
+        COR_SIGNATURE sigFunctionProbe[7 + TYPED_PROBE_MAX_ARGS * 2];
+        ULONG cbSig = 0;
 
-        mdToken token = getTypeTokenByName(typeName);
-        if (IsNilToken(token) == true)
+        if (argCount == 0)
+        {
+            sigFunctionProbe[cbSig++] = IMAGE_CEE_CS_CALLCONV_DEFAULT;
+        }
+        else
         {
-            token = tryToMakeTypeReference(L"mscorlib", typeName);
+            sigFunctionProbe[cbSig++] = IMAGE_CEE_CS_CALLCONV_GENERIC;
+            sigFunctionProbe[cbSig++] = (COR_SIGNATURE)argCount;      // number of generic parameters
         }
 
-        if (IsNilToken(token) == true)
+        sigFunctionProbe[cbSig++] = (COR_SIGNATURE)(argCount + 3);    // number of arguments
+        sigFunctionProbe[cbSig++] = ELEMENT_TYPE_VOID;
+        sigFunctionProbe[cbSig++] = ELEMENT_TYPE_I4;                  // method token
+        sigFunctionProbe[cbSig++] = ELEMENT_TYPE_I4;                  // module cookie
+        sigFunctionProbe[cbSig++] = ELEMENT_TYPE_OBJECT;
+
+        for (int i = 0; i < argCount; i++)
+        {
+            sigFunctionProbe[cbSig++] = ELEMENT_TYPE_MVAR;
+            sigFunctionProbe[cbSig++] = (COR_SIGNATURE)i;
+        }
+
+        mdToken mdProbeRef;
+        HRESULT hr = m_pEmit->DefineMemberRef(helperTypeRef, NAME_HELPER_METHOD_ENTER,
+            sigFunctionProbe, cbSig, &mdProbeRef);
+        if (hr != S_OK)
         {
             return false;
         }
 
-        context.m_primitives[i] = token;
+        context.m_mdTypedEnterProbeRefs[argCount] = mdProbeRef;
     }
 
     return true;
 }
 
-mdToken ClrModule::getTypeTokenByName(const wchar_t *typeName)
+bool ClrModule::makeExitProbeRefs(mdTypeRef helperTypeRef, ModuleContext &context)
 {
-    if (wcscmp(typeName, L"System.Void") == 0)
+    if (g_probeRegistry.UsesExitProbes() == false)
     {
-        return 0;
+        return true;
     }
 
-    mdTypeDef td = 0;
-    HRESULT hr = m_pMetaDataImport->FindTypeDefByName(typeName, 0, &td);
-    if (IsNilToken(td) == false)
+    COR_SIGNATURE sigTimestamp[] = {
+        IMAGE_CEE_CS_CALLCONV_DEFAULT,      // default calling convention
+        0x0,                                // number of arguments == 0
+        ELEMENT_TYPE_I8,                    // return type == long
+    };
+
+    mdToken mdEnterTimestampRef;
+    HRESULT hr = m_pEmit->DefineMemberRef(helperTypeRef, NAME_HELPER_METHOD_ENTER_TIMESTAMP,
+        sigTimestamp, sizeof(sigTimestamp), &mdEnterTimestampRef);
+    if (hr != S_OK)
     {
-        return td;
+        return false;
     }
 
-    HCORENUM corEnum = 0;
-    mdAssemblyRef mdAssemblies[MAX_LOOKUP_OF_ASMREF];
-    DWORD cAssemblyRefs = 0;
-
-    mdTypeRef foundTypeRef = 0;
+    COR_SIGNATURE sigExitProbe[] = {
+        IMAGE_CEE_CS_CALLCONV_DEFAULT,      // default calling convention
+        0x3,                                // number of arguments == 3
+        ELEMENT_TYPE_VOID,                  // return type == void
+        ELEMENT_TYPE_I4,                    // 1st arg type == method token
+        ELEMENT_TYPE_I4,                    // 2nd arg type == module cookie
+        ELEMENT_TYPE_I8,                    // 3rd arg type == timestamp taken at entry
+    };
 
-    do
+    mdToken mdExitProbeRef;
+    hr = m_pEmit->DefineMemberRef(helperTypeRef, NAME_HELPER_METHOD_EXIT,
+        sigExitProbe, sizeof(sigExitProbe), &mdExitProbeRef);
+    if (hr != S_OK)
     {
-        hr = m_pMetaDataAssemblyImport->EnumAssemblyRefs(&corEnum, mdAssemblies, MAX_LOOKUP_OF_ASMREF, &cAssemblyRefs);
-        if (S_OK != hr)
-        {
-            break;
-        }
+        return false;
+    }
 
-        mdTypeRef tr = 0;
-        for (ULONG asmIndex = 0; asmIndex < cAssemblyRefs; asmIndex++)
-        {
-            hr = m_pMetaDataImport->FindTypeRef(mdAssemblies[asmIndex], typeName, &tr);
-            if (hr == S_OK)
-            {
-                foundTypeRef = tr;
-                break;
-            }
-        }
+    context.m_mdEnterTimestampRef = mdEnterTimestampRef;
+    context.m_mdExitProbeRef = mdExitProbeRef;
 
-    } while (IsNilToken(foundTypeRef));
+    if (g_probeRegistry.PassesReturnValues() == false)
+    {
+        return true;
+    }
 
-    if (corEnum != 0)
+    COR_SIGNATURE sigTypedExitProbe[] = {
+        IMAGE_CEE_CS_CALLCONV_GENERIC,      // generic calling convention
+        0x1,                                // number of generic parameters == 1
+        0x4,                                // number of arguments == 4
+        ELEMENT_TYPE_VOID,                  // return type == void
+        ELEMENT_TYPE_MVAR, 0x0,             // 1st arg type == return value of the method
+        ELEMENT_TYPE_I4,                    // 2nd arg type == method token
+        ELEMENT_TYPE_I4,                    // 3rd arg type == module cookie
+        ELEMENT_TYPE_I8,                    // 4th arg type == timestamp taken at entry
+    };
+
+    mdToken mdTypedExitProbeRef;
+    hr = m_pEmit->DefineMemberRef(helperTypeRef, NAME_HELPER_METHOD_EXIT,
+        sigTypedExitProbe, sizeof(sigTypedExitProbe), &mdTypedExitProbeRef);
+    if (hr != S_OK)
     {
-        m_pMetaDataAssemblyImport->CloseEnum(corEnum);
+        return false;
     }
 
-    return foundTypeRef;
+    context.m_mdTypedExitProbeRef = mdTypedExitProbeRef;
+
+    return true;
 }
 
-mdToken ClrModule::tryToMakeTypeReference(const wchar_t *assemblyName, const wchar_t *typeName)
+bool ClrModule::makeFastProbeRef(mdTypeRef helperTypeRef, ModuleContext &context)
 {
-    mdToken typeToken = mdTokenNil;
+    // The trace records the fast probes only
+    if (g_probeRegistry.IsSelected(m_szModule) == false && g_eventTrace.IsEnabled() == false)
+    {
+        return true;
+    }
 
-    HCORENUM assemblyEnum = 0;
-    mdAssemblyRef asmRefs[MAX_LOOKUP_OF_ASMREF];
-    ULONG cTokens;
-    bool foundAssembly = false;
+    COR_SIGNATURE sigFunctionProbe[] = {
+        IMAGE_CEE_CS_CALLCONV_DEFAULT,      // default calling convention
+        0x2,                                // number of arguments == 2
+        ELEMENT_TYPE_VOID,                  // return type == void
+        ELEMENT_TYPE_I4,                    // 1st arg type == method token
+        ELEMENT_TYPE_I4,                    // 2nd arg type == module cookie
+    };
 
-    do
+    mdToken mdFastEnterProbeRef;
+    HRESULT hr = m_pEmit->DefineMemberRef(helperTypeRef, NAME_HELPER_METHOD_ENTER,
+        sigFunctionProbe, sizeof(sigFunctionProbe), &mdFastEnterProbeRef);
+    if (hr != S_OK)
     {
+        return false;
+    }
 
-        HRESULT hr = m_pMetaDataAssemblyImport->EnumAssemblyRefs(&assemblyEnum, asmRefs, MAX_LOOKUP_OF_ASMREF, &cTokens);
-        if (hr != S_OK)
+    context.m_mdFastEnterProbeRef = mdFastEnterProbeRef;
+    return true;
+}
+
+bool ClrModule::makePrimitiveTypeRef(ModuleContext &context)
+{
+    for (int i = ELEMENT_TYPE_BOOLEAN; i < (ELEMENT_TYPE_BOOLEAN + PRIMITIVE_COUNT); i++)
+    {
+        const WCHAR *typeName = m_primitiveNames[i - ELEMENT_TYPE_BOOLEAN];
+
+        mdToken token = getTypeTokenByName(typeName);
+        if (IsNilToken(token) == true)
         {
-            break;
+            token = tryToMakeTypeReference(W("mscorlib"), typeName);
         }
 
-        wchar_t wchName[MAX_ASSEMBLY_NAME_BUF];
-        ULONG chName;
-
-        for (ULONG i = 0; i < cTokens; i++)
+        if (IsNilToken(token) == true)
         {
-            mdAssemblyRef asmRef = asmRefs[i];
-            hr = m_pMetaDataAssemblyImport->GetAssemblyRefProps(asmRef, nullptr, nullptr,
-                wchName, MAX_ASSEMBLY_NAME_BUF, &chName, nullptr, nullptr, nullptr, nullptr);
+            return false;
+        }
 
-            if (hr != S_OK)
-            {
-                continue;
-            }
+        context.m_primitives[i] = token;
+    }
 
-            foundAssembly = _wcsicmp(wchName, assemblyName) == 0;
-            if (foundAssembly)
-            {
-                m_pEmit->DefineTypeRefByName(asmRef, typeName, &typeToken);
-                break;
-            }
-        }
+    return true;
+}
 
-    } while (foundAssembly == false);
+mdToken ClrModule::getTypeTokenByName(const WCHAR *typeName)
+{
+    if (WSTRING(typeName) == W("System.Void"))
+    {
+        return 0;
+    }
 
-    if (assemblyEnum != 0)
+    mdTypeDef td = 0;
+    m_pMetaDataImport->FindTypeDefByName(typeName, 0, &td);
+    if (IsNilToken(td) == false)
     {
-        m_pMetaDataAssemblyImport->CloseEnum(assemblyEnum);
+        return td;
+    }
+
+    buildRefIndex();
+
+    auto iterator = m_assemblyTypeRefs.find(typeName);
+    if (iterator == m_assemblyTypeRefs.end())
+    {
+        return 0;
+    }
+
+    return iterator->second;
+}
+
+mdToken ClrModule::tryToMakeTypeReference(const WCHAR *assemblyName, const WCHAR *typeName)
+{
+    buildRefIndex();
+
+    WSTRING lowerAssemblyName = assemblyName;
+    std::transform(lowerAssemblyName.begin(), lowerAssemblyName.end(), lowerAssemblyName.begin(), towlower);
+
+    auto iterator = m_assemblyRefs.find(lowerAssemblyName);
+    if (iterator == m_assemblyRefs.end())
+    {
+        return mdTokenNil;
+    }
+
+    mdToken typeToken = mdTokenNil;
+    if (m_pEmit->DefineTypeRefByName(iterator->second, typeName, &typeToken) != S_OK)
+    {
+        return mdTokenNil;
     }
 
+    m_typeRefs.emplace(typeName, typeToken);
+    m_assemblyTypeRefs.emplace(typeName, typeToken);
+
     return typeToken;
 }
 
 bool ClrModule::PrepareModuleContext(ModuleContext &moduleContext)
 {
+    if (cacheInterfaces(moduleContext) == false)
+    {
+        return false;
+    }
+
     if (retrieveObjectToken(moduleContext) == false)
     {
         return false;
@@ -253,69 +477,118 @@ bool ClrModule::PrepareModuleContext(ModuleContext &moduleContext)
     return true;
 }
 
-void ClrModule::Rewrite(ModuleContext &context, ClassID classId, FunctionID functionId, mdToken methodToken)
+mdTypeRef ClrModule::getTypeRef(const WCHAR *findTypeName)
 {
-    if (context.IsValid() == false)
+    buildRefIndex();
+
+    auto iterator = m_typeRefs.find(findTypeName);
+    if (iterator == m_typeRefs.end())
     {
-        return;
+        return mdTypeRefNil;
     }
 
-    RewriteIL(m_pICorProfilerInfo2, m_moduleId, methodToken, context);
+    return iterator->second;
 }
 
-mdTypeRef ClrModule::getTypeRef(const wchar_t *findTypeName)
+void ClrModule::buildRefIndex()
 {
-    const int maxTokens = 512;
-    ULONG typeRefCount = 0;
-    HCORENUM hEnum = 0;
-    mdTypeRef rTypeRefs[maxTokens];
-    mdTypeRef foundRef = mdTypeRefNil;
+    if (m_fRefIndexBuilt == true)
+    {
+        return;
+    }
 
-    do
+    m_fRefIndexBuilt = true;
+
+    HCORENUM assemblyEnum = 0;
+    mdAssemblyRef asmRefs[MAX_LOOKUP_OF_ASMREF];
+    ULONG cAssemblyRefs = 0;
+
+    while (m_pMetaDataAssemblyImport->EnumAssemblyRefs(&assemblyEnum, asmRefs, MAX_LOOKUP_OF_ASMREF, &cAssemblyRefs) == S_OK &&
+        cAssemblyRefs > 0)
     {
+        WCHAR wchName[MAX_ASSEMBLY_NAME_BUF];
+        ULONG chName;
 
-        HRESULT hr = m_pMetaDataImport->EnumTypeRefs(&hEnum, rTypeRefs, maxTokens, &typeRefCount);
-        if (S_OK != hr)
+        for (ULONG i = 0; i < cAssemblyRefs; i++)
         {
-            break;
+            HRESULT hr = m_pMetaDataAssemblyImport->GetAssemblyRefProps(asmRefs[i], nullptr, nullptr,
+                wchName, MAX_ASSEMBLY_NAME_BUF, &chName, nullptr, nullptr, nullptr, nullptr);
+            if (hr != S_OK)
+            {
+                continue;
+            }
+
+            WSTRING name = wchName;
+            std::transform(name.begin(), name.end(), name.begin(), towlower);
+            m_assemblyRefs.emplace(name, asmRefs[i]);
         }
+    }
+
+    if (assemblyEnum != 0)
+    {
+        m_pMetaDataAssemblyImport->CloseEnum(assemblyEnum);
+    }
 
-        wchar_t wszTypeName[MAX_PATH];
+    const int maxTokens = 512;
+    HCORENUM typeEnum = 0;
+    mdTypeRef rTypeRefs[maxTokens];
+    ULONG typeRefCount = 0;
+
+    while (m_pMetaDataImport->EnumTypeRefs(&typeEnum, rTypeRefs, maxTokens, &typeRefCount) == S_OK && typeRefCount > 0)
+    {
+        WCHAR wszTypeName[MAX_PATH];
 
         for (ULONG typeIndex = 0; typeIndex < typeRefCount; typeIndex++)
         {
-            ULONG cbTypeName;
-            hr = m_pMetaDataImport->GetTypeRefProps(rTypeRefs[typeIndex], 0, wszTypeName, MAX_PATH, &cbTypeName);
-            if (S_OK != hr)
+            mdToken tkScope = mdTokenNil;
+            ULONG cchTypeName;
+            HRESULT hr = m_pMetaDataImport->GetTypeRefProps(rTypeRefs[typeIndex], &tkScope, wszTypeName, MAX_PATH, &cchTypeName);
+            if (hr != S_OK)
             {
                 continue;
             }
 
-            if (wcscmp(findTypeName, wszTypeName) == 0)
+            // The first TypeRef of a name wins, as with the scans this index replaces
+            m_typeRefs.emplace(wszTypeName, rTypeRefs[typeIndex]);
+            if (TypeFromToken(tkScope) == mdtAssemblyRef)
             {
-                foundRef = rTypeRefs[typeIndex];
-                break;
+                m_assemblyTypeRefs.emplace(wszTypeName, rTypeRefs[typeIndex]);
             }
         }
+    }
 
-    } while (IsNilToken(foundRef) == true);
-
-    if (hEnum != 0)
+    if (typeEnum != 0)
     {
-        m_pMetaDataImport->CloseEnum(hEnum);
+        m_pMetaDataImport->CloseEnum(typeEnum);
     }
-
-    return foundRef;
 }
 
 void ClrModule::retrieveModuleName()
 {
-    ULONG cchModule = _MAX_PATH;
+    ULONG cchModule = MAX_PATH;
     ULONG rCchModule = 0;
 
     m_pICorProfilerInfo2->GetModuleInfo(m_moduleId, nullptr, cchModule, &rCchModule, m_szModule, nullptr);
 }
 
+void ClrModule::retrieveAssemblyName(WSTRING &assemblyName)
+{
+    mdAssembly tkAssembly = mdTokenNil;
+    WCHAR wszName[MAX_ASSEMBLY_NAME_BUF];
+    ULONG cchName = 0;
+
+    if (m_pMetaDataAssemblyImport->GetAssemblyFromScope(&tkAssembly) == S_OK &&
+        m_pMetaDataAssemblyImport->GetAssemblyProps(tkAssembly, nullptr, nullptr, nullptr,
+            wszName, MAX_ASSEMBLY_NAME_BUF, &cchName, nullptr, nullptr) == S_OK)
+    {
+        assemblyName = wszName;
+        return;
+    }
+
+    // Modules without an assembly manifest go by their file name
+    assemblyName = fromPath(std::filesystem::path(WSTRING(m_szModule)).stem());
+}
+
 bool ClrModule::canApply()
 {
     retrieveModuleName();
@@ -14,30 +14,43 @@ private:
 
     CComQIPtr<ICorProfilerInfo2> m_pICorProfilerInfo2;
     ModuleID m_moduleId = 0;
-    wchar_t m_szModule[_MAX_PATH];
+    WCHAR m_szModule[MAX_PATH];
 
     void retrieveModuleName();
+    void retrieveAssemblyName(WSTRING &assemblyName);
     bool canApply();
-    mdTypeRef getTypeRef(const wchar_t *findTypeName);
+    mdTypeRef getTypeRef(const WCHAR *findTypeName);
+    bool cacheInterfaces(ModuleContext &context);
     bool retrieveObjectToken(ModuleContext &context);
     bool makeHelperAssemblyRef(ModuleContext &context);
+    bool makeTypedProbeRefs(mdTypeRef helperTypeRef, ModuleContext &context);
+    bool makeExitProbeRefs(mdTypeRef helperTypeRef, ModuleContext &context);
+    bool makeFastProbeRef(mdTypeRef helperTypeRef, ModuleContext &context);
     bool makePrimitiveTypeRef(ModuleContext &context);
-    mdToken getTypeTokenByName(const wchar_t *typeName);
-    mdToken tryToMakeTypeReference(const wchar_t *assemblyName, const wchar_t *typeName);
+    mdToken getTypeTokenByName(const WCHAR *typeName);
+    mdToken tryToMakeTypeReference(const WCHAR *assemblyName, const WCHAR *typeName);
+    void buildRefIndex();
 
-    wchar_t *m_primitiveNames[PRIMITIVE_COUNT] = {
-        L"System.Boolean",
-        L"System.Char",
-        L"System.SByte",
-        L"System.Byte",
-        L"System.Int16",
-        L"System.UInt16",
-        L"System.Int32",
-        L"System.UInt32",
-        L"System.Int64",
-        L"System.UInt64",
-        L"System.Single",
-        L"System.Double",
+    // Name to token indexes of the module's AssemblyRefs (lower case names) and TypeRefs,
+    // filled by a single pass on first lookup
+    bool m_fRefIndexBuilt = false;
+    std::unordered_map<WSTRING, mdAssemblyRef> m_assemblyRefs;
+    std::unordered_map<WSTRING, mdTypeRef> m_typeRefs;
+    std::unordered_map<WSTRING, mdTypeRef> m_assemblyTypeRefs;     // scoped by an AssemblyRef
+
+    const WCHAR *m_primitiveNames[PRIMITIVE_COUNT] = {
+        W("System.Boolean"),
+        W("System.Char"),
+        W("System.SByte"),
+        W("System.Byte"),
+        W("System.Int16"),
+        W("System.UInt16"),
+        W("System.Int32"),
+        W("System.UInt32"),
+        W("System.Int64"),
+        W("System.UInt64"),
+        W("System.Single"),
+        W("System.Double"),
     };
 
 public:
@@ -71,6 +84,13 @@ public:
     }
 
     bool Initialize();
+    bool ApplyFilter(ModuleContext &moduleContext);
+
+    // The methods with IL that filter includes
+    void SelectMethods(const MethodFilter &filter, std::vector<mdMethodDef> &methods);
+
+    // The method's body as the image has it, unlike GetILFunctionBody once the method
+    // was rewritten
+    bool GetImageILBody(mdMethodDef tkMethod, LPCBYTE &pBody, ULONG &cbBody);
     bool PrepareModuleContext(ModuleContext &moduleContext);
-    void Rewrite(ModuleContext &context, ClassID classId, FunctionID functionId, mdToken methodToken);
 };
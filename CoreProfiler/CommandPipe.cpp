@@ -0,0 +1,329 @@
+#include "stdafx.h"
+#include "CommandPipe.h"
+#include "Constants.h"
+#include "Misc.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+CommandPipe g_commandPipe;
+
+CommandPipe::CommandPipe()
+{
+    WSTRING value;
+    if (getEnvironmentString(ENV_COMMAND_PIPE, value) == true && value.empty() == false)
+    {
+        m_pipeName = getPipeName(value);
+    }
+}
+
+void CommandPipe::UseDefaultName()
+{
+    if (m_pipeName.empty() == true)
+    {
+        m_pipeName = getPipeName(W("CoreProfiler-") + fromUtf8(std::to_string(getCurrentProcessId())));
+    }
+}
+
+WSTRING CommandPipe::getPipeName(const WSTRING &name)
+{
+#ifdef _WIN32
+    return W("\\\\.\\pipe\\") + name;
+#else
+    WSTRING directory;
+    if (getEnvironmentString(W("TMPDIR"), directory) == false)
+    {
+        directory = W("/tmp");
+    }
+
+    return fromPath(std::filesystem::path(directory) / std::filesystem::path(name));
+#endif
+}
+
+void CommandPipe::Start(Handler handler)
+{
+    if (IsEnabled() == false || m_server.joinable() == true)
+    {
+        return;
+    }
+
+    m_handler = handler;
+
+#ifdef _WIN32
+    m_hStopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    if (m_hStopEvent == nullptr)
+    {
+        return;
+    }
+#else
+    if (pipe2(m_stopPipe, O_CLOEXEC) != 0)
+    {
+        return;
+    }
+#endif
+
+    m_server = std::thread(&CommandPipe::serve, this);
+}
+
+void CommandPipe::Stop()
+{
+    if (m_server.joinable() == false)
+    {
+        return;
+    }
+
+#ifdef _WIN32
+    SetEvent(m_hStopEvent);
+    m_server.join();
+
+    CloseHandle(m_hStopEvent);
+    m_hStopEvent = nullptr;
+#else
+    char stop = 0;
+    while (write(m_stopPipe[1], &stop, 1) == -1 && errno == EINTR)
+    {
+    }
+
+    m_server.join();
+
+    close(m_stopPipe[0]);
+    close(m_stopPipe[1]);
+    m_stopPipe[0] = -1;
+    m_stopPipe[1] = -1;
+#endif
+}
+
+bool CommandPipe::runCommands(std::string &pending, std::string &replies)
+{
+    size_t newline;
+    while ((newline = pending.find('\n')) != std::string::npos)
+    {
+        std::string command = pending.substr(0, newline);
+        pending.erase(0, newline + 1);
+
+        if (command.empty() == false && command.back() == '\r')
+        {
+            command.pop_back();
+        }
+
+        replies += m_handler(command) + "\n";
+    }
+
+    return pending.size() <= COMMAND_PIPE_MAX_LINE;
+}
+
+#ifdef _WIN32
+
+void CommandPipe::serve()
+{
+    OVERLAPPED overlapped = {};
+    overlapped.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    if (overlapped.hEvent == nullptr)
+    {
+        return;
+    }
+
+    while (WaitForSingleObject(m_hStopEvent, 0) == WAIT_TIMEOUT)
+    {
+        HANDLE hPipe = CreateNamedPipe(m_pipeName.c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+            1, COMMAND_PIPE_MAX_LINE, COMMAND_PIPE_MAX_LINE, 0, nullptr);
+        if (hPipe == INVALID_HANDLE_VALUE)
+        {
+            outputDebugText("CoreProfiler: cannot create %s (%lu)\n", toUtf8(m_pipeName).c_str(), GetLastError());
+            break;
+        }
+
+        DWORD cbTransferred = 0;
+        BOOL fDone = ConnectNamedPipe(hPipe, &overlapped);
+        if ((fDone == FALSE && GetLastError() == ERROR_PIPE_CONNECTED) ||
+            complete(hPipe, overlapped, fDone, cbTransferred) == true)
+        {
+            serveClient(hPipe, overlapped);
+        }
+
+        DisconnectNamedPipe(hPipe);
+        CloseHandle(hPipe);
+    }
+
+    CloseHandle(overlapped.hEvent);
+}
+
+void CommandPipe::serveClient(HANDLE hPipe, OVERLAPPED &overlapped)
+{
+    std::string pending;
+    char buffer[512];
+
+    for (;;)
+    {
+        DWORD cbRead = 0;
+        BOOL fDone = ReadFile(hPipe, buffer, sizeof(buffer), nullptr, &overlapped);
+        if (complete(hPipe, overlapped, fDone, cbRead) == false || cbRead == 0)
+        {
+            return;
+        }
+
+        pending.append(buffer, cbRead);
+
+        std::string replies;
+        bool fValid = runCommands(pending, replies);
+
+        if (replies.empty() == false)
+        {
+            DWORD cbWritten = 0;
+            fDone = WriteFile(hPipe, replies.data(), (DWORD)replies.size(), nullptr, &overlapped);
+            if (complete(hPipe, overlapped, fDone, cbWritten) == false)
+            {
+                return;
+            }
+        }
+
+        if (fValid == false)
+        {
+            return;
+        }
+    }
+}
+
+// Waits for an overlapped operation on the pipe to finish; false when it failed or the
+// pipe is being stopped, in which case the operation was cancelled
+bool CommandPipe::complete(HANDLE hPipe, OVERLAPPED &overlapped, BOOL fDone, DWORD &cbTransferred)
+{
+    if (fDone == FALSE && GetLastError() != ERROR_IO_PENDING)
+    {
+        return false;
+    }
+
+    HANDLE handles[] = { overlapped.hEvent, m_hStopEvent };
+    if (WaitForMultipleObjects(_countof(handles), handles, FALSE, INFINITE) != WAIT_OBJECT_0)
+    {
+        CancelIo(hPipe);
+        GetOverlappedResult(hPipe, &overlapped, &cbTransferred, TRUE);
+        return false;
+    }
+
+    return GetOverlappedResult(hPipe, &overlapped, &cbTransferred, FALSE) == TRUE;
+}
+
+#else
+
+void CommandPipe::serve()
+{
+    std::string path = toUtf8(m_pipeName);
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+    {
+        outputDebugText("CoreProfiler: socket path too long: %s\n", path.c_str());
+        return;
+    }
+
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server == -1)
+    {
+        return;
+    }
+
+    // Left behind by an earlier process of the same id; anything else at the path stays
+    struct stat status;
+    if (lstat(path.c_str(), &status) == 0 && S_ISSOCK(status.st_mode))
+    {
+        unlink(path.c_str());
+    }
+
+    // Nobody can connect before listen, so the mode is narrowed in time
+    if (bind(server, (sockaddr *)&address, sizeof(address)) != 0)
+    {
+        outputDebugText("CoreProfiler: cannot create %s (%d)\n", path.c_str(), errno);
+        close(server);
+        return;
+    }
+
+    if (chmod(path.c_str(), S_IRUSR | S_IWUSR) != 0 || listen(server, 1) != 0)
+    {
+        outputDebugText("CoreProfiler: cannot create %s (%d)\n", path.c_str(), errno);
+        close(server);
+        unlink(path.c_str());
+        return;
+    }
+
+    while (waitReadable(server) == true)
+    {
+        int client = accept4(server, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client == -1)
+        {
+            continue;
+        }
+
+        serveClient(client);
+        close(client);
+    }
+
+    close(server);
+    unlink(path.c_str());
+}
+
+void CommandPipe::serveClient(int client)
+{
+    std::string pending;
+    char buffer[512];
+
+    while (waitReadable(client) == true)
+    {
+        ssize_t cbRead = recv(client, buffer, sizeof(buffer), 0);
+        if (cbRead <= 0)
+        {
+            return;
+        }
+
+        pending.append(buffer, cbRead);
+
+        std::string replies;
+        bool fValid = runCommands(pending, replies);
+
+        for (size_t offset = 0; offset < replies.size(); )
+        {
+            ssize_t cbSent = send(client, replies.data() + offset, replies.size() - offset, MSG_NOSIGNAL);
+            if (cbSent <= 0)
+            {
+                return;
+            }
+
+            offset += cbSent;
+        }
+
+        if (fValid == false)
+        {
+            return;
+        }
+    }
+}
+
+// Waits until fd has something to read; false once the pipe is being stopped
+bool CommandPipe::waitReadable(int fd)
+{
+    pollfd fds[] = { { fd, POLLIN, 0 }, { m_stopPipe[0], POLLIN, 0 } };
+
+    for (;;)
+    {
+        int cReady = poll(fds, _countof(fds), -1);
+        if (cReady == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        return cReady > 0 && fds[1].revents == 0;
+    }
+}
+
+#endif
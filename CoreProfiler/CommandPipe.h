@@ -0,0 +1,67 @@
+#pragma once
+
+#include "Misc.h"
+
+// Local command channel: with COREPROFILER_COMMAND_PIPE=name the profiler serves the
+// named pipe \\.\pipe\name, one client at a time. A client writes commands terminated by
+// a newline and reads back one line per command, e.g.
+//
+//     disable MyApp!MyApp.Hot.*
+//     ok 12
+//
+// The pipe has the default security of its process, so only the same user and
+// administrators can write to it; remote clients are rejected.
+//
+// Outside Windows the channel is the Unix domain socket $TMPDIR/name (/tmp/name without
+// TMPDIR), which only the same user can connect to.
+
+#define COMMAND_PIPE_MAX_LINE 4096
+
+class CommandPipe
+{
+public:
+    // Runs a command line and returns the reply line, without the newline
+    typedef std::function<std::string(const std::string &command)> Handler;
+
+    CommandPipe();
+
+    bool IsEnabled()
+    {
+        return m_pipeName.empty() == false;
+    }
+
+    // Serves \\.\pipe\CoreProfiler-<process id> unless a name was set
+    void UseDefaultName();
+
+    // Serves the pipe on a thread of its own, so handlers don't run on a CLR thread
+    void Start(Handler handler);
+    void Stop();
+
+private:
+    static WSTRING getPipeName(const WSTRING &name);
+
+    void serve();
+
+    // Runs the complete lines of pending and appends their replies; false when a line
+    // is too long
+    bool runCommands(std::string &pending, std::string &replies);
+
+#ifdef _WIN32
+    void serveClient(HANDLE hPipe, OVERLAPPED &overlapped);
+    bool complete(HANDLE hPipe, OVERLAPPED &overlapped, BOOL fDone, DWORD &cbTransferred);
+
+    HANDLE m_hStopEvent = nullptr;
+#else
+    void serveClient(int client);
+    bool waitReadable(int fd);
+
+    int m_stopPipe[2] = { -1, -1 };
+#endif
+
+    WSTRING m_pipeName;
+    Handler m_handler;
+
+    std::thread m_server;
+};
+
+extern CommandPipe g_commandPipe;
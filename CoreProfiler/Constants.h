@@ -1,13 +1,30 @@
 #pragma once
 
-constexpr const wchar_t *NAME_HELPER_DLL = L"Intercept.Helper.dll";
-constexpr const wchar_t *NAME_HELPER_ASSEMBLY = L"Intercept.Helper";
-constexpr const wchar_t *NAME_HELPER_MANAGEDTYPE = L"Intercept.Helper.ManagedLayer";
-constexpr const wchar_t *NAME_HELPER_METHOD_ENTER = L"Enter";
-constexpr const wchar_t *NAME_MSCORLIB_DLL = L"mscorlib.dll";
+constexpr const WCHAR *NAME_HELPER_DLL = W("Intercept.Helper.dll");
+constexpr const WCHAR *NAME_HELPER_ASSEMBLY = W("Intercept.Helper");
+constexpr const WCHAR *NAME_HELPER_MANAGEDTYPE = W("Intercept.Helper.ManagedLayer");
+constexpr const WCHAR *NAME_HELPER_METHOD_ENTER = W("Enter");
+constexpr const WCHAR *NAME_HELPER_METHOD_ENTER_TIMESTAMP = W("EnterTimestamp");
+constexpr const WCHAR *NAME_HELPER_METHOD_EXIT = W("Exit");
+constexpr const WCHAR *NAME_MSCORLIB_DLL = W("mscorlib.dll");
 constexpr const BYTE g_rgbPublicKeyToken[] = { 0x20, 0xa5, 0x97, 0x60, 0x64, 0xab, 0x52, 0x7b };
 
 constexpr const int MAX_LOOKUP_OF_ASMREF = 32;
 constexpr const int MAX_LOOKUP_OF_TYPESPEC = 64;
 
-constexpr const int MAX_ASSEMBLY_NAME_BUF = 1024;
\ No newline at end of file
+constexpr const int MAX_ASSEMBLY_NAME_BUF = 1024;
+
+constexpr const WCHAR *ENV_DUMP_FILE = W("COREPROFILER_DUMP_FILE");
+constexpr const WCHAR *ENV_DUMP_METHODS = W("COREPROFILER_DUMP_METHODS");
+constexpr const WCHAR *ENV_FAST_PROBE_MODULES = W("COREPROFILER_FAST_PROBE_MODULES");
+constexpr const WCHAR *ENV_EXIT_PROBES = W("COREPROFILER_EXIT_PROBES");
+constexpr const WCHAR *ENV_RETURN_VALUES = W("COREPROFILER_RETURN_VALUES");
+constexpr const WCHAR *ENV_FILTER = W("COREPROFILER_FILTER");
+constexpr const WCHAR *ENV_FILTER_FILE = W("COREPROFILER_FILTER_FILE");
+constexpr const WCHAR *ENV_EAGER_PREPARE = W("COREPROFILER_EAGER_PREPARE");
+constexpr const WCHAR *ENV_REWRITE_CACHE = W("COREPROFILER_REWRITE_CACHE");
+constexpr const WCHAR *ENV_TRACE_FILE = W("COREPROFILER_TRACE_FILE");
+constexpr const WCHAR *ENV_REPORT_FILE = W("COREPROFILER_REPORT_FILE");
+constexpr const WCHAR *ENV_SAMPLING = W("COREPROFILER_SAMPLING");
+constexpr const WCHAR *ENV_SAMPLING_WINDOW = W("COREPROFILER_SAMPLING_WINDOW");
+constexpr const WCHAR *ENV_COMMAND_PIPE = W("COREPROFILER_COMMAND_PIPE");
\ No newline at end of file
@@ -0,0 +1,103 @@
+#include "stdafx.h"
+#include "Diagnostics.h"
+#include "Constants.h"
+#include "Misc.h"
+
+#include <algorithm>
+
+#if PROFILER_DIAGNOSTICS
+BodyDumpSink g_bodyDumpSink;
+#endif
+
+BodyDumpSink::BodyDumpSink()
+{
+    getEnvironmentString(ENV_DUMP_FILE, m_filePath);
+
+    WSTRING filter;
+    if (getEnvironmentString(ENV_DUMP_METHODS, filter))
+    {
+        std::string tokens = toUtf8(filter);
+        const char * pCur = tokens.c_str();
+        while (*pCur != '\0')
+        {
+            char * pEnd = nullptr;
+            unsigned long token = strtoul(pCur, &pEnd, 0);
+            if (pEnd == pCur)
+            {
+                pCur++;
+                continue;
+            }
+
+            m_methodFilter.push_back((mdToken)token);
+            pCur = pEnd;
+        }
+
+        std::sort(m_methodFilter.begin(), m_methodFilter.end());
+    }
+}
+
+BodyDumpSink::~BodyDumpSink()
+{
+    if (m_pFile != nullptr)
+    {
+        fclose(m_pFile);
+    }
+}
+
+bool BodyDumpSink::IsSelected(mdToken tkMethod)
+{
+    if (m_filePath.empty())
+    {
+        return false;
+    }
+
+    if (m_methodFilter.empty())
+    {
+        return true;
+    }
+
+    return std::binary_search(m_methodFilter.begin(), m_methodFilter.end(), tkMethod);
+}
+
+void BodyDumpSink::Write(ModuleID moduleId, mdToken tkMethod, LPCBYTE pBody, ULONG cbBody)
+{
+    CSHolder csHolder(&m_cs);
+
+    if (openFile() == false)
+    {
+        return;
+    }
+
+    BodyDumpRecord record = {};
+    record.m_magic = BODY_DUMP_MAGIC;
+    record.m_cbBody = cbBody;
+    record.m_moduleId = moduleId;
+    record.m_tkMethod = tkMethod;
+
+    fwrite(&record, sizeof(record), 1, m_pFile);
+    fwrite(pBody, 1, cbBody, m_pFile);
+    fflush(m_pFile);
+}
+
+bool BodyDumpSink::openFile()
+{
+    if (m_pFile != nullptr)
+    {
+        return true;
+    }
+
+    if (m_fOpenFailed == true)
+    {
+        return false;
+    }
+
+    m_pFile = ::openFile(m_filePath, "ab");
+    if (m_pFile == nullptr)
+    {
+        outputDebugText("[CoreProfiler] cannot open dump file: %s\n", toUtf8(m_filePath).c_str());
+        m_fOpenFailed = true;
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "ProfilerData.h"
+#include "Misc.h"
+
+// Dumps of rewritten method bodies are compiled out unless PROFILER_DIAGNOSTICS is 1.
+// Even then nothing is written until COREPROFILER_DUMP_FILE names an output file, and
+// COREPROFILER_DUMP_METHODS can narrow the dump to a list of method tokens, e.g.
+// "0x06000012;0x06000020".
+#ifndef PROFILER_DIAGNOSTICS
+#define PROFILER_DIAGNOSTICS 0
+#endif
+
+// One record of the dump file, followed by m_cbBody bytes of the method body
+struct BodyDumpRecord
+{
+    DWORD   m_magic;        // BODY_DUMP_MAGIC
+    DWORD   m_cbBody;
+    UINT64  m_moduleId;
+    DWORD   m_tkMethod;
+    DWORD   m_reserved;
+};
+
+constexpr const DWORD BODY_DUMP_MAGIC = 0x44424c49;   // "ILBD"
+
+class BodyDumpSink
+{
+public:
+    BodyDumpSink();
+    ~BodyDumpSink();
+
+    bool IsSelected(mdToken tkMethod);
+    void Write(ModuleID moduleId, mdToken tkMethod, LPCBYTE pBody, ULONG cbBody);
+
+private:
+    bool openFile();
+
+    std::recursive_mutex m_cs;
+    WSTRING m_filePath;
+    FILE * m_pFile = nullptr;
+    bool m_fOpenFailed = false;
+
+    // Sorted; empty means every method
+    std::vector<mdToken> m_methodFilter;
+};
+
+#if PROFILER_DIAGNOSTICS
+
+extern BodyDumpSink g_bodyDumpSink;
+
+#define DUMP_METHOD_BODY(moduleId, tkMethod, pBody, cbBody) \
+    do { if (g_bodyDumpSink.IsSelected(tkMethod)) g_bodyDumpSink.Write((moduleId), (tkMethod), (pBody), (cbBody)); } while (0)
+
+#else
+
+#define DUMP_METHOD_BODY(moduleId, tkMethod, pBody, cbBody) ((void)0)
+
+#endif
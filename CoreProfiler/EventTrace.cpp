@@ -0,0 +1,340 @@
+#include "stdafx.h"
+#include "EventTrace.h"
+#include "Constants.h"
+#include "ProbeRegistry.h"
+#include "Misc.h"
+
+EventTrace g_eventTrace;
+
+static thread_local TraceRing * t_pTraceRing = nullptr;
+static thread_local DWORD t_threadId = 0;
+
+// Kept apart from t_pTraceRing, so the probes don't pay for a thread_local with a destructor
+struct TraceRingOwner
+{
+    TraceRing * m_pRing = nullptr;
+
+    ~TraceRingOwner()
+    {
+        if (m_pRing != nullptr)
+        {
+            m_pRing->Abandon();
+        }
+    }
+};
+
+static thread_local TraceRingOwner t_traceRingOwner;
+
+EventTrace::EventTrace()
+{
+    m_fRunning.store(false, std::memory_order_relaxed);
+    m_cDropped.store(0, std::memory_order_relaxed);
+
+    getEnvironmentString(ENV_TRACE_FILE, m_filePath);
+}
+
+EventTrace::~EventTrace()
+{
+    // Shutdown stops the drainer. Waiting for it here, under the loader lock, could
+    // deadlock, so without a Shutdown the rings are left to the process exit.
+    if (m_drainer.joinable() == true)
+    {
+        m_drainer.detach();
+        return;
+    }
+
+    for (TraceRing * pRing : m_rings)
+    {
+        delete pRing;
+    }
+}
+
+void EventTrace::Start()
+{
+    if (IsEnabled() == false || m_drainer.joinable() == true)
+    {
+        return;
+    }
+
+    m_pFile = openFile(m_filePath, "wb");
+    if (m_pFile == nullptr)
+    {
+        outputDebugText("[CoreProfiler] cannot open trace file: %s\n", toUtf8(m_filePath).c_str());
+        return;
+    }
+
+    TraceFileHeader header = {};
+    header.m_magic = TRACE_FILE_MAGIC;
+    header.m_version = TRACE_FILE_VERSION;
+    header.m_timestampFrequency = (uint64_t)getTimestampFrequency();
+    fwrite(&header, sizeof(header), 1, m_pFile);
+
+    m_wakeSignal.Reset();
+    m_fRunning.store(true, std::memory_order_release);
+
+    m_drainer = std::thread(&EventTrace::drainerThread, this);
+}
+
+void EventTrace::Stop()
+{
+    if (m_drainer.joinable() == false)
+    {
+        return;
+    }
+
+    // Probes racing with this may still push; their events are lost
+    m_fRunning.store(false, std::memory_order_release);
+
+    m_wakeSignal.Set();
+    m_drainer.join();
+
+    fclose(m_pFile);
+    m_pFile = nullptr;
+
+    UINT64 cDropped = m_cDropped.load(std::memory_order_relaxed);
+    if (cDropped != 0)
+    {
+        g_probeRegistry.WriteReport("[Profiler] trace dropped %llu event(s)\n", (unsigned long long)cDropped);
+    }
+}
+
+void EventTrace::Record(mdMethodDef tkMethod, int cookie, DWORD flags)
+{
+    if (m_fRunning.load(std::memory_order_acquire) == false)
+    {
+        return;
+    }
+
+    TraceRing * pRing = t_pTraceRing;
+    if (pRing == nullptr)
+    {
+        pRing = registerThread();
+    }
+
+    TraceEvent event;
+    event.m_tkMethod = tkMethod;
+    event.m_moduleCookie = cookie;
+    event.m_threadId = t_threadId;
+    event.m_flags = flags;
+    event.m_timestamp = getTimestamp();
+
+    ULONG cEvents = pRing->TryPush(event);
+    if (cEvents == 0)
+    {
+        m_cDropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    else if (cEvents == TRACE_RING_CAPACITY / 2)
+    {
+        // The count grows by one per push, so each filling of the ring wakes the drainer once
+        m_wakeSignal.Set();
+    }
+}
+
+TraceRing * EventTrace::registerThread()
+{
+    TraceRing * pRing = nullptr;
+
+    {
+        CSHolder csHolder(&m_cs);
+
+        for (TraceRing * pCandidate : m_rings)
+        {
+            if (pCandidate->TryAdopt() == true)
+            {
+                pRing = pCandidate;
+                break;
+            }
+        }
+
+        if (pRing == nullptr)
+        {
+            pRing = new TraceRing();
+            m_rings.push_back(pRing);
+        }
+    }
+
+    t_traceRingOwner.m_pRing = pRing;
+    t_pTraceRing = pRing;
+    t_threadId = getCurrentThreadId();
+    return pRing;
+}
+
+void EventTrace::drain(TraceEvent * pBuffer)
+{
+    std::vector<TraceRing *> rings;
+    {
+        CSHolder csHolder(&m_cs);
+        rings = m_rings;
+    }
+
+    for (TraceRing * pRing : rings)
+    {
+        ULONG cEvents = pRing->Drain(pBuffer, TRACE_RING_CAPACITY);
+        m_pending.insert(m_pending.end(), pBuffer, pBuffer + cEvents);
+    }
+
+    writePending();
+}
+
+void EventTrace::writePending()
+{
+    if (m_pending.empty() == true)
+    {
+        return;
+    }
+
+    writeNames();
+
+    // An event takes at most 41 bytes, which keeps a chunk under TRACE_CHUNK_MAX_RAW_SIZE
+    const size_t cMaxEventsPerChunk = 64 * 1024;
+
+    for (size_t first = 0; first < m_pending.size(); first += cMaxEventsPerChunk)
+    {
+        size_t last = min(first + cMaxEventsPerChunk, m_pending.size());
+
+        m_chunk.clear();
+
+        TraceEvent previous = {};
+        for (size_t i = first; i < last; i++)
+        {
+            const TraceEvent &event = m_pending[i];
+
+            m_chunk.push_back((uint8_t)event.m_flags);
+            TracePutSignedVarint(m_chunk, (int64_t)event.m_threadId - (int64_t)previous.m_threadId);
+            TracePutSignedVarint(m_chunk, (int64_t)event.m_moduleCookie - (int64_t)previous.m_moduleCookie);
+            TracePutSignedVarint(m_chunk, (int64_t)event.m_tkMethod - (int64_t)previous.m_tkMethod);
+            TracePutSignedVarint(m_chunk, event.m_timestamp - previous.m_timestamp);
+
+            previous = event;
+        }
+
+        writeChunk(TRACE_CHUNK_EVENTS, (ULONG)(last - first));
+    }
+
+    m_pending.clear();
+}
+
+void EventTrace::writeNames()
+{
+    m_chunk.clear();
+    ULONG cModules = 0;
+
+    for (const TraceEvent &event : m_pending)
+    {
+        if (event.m_moduleCookie < 0)
+        {
+            continue;
+        }
+
+        size_t cookie = (size_t)event.m_moduleCookie;
+        if (cookie < m_namedModules.size() && m_namedModules[cookie] == true)
+        {
+            continue;
+        }
+
+        if (cookie >= m_namedModules.size())
+        {
+            m_namedModules.resize(cookie + 1, false);
+        }
+        m_namedModules[cookie] = true;
+
+        WSTRING path;
+        if (g_probeRegistry.GetModulePath(event.m_moduleCookie, path) == false)
+        {
+            continue;
+        }
+
+        TracePutVarint(m_chunk, cookie);
+        putString(path);
+        cModules++;
+    }
+
+    if (cModules != 0)
+    {
+        writeChunk(TRACE_CHUNK_MODULE_NAMES, cModules);
+    }
+
+    m_chunk.clear();
+    ULONG cMethods = 0;
+
+    for (const TraceEvent &event : m_pending)
+    {
+        UINT64 key = ((UINT64)(UINT32)event.m_moduleCookie << 32) | event.m_tkMethod;
+        if (m_namedMethods.insert(key).second == false)
+        {
+            continue;
+        }
+
+        WSTRING name;
+        if (g_probeRegistry.GetMethodName(event.m_moduleCookie, event.m_tkMethod, name) == false)
+        {
+            continue;
+        }
+
+        TracePutVarint(m_chunk, (uint64_t)event.m_moduleCookie);
+        TracePutVarint(m_chunk, event.m_tkMethod);
+        putString(name);
+        cMethods++;
+
+        if (m_chunk.size() >= TRACE_CHUNK_MAX_RAW_SIZE / 2)
+        {
+            writeChunk(TRACE_CHUNK_METHOD_NAMES, cMethods);
+            m_chunk.clear();
+            cMethods = 0;
+        }
+    }
+
+    if (cMethods != 0)
+    {
+        writeChunk(TRACE_CHUNK_METHOD_NAMES, cMethods);
+    }
+}
+
+void EventTrace::writeChunk(TraceChunkKind kind, ULONG cRecords)
+{
+    TraceChunkHeader header = {};
+    header.m_kind = kind;
+    header.m_cbRaw = (uint32_t)m_chunk.size();
+    header.m_cRecords = cRecords;
+
+    // Stored as is when compression doesn't pay
+    TraceCompress(m_chunk.data(), m_chunk.size(), m_compressed);
+
+    const std::vector<uint8_t> &payload = m_compressed.size() < m_chunk.size() ? m_compressed : m_chunk;
+    if (&payload == &m_compressed)
+    {
+        header.m_flags = TRACE_CHUNK_COMPRESSED;
+    }
+    header.m_cbStored = (uint32_t)payload.size();
+
+    fwrite(&header, sizeof(header), 1, m_pFile);
+    fwrite(payload.data(), 1, payload.size(), m_pFile);
+}
+
+void EventTrace::putString(const WSTRING &value)
+{
+    std::string utf8 = toUtf8(value);
+
+    TracePutVarint(m_chunk, (uint64_t)utf8.size());
+    m_chunk.insert(m_chunk.end(), utf8.begin(), utf8.end());
+}
+
+void EventTrace::drainerThread()
+{
+    TraceEvent * pBuffer = new TraceEvent[TRACE_RING_CAPACITY];
+
+    // Stop clears m_fRunning before setting the signal, so the last pass drains after it
+    bool fRunning = true;
+    while (fRunning == true)
+    {
+        m_wakeSignal.Wait(TRACE_DRAIN_INTERVAL_MS);
+        m_wakeSignal.Reset();
+
+        fRunning = m_fRunning.load(std::memory_order_acquire);
+        drain(pBuffer);
+    }
+
+    fflush(m_pFile);
+
+    delete[] pBuffer;
+}
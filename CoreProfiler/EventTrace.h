@@ -0,0 +1,168 @@
+#pragma once
+
+#include "ProfilerData.h"
+#include "TraceFormat.h"
+#include "Misc.h"
+
+// Binary trace of the probe calls, written to the file named by COREPROFILER_TRACE_FILE.
+// A probe writes a fixed-size TraceEvent into a ring owned by its thread, which takes no
+// lock, and a drainer thread empties the rings into the file every
+// TRACE_DRAIN_INTERVAL_MS, or as soon as a ring is half full. An event that finds its ring
+// full is dropped and counted.
+//
+// While tracing, every module is instrumented with the fast probes, so the probes write
+// nothing to the console.
+//
+// Each drain pass writes the events it found as one events chunk, preceded by the names
+// of the modules and methods it refers to for the first time (see TraceFormat.h). The
+// events of one thread are in order; events of different threads are interleaved in
+// drain order.
+
+// Events per ring; a power of two
+#define TRACE_RING_CAPACITY 4096
+
+#define TRACE_DRAIN_INTERVAL_MS 10
+
+struct TraceEvent
+{
+    DWORD   m_tkMethod;
+    INT32   m_moduleCookie;
+    DWORD   m_threadId;
+    DWORD   m_flags;        // TRACE_EVENT_*
+    INT64   m_timestamp;    // getTimestamp
+};
+
+// Single producer (the owning thread), single consumer (the drainer).  When its thread
+// exits the ring is abandoned, and once drained it can be handed to a new thread.
+class TraceRing
+{
+public:
+    TraceRing()
+    {
+        m_head.store(0, std::memory_order_relaxed);
+        m_tail.store(0, std::memory_order_relaxed);
+        m_fAbandoned.store(false, std::memory_order_relaxed);
+    }
+
+    void Abandon()
+    {
+        m_fAbandoned.store(true, std::memory_order_release);
+    }
+
+    // Takes an abandoned ring the drainer has emptied for the calling thread
+    bool TryAdopt()
+    {
+        if (m_fAbandoned.load(std::memory_order_acquire) == false ||
+            m_head.load(std::memory_order_relaxed) != m_tail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+
+        m_fAbandoned.store(false, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Returns the number of events in the ring with this one, or 0 when the ring is full
+    ULONG TryPush(const TraceEvent &event)
+    {
+        UINT64 head = m_head.load(std::memory_order_relaxed);
+        UINT64 cEvents = head - m_tail.load(std::memory_order_acquire);
+        if (cEvents == TRACE_RING_CAPACITY)
+        {
+            return 0;
+        }
+
+        m_events[head & (TRACE_RING_CAPACITY - 1)] = event;
+        m_head.store(head + 1, std::memory_order_release);
+        return (ULONG)cEvents + 1;
+    }
+
+    // Moves up to cMaxEvents of the pushed events to pEvents; returns how many
+    ULONG Drain(TraceEvent * pEvents, ULONG cMaxEvents)
+    {
+        UINT64 tail = m_tail.load(std::memory_order_relaxed);
+        UINT64 cEvents = m_head.load(std::memory_order_acquire) - tail;
+        if (cEvents > cMaxEvents)
+        {
+            cEvents = cMaxEvents;
+        }
+
+        for (UINT64 i = 0; i < cEvents; i++)
+        {
+            pEvents[i] = m_events[(tail + i) & (TRACE_RING_CAPACITY - 1)];
+        }
+
+        m_tail.store(tail + cEvents, std::memory_order_release);
+        return (ULONG)cEvents;
+    }
+
+private:
+    // The indexes only grow; each sits on its own cache line so the producer and the
+    // consumer don't contend for one
+    std::atomic<UINT64> m_head;
+    BYTE m_headPadding[64 - sizeof(std::atomic<UINT64>)];
+    std::atomic<UINT64> m_tail;
+    BYTE m_tailPadding[64 - sizeof(std::atomic<UINT64>)];
+
+    std::atomic<bool> m_fAbandoned;
+
+    TraceEvent m_events[TRACE_RING_CAPACITY];
+};
+
+class EventTrace
+{
+public:
+    EventTrace();
+    ~EventTrace();
+
+    bool IsEnabled()
+    {
+        return m_filePath.empty() == false;
+    }
+
+    // Opens the file and starts the drainer; rings of threads that exit go to new threads
+    // once drained, and are freed with the profiler
+    void Start();
+
+    // Stops the drainer after emptying the rings a last time and closes the file
+    void Stop();
+
+    void Record(mdMethodDef tkMethod, int cookie, DWORD flags);
+
+    // Events dropped on a full ring since the trace was created
+    UINT64 GetDroppedCount()
+    {
+        return m_cDropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    TraceRing * registerThread();
+    void drain(TraceEvent * pBuffer);
+
+    // Streaming writer, used by the drainer thread only
+    void writePending();
+    void writeNames();
+    void writeChunk(TraceChunkKind kind, ULONG cRecords);
+    void putString(const WSTRING &value);
+
+    void drainerThread();
+
+    WSTRING m_filePath;
+    FILE * m_pFile = nullptr;
+
+    std::thread m_drainer;
+    StopSignal m_wakeSignal;        // set to stop the drainer, or to drain before the interval
+    std::atomic<bool> m_fRunning;
+    std::atomic<UINT64> m_cDropped;
+
+    std::recursive_mutex m_cs;      // guards m_rings and adopting rings
+    std::vector<TraceRing *> m_rings;
+
+    std::vector<TraceEvent> m_pending;          // drained, not written yet
+    std::vector<uint8_t> m_chunk;
+    std::vector<uint8_t> m_compressed;
+    std::vector<bool> m_namedModules;           // by cookie
+    std::unordered_set<UINT64> m_namedMethods;  // cookie << 32 | token
+};
+
+extern EventTrace g_eventTrace;
@@ -0,0 +1,356 @@
+#include "stdafx.h"
+#include "Filter.h"
+#include "Constants.h"
+#include "Misc.h"
+
+#include <algorithm>
+
+MethodFilter g_methodFilter;
+
+static bool isWildcard(WCHAR ch)
+{
+    return ch == W('*') || ch == W('?');
+}
+
+static bool globMatch(const WCHAR * wszPattern, const WCHAR * wszName)
+{
+    const WCHAR * pStar = nullptr;
+    const WCHAR * pResume = nullptr;
+
+    while (*wszName != W('\0'))
+    {
+        if (*wszPattern == W('*'))
+        {
+            pStar = wszPattern++;
+            pResume = wszName;
+        }
+        else if (*wszPattern == W('?') || *wszPattern == *wszName)
+        {
+            wszPattern++;
+            wszName++;
+        }
+        else if (pStar != nullptr)
+        {
+            wszPattern = pStar + 1;
+            wszName = ++pResume;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    while (*wszPattern == W('*'))
+    {
+        wszPattern++;
+    }
+
+    return *wszPattern == W('\0');
+}
+
+static WSTRING trim(const WSTRING &text)
+{
+    size_t begin = text.find_first_not_of(W(" \t\r\n"));
+    if (begin == WSTRING::npos)
+    {
+        return WSTRING();
+    }
+
+    size_t end = text.find_last_not_of(W(" \t\r\n"));
+    return text.substr(begin, end - begin + 1);
+}
+
+void FilterTrie::Insert(const WSTRING &pattern, int ruleIndex)
+{
+    int node = 0;
+    for (WCHAR ch : pattern)
+    {
+        if (isWildcard(ch) == true)
+        {
+            break;
+        }
+
+        auto iterator = m_nodes[node].m_children.find(ch);
+        if (iterator != m_nodes[node].m_children.end())
+        {
+            node = iterator->second;
+            continue;
+        }
+
+        int child = (int)m_nodes.size();
+        m_nodes[node].m_children[ch] = child;
+        m_nodes.push_back(Node());
+        node = child;
+    }
+
+    m_nodes[node].m_rules.push_back(ruleIndex);
+}
+
+MethodFilter::MethodFilter()
+{
+    WSTRING value;
+
+    if (getEnvironmentString(ENV_FILTER_FILE, value) == true)
+    {
+        loadFile(value);
+    }
+
+    if (getEnvironmentString(ENV_FILTER, value) == true)
+    {
+        addRules(value, W(';'));
+    }
+
+    buildIndex();
+}
+
+MethodFilter::MethodFilter(const WSTRING &rules)
+{
+    addRules(rules, W(';'));
+    buildIndex();
+}
+
+void MethodFilter::buildIndex()
+{
+    m_fDefault = std::none_of(m_rules.begin(), m_rules.end(),
+        [](const Rule &rule) { return rule.m_fInclude; });
+
+    for (size_t i = 0; i < m_rules.size(); i++)
+    {
+        m_assemblyTrie.Insert(m_rules[i].m_assembly, (int)i);
+
+        if (m_rules[i].m_fWholeAssembly == false)
+        {
+            m_qualifiedNameTrie.Insert(m_rules[i].m_qualifiedName, (int)i);
+        }
+    }
+}
+
+void MethodFilter::loadFile(const WSTRING &filePath)
+{
+    std::ifstream file{std::filesystem::path(filePath)};
+    if (file.is_open() == false)
+    {
+        return;
+    }
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        WSTRING wideLine = fromUtf8(line);
+        if (wideLine.empty() == true)
+        {
+            continue;
+        }
+
+        size_t comment = wideLine.find(W('#'));
+        if (comment != WSTRING::npos)
+        {
+            wideLine.erase(comment);
+        }
+
+        addRule(wideLine);
+    }
+}
+
+void MethodFilter::addRules(const WSTRING &rules, WCHAR separator)
+{
+    size_t begin = 0;
+    while (begin <= rules.size())
+    {
+        size_t end = rules.find(separator, begin);
+        if (end == WSTRING::npos)
+        {
+            end = rules.size();
+        }
+
+        addRule(rules.substr(begin, end - begin));
+        begin = end + 1;
+    }
+}
+
+void MethodFilter::addRule(WSTRING text)
+{
+    text = trim(text);
+    if (text.empty() == true)
+    {
+        return;
+    }
+
+    Rule rule;
+    if (text[0] == W('+') || text[0] == W('-'))
+    {
+        rule.m_fInclude = text[0] == W('+');
+        text = trim(text.substr(1));
+    }
+
+    size_t bang = text.find(W('!'));
+    rule.m_assembly = text.substr(0, bang);
+    if (rule.m_assembly.empty() == true)
+    {
+        rule.m_assembly = W("*");
+    }
+
+    std::transform(rule.m_assembly.begin(), rule.m_assembly.end(), rule.m_assembly.begin(), towlower);
+
+    if (bang != WSTRING::npos && bang + 1 < text.size())
+    {
+        rule.m_fWholeAssembly = false;
+        rule.m_qualifiedName = text.substr(bang + 1);
+
+        if (rule.m_qualifiedName.find(W("::")) == WSTRING::npos)
+        {
+            rule.m_qualifiedName += W("::*");
+        }
+    }
+
+    m_rules.push_back(rule);
+}
+
+bool MethodFilter::getTypeName(IMetaDataImport * pMetaDataImport, mdTypeDef tkType, WSTRING &name) const
+{
+    WCHAR wszName[MAX_PATH];
+    ULONG cchName = 0;
+
+    if (pMetaDataImport->GetTypeDefProps(tkType, wszName, MAX_PATH, &cchName, nullptr, nullptr) != S_OK)
+    {
+        return false;
+    }
+
+    name = wszName;
+
+    // Nested types are named Outer+Inner
+    mdTypeDef tkEnclosing = mdTypeDefNil;
+    for (int depth = 0; depth < 16; depth++)
+    {
+        if (pMetaDataImport->GetNestedClassProps(tkType, &tkEnclosing) != S_OK || IsNilToken(tkEnclosing) == true)
+        {
+            break;
+        }
+
+        if (pMetaDataImport->GetTypeDefProps(tkEnclosing, wszName, MAX_PATH, &cchName, nullptr, nullptr) != S_OK)
+        {
+            break;
+        }
+
+        name = WSTRING(wszName) + W("+") + name;
+        tkType = tkEnclosing;
+    }
+
+    return true;
+}
+
+bool MethodFilter::BuildModuleFilter(LPCWSTR wszAssemblyName, IMetaDataImport * pMetaDataImport,
+    ModuleMethodFilter &moduleFilter) const
+{
+    moduleFilter.m_fDefault = true;
+    moduleFilter.m_bits.clear();
+
+    if (m_rules.empty() == true)
+    {
+        return true;
+    }
+
+    WSTRING assemblyName = wszAssemblyName;
+    std::transform(assemblyName.begin(), assemblyName.end(), assemblyName.begin(), towlower);
+
+    // Rules that apply to this assembly; the last whole-assembly one sets the default
+    std::vector<bool> applicable(m_rules.size(), false);
+    int lastWholeAssemblyRule = -1;
+    bool fHasMemberRules = false;
+
+    m_assemblyTrie.ForEachCandidate(assemblyName.c_str(), [&](int ruleIndex)
+    {
+        const Rule &rule = m_rules[ruleIndex];
+        if (globMatch(rule.m_assembly.c_str(), assemblyName.c_str()) == false)
+        {
+            return;
+        }
+
+        applicable[ruleIndex] = true;
+        if (rule.m_fWholeAssembly == true)
+        {
+            lastWholeAssemblyRule = max(lastWholeAssemblyRule, ruleIndex);
+        }
+        else
+        {
+            fHasMemberRules = true;
+        }
+    });
+
+    moduleFilter.m_fDefault = lastWholeAssemblyRule >= 0 ? m_rules[lastWholeAssemblyRule].m_fInclude : m_fDefault;
+    if (fHasMemberRules == false)
+    {
+        return moduleFilter.m_fDefault;
+    }
+
+    bool fAnyIncluded = moduleFilter.m_fDefault;
+
+    HCORENUM typeEnum = 0;
+    mdTypeDef typeDefs[64];
+    ULONG cTypeDefs = 0;
+
+    while (pMetaDataImport->EnumTypeDefs(&typeEnum, typeDefs, _countof(typeDefs), &cTypeDefs) == S_OK && cTypeDefs > 0)
+    {
+        for (ULONG typeIndex = 0; typeIndex < cTypeDefs; typeIndex++)
+        {
+            WSTRING typeName;
+            if (getTypeName(pMetaDataImport, typeDefs[typeIndex], typeName) == false)
+            {
+                continue;
+            }
+
+            HCORENUM methodEnum = 0;
+            mdMethodDef methodDefs[64];
+            ULONG cMethodDefs = 0;
+
+            while (pMetaDataImport->EnumMethods(&methodEnum, typeDefs[typeIndex], methodDefs, _countof(methodDefs), &cMethodDefs) == S_OK && cMethodDefs > 0)
+            {
+                for (ULONG methodIndex = 0; methodIndex < cMethodDefs; methodIndex++)
+                {
+                    WCHAR wszMethod[MAX_PATH];
+                    ULONG cchMethod = 0;
+                    if (pMetaDataImport->GetMethodProps(methodDefs[methodIndex], nullptr, wszMethod, MAX_PATH, &cchMethod,
+                        nullptr, nullptr, nullptr, nullptr, nullptr) != S_OK)
+                    {
+                        continue;
+                    }
+
+                    WSTRING qualifiedName = typeName + W("::") + wszMethod;
+
+                    int lastRule = lastWholeAssemblyRule;
+                    m_qualifiedNameTrie.ForEachCandidate(qualifiedName.c_str(), [&](int ruleIndex)
+                    {
+                        if (ruleIndex > lastRule && applicable[ruleIndex] == true &&
+                            globMatch(m_rules[ruleIndex].m_qualifiedName.c_str(), qualifiedName.c_str()) == true)
+                        {
+                            lastRule = ruleIndex;
+                        }
+                    });
+
+                    bool fInclude = lastRule >= 0 ? m_rules[lastRule].m_fInclude : m_fDefault;
+
+                    ULONG rid = RidFromToken(methodDefs[methodIndex]);
+                    if (rid > moduleFilter.m_bits.size())
+                    {
+                        moduleFilter.m_bits.resize(rid, moduleFilter.m_fDefault);
+                    }
+
+                    moduleFilter.m_bits[rid - 1] = fInclude;
+                    fAnyIncluded |= fInclude;
+                }
+            }
+
+            if (methodEnum != 0)
+            {
+                pMetaDataImport->CloseEnum(methodEnum);
+            }
+        }
+    }
+
+    if (typeEnum != 0)
+    {
+        pMetaDataImport->CloseEnum(typeEnum);
+    }
+
+    return fAnyIncluded;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+// Which methods get instrumented is decided by rules read from COREPROFILER_FILTER_FILE
+// (one rule per line, '#' starts a comment) followed by COREPROFILER_FILTER (rules
+// separated by ';'). A rule is
+//
+//     [+|-]assembly[!type[::method]]
+//
+// where each part is a glob ('*' and '?'), assembly names are matched case-insensitively
+// and nested types are written Outer+Inner. The last matching rule wins. Without any
+// '+' rule everything not excluded is instrumented; otherwise only what is included.
+//
+//     +MyApp;-MyApp!MyApp.Internal.*;+*!*Controller::Get*
+
+// Verdict per MethodDef of one module, computed once at ModuleLoadFinished
+class ModuleMethodFilter
+{
+public:
+    bool IsIncluded(mdMethodDef tkMethod) const
+    {
+        ULONG rid = RidFromToken(tkMethod);
+        if (rid == 0 || rid > m_bits.size())
+        {
+            return m_fDefault;
+        }
+
+        return m_bits[rid - 1];
+    }
+
+private:
+    friend class MethodFilter;
+
+    bool m_fDefault = true;         // for methods without a bit, e.g. <Module> methods
+    std::vector<bool> m_bits;       // by RID - 1; empty when no rule looks past the assembly
+};
+
+// Patterns keyed by their literal prefix, i.e. the part before the first wildcard. A
+// lookup walks the name once and only the patterns whose prefix it passes are globbed.
+class FilterTrie
+{
+public:
+    FilterTrie()
+    {
+        m_nodes.push_back(Node());
+    }
+
+    void Insert(const WSTRING &pattern, int ruleIndex);
+
+    template <class _Callback>
+    void ForEachCandidate(const WCHAR * wszName, _Callback callback) const
+    {
+        int node = 0;
+        for (;;)
+        {
+            for (int ruleIndex : m_nodes[node].m_rules)
+            {
+                callback(ruleIndex);
+            }
+
+            if (*wszName == W('\0'))
+            {
+                break;
+            }
+
+            auto iterator = m_nodes[node].m_children.find(*wszName++);
+            if (iterator == m_nodes[node].m_children.end())
+            {
+                break;
+            }
+
+            node = iterator->second;
+        }
+    }
+
+private:
+    struct Node
+    {
+        std::map<WCHAR, int> m_children;
+        std::vector<int> m_rules;
+    };
+
+    std::vector<Node> m_nodes;
+};
+
+class MethodFilter
+{
+public:
+    MethodFilter();
+
+    // From rules separated by ';' only, e.g. the method set of a command
+    explicit MethodFilter(const WSTRING &rules);
+
+    // Returns false when nothing in the module is instrumented
+    bool BuildModuleFilter(LPCWSTR wszAssemblyName, IMetaDataImport * pMetaDataImport,
+        ModuleMethodFilter &moduleFilter) const;
+
+private:
+    struct Rule
+    {
+        bool m_fInclude = true;
+        bool m_fWholeAssembly = true;
+        WSTRING m_assembly;        // lower case
+        WSTRING m_qualifiedName;   // type::method
+    };
+
+    void loadFile(const WSTRING &filePath);
+    void addRules(const WSTRING &rules, WCHAR separator);
+    void addRule(WSTRING rule);
+    void buildIndex();
+
+    bool getTypeName(IMetaDataImport * pMetaDataImport, mdTypeDef tkType, WSTRING &name) const;
+
+    std::vector<Rule> m_rules;
+    FilterTrie m_assemblyTrie;
+    FilterTrie m_qualifiedNameTrie;
+    bool m_fDefault = true;
+};
+
+extern MethodFilter g_methodFilter;
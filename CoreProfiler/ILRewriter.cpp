@@ -18,8 +18,13 @@
 #include <corhlpr.cpp>
 #include "ProfilerData.h"
 #include "Constants.h"
+#include "Diagnostics.h"
+#include "RewriteCache.h"
+#include "ProbeRegistry.h"
+#include "Sampling.h"
 
 #include <vector>
+#include <algorithm>
 using namespace std;
 
 #include "sigparse.inl"
@@ -41,7 +46,7 @@ public:
         assert(argIndex >= 0);
         assert(GetArgCount() > argIndex);
 
-        return IsPrimitiveType(m_argType[argIndex]);
+        return IsPrimitiveType(m_args[argIndex].m_type);
     }
 
     bool IsVarTypeGeneric(int argIndex)
@@ -49,7 +54,7 @@ public:
         assert(argIndex >= 0);
         assert(GetArgCount() > argIndex);
 
-        return m_argType[argIndex] == ELEMENT_TYPE_VAR;
+        return m_args[argIndex].m_type == ELEMENT_TYPE_VAR;
     }
 
     bool IsGenericArg(int argIndex)
@@ -57,8 +62,63 @@ public:
         assert(argIndex >= 0);
         assert(GetArgCount() > argIndex);
 
-        return m_argType[argIndex] == ELEMENT_TYPE_VAR ||
-            m_argType[argIndex] == ELEMENT_TYPE_MVAR;
+        return m_args[argIndex].m_type == ELEMENT_TYPE_VAR ||
+            m_args[argIndex].m_type == ELEMENT_TYPE_MVAR;
+    }
+
+    // Value types other than the primitives: structs, generic structs, native ints
+    bool IsValueTypeArg(int argIndex)
+    {
+        assert(argIndex >= 0);
+        assert(GetArgCount() > argIndex);
+
+        return m_args[argIndex].m_fValueType;
+    }
+
+    // byref, pointer, typedbyref and ref struct arguments can be neither boxed nor used as
+    // generic arguments
+    bool IsByRefLikeArg(int argIndex)
+    {
+        assert(argIndex >= 0);
+        assert(GetArgCount() > argIndex);
+
+        return m_args[argIndex].m_fByRefLike;
+    }
+
+    bool CanInstantiateWithArg(int argIndex)
+    {
+        assert(argIndex >= 0);
+        assert(GetArgCount() > argIndex);
+
+        return m_args[argIndex].m_fByRefLike == false && m_args[argIndex].m_fCustomMod == false;
+    }
+
+    // The TypeDef or TypeRef of a value type argument, nil for other arguments; whether the
+    // type is a ref struct takes metadata to find out, so the caller reports it back
+    mdToken GetArgValueTypeToken(int argIndex)
+    {
+        assert(argIndex >= 0);
+        assert(GetArgCount() > argIndex);
+
+        return m_args[argIndex].m_tkValueType;
+    }
+
+    void SetArgByRefLike(int argIndex)
+    {
+        assert(argIndex >= 0);
+        assert(GetArgCount() > argIndex);
+
+        m_args[argIndex].m_fByRefLike = true;
+    }
+
+    mdToken GetReturnValueTypeToken()
+    {
+        return m_ret.m_tkValueType;
+    }
+
+    void SetReturnByRefLike()
+    {
+        m_ret.m_fByRefLike = true;
     }
 
     CorElementType GetArgType(int argIndex)
@@ -66,7 +126,7 @@ public:
         assert(argIndex >= 0);
         assert(GetArgCount() > argIndex);
 
-        return m_argType[argIndex];
+        return m_args[argIndex].m_type;
     }
 
     int GetGenericNumber(int argIndex)
@@ -74,15 +134,62 @@ public:
         assert(argIndex >= 0);
         assert(GetArgCount() > argIndex);
 
-        return m_genericVarNumber[argIndex];
+        return m_args[argIndex].m_genericVarNumber;
+    }
+
+    // Raw signature blob of the argument's type
+    PCCOR_SIGNATURE GetArgSig(int argIndex, ULONG *pcbSig)
+    {
+        assert(argIndex >= 0);
+        assert(GetArgCount() > argIndex);
+
+        *pcbSig = (ULONG)(m_args[argIndex].m_pSigEnd - m_args[argIndex].m_pSigBegin);
+        return m_args[argIndex].m_pSigBegin;
+    }
+
+    bool HasReturnValue()
+    {
+        return m_ret.m_type != ELEMENT_TYPE_VOID;
+    }
+
+    bool CanInstantiateWithReturnType()
+    {
+        return HasReturnValue() && m_ret.m_fByRefLike == false && m_ret.m_fCustomMod == false;
+    }
+
+    bool HasReturnTypeCustomMod()
+    {
+        return m_ret.m_fCustomMod;
+    }
+
+    // Raw signature blob of the return type
+    PCCOR_SIGNATURE GetReturnTypeSig(ULONG *pcbSig)
+    {
+        *pcbSig = (ULONG)(m_ret.m_pSigEnd - m_ret.m_pSigBegin);
+        return m_ret.m_pSigBegin;
     }
 
 private:
-    int m_currentArgIndex = 0;
-    
+    struct ArgInfo
+    {
+        CorElementType m_type = ELEMENT_TYPE_END;
+        int m_genericVarNumber = 0;
+        bool m_fValueType = false;
+        bool m_fByRefLike = false;
+        bool m_fCustomMod = false;
+        mdToken m_tkValueType = mdTokenNil;
+        sig_byte *m_pSigBegin = nullptr;
+        sig_byte *m_pSigEnd = nullptr;
+    };
+
     int m_argCount = 0;
-    vector<CorElementType> m_argType;
-    vector<int> m_genericVarNumber;
+    vector<ArgInfo> m_args;
+    ArgInfo m_ret;
+
+    // Function pointer types nest a whole method signature and array/generic types
+    // nest other types; only the outermost ones describe the method's arguments.
+    int m_methodDepth = 0;
+    int m_typeDepth = 0;
 
     bool m_stepInReturnType = false;
     bool m_needBoxOfReturnType = false;
@@ -92,62 +199,210 @@ private:
         return (elem_type >= ELEMENT_TYPE_BOOLEAN && elem_type <= ELEMENT_TYPE_R8);
     }
 
+    static mdToken TypeDefOrRefToken(sig_index_type indexType, sig_index index)
+    {
+        switch (indexType)
+        {
+        case SIG_INDEX_TYPE_TYPEDEF:
+            return TokenFromRid(index, mdtTypeDef);
+        case SIG_INDEX_TYPE_TYPEREF:
+            return TokenFromRid(index, mdtTypeRef);
+        default:
+            return mdTokenNil;
+        }
+    }
+
+    // In the return type or an argument of the method itself
+    bool InParam()
+    {
+        return m_methodDepth == 1 && (m_stepInReturnType == true || m_args.empty() == false);
+    }
+
+    bool InParamType()
+    {
+        return InParam() && m_typeDepth == 1;
+    }
+
+    ArgInfo &CurrentArg()
+    {
+        return m_stepInReturnType ? m_ret : m_args[m_args.size() - 1];
+    }
+
     virtual void NotifyBeginMethod(sig_elem_type elem_type)
     {
-        m_currentArgIndex = 0;
+        m_methodDepth++;
+    }
+
+    virtual void NotifyEndMethod()
+    {
+        m_methodDepth--;
     }
 
     virtual void NotifyParamCount(sig_count countOfArg)
     {
-        m_argCount = countOfArg;   
+        if (m_methodDepth == 1)
+        {
+            m_argCount = countOfArg;
+        }
     }
 
     virtual void NotifyBeginRetType() 
     {
-        m_stepInReturnType = true;
+        if (m_methodDepth == 1)
+        {
+            m_stepInReturnType = true;
+            m_ret.m_pSigBegin = GetCurrentPosition();
+        }
     }
     
     virtual void NotifyEndRetType() 
     {
-        m_stepInReturnType = false;
+        if (m_methodDepth == 1)
+        {
+            m_ret.m_pSigEnd = GetCurrentPosition();
+            m_stepInReturnType = false;
+        }
+    }
+
+    virtual void NotifyVoid()
+    {
+        // void * is a pointer type, not a void return
+        if (m_methodDepth == 1 && m_stepInReturnType == true && m_typeDepth == 0)
+        {
+            m_ret.m_type = ELEMENT_TYPE_VOID;
+        }
+    }
+
+    virtual void NotifyBeginType()
+    {
+        m_typeDepth++;
+    }
+
+    virtual void NotifyEndType()
+    {
+        m_typeDepth--;
     }
 
     virtual void NotifyTypeSimple(sig_elem_type elem_type)
     {
+        if (m_methodDepth != 1 || m_typeDepth != 1)
+        {
+            return;
+        }
+
         if (m_stepInReturnType == true)
         {
             m_needBoxOfReturnType = IsPrimitiveType(elem_type);
         }
-        else
+
+        if (InParam())
         {
-            m_argType[m_argType.size() - 1] = (CorElementType)elem_type;
+            CurrentArg().m_type = (CorElementType)elem_type;
+            CurrentArg().m_fValueType = (elem_type == ELEMENT_TYPE_I || elem_type == ELEMENT_TYPE_U);
         }
     }
 
     virtual void NotifyBeginParam() 
     {
-        m_argType.push_back(ELEMENT_TYPE_END);
-        m_genericVarNumber.push_back(0);
+        if (m_methodDepth == 1)
+        {
+            m_args.push_back(ArgInfo());
+            CurrentArg().m_pSigBegin = GetCurrentPosition();
+        }
     }
 
     virtual void NotifyEndParam() 
     {
+        if (m_methodDepth == 1)
+        {
+            CurrentArg().m_pSigEnd = GetCurrentPosition();
+        }
+    }
+
+    virtual void NotifyByref()
+    {
+        if (InParam())
+        {
+            CurrentArg().m_fByRefLike = true;
+        }
+    }
+
+    virtual void NotifyTypedByref()
+    {
+        if (InParam())
+        {
+            CurrentArg().m_fByRefLike = true;
+        }
+    }
+
+    virtual void NotifyTypePointer()
+    {
+        if (InParam())
+        {
+            CurrentArg().m_fByRefLike = true;
+        }
+    }
+
+    virtual void NotifyTypeFunctionPointer()
+    {
+        if (InParam())
+        {
+            CurrentArg().m_fByRefLike = true;
+        }
+    }
+
+    virtual void NotifyCustomMod(sig_elem_type cmod, sig_index_type indexType, sig_index index)
+    {
+        if (InParam())
+        {
+            CurrentArg().m_fCustomMod = true;
+        }
     }
 
     virtual void NotifyTypeValueType()
     {
+        if (InParamType())
+        {
+            CurrentArg().m_fValueType = true;
+        }
+    }
+
+    virtual void NotifyTypeDefOrRef(sig_index_type indexType, int index)
+    {
+        if (InParamType() && CurrentArg().m_fValueType == true)
+        {
+            CurrentArg().m_tkValueType = TypeDefOrRefToken(indexType, index);
+        }
+    }
+
+    virtual void NotifyTypeGenericInst(sig_elem_type elem_type, sig_index_type indexType, sig_index index, sig_mem_number number)
+    {
+        if (InParamType())
+        {
+            CurrentArg().m_fValueType = (elem_type == ELEMENT_TYPE_VALUETYPE);
+            if (elem_type == ELEMENT_TYPE_VALUETYPE)
+            {
+                CurrentArg().m_tkValueType = TypeDefOrRefToken(indexType, index);
+            }
+        }
     }
 
     virtual void NotifyTypeGenericTypeVariable(sig_mem_number number) 
     {
-        m_argType[m_argType.size() - 1] = ELEMENT_TYPE_VAR;
-        m_genericVarNumber[m_genericVarNumber.size() - 1] = number;
+        if (InParamType())
+        {
+            CurrentArg().m_type = ELEMENT_TYPE_VAR;
+            CurrentArg().m_genericVarNumber = number;
+        }
     }
 
     virtual void NotifyTypeGenericMemberVariable(sig_mem_number number) 
     {
-        m_argType[m_argType.size() - 1] = ELEMENT_TYPE_MVAR;
-        m_genericVarNumber[m_genericVarNumber.size() - 1] = number;
+        if (InParamType())
+        {
+            CurrentArg().m_type = ELEMENT_TYPE_MVAR;
+            CurrentArg().m_genericVarNumber = number;
+        }
     }
 
     virtual void NotifyGenericParamCount(sig_count)
@@ -177,6 +432,10 @@ void __fastcall UnmanagedInspectObject(void* pv)
 #undef IfNullRet
 #define IfNullRet(EXPR) do { if ((EXPR) == NULL) return E_OUTOFMEMORY; } while (0)
 
+// The instructions of a rewrite form a circular doubly-linked list headed by
+// ILRewriter::m_IL, and branch targets point at instructions.  Only where they live
+// differs: the imported ones fill one array in IL order, the inserted ones are
+// allocated one at a time from the arena.
 struct ILInstr
 {
     ILInstr *       m_pNext;
@@ -209,6 +468,129 @@ struct EHClause
     };
 };
 
+// Bytes the arenas of this thread have handed out
+static thread_local UINT64 t_cbArenaAllocated = 0;
+
+// Bump allocator that owns every ILInstr, EHClause and the offset table of a rewrite.
+// Nothing is freed piecemeal: Reset() rewinds to the first block in O(1), and the
+// blocks are recycled by the next rewrite on the same thread.
+class ILArena
+{
+public:
+    ILArena() : m_iBlock(0), m_used(0), m_fInUse(false)
+    {
+    }
+
+    ~ILArena()
+    {
+        for (BYTE * pBlock : m_blocks)
+        {
+            free(pBlock);
+        }
+    }
+
+    template <class T>
+    T * Alloc(size_t count = 1)
+    {
+        return (T *)AllocBytes(sizeof(T) * count);
+    }
+
+    void * AllocBytes(size_t size)
+    {
+        size = (size + k_alignment - 1) & ~(k_alignment - 1);
+
+        if (m_blocks.empty() || m_used + size > m_sizes[m_iBlock])
+        {
+            if (NextBlock(size) == false)
+            {
+                return NULL;
+            }
+        }
+
+        BYTE * p = m_blocks[m_iBlock] + m_used;
+        m_used += size;
+        t_cbArenaAllocated += size;
+
+        ZeroMemory(p, size);
+        return p;
+    }
+
+    void Reset()
+    {
+        // Keep the common case allocation-free, but don't pin the memory of one huge method.
+        size_t retained = 0;
+        size_t iKeep = 0;
+        while (iKeep < m_blocks.size() && retained + m_sizes[iKeep] <= k_maxRetainedSize)
+        {
+            retained += m_sizes[iKeep++];
+        }
+
+        for (size_t i = iKeep; i < m_blocks.size(); i++)
+        {
+            free(m_blocks[i]);
+        }
+        m_blocks.resize(iKeep);
+        m_sizes.resize(iKeep);
+
+        m_iBlock = 0;
+        m_used = 0;
+    }
+
+    // A rewrite borrows its thread's arena; a nested rewrite on the same thread
+    // falls back to a private one.
+    bool TryAcquire()
+    {
+        if (m_fInUse)
+        {
+            return false;
+        }
+
+        m_fInUse = true;
+        return true;
+    }
+
+    void Release()
+    {
+        Reset();
+        m_fInUse = false;
+    }
+
+private:
+    static const size_t k_alignment = 16;
+    static const size_t k_blockSize = 64 * 1024;
+    static const size_t k_maxRetainedSize = 1024 * 1024;
+
+    bool NextBlock(size_t size)
+    {
+        size_t iNext = m_blocks.empty() ? 0 : m_iBlock + 1;
+
+        if (iNext >= m_blocks.size() || m_sizes[iNext] < size)
+        {
+            size_t blockSize = (size > k_blockSize) ? size : k_blockSize;
+            BYTE * pBlock = (BYTE *)malloc(blockSize);
+            if (pBlock == NULL)
+            {
+                return false;
+            }
+
+            m_blocks.insert(m_blocks.begin() + iNext, pBlock);
+            m_sizes.insert(m_sizes.begin() + iNext, blockSize);
+        }
+
+        m_iBlock = iNext;
+        m_used = 0;
+        return true;
+    }
+
+    vector<BYTE *> m_blocks;
+    vector<size_t> m_sizes;
+    size_t m_iBlock;
+    size_t m_used;
+    bool m_fInUse;
+};
+
+static thread_local ILArena t_ilArena;
+
 typedef enum
 {
 #define OPDEF(c,s,pop,push,args,type,l,s1,s2,ctrl) c,
@@ -298,6 +680,130 @@ static int k_rgnStackPushes[] =
     #undef OPDEF
 };
 
+// What each opcode pops; -1 for the calls and ret, which pop what a signature says
+static const int k_rgnStackPops[] =
+{
+    #define OPDEF(c,s,pop,push,args,type,l,s1,s2,ctrl) \
+        pop,
+
+    #define Pop0     0
+    #define Pop1     1
+    #define PopI     1
+    #define PopI8    1
+    #define PopR4    1
+    #define PopR8    1
+    #define PopRef   1
+    #define VarPop   -1
+
+    #include "opcode.def"
+
+    #undef Pop0
+    #undef Pop1
+    #undef PopI
+    #undef PopI8
+    #undef PopR4
+    #undef PopR8
+    #undef PopRef
+    #undef VarPop
+    #undef OPDEF
+    0,                              // CEE_COUNT
+    0,                              // CEE_SWITCH_ARG
+};
+
+// Reads the stack effect of a method signature: the arguments a call pops, this included,
+// and whether it pushes a return value
+static bool ParseCallSig(PCCOR_SIGNATURE pSig, ULONG cbSig, ULONG * pcArgs, bool * pfReturnsValue)
+{
+    if (pSig == NULL || cbSig == 0)
+        return false;
+
+    BYTE callConv = *pSig++;
+    cbSig--;
+
+    ULONG value = 0;
+    ULONG cbValue = 0;
+    if ((callConv & IMAGE_CEE_CS_CALLCONV_GENERIC) != 0)
+    {
+        if (FAILED(CorSigUncompressData(pSig, cbSig, &value, &cbValue)))
+            return false;
+        pSig += cbValue;
+        cbSig -= cbValue;
+    }
+
+    ULONG cParams = 0;
+    if (FAILED(CorSigUncompressData(pSig, cbSig, &cParams, &cbValue)))
+        return false;
+    pSig += cbValue;
+    cbSig -= cbValue;
+
+    // Custom modifiers come before the return type
+    while (cbSig > 0 && (*pSig == ELEMENT_TYPE_CMOD_REQD || *pSig == ELEMENT_TYPE_CMOD_OPT))
+    {
+        pSig++;
+        cbSig--;
+
+        mdToken tkModifier = mdTokenNil;
+        if (FAILED(CorSigUncompressToken(pSig, cbSig, &tkModifier, &cbValue)))
+            return false;
+        pSig += cbValue;
+        cbSig -= cbValue;
+    }
+
+    if (cbSig == 0)
+        return false;
+
+    // An explicit this is one of the parameters already
+    bool fImplicitThis = (callConv & IMAGE_CEE_CS_CALLCONV_HASTHIS) != 0 &&
+        (callConv & IMAGE_CEE_CS_CALLCONV_EXPLICITTHIS) == 0;
+
+    *pcArgs = cParams + (fImplicitThis ? 1 : 0);
+    *pfReturnsValue = (*pSig != ELEMENT_TYPE_VOID);
+    return true;
+}
+
+ULONG GetMethodBodySize(LPCBYTE pBody, ULONG cbMax)
+{
+    if (cbMax < 1)
+        return 0;
+
+    // Two bits tell a tiny header; the third is the low bit of its code size
+    if ((pBody[0] & (CorILMethod_FormatMask >> 1)) == CorILMethod_TinyFormat)
+    {
+        ULONG cbTiny = 1 + (pBody[0] >> 2);
+        return (cbTiny <= cbMax) ? cbTiny : 0;
+    }
+
+    if (cbMax < sizeof(IMAGE_COR_ILMETHOD_FAT))
+        return 0;
+
+    const IMAGE_COR_ILMETHOD_FAT * pFat = (const IMAGE_COR_ILMETHOD_FAT *)pBody;
+    UINT64 cbSize = (UINT64)pFat->Size * 4 + pFat->CodeSize;
+    if (pFat->Size * 4 < sizeof(IMAGE_COR_ILMETHOD_FAT) || cbSize > cbMax)
+        return 0;
+
+    // The sections follow the code, each 4-byte aligned
+    bool fMoreSects = (pFat->Flags & CorILMethod_MoreSects) != 0;
+    while (fMoreSects)
+    {
+        cbSize = (cbSize + 3) & ~(UINT64)3;
+        if (cbSize + 4 > cbMax)
+            return 0;
+
+        LPCBYTE pSect = pBody + cbSize;
+        UINT64 cbSect = (pSect[0] & CorILMethod_Sect_FatFormat) ?
+            (pSect[1] | (pSect[2] << 8) | (pSect[3] << 16)) : pSect[1];
+        if (cbSect < 4)
+            return 0;
+
+        fMoreSects = (pSect[0] & CorILMethod_Sect_MoreSects) != 0;
+        cbSize += cbSect;
+        if (cbSize > cbMax)
+            return 0;
+    }
+
+    return (ULONG)cbSize;
+}
+
 class ILRewriter
 {
 private:
@@ -307,7 +813,12 @@ private:
     mdToken     m_tkMethod;
 
     mdToken     m_tkLocalVarSig;
+
+    // An upper bound kept up as instructions are added, used when the stack can't be
+    // simulated; the imported header's value is the floor of the simulated one
     unsigned    m_maxStack;
+    unsigned    m_importedMaxStack;
+    bool        m_fReturnsValue;
     unsigned    m_flags;
     bool        m_fGenerateTinyHeader;
     bool        m_isStaticMethod;
@@ -317,64 +828,100 @@ private:
     unsigned    m_nEH;
     EHClause *  m_pEH;
 
+    // The original instructions, contiguous and in IL order
+    ILInstr *   m_pInstrs;
+    unsigned    m_nImportedInstrs;
+
     // Helper table for importing.  Sparse array that maps BYTE offset of beginning of an
-    // instruction to that instruction's ILInstr*.  BYTE offsets that don't correspond
-    // to the beginning of an instruction are mapped to NULL.
-    ILInstr **  m_pOffsetToInstr;
+    // instruction to that instruction's 1-based index in m_pInstrs.  BYTE offsets that
+    // don't correspond to the beginning of an instruction are mapped to 0; the offset
+    // just past the code maps to m_nImportedInstrs + 1 (the sentinel).
+    unsigned *  m_pOffsetToIndex;
     unsigned    m_CodeSize;
 
     unsigned    m_nInstrs;
 
-    BYTE *      m_pOutputBuffer;
+    // Scratch for Export: the branch and switch instructions in layout order
+    ILInstr **  m_ppBranches;
 
+    // What Export produced, and what the rewrite cache needs to re-bind it later
+    LPBYTE      m_pBody;
+    unsigned    m_cbBody;
+    unsigned    m_cbHeader;
+    vector<COR_SIGNATURE> m_newLocalSig;
+    vector<ILInstr *> m_moduleCookieInstrs;
+
+    // Borrowed from the ModuleContext, which keeps them while it lives, retired or not
     IMethodMalloc * m_pIMethodMalloc;
 
+    // Set when the body is for a ReJIT; it's built before the ReJIT is requested and
+    // handed to the runtime by GetReJITParameters
+    vector<BYTE> * m_pReJitBody;
+
     IMetaDataImport * m_pMetaDataImport;
+    IMetaDataImport2 * m_pMetaDataImport2;
     IMetaDataEmit * m_pMetaDataEmit;
+    IMetaDataEmit2 * m_pMetaDataEmit2;
+
+    GenericSpecIndex * m_pGenericSpecIndex;
+    ByRefLikeIndex * m_pByRefLikeIndex;
 
     MethodSigParser m_sigParser;
 
+    // Owns all ILInstr, EHClause and offset table memory of this rewrite
+    ILArena *   m_pArena;
+    ILArena     m_privateArena;
+
 public:
-    ILRewriter(ICorProfilerInfo2 * pICorProfilerInfo, ModuleID moduleID, mdToken tkMethod)
-        : m_pICorProfilerInfo(pICorProfilerInfo), m_moduleId(moduleID), m_tkMethod(tkMethod), m_fGenerateTinyHeader(false),
-        m_pEH(NULL), m_pOffsetToInstr(NULL), m_pOutputBuffer(NULL), m_pIMethodMalloc(NULL),
-        m_pMetaDataImport(NULL), m_pMetaDataEmit(NULL)
+    ILRewriter(ICorProfilerInfo2 * pICorProfilerInfo, vector<BYTE> * pReJitBody,
+        ModuleID moduleID, mdToken tkMethod)
+        : m_pICorProfilerInfo(pICorProfilerInfo), m_moduleId(moduleID), m_tkMethod(tkMethod),
+        m_importedMaxStack(0), m_fReturnsValue(false), m_fGenerateTinyHeader(false),
+        m_pEH(NULL), m_pInstrs(NULL), m_nImportedInstrs(0), m_pOffsetToIndex(NULL), m_ppBranches(NULL),
+        m_pBody(NULL), m_cbBody(0), m_cbHeader(0), m_pIMethodMalloc(NULL),
+        m_pReJitBody(pReJitBody),
+        m_pMetaDataImport(NULL), m_pMetaDataImport2(NULL), m_pMetaDataEmit(NULL), m_pMetaDataEmit2(NULL),
+        m_pGenericSpecIndex(NULL),
+        m_pByRefLikeIndex(NULL)
     {
         m_IL.m_pNext = &m_IL;
         m_IL.m_pPrev = &m_IL;
 
         m_nInstrs = 0;
+
+        m_pArena = t_ilArena.TryAcquire() ? &t_ilArena : &m_privateArena;
     }
 
     ~ILRewriter()
     {
-        ILInstr * p = m_IL.m_pNext;
-        while (p != &m_IL)
+        // ILInstr, EHClause and the offset table all live in the arena
+        if (m_pArena == &t_ilArena)
         {
-            ILInstr * t = p->m_pNext;
-            delete p;
-            p = t;
+            t_ilArena.Release();
         }
-        delete[] m_pEH;
-        delete[] m_pOffsetToInstr;
-        delete[] m_pOutputBuffer;
 
-        if (m_pIMethodMalloc)
-            m_pIMethodMalloc->Release();
-        if (m_pMetaDataImport)
-            m_pMetaDataImport->Release();
-        if (m_pMetaDataEmit)
-            m_pMetaDataEmit->Release();
     }
 
-    HRESULT Initialize()
+    HRESULT Initialize(ModuleContext &moduleInfo)
     {
-        // Get metadata interfaces ready
+        // Metadata interfaces and the IL allocator were acquired at module load
+        if (moduleInfo.m_pMetaDataImport == NULL || moduleInfo.m_pMetaDataEmit == NULL ||
+            moduleInfo.m_pMethodMalloc == NULL)
+        {
+            return E_FAIL;
+        }
+
+        m_pMetaDataImport = moduleInfo.m_pMetaDataImport;
+        m_pMetaDataEmit = moduleInfo.m_pMetaDataEmit;
+        m_pIMethodMalloc = moduleInfo.m_pMethodMalloc;
+        m_pGenericSpecIndex = &moduleInfo.m_genericSpecIndex;
+        m_pByRefLikeIndex = &moduleInfo.m_byRefLikeIndex;
 
-        IfFailRet(m_pICorProfilerInfo->GetModuleMetaData(
-            m_moduleId, ofRead | ofWrite, IID_IMetaDataImport, (IUnknown**)&m_pMetaDataImport));
+        // Only needed for the typed probes; without it the object[] probe is used
+        m_pMetaDataEmit2 = moduleInfo.m_pMetaDataEmit2;
 
-        IfFailRet(m_pMetaDataImport->QueryInterface(IID_IMetaDataEmit, (void **)&m_pMetaDataEmit));
+        // Only needed for calls to method instantiations; without it their methods aren't rewritten
+        m_pMetaDataImport2 = moduleInfo.m_pMetaDataImport2;
         return S_OK;
     }
 
@@ -397,28 +944,58 @@ public:
     HRESULT Import()
     {
         LPCBYTE pMethodBytes;
+        ULONG cbMethod = 0;
         PCCOR_SIGNATURE signature = nullptr;
         ULONG signatureLen = 0;
 
         IfFailRet(m_pICorProfilerInfo->GetILFunctionBody(
-            m_moduleId, m_tkMethod, &pMethodBytes, NULL));
+            m_moduleId, m_tkMethod, &pMethodBytes, &cbMethod));
 
         IfFailRet(m_pMetaDataImport->GetMethodProps(m_tkMethod, nullptr, nullptr, 0, nullptr,
             nullptr, &signature, &signatureLen, nullptr, nullptr));
 
-        m_isStaticMethod = (signature[0] & IMAGE_CEE_CS_CALLCONV_HASTHIS) != IMAGE_CEE_CS_CALLCONV_HASTHIS;
-
-        
-        if (m_sigParser.Parse((sig_byte *)signature, signatureLen) == false)
+        if (signatureLen == 0 || m_sigParser.Parse((sig_byte *)signature, signatureLen) == false)
         {
-            return S_FALSE;
+            return COR_E_BADIMAGEFORMAT;
+        }
+
+        m_isStaticMethod = (signature[0] & IMAGE_CEE_CS_CALLCONV_HASTHIS) != IMAGE_CEE_CS_CALLCONV_HASTHIS;
+
+        FindByRefLikeTypes();
+
+        ULONG cArgs = 0;
+        if (ParseCallSig(signature, signatureLen, &cArgs, &m_fReturnsValue) == false)
+        {
+            return COR_E_BADIMAGEFORMAT;
+        }
+
+        // The decoder follows the header and section sizes without bounds, and everything
+        // below reads the body through them, so a body that doesn't hold its code and EH
+        // clauses is refused here
+        if (GetMethodBodySize(pMethodBytes, cbMethod) == 0)
+        {
+            return COR_E_INVALIDPROGRAM;
         }
 
         COR_ILMETHOD_DECODER decoder((COR_ILMETHOD*)pMethodBytes);
 
+        LPCBYTE pMethodEnd = pMethodBytes + cbMethod;
+        if (decoder.Code == NULL || decoder.Code < pMethodBytes || decoder.Code > pMethodEnd ||
+            decoder.GetCodeSize() > (ULONG)(pMethodEnd - decoder.Code))
+        {
+            return COR_E_INVALIDPROGRAM;
+        }
+
+        if (decoder.EH != NULL && ((LPCBYTE)decoder.EH < decoder.Code + decoder.GetCodeSize() ||
+            (LPCBYTE)decoder.EH > pMethodEnd || decoder.EH->DataSize() > (ULONG)(pMethodEnd - (LPCBYTE)decoder.EH)))
+        {
+            return COR_E_INVALIDPROGRAM;
+        }
+
         // Import the header flags
         m_tkLocalVarSig = decoder.GetLocalVarSigTok();
         m_maxStack = decoder.GetMaxStack();
+        m_importedMaxStack = m_maxStack;
         m_flags = (decoder.GetFlags() & CorILMethod_InitLocals);
 
         m_CodeSize = decoder.GetCodeSize();
@@ -430,18 +1007,97 @@ public:
         return S_OK;
     }
 
+    // Span<T> and the other ref structs look like any value type in a signature
+    void FindByRefLikeTypes()
+    {
+        if (m_pByRefLikeIndex == NULL)
+        {
+            return;
+        }
+
+        for (int i = 0; i < m_sigParser.GetArgCount(); i++)
+        {
+            mdToken tkValueType = m_sigParser.GetArgValueTypeToken(i);
+            if (IsNilToken(tkValueType) == false &&
+                m_pByRefLikeIndex->IsByRefLike(m_pICorProfilerInfo, m_pMetaDataImport, tkValueType) == true)
+            {
+                m_sigParser.SetArgByRefLike(i);
+            }
+        }
+
+        mdToken tkReturnValueType = m_sigParser.GetReturnValueTypeToken();
+        if (IsNilToken(tkReturnValueType) == false &&
+            m_pByRefLikeIndex->IsByRefLike(m_pICorProfilerInfo, m_pMetaDataImport, tkReturnValueType) == true)
+        {
+            m_sigParser.SetReturnByRefLike();
+        }
+    }
+
     HRESULT ImportIL(LPCBYTE pIL)
     {
-        m_pOffsetToInstr = new ILInstr*[m_CodeSize + 1];
-        IfNullRet(m_pOffsetToInstr);
+        // The first pass only validates and counts, so that the original instructions
+        // can be decoded into one contiguous array in IL order.  The linked list is then
+        // threaded through that array: walks over code left as imported touch memory in
+        // order, but every pass still follows m_pNext and the branch targets are still
+        // pointers.
+        unsigned nInstrs = 0;
+        bool fBranch = false;
+        IfFailRet(DecodeIL(pIL, NULL, &nInstrs, &fBranch));
+
+        m_pInstrs = m_pArena->Alloc<ILInstr>(nInstrs);
+        IfNullRet(m_pInstrs);
 
-        ZeroMemory(m_pOffsetToInstr, m_CodeSize * sizeof(ILInstr*));
+        m_pOffsetToIndex = m_pArena->Alloc<unsigned>(m_CodeSize + 1);
+        IfNullRet(m_pOffsetToIndex);
+
+        IfFailRet(DecodeIL(pIL, m_pInstrs, &nInstrs, &fBranch));
+        m_nImportedInstrs = nInstrs;
+        m_nInstrs += nInstrs;
 
         // Set the sentinel instruction
-        m_pOffsetToInstr[m_CodeSize] = &m_IL;
+        m_pOffsetToIndex[m_CodeSize] = nInstrs + 1;
         m_IL.m_opcode = -1;
 
-        bool fBranch = false;
+        // The imported max stack already covers these instructions; only the ones added
+        // later raise the upper bound
+        for (unsigned i = 0; i < nInstrs; i++)
+        {
+            m_pInstrs[i].m_pPrev = (i == 0) ? &m_IL : &m_pInstrs[i - 1];
+            m_pInstrs[i].m_pNext = (i + 1 == nInstrs) ? &m_IL : &m_pInstrs[i + 1];
+        }
+
+        if (nInstrs != 0)
+        {
+            m_IL.m_pNext = &m_pInstrs[0];
+            m_IL.m_pPrev = &m_pInstrs[nInstrs - 1];
+        }
+
+        if (fBranch)
+        {
+            // Go over all control flow instructions and resolve the targets; a target has
+            // to be the start of an instruction of the method
+            for (unsigned i = 0; i < nInstrs; i++)
+            {
+                ILInstr * pInstr = &m_pInstrs[i];
+                if (s_OpCodeFlags[pInstr->m_opcode] & OPCODEFLAGS_BranchTarget)
+                {
+                    pInstr->m_pTarget = GetInstrFromOffset(pInstr->m_Arg32);
+                    if (pInstr->m_pTarget == NULL || pInstr->m_pTarget == &m_IL)
+                        return COR_E_INVALIDPROGRAM;
+                }
+            }
+        }
+
+        return S_OK;
+    }
+
+    // Decodes the IL stream into pInstrs (in order, switch targets included), or only
+    // validates and counts the instructions when pInstrs is NULL.  Branch operands are
+    // left as absolute byte offsets, which ImportIL turns into pointers; the offset table
+    // records 1-based instruction indices, used only while importing.
+    HRESULT DecodeIL(LPCBYTE pIL, ILInstr * pInstrs, unsigned * pnInstrs, bool * pfBranch)
+    {
+        unsigned nInstrs = 0;
         unsigned offset = 0;
         while (offset < m_CodeSize)
         {
@@ -451,121 +1107,104 @@ public:
             if (opcode == CEE_PREFIX1)
             {
                 if (offset >= m_CodeSize)
-                {
-                    assert(false);
                     return COR_E_INVALIDPROGRAM;
-                }
                 opcode = 0x100 + pIL[offset++];
             }
 
+            // NOTE: CEE_PREFIX2-7 are currently not supported
             if ((CEE_PREFIX7 <= opcode) && (opcode <= CEE_PREFIX2))
-            {
-                // NOTE: CEE_PREFIX2-7 are currently not supported
-                assert(false);
                 return COR_E_INVALIDPROGRAM;
-            }
 
-            if (opcode >= CEE_COUNT)
-            {
-                assert(false);
+            // Neither are prefixref and the internal opcodes numbered after the two-byte ones
+            if (opcode == CEE_PREFIXREF || opcode >= CEE_ILLEGAL)
                 return COR_E_INVALIDPROGRAM;
-            }
 
             BYTE flags = s_OpCodeFlags[opcode];
 
             int size = (flags & OPCODEFLAGS_SizeMask);
             if (offset + size > m_CodeSize)
-            {
-                assert(false);
                 return COR_E_INVALIDPROGRAM;
-            }
-
-            ILInstr * pInstr = NewILInstr();
-            IfNullRet(pInstr);
-
-            pInstr->m_opcode = opcode;
 
-            InsertBefore(&m_IL, pInstr);
+            ILInstr * pInstr = (pInstrs != NULL) ? &pInstrs[nInstrs] : NULL;
+            nInstrs++;
 
-            m_pOffsetToInstr[startOffset] = pInstr;
+            if (pInstr != NULL)
+            {
+                pInstr->m_opcode = opcode;
+                m_pOffsetToIndex[startOffset] = nInstrs;
+            }
 
             switch (flags)
             {
             case 0:
                 break;
             case 1:
-                pInstr->m_Arg8 = *(UNALIGNED INT8 *)&(pIL[offset]);
+                if (pInstr != NULL)
+                    pInstr->m_Arg8 = *(UNALIGNED INT8 *)&(pIL[offset]);
                 break;
             case 2:
-                pInstr->m_Arg16 = *(UNALIGNED INT16 *)&(pIL[offset]);
+                if (pInstr != NULL)
+                    pInstr->m_Arg16 = *(UNALIGNED INT16 *)&(pIL[offset]);
                 break;
             case 4:
-                pInstr->m_Arg32 = *(UNALIGNED INT32 *)&(pIL[offset]);
+                if (pInstr != NULL)
+                    pInstr->m_Arg32 = *(UNALIGNED INT32 *)&(pIL[offset]);
                 break;
             case 8:
-                pInstr->m_Arg64 = *(UNALIGNED INT64 *)&(pIL[offset]);
+                if (pInstr != NULL)
+                    pInstr->m_Arg64 = *(UNALIGNED INT64 *)&(pIL[offset]);
                 break;
             case 1 | OPCODEFLAGS_BranchTarget:
-                pInstr->m_Arg32 = offset + 1 + *(UNALIGNED INT8 *)&(pIL[offset]);
-                fBranch = true;
+                if (pInstr != NULL)
+                    pInstr->m_Arg32 = offset + 1 + *(UNALIGNED INT8 *)&(pIL[offset]);
+                *pfBranch = true;
                 break;
             case 4 | OPCODEFLAGS_BranchTarget:
-                pInstr->m_Arg32 = offset + 4 + *(UNALIGNED INT32 *)&(pIL[offset]);
-                fBranch = true;
+                if (pInstr != NULL)
+                    pInstr->m_Arg32 = offset + 4 + *(UNALIGNED INT32 *)&(pIL[offset]);
+                *pfBranch = true;
                 break;
             case 0 | OPCODEFLAGS_Switch:
             {
                 if (offset + sizeof(INT32) > m_CodeSize)
-                {
-                    assert(false);
                     return COR_E_INVALIDPROGRAM;
-                }
 
                 unsigned nTargets = *(UNALIGNED INT32 *)&(pIL[offset]);
-                pInstr->m_Arg32 = nTargets;
+                if (pInstr != NULL)
+                    pInstr->m_Arg32 = nTargets;
                 offset += sizeof(INT32);
 
+                // The targets have to fit in the code, which also keeps base from wrapping
+                if (nTargets > (m_CodeSize - offset) / sizeof(INT32))
+                    return COR_E_INVALIDPROGRAM;
+
                 unsigned base = offset + nTargets * sizeof(INT32);
 
                 for (unsigned iTarget = 0; iTarget < nTargets; iTarget++)
                 {
-                    if (offset + sizeof(INT32) > m_CodeSize)
+
+                    if (pInstrs != NULL)
                     {
-                        assert(false);
-                        return COR_E_INVALIDPROGRAM;
+                        pInstr = &pInstrs[nInstrs];
+                        pInstr->m_opcode = CEE_SWITCH_ARG;
+                        pInstr->m_Arg32 = base + *(UNALIGNED INT32 *)&(pIL[offset]);
                     }
+                    nInstrs++;
 
-                    pInstr = NewILInstr();
-                    IfNullRet(pInstr);
-
-                    pInstr->m_opcode = CEE_SWITCH_ARG;
-
-                    pInstr->m_Arg32 = base + *(UNALIGNED INT32 *)&(pIL[offset]);
                     offset += sizeof(INT32);
-
-                    InsertBefore(&m_IL, pInstr);
                 }
-                fBranch = true;
+                *pfBranch = true;
                 break;
             }
             default:
-                assert(false);
-                break;
+                // An opcode the table knows no operand for
+                return COR_E_INVALIDPROGRAM;
             }
             offset += size;
         }
         assert(offset == m_CodeSize);
 
-        if (fBranch)
-        {
-            // Go over all control flow instructions and resolve the targets
-            for (ILInstr * pInstr = m_IL.m_pNext; pInstr != &m_IL; pInstr = pInstr->m_pNext)
-            {
-                if (s_OpCodeFlags[pInstr->m_opcode] & OPCODEFLAGS_BranchTarget)
-                    pInstr->m_pTarget = GetInstrFromOffset(pInstr->m_Arg32);
-            }
-        }
-
+        *pnInstrs = nInstrs;
         return S_OK;
     }
 
@@ -578,7 +1217,7 @@ public:
         if (nEH == 0)
             return S_OK;
 
-        IfNullRet(m_pEH = new EHClause[m_nEH]);
+        IfNullRet(m_pEH = m_pArena->Alloc<EHClause>(m_nEH));
         for (unsigned iEH = 0; iEH < m_nEH; iEH++)
         {
             // If the EH clause is in tiny form, the call to pILEH->EHClause() below will
@@ -588,17 +1227,35 @@ public:
             const COR_ILMETHOD_SECT_EH_CLAUSE_FAT* ehInfo;
             ehInfo = (COR_ILMETHOD_SECT_EH_CLAUSE_FAT*)pILEH->EHClause(iEH, &scratch);
 
+            // Both blocks have to be non-empty runs of whole instructions of the code
+            if (ehInfo->GetTryOffset() > m_CodeSize || ehInfo->GetTryLength() == 0 || ehInfo->GetTryLength() > m_CodeSize ||
+                ehInfo->GetHandlerOffset() > m_CodeSize || ehInfo->GetHandlerLength() == 0 || ehInfo->GetHandlerLength() > m_CodeSize)
+                return COR_E_INVALIDPROGRAM;
+
             EHClause* clause = &(m_pEH[iEH]);
             clause->m_Flags = ehInfo->GetFlags();
 
+            ILInstr * pHandlerEnd = GetInstrFromOffset(ehInfo->GetHandlerOffset() + ehInfo->GetHandlerLength());
+
             clause->m_pTryBegin = GetInstrFromOffset(ehInfo->GetTryOffset());
             clause->m_pTryEnd = GetInstrFromOffset(ehInfo->GetTryOffset() + ehInfo->GetTryLength());
             clause->m_pHandlerBegin = GetInstrFromOffset(ehInfo->GetHandlerOffset());
-            clause->m_pHandlerEnd = GetInstrFromOffset(ehInfo->GetHandlerOffset() + ehInfo->GetHandlerLength())->m_pPrev;
+            clause->m_pHandlerEnd = (pHandlerEnd != NULL) ? pHandlerEnd->m_pPrev : NULL;
+            if (clause->m_pTryBegin == NULL || clause->m_pTryBegin == &m_IL || clause->m_pTryEnd == NULL ||
+                clause->m_pHandlerBegin == NULL || clause->m_pHandlerBegin == &m_IL ||
+                clause->m_pHandlerEnd == NULL || clause->m_pHandlerEnd == &m_IL)
+                return COR_E_INVALIDPROGRAM;
+
             if ((clause->m_Flags & COR_ILEXCEPTION_CLAUSE_FILTER) == 0)
+            {
                 clause->m_ClassToken = ehInfo->GetClassToken();
+            }
             else
+            {
                 clause->m_pFilter = GetInstrFromOffset(ehInfo->GetFilterOffset());
+                if (clause->m_pFilter == NULL || clause->m_pFilter == &m_IL)
+                    return COR_E_INVALIDPROGRAM;
+            }
         }
 
         return S_OK;
@@ -607,7 +1264,7 @@ public:
     ILInstr* NewILInstr()
     {
         m_nInstrs++;
-        return new ILInstr();
+        return m_pArena->Alloc<ILInstr>();
     }
 
     ILInstr* GetInstrFromOffset(unsigned offset)
@@ -615,9 +1272,15 @@ public:
         ILInstr * pInstr = NULL;
 
         if (offset <= m_CodeSize)
-            pInstr = m_pOffsetToInstr[offset];
+        {
+            unsigned index = m_pOffsetToIndex[offset];
+            if (index > m_nImportedInstrs)
+                pInstr = (index == m_nImportedInstrs + 1) ? &m_IL : NULL;
+            else if (index != 0)
+                pInstr = &m_pInstrs[index - 1];
+        }
 
-        assert(pInstr != NULL);
+        // NULL when offset isn't the start of an instruction
         return pInstr;
     }
 
@@ -676,84 +1339,209 @@ public:
         assert(argIndex >= 0);
         assert(GetArgCount() > argIndex);
 
-        return m_sigParser.IsPrimitiveArg(argIndex) || m_sigParser.IsGenericArg(argIndex);
+        return m_sigParser.IsPrimitiveArg(argIndex) || m_sigParser.IsGenericArg(argIndex) ||
+            m_sigParser.IsValueTypeArg(argIndex);
     }
 
-    bool IsGeneric(int argIndex)
+    bool IsByRefLike(int argIndex)
     {
         assert(argIndex >= 0);
         assert(GetArgCount() > argIndex);
 
-        return m_sigParser.IsGenericArg(argIndex);
+        return m_sigParser.IsByRefLikeArg(argIndex);
     }
 
-    mdToken GetGenericTypeToken(int argIndex)
+    bool IsValueType(int argIndex)
     {
         assert(argIndex >= 0);
         assert(GetArgCount() > argIndex);
 
-        CorElementType genericType = m_sigParser.GetArgType(argIndex);
-
-        return GetVarSpecToken(genericType, m_sigParser.GetGenericNumber(argIndex));
+        return m_sigParser.IsValueTypeArg(argIndex);
     }
 
-    mdToken GetVarSpecToken(int genericType, int varNumber)
+    // Whether every argument can be passed as it is to the generic Enter<T1, ..., Tn> probe
+    bool CanUseTypedProbe()
     {
-        HCORENUM hCorEnum = 0;
-        DWORD cEnumResult = 0;
-        mdTypeSpec typeSpecs[MAX_LOOKUP_OF_TYPESPEC];
-        mdTypeSpec foundTypeSpec = mdTokenNil;
+        int argCount = GetArgCount();
+        if (argCount > TYPED_PROBE_MAX_ARGS)
+        {
+            return false;
+        }
 
-        while (foundTypeSpec == mdTokenNil)
+        if (argCount != 0 && m_pMetaDataEmit2 == NULL)
         {
-            HRESULT hr = m_pMetaDataImport->EnumTypeSpecs(&hCorEnum, typeSpecs, MAX_LOOKUP_OF_TYPESPEC, &cEnumResult);
+            return false;
+        }
 
-            if (hr != S_OK || cEnumResult == 0)
+        for (int i = 0; i < argCount; i++)
+        {
+            if (m_sigParser.CanInstantiateWithArg(i) == false)
             {
-                break;
+                return false;
             }
+        }
 
-            for (size_t i = 0; i < cEnumResult; i++)
-            {
-                DWORD cbSig = 0;
-                PCCOR_SIGNATURE pvSig;
-                hr = m_pMetaDataImport->GetTypeSpecFromToken(typeSpecs[i], &pvSig, &cbSig);
-                if (hr != S_OK)
-                {
-                    break;
-                }
+        return true;
+    }
 
-                byte genericCode = pvSig[0];
-                if (genericType == genericCode)
-                {
-                    int sigId = SigToInt32(pvSig + 1, cbSig - 1);
+    // Instantiates the generic probe with the method's own argument types
+    mdMethodSpec DefineTypedProbeSpec(mdMemberRef tkProbeRef)
+    {
+        if (m_pMetaDataEmit2 == NULL)
+        {
+            return mdTokenNil;
+        }
 
-                    if (sigId == varNumber)
-                    {
-                        foundTypeSpec = typeSpecs[i];
-                        break;
-                    }
-                }
-            }
+        int argCount = GetArgCount();
+
+        vector<COR_SIGNATURE> blob;
+        blob.push_back(IMAGE_CEE_CS_CALLCONV_GENERICINST);
+        blob.push_back((COR_SIGNATURE)argCount);
+
+        for (int i = 0; i < argCount; i++)
+        {
+            ULONG cbArgSig = 0;
+            PCCOR_SIGNATURE pArgSig = m_sigParser.GetArgSig(i, &cbArgSig);
+            blob.insert(blob.end(), pArgSig, pArgSig + cbArgSig);
+        }
+
+        mdMethodSpec tkSpec = mdTokenNil;
+        if (FAILED(m_pMetaDataEmit2->DefineMethodSpec(tkProbeRef, blob.data(), (ULONG)blob.size(), &tkSpec)))
+        {
+            return mdTokenNil;
         }
 
-        m_pMetaDataImport->CloseEnum(hCorEnum);
+        return tkSpec;
+    }
 
-        return foundTypeSpec;
+    // Whether the return value can be passed as it is to the generic Exit<TResult> probe
+    bool CanUseTypedExitProbe()
+    {
+        return m_pMetaDataEmit2 != NULL && m_sigParser.CanInstantiateWithReturnType();
     }
 
-    int SigToInt32(const BYTE *pSig, int sigLength)
+    // Instantiates the generic exit probe with the method's return type
+    mdMethodSpec DefineExitProbeSpec(mdMemberRef tkProbeRef)
     {
-        int result = 0;
+        if (m_pMetaDataEmit2 == NULL)
+        {
+            return mdTokenNil;
+        }
 
-        memcpy(&result, pSig, sigLength);
+        vector<COR_SIGNATURE> blob;
+        blob.push_back(IMAGE_CEE_CS_CALLCONV_GENERICINST);
+        blob.push_back(1);
 
-        return result;
+        ULONG cbRetSig = 0;
+        PCCOR_SIGNATURE pRetSig = m_sigParser.GetReturnTypeSig(&cbRetSig);
+        blob.insert(blob.end(), pRetSig, pRetSig + cbRetSig);
+
+        mdMethodSpec tkSpec = mdTokenNil;
+        if (FAILED(m_pMetaDataEmit2->DefineMethodSpec(tkProbeRef, blob.data(), (ULONG)blob.size(), &tkSpec)))
+        {
+            return mdTokenNil;
+        }
+
+        return tkSpec;
+    }
+
+    // Nothing may come between a tail call and its ret
+    bool HasTailCall()
+    {
+        for (unsigned i = 0; i < m_nImportedInstrs; i++)
+        {
+            if (m_pInstrs[i].m_opcode == CEE_TAILCALL)
+                return true;
+        }
+
+        return false;
+    }
+
+    // Whether the whole body can become a protected block: localloc and jmp aren't allowed
+    // in one, and the return value needs a local of the return type
+    bool CanProtectBody()
+    {
+        for (unsigned i = 0; i < m_nImportedInstrs; i++)
+        {
+            if (m_pInstrs[i].m_opcode == CEE_LOCALLOC || m_pInstrs[i].m_opcode == CEE_JMP)
+                return false;
+        }
+
+        return m_sigParser.HasReturnTypeCustomMod() == false;
+    }
+
+    bool ReturnsValue()
+    {
+        return m_fReturnsValue;
+    }
+
+    PCCOR_SIGNATURE GetReturnTypeSig(ULONG * pcbSig)
+    {
+        return m_sigParser.GetReturnTypeSig(pcbSig);
+    }
+
+    // Appends a clause, which makes it the outermost of those sharing its blocks
+    HRESULT AddEHClause(const EHClause &clause)
+    {
+        EHClause * pEH = m_pArena->Alloc<EHClause>(m_nEH + 1);
+        IfNullRet(pEH);
+
+        for (unsigned iEH = 0; iEH < m_nEH; iEH++)
+            pEH[iEH] = m_pEH[iEH];
+
+        pEH[m_nEH] = clause;
+        m_pEH = pEH;
+        m_nEH++;
+        return S_OK;
+    }
+
+    // TypeSpec for boxing a value type argument that has no primitive TypeRef
+    mdTypeSpec GetArgTypeSpecToken(int argIndex)
+    {
+        assert(argIndex >= 0);
+        assert(GetArgCount() > argIndex);
+
+        ULONG cbArgSig = 0;
+        PCCOR_SIGNATURE pArgSig = m_sigParser.GetArgSig(argIndex, &cbArgSig);
+
+        mdTypeSpec tkSpec = mdTokenNil;
+        if (FAILED(m_pMetaDataEmit->GetTokenFromTypeSpec(pArgSig, cbArgSig, &tkSpec)))
+        {
+            return mdTokenNil;
+        }
+
+        return tkSpec;
+    }
+
+    bool IsGeneric(int argIndex)
+    {
+        assert(argIndex >= 0);
+        assert(GetArgCount() > argIndex);
+
+        return m_sigParser.IsGenericArg(argIndex);
+    }
+
+    mdToken GetGenericTypeToken(int argIndex)
+    {
+        assert(argIndex >= 0);
+        assert(GetArgCount() > argIndex);
+
+        if (m_sigParser.GetArgType(argIndex) == ELEMENT_TYPE_MVAR)
+        {
+            return GetMVarSpecToken(m_sigParser.GetGenericNumber(argIndex));
+        }
+
+        return GetVarSpecToken(m_sigParser.GetGenericNumber(argIndex));
+    }
+
+    mdToken GetVarSpecToken(int varNumber)
+    {
+        return m_pGenericSpecIndex->GetToken(m_pMetaDataImport, m_pMetaDataEmit, ELEMENT_TYPE_VAR, varNumber);
     }
 
     mdToken GetMVarSpecToken(int varNumber)
     {
-        return mdTokenNil;
+        return m_pGenericSpecIndex->GetToken(m_pMetaDataImport, m_pMetaDataEmit, ELEMENT_TYPE_MVAR, varNumber);
     }
 
     /////////////////////////////////////////////////////////////////////////////////////////////////
@@ -763,149 +1551,223 @@ public:
     ////////////////////////////////////////////////////////////////////////////////////////////////
 
 
-    HRESULT Export()
+    // Follows every path through the laid out code, from the entry and from the handlers,
+    // for the deepest the evaluation stack gets.  False when a path can't be followed, e.g.
+    // a call whose signature can't be read or paths that meet at different depths; the
+    // caller keeps the upper bound then.
+    bool ComputeMaxStack(unsigned codeSize, unsigned * pMaxStack)
     {
-        // One instruction produces 6 bytes in the worst case
-        unsigned maxSize = m_nInstrs * 6;
+        // 1 + the depth before the instruction at each offset; 0 until a path reaches it
+        unsigned * pDepths = m_pArena->Alloc<unsigned>(codeSize + 1);
+        ILInstr ** ppPending = m_pArena->Alloc<ILInstr *>(m_nInstrs);
+        if (pDepths == NULL || ppPending == NULL)
+            return false;
 
-        m_pOutputBuffer = new BYTE[maxSize];
-        IfNullRet(m_pOutputBuffer);
+        unsigned nPending = 0;
+        unsigned maxStack = 0;
 
-    again:
-        BYTE * pIL = m_pOutputBuffer;
+        auto reach = [&](ILInstr * pInstr, unsigned depth)
+        {
+            // Running off the end of the code isn't valid either
+            if (pInstr == NULL || pInstr == &m_IL)
+                return false;
 
-        bool fBranch = false;
-        unsigned offset = 0;
+            if (depth > maxStack)
+                maxStack = depth;
 
-        // Go over all instructions and produce code for them
-        for (ILInstr * pInstr = m_IL.m_pNext; pInstr != &m_IL; pInstr = pInstr->m_pNext)
+            unsigned &entry = pDepths[pInstr->m_offset];
+            if (entry == 0)
+            {
+                entry = depth + 1;
+                ppPending[nPending++] = pInstr;
+                return true;
+            }
+
+            return entry == depth + 1;
+        };
+
+        if (reach(m_IL.m_pNext, 0) == false)
+            return false;
+
+        // A try starts with an empty stack, a catch or filter with the exception
+        for (unsigned iEH = 0; iEH < m_nEH; iEH++)
         {
-            pInstr->m_offset = offset;
+            EHClause * pClause = &m_pEH[iEH];
+            bool fFilter = (pClause->m_Flags & COR_ILEXCEPTION_CLAUSE_FILTER) != 0;
+            bool fCatch = (pClause->m_Flags & (COR_ILEXCEPTION_CLAUSE_FINALLY | COR_ILEXCEPTION_CLAUSE_FAULT)) == 0;
+
+            if (reach(pClause->m_pTryBegin, 0) == false ||
+                reach(pClause->m_pHandlerBegin, fCatch ? 1 : 0) == false ||
+                (fFilter && reach(pClause->m_pFilter, 1) == false))
+                return false;
+        }
 
-            unsigned opcode = pInstr->m_opcode;
-            if (opcode < CEE_COUNT)
-            {
-                // CEE_PREFIX1 refers not to instruction prefixes (like tail.), but to
-                // the lead byte of multi-byte opcodes. For now, the only lead byte
-                // supported is CEE_PREFIX1 = 0xFE.
-                if (opcode >= 0x100)
-                    m_pOutputBuffer[offset++] = CEE_PREFIX1;
+        while (nPending > 0)
+        {
+            ILInstr * pInstr = ppPending[--nPending];
+            unsigned depth = pDepths[pInstr->m_offset] - 1;
 
-                // This appears to depend on an implicit conversion from
-                // unsigned opcode down to BYTE, to deliberately lose data and have
-                // opcode >= 0x100 wrap around to 0.
-                m_pOutputBuffer[offset++] = (opcode & 0xFF);
-            }
+            unsigned nPops = 0;
+            unsigned nPushes = 0;
+            if (GetStackEffect(pInstr, &nPops, &nPushes) == false || nPops > depth)
+                return false;
 
-            assert(pInstr->m_opcode < _countof(s_OpCodeFlags));
-            BYTE flags = s_OpCodeFlags[pInstr->m_opcode];
-            switch (flags)
+            depth = depth - nPops + nPushes;
+            if (depth > maxStack)
+                maxStack = depth;
+
+            switch (pInstr->m_opcode)
             {
-            case 0:
-                break;
-            case 1:
-                *(UNALIGNED INT8 *)&(pIL[offset]) = pInstr->m_Arg8;
-                break;
-            case 2:
-                *(UNALIGNED INT16 *)&(pIL[offset]) = pInstr->m_Arg16;
-                break;
-            case 4:
-                *(UNALIGNED INT32 *)&(pIL[offset]) = pInstr->m_Arg32;
-                break;
-            case 8:
-                *(UNALIGNED INT64 *)&(pIL[offset]) = pInstr->m_Arg64;
-                break;
-            case 1 | OPCODEFLAGS_BranchTarget:
-                fBranch = true;
-                break;
-            case 4 | OPCODEFLAGS_BranchTarget:
-                fBranch = true;
-                break;
-            case 0 | OPCODEFLAGS_Switch:
-                *(UNALIGNED INT32 *)&(pIL[offset]) = pInstr->m_Arg32;
-                offset += sizeof(INT32);
-                break;
-            default:
-                assert(false);
-                break;
+            case CEE_BR:
+            case CEE_BR_S:
+                if (reach(pInstr->m_pTarget, depth) == false)
+                    return false;
+                continue;
+
+            case CEE_LEAVE:
+            case CEE_LEAVE_S:
+                // Leave empties the stack
+                if (reach(pInstr->m_pTarget, 0) == false)
+                    return false;
+                continue;
+
+            case CEE_RET:
+            case CEE_JMP:
+            case CEE_THROW:
+            case CEE_RETHROW:
+            case CEE_ENDFINALLY:
+            case CEE_ENDFILTER:
+                continue;
             }
-            offset += (flags & OPCODEFLAGS_SizeMask);
+
+            // Conditional branches and switch targets also fall through
+            if ((s_OpCodeFlags[pInstr->m_opcode] & OPCODEFLAGS_BranchTarget) && reach(pInstr->m_pTarget, depth) == false)
+                return false;
+
+            if (reach(pInstr->m_pNext, depth) == false)
+                return false;
         }
-        m_IL.m_offset = offset;
 
-        if (fBranch)
+        *pMaxStack = maxStack;
+        return true;
+    }
+
+    bool GetStackEffect(ILInstr * pInstr, unsigned * pnPops, unsigned * pnPushes)
+    {
+        unsigned opcode = pInstr->m_opcode;
+        if (opcode == CEE_SWITCH_ARG)
         {
-            bool fTryAgain = false;
-            unsigned switchBase = 0;
+            *pnPops = 0;
+            *pnPushes = 0;
+            return true;
+        }
 
-            // Go over all control flow instructions and resolve the targets
-            for (ILInstr * pInstr = m_IL.m_pNext; pInstr != &m_IL; pInstr = pInstr->m_pNext)
-            {
-                unsigned opcode = pInstr->m_opcode;
+        ULONG cArgs = 0;
+        bool fReturnsValue = false;
 
-                if (pInstr->m_opcode == CEE_SWITCH)
-                {
-                    switchBase = pInstr->m_offset + 1 + sizeof(INT32) * (pInstr->m_Arg32 + 1);
-                    continue;
-                }
-                if (opcode == CEE_SWITCH_ARG)
-                {
-                    // Switch args are special
-                    *(UNALIGNED INT32 *)&(pIL[pInstr->m_offset]) = pInstr->m_pTarget->m_offset - switchBase;
-                    continue;
-                }
+        switch (opcode)
+        {
+        case CEE_RET:
+            *pnPops = m_fReturnsValue ? 1 : 0;
+            *pnPushes = 0;
+            return true;
+
+        case CEE_CALL:
+        case CEE_CALLVIRT:
+            if (GetCallSig(pInstr->m_Arg32, &cArgs, &fReturnsValue) == false)
+                return false;
+            *pnPops = cArgs;
+            *pnPushes = fReturnsValue ? 1 : 0;
+            return true;
+
+        case CEE_CALLI:
+            // The arguments and then the function pointer
+            if (GetCallSig(pInstr->m_Arg32, &cArgs, &fReturnsValue) == false)
+                return false;
+            *pnPops = cArgs + 1;
+            *pnPushes = fReturnsValue ? 1 : 0;
+            return true;
+
+        case CEE_NEWOBJ:
+            // The constructor's this is the new object, which isn't on the stack yet
+            if (GetCallSig(pInstr->m_Arg32, &cArgs, &fReturnsValue) == false || cArgs == 0)
+                return false;
+            *pnPops = cArgs - 1;
+            *pnPushes = 1;
+            return true;
+        }
 
-                BYTE flags = s_OpCodeFlags[pInstr->m_opcode];
+        if (k_rgnStackPops[opcode] < 0)
+            return false;
 
-                if (flags & OPCODEFLAGS_BranchTarget)
-                {
-                    int delta = pInstr->m_pTarget->m_offset - pInstr->m_pNext->m_offset;
+        *pnPops = k_rgnStackPops[opcode];
+        *pnPushes = k_rgnStackPushes[opcode];
+        return true;
+    }
 
-                    switch (flags)
-                    {
-                    case 1 | OPCODEFLAGS_BranchTarget:
-                        // Check if delta is too big to fit into an INT8.
-                        // 
-                        // (see #pragma at top of file)
-                        if ((INT8)delta != delta)
-                        {
-                            if (opcode == CEE_LEAVE_S)
-                            {
-                                pInstr->m_opcode = CEE_LEAVE;
-                            }
-                            else
-                            {
-                                assert(opcode >= CEE_BR_S && opcode <= CEE_BLT_UN_S);
-                                pInstr->m_opcode = opcode - CEE_BR_S + CEE_BR;
-                                assert(pInstr->m_opcode >= CEE_BR && pInstr->m_opcode <= CEE_BLT_UN);
-                            }
-                            fTryAgain = true;
-                            continue;
-                        }
-                        *(UNALIGNED INT8 *)&(pIL[pInstr->m_pNext->m_offset - sizeof(INT8)]) = delta;
-                        break;
-                    case 4 | OPCODEFLAGS_BranchTarget:
-                        *(UNALIGNED INT32 *)&(pIL[pInstr->m_pNext->m_offset - sizeof(INT32)]) = delta;
-                        break;
-                    default:
-                        assert(false);
-                        break;
-                    }
-                }
-            }
+    bool GetCallSig(mdToken token, ULONG * pcArgs, bool * pfReturnsValue)
+    {
+        PCCOR_SIGNATURE pSig = NULL;
+        ULONG cbSig = 0;
+
+        // A method instantiation pops and pushes what its generic method does
+        if (TypeFromToken(token) == mdtMethodSpec)
+        {
+            if (m_pMetaDataImport2 == NULL ||
+                FAILED(m_pMetaDataImport2->GetMethodSpecProps(token, &token, NULL, NULL)))
+                return false;
+        }
 
-            // Do the whole thing again if we changed the size of some branch targets
-            if (fTryAgain)
-                goto again;
+        HRESULT hr;
+        switch (TypeFromToken(token))
+        {
+        case mdtMethodDef:
+            hr = m_pMetaDataImport->GetMethodProps(token, NULL, NULL, 0, NULL, NULL, &pSig, &cbSig, NULL, NULL);
+            break;
+        case mdtMemberRef:
+            hr = m_pMetaDataImport->GetMemberRefProps(token, NULL, NULL, 0, NULL, &pSig, &cbSig);
+            break;
+        case mdtSignature:
+            hr = m_pMetaDataImport->GetSigFromToken(token, &pSig, &cbSig);
+            break;
+        default:
+            return false;
         }
 
+        return SUCCEEDED(hr) && ParseCallSig(pSig, cbSig, pcArgs, pfReturnsValue);
+    }
+
+    HRESULT Export()
+    {
+        m_ppBranches = m_pArena->Alloc<ILInstr *>(m_nInstrs);
+        IfNullRet(m_ppBranches);
+
+        // Sizes are settled before any byte is written: every branch starts out in its
+        // short form, the relaxation pass widens only the ones that don't fit, and a
+        // single emission pass then encodes the method with final offsets.
+        unsigned nBranches = 0;
+        unsigned offset = LayoutInstrs(true, &nBranches);
+
+        if (RelaxBranches(nBranches))
+        {
+            offset = LayoutInstrs(false, &nBranches);
+        }
+
+        unsigned maxStack = 0;
+        if (ComputeMaxStack(offset, &maxStack))
+        {
+            m_maxStack = (maxStack > m_importedMaxStack) ? maxStack : m_importedMaxStack;
+        }
+
+        // The exact size of the body is known now, so the code is encoded straight
+        // into the memory handed to the CLR.
         unsigned codeSize = offset;
         unsigned totalSize;
         LPBYTE pBody = NULL;
         if (m_fGenerateTinyHeader)
         {
-            // Make sure we can fit in a tiny header
-            if (codeSize >= 64)
+            // Make sure we can fit in a tiny header, which implies a max stack of 8
+            if (codeSize >= 64 || m_maxStack > 8)
                 return E_FAIL;
 
             totalSize = sizeof(IMAGE_COR_ILMETHOD_TINY) + codeSize;
@@ -919,7 +1781,7 @@ public:
             pCurrent += sizeof(IMAGE_COR_ILMETHOD_TINY);
 
             // And the body
-            CopyMemory(pCurrent, m_pOutputBuffer, codeSize);
+            EmitInstrs(pCurrent);
         }
         else
         {
@@ -944,9 +1806,10 @@ public:
 
             pCurrent = (BYTE*)(pHeader + 1);
 
-            // DumpBody(m_pOutputBuffer, codeSize);
+            EmitInstrs(pCurrent);
 
-            CopyMemory(pCurrent, m_pOutputBuffer, codeSize);
+            // The allocator doesn't zero its memory; clear the alignment padding
+            ZeroMemory(pCurrent + codeSize, alignedCodeSize - codeSize);
             pCurrent += alignedCodeSize;
 
             if (m_nEH != 0)
@@ -972,44 +1835,365 @@ public:
                     else
                         pDst->FilterOffset = pSrc->m_pFilter->m_offset;
 
-                    pCurrent = (BYTE*)(pDst + 1);
+                    pCurrent = (BYTE*)(pDst + 1);
+                }
+            }
+        }
+
+        DUMP_METHOD_BODY(m_moduleId, m_tkMethod, pBody, totalSize);
+
+        m_pBody = pBody;
+        m_cbBody = totalSize;
+        m_cbHeader = m_fGenerateTinyHeader ? sizeof(IMAGE_COR_ILMETHOD_TINY) : sizeof(IMAGE_COR_ILMETHOD_FAT);
+
+        IfFailRet(SetILFunctionBody(totalSize, pBody));
+
+        return S_OK;
+    }
+
+    static bool IsTokenOperand(unsigned opcode)
+    {
+        switch (opcode)
+        {
+        case CEE_JMP: case CEE_CALL: case CEE_CALLI: case CEE_CALLVIRT:
+        case CEE_CPOBJ: case CEE_LDOBJ: case CEE_NEWOBJ: case CEE_CASTCLASS: case CEE_ISINST:
+        case CEE_UNBOX: case CEE_LDFLD: case CEE_LDFLDA: case CEE_STFLD: case CEE_LDSFLD:
+        case CEE_LDSFLDA: case CEE_STSFLD: case CEE_STOBJ: case CEE_BOX: case CEE_NEWARR:
+        case CEE_LDELEMA: case CEE_LDELEM: case CEE_STELEM: case CEE_UNBOX_ANY:
+        case CEE_REFANYVAL: case CEE_MKREFANY: case CEE_LDTOKEN: case CEE_LDFTN:
+        case CEE_LDVIRTFTN: case CEE_INITOBJ: case CEE_CONSTRAINED: case CEE_SIZEOF:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    bool IsImportedInstr(ILInstr * pInstr)
+    {
+        return pInstr >= m_pInstrs && pInstr < m_pInstrs + m_nImportedInstrs;
+    }
+
+    // Copies the exported body for the rewrite cache, with a relocation for every token
+    // the rewrite introduced.  Returns false if one of them can't be re-bound in a later run.
+    bool CaptureForCache(ModuleContext &moduleInfo, RewriteCacheData &data)
+    {
+        if (m_pBody == NULL)
+        {
+            return false;
+        }
+
+        data.m_body.assign(m_pBody, m_pBody + m_cbBody);
+
+        if (m_newLocalSig.empty() == false)
+        {
+            if (m_fGenerateTinyHeader)
+                return false;
+
+            data.AddReloc(offsetof(IMAGE_COR_ILMETHOD_FAT, LocalVarSigTok), RELOC_LOCAL_SIG, ROLE_NONE, 0,
+                m_newLocalSig.data(), (ULONG)m_newLocalSig.size());
+        }
+
+        for (ILInstr * pInstr = m_IL.m_pNext; pInstr != &m_IL; pInstr = pInstr->m_pNext)
+        {
+            if (IsImportedInstr(pInstr))
+                continue;
+
+            unsigned opcode = pInstr->m_opcode;
+            DWORD operandOffset = m_cbHeader + pInstr->m_offset + ((opcode >= 0x100) ? 2 : 1);
+
+            if (std::find(m_moduleCookieInstrs.begin(), m_moduleCookieInstrs.end(), pInstr) != m_moduleCookieInstrs.end())
+            {
+                data.AddReloc(operandOffset, RELOC_MODULE_COOKIE, ROLE_NONE, 0);
+                continue;
+            }
+
+            if (IsTokenOperand(opcode) == false)
+                continue;
+
+            mdToken token = pInstr->m_Arg32;
+
+            int index = 0;
+            TokenRole role = moduleInfo.FindTokenRole(token, &index);
+            if (role != ROLE_NONE)
+            {
+                data.AddReloc(operandOffset, RELOC_ROLE_TOKEN, role, index);
+                continue;
+            }
+
+            switch (TypeFromToken(token))
+            {
+            case mdtTypeDef:
+            case mdtMethodDef:
+            case mdtFieldDef:
+                // Defined by the module itself, so identical in every run
+                break;
+
+            case mdtTypeSpec:
+            {
+                PCCOR_SIGNATURE pSig = NULL;
+                ULONG cbSig = 0;
+                if (FAILED(m_pMetaDataImport->GetTypeSpecFromToken(token, &pSig, &cbSig)))
+                    return false;
+
+                data.AddReloc(operandOffset, RELOC_TYPESPEC, ROLE_NONE, 0, pSig, cbSig);
+                break;
+            }
+
+            case mdtMethodSpec:
+            {
+                mdToken tkParent = mdTokenNil;
+                PCCOR_SIGNATURE pSig = NULL;
+                ULONG cbSig = 0;
+                if (m_pMetaDataImport2 == NULL ||
+                    FAILED(m_pMetaDataImport2->GetMethodSpecProps(token, &tkParent, &pSig, &cbSig)))
+                    return false;
+
+                role = moduleInfo.FindTokenRole(tkParent, &index);
+                if (role == ROLE_NONE)
+                    return false;
+
+                data.AddReloc(operandOffset, RELOC_METHODSPEC, role, index, pSig, cbSig);
+                break;
+            }
+
+            default:
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    static unsigned GetInstrSize(ILInstr * pInstr)
+    {
+        unsigned opcode = pInstr->m_opcode;
+        BYTE flags = s_OpCodeFlags[opcode];
+
+        unsigned size = (flags & OPCODEFLAGS_SizeMask);
+        if (opcode < CEE_COUNT)
+            size += (opcode >= 0x100) ? 2 : 1;
+        if (flags & OPCODEFLAGS_Switch)
+            size += sizeof(INT32);
+
+        return size;
+    }
+
+    static bool IsShortBranch(unsigned opcode)
+    {
+        return (opcode >= CEE_BR_S && opcode <= CEE_BLT_UN_S) || opcode == CEE_LEAVE_S;
+    }
+
+    static unsigned ToShortBranch(unsigned opcode)
+    {
+        if (opcode == CEE_LEAVE)
+            return CEE_LEAVE_S;
+        if (opcode >= CEE_BR && opcode <= CEE_BLT_UN)
+            return opcode - CEE_BR + CEE_BR_S;
+        return opcode;
+    }
+
+    static unsigned ToLongBranch(unsigned opcode)
+    {
+        if (opcode == CEE_LEAVE_S)
+            return CEE_LEAVE;
+
+        assert(opcode >= CEE_BR_S && opcode <= CEE_BLT_UN_S);
+        return opcode - CEE_BR_S + CEE_BR;
+    }
+
+    // Assigns m_offset to every instruction from the current opcode sizes and records
+    // the branch and switch instructions in layout order.  Writes no code.
+    unsigned LayoutInstrs(bool fShortenBranches, unsigned * pnBranches)
+    {
+        unsigned nBranches = 0;
+        unsigned offset = 0;
+
+        for (ILInstr * pInstr = m_IL.m_pNext; pInstr != &m_IL; pInstr = pInstr->m_pNext)
+        {
+            assert(pInstr->m_opcode < _countof(s_OpCodeFlags));
+
+            if (fShortenBranches)
+                pInstr->m_opcode = ToShortBranch(pInstr->m_opcode);
+
+            if (s_OpCodeFlags[pInstr->m_opcode] & (OPCODEFLAGS_BranchTarget | OPCODEFLAGS_Switch))
+                m_ppBranches[nBranches++] = pInstr;
+
+            pInstr->m_offset = offset;
+            offset += GetInstrSize(pInstr);
+        }
+        m_IL.m_offset = offset;
+
+        *pnBranches = nBranches;
+        return offset;
+    }
+
+    // Widens short branches whose displacement doesn't fit into an INT8, to a fixed
+    // point.  Only the branch table is visited: the offsets from the last layout stay
+    // as they are, and the growth in front of any instruction is derived from the
+    // branches widened before it.  Returns true if any branch was widened.
+    bool RelaxBranches(unsigned nBranches)
+    {
+        const unsigned k_growth = sizeof(INT32) - sizeof(INT8);
+
+        if (nBranches == 0)
+            return false;
+
+        // pGrowth[i] = bytes added by the widened branches among m_ppBranches[0..i)
+        unsigned * pGrowth = m_pArena->Alloc<unsigned>(nBranches + 1);
+        if (pGrowth == NULL)
+        {
+            // Can't relax incrementally; fall back to the long form everywhere
+            for (unsigned i = 0; i < nBranches; i++)
+            {
+                if (IsShortBranch(m_ppBranches[i]->m_opcode))
+                    m_ppBranches[i]->m_opcode = ToLongBranch(m_ppBranches[i]->m_opcode);
+            }
+            return true;
+        }
+
+        bool fWidened = false;
+        bool fChanged = true;
+
+        while (fChanged)
+        {
+            fChanged = false;
+
+            pGrowth[0] = 0;
+            for (unsigned i = 0; i < nBranches; i++)
+            {
+                unsigned opcode = m_ppBranches[i]->m_opcode;
+                bool fLong = (opcode == CEE_LEAVE) || (opcode >= CEE_BR && opcode <= CEE_BLT_UN);
+                pGrowth[i + 1] = pGrowth[i] + (fLong ? k_growth : 0);
+            }
+
+            for (unsigned i = 0; i < nBranches; i++)
+            {
+                ILInstr * pInstr = m_ppBranches[i];
+                if (!IsShortBranch(pInstr->m_opcode))
+                    continue;
+
+                int next = pInstr->m_offset + pGrowth[i] + 1 + sizeof(INT8);
+                int target = pInstr->m_pTarget->m_offset + pGrowth[CountBranchesBefore(nBranches, pInstr->m_pTarget->m_offset)];
+                int delta = target - next;
+
+                // (see #pragma at top of file)
+                if ((INT8)delta != delta)
+                {
+                    pInstr->m_opcode = ToLongBranch(pInstr->m_opcode);
+                    fChanged = true;
+                    fWidened = true;
+                }
+            }
+        }
+
+        return fWidened;
+    }
+
+    // Number of recorded branches laid out before the given offset
+    unsigned CountBranchesBefore(unsigned nBranches, unsigned offset)
+    {
+        unsigned lo = 0;
+        unsigned hi = nBranches;
+        while (lo < hi)
+        {
+            unsigned mid = (lo + hi) / 2;
+            if (m_ppBranches[mid]->m_offset < offset)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    // Encodes every instruction at its final offset, branch displacements included.
+    void EmitInstrs(BYTE * pIL)
+    {
+        unsigned switchBase = 0;
+
+        for (ILInstr * pInstr = m_IL.m_pNext; pInstr != &m_IL; pInstr = pInstr->m_pNext)
+        {
+            unsigned offset = pInstr->m_offset;
+
+            unsigned opcode = pInstr->m_opcode;
+            if (opcode < CEE_COUNT)
+            {
+                // CEE_PREFIX1 refers not to instruction prefixes (like tail.), but to
+                // the lead byte of multi-byte opcodes. For now, the only lead byte
+                // supported is CEE_PREFIX1 = 0xFE.
+                if (opcode >= 0x100)
+                    pIL[offset++] = CEE_PREFIX1;
+
+                // This appears to depend on an implicit conversion from
+                // unsigned opcode down to BYTE, to deliberately lose data and have
+                // opcode >= 0x100 wrap around to 0.
+                pIL[offset++] = (opcode & 0xFF);
+            }
+
+            BYTE flags = s_OpCodeFlags[opcode];
+            switch (flags)
+            {
+            case 0:
+                break;
+            case 1:
+                *(UNALIGNED INT8 *)&(pIL[offset]) = pInstr->m_Arg8;
+                break;
+            case 2:
+                *(UNALIGNED INT16 *)&(pIL[offset]) = pInstr->m_Arg16;
+                break;
+            case 4:
+                *(UNALIGNED INT32 *)&(pIL[offset]) = pInstr->m_Arg32;
+                break;
+            case 8:
+                *(UNALIGNED INT64 *)&(pIL[offset]) = pInstr->m_Arg64;
+                break;
+            case 1 | OPCODEFLAGS_BranchTarget:
+                *(UNALIGNED INT8 *)&(pIL[offset]) = (INT8)(pInstr->m_pTarget->m_offset - pInstr->m_pNext->m_offset);
+                break;
+            case 4 | OPCODEFLAGS_BranchTarget:
+                if (opcode == CEE_SWITCH_ARG)
+                {
+                    // Switch args are special
+                    *(UNALIGNED INT32 *)&(pIL[offset]) = pInstr->m_pTarget->m_offset - switchBase;
+                }
+                else
+                {
+                    *(UNALIGNED INT32 *)&(pIL[offset]) = pInstr->m_pTarget->m_offset - pInstr->m_pNext->m_offset;
                 }
+                break;
+            case 0 | OPCODEFLAGS_Switch:
+                *(UNALIGNED INT32 *)&(pIL[offset]) = pInstr->m_Arg32;
+                switchBase = pInstr->m_offset + 1 + sizeof(INT32) * (pInstr->m_Arg32 + 1);
+                break;
+            default:
+                assert(false);
+                break;
             }
         }
-
-        DumpBody(pBody, totalSize);
-
-        IfFailRet(SetILFunctionBody(totalSize, pBody));
-
-        return S_OK;
     }
 
-    void DumpBody(LPBYTE pBody, int totalSize)
+    HRESULT SetILFunctionBody(unsigned size, LPBYTE pBody)
     {
-        printf("\n");
-
-        for (int i = 0; i < totalSize; i++)
+        if (m_pReJitBody != NULL)
         {
-            printf("%02x ", pBody[i]);
+            // Already in *m_pReJitBody, where the ReJIT takes it from
+            return S_OK;
         }
 
-        printf("\n");
-    }
-
-    HRESULT SetILFunctionBody(unsigned size, LPBYTE pBody)
-    {
         m_pICorProfilerInfo->SetILFunctionBody(m_moduleId, m_tkMethod, pBody);
         return S_OK;
     }
 
     LPBYTE AllocateILMemory(unsigned size)
     {
+        if (m_pReJitBody != NULL)
+        {
+            // We're supplying IL for a rejit, so this memory is ours to free
+            m_pReJitBody->resize(size);
+            return m_pReJitBody->data();
+        }
+
         // Else, this is "classic-style" instrumentation on first JIT, and
         // need to use the CLR's IL allocator
-
-        if (FAILED(m_pICorProfilerInfo->GetILFunctionBodyAllocator(m_moduleId, &m_pIMethodMalloc)))
-            return NULL;
-
         return (LPBYTE)m_pIMethodMalloc->Alloc(size);
     }
 
@@ -1020,7 +2204,8 @@ public:
     //
     ////////////////////////////////////////////////////////////////////////////////////////////////
 
-    UINT AddNewLocal()
+    // Appends cNewLocals locals whose types are the concatenated pNewTypes
+    HRESULT AddNewLocals(PCCOR_SIGNATURE pNewTypes, ULONG cbNewTypes, ULONG cNewLocals, UINT * piFirstNewLocal)
     {
         HRESULT hr;
 
@@ -1043,7 +2228,7 @@ public:
             hr = m_pMetaDataImport->GetSigFromToken(m_tkLocalVarSig, &rgbOrigSig, &cbOrigSig);
             if (FAILED(hr))
             {
-                return 0;
+                return hr;
             }
         }
 
@@ -1062,7 +2247,7 @@ public:
         if (iNewSig + 1 > sizeof(rgbNewSig))
         {
             // We'll write one byte below but no room!
-            return 0;
+            return E_FAIL;
         }
         rgbNewSig[iNewSig++] = SIG_LOCAL_SIG;
 
@@ -1082,20 +2267,20 @@ public:
                 &cbOrigLocals);       // [OUT] length of the expanded data    
             if (FAILED(hr))
             {
-                return 0;
+                return hr;
             }
             iOrigSig += cbOrigLocals;
         }
 
-        // ...and write new count of locals (cOrigLocals + 1)
+        // ...and write new count of locals (cOrigLocals + cNewLocals)
         if (iNewSig + 4 > sizeof(rgbNewSig))
         {
             // CorSigCompressData will write up to 4 bytes but no room!
-            return 0;
+            return E_FAIL;
         }
 
         ULONG cbNewLocals;
-        cbNewLocals = CorSigCompressData(cOrigLocals + 1,         // [IN] given uncompressed data 
+        cbNewLocals = CorSigCompressData(cOrigLocals + cNewLocals,    // [IN] given uncompressed data 
             &rgbNewSig[iNewSig]);  // [OUT] buffer where iLen will be compressed and stored.   
         iNewSig += cbNewLocals;
 
@@ -1105,22 +2290,22 @@ public:
             if (iNewSig + cbOrigSig - iOrigSig > sizeof(rgbNewSig))
             {
                 // We'll copy cbOrigSig - iOrigSig bytes, but no room!
-                return 0;
+                return E_FAIL;
             }
             memcpy(&rgbNewSig[iNewSig], &rgbOrigSig[iOrigSig], cbOrigSig - iOrigSig);
             iNewSig += cbOrigSig - iOrigSig;
         }
 
-        // Manually append final local
+        // Manually append the new locals
 
-        if (iNewSig + 3 > sizeof(rgbNewSig))
+        if (iNewSig + cbNewTypes > sizeof(rgbNewSig))
         {
-            // We'll write one byte below but no room!
-            return 0;
+            // We'll copy cbNewTypes bytes below but no room!
+            return E_FAIL;
         }
 
-        rgbNewSig[iNewSig++] = ELEMENT_TYPE_SZARRAY;
-        rgbNewSig[iNewSig++] = ELEMENT_TYPE_OBJECT;
+        memcpy(&rgbNewSig[iNewSig], pNewTypes, cbNewTypes);
+        iNewSig += cbNewTypes;
 
         // We're done building up the new signature blob.  We now need to add it to
         // the metadata for this module, so we can get a token back for it.
@@ -1130,12 +2315,15 @@ public:
             &m_tkLocalVarSig);  // [OUT] returned signature token.  
         if (FAILED(hr))
         {
-            return 0;
+            return hr;
         }
 
-        // 0-based index of new local = 0-based index of original last local + 1
-        //                            = count of original locals
-        return cOrigLocals;
+        m_newLocalSig.assign(&rgbNewSig[0], &rgbNewSig[iNewSig]);
+
+        // 0-based index of first new local = 0-based index of original last local + 1
+        //                                  = count of original locals
+        *piFirstNewLocal = cOrigLocals;
+        return S_OK;
     }
 
     WCHAR* GetNameFromToken(mdToken tk)
@@ -1201,10 +2389,54 @@ public:
         InsertBefore(pInsertProbeBeforeThisInstr, pNewInstr);
     }
 
-    void InsertLdc4Before(ILInstr * pInsertProbeBeforeThisInstr, int arg1)
+    ILInstr * InsertLdc4Before(ILInstr * pInsertProbeBeforeThisInstr, int arg1)
+    {
+        ILInstr * pNewInstr = NewILInstr();
+        pNewInstr->m_opcode = CEE_LDC_I4;
+        pNewInstr->m_Arg32 = arg1;
+        InsertBefore(pInsertProbeBeforeThisInstr, pNewInstr);
+        return pNewInstr;
+    }
+
+    ILInstr * InsertLdc8Before(ILInstr * pInsertProbeBeforeThisInstr, INT64 arg1)
+    {
+        ILInstr * pNewInstr = NewILInstr();
+        pNewInstr->m_opcode = CEE_LDC_I8;
+        pNewInstr->m_Arg64 = arg1;
+        InsertBefore(pInsertProbeBeforeThisInstr, pNewInstr);
+        return pNewInstr;
+    }
+
+    // Pushes the address of native memory as a native int
+    void InsertLdcPtrBefore(ILInstr * pInsertProbeBeforeThisInstr, const volatile void * p)
     {
-        ILInstr * pNewInstr = NewLDC((LPVOID)arg1);
+        InsertBefore(pInsertProbeBeforeThisInstr, NewLDC((LPVOID)p));
+        InsertBefore(pInsertProbeBeforeThisInstr, CEE_CONV_I);
+    }
+
+    // Export picks the short form when the target is close enough
+    ILInstr * InsertBranchBefore(ILInstr * pInsertProbeBeforeThisInstr, unsigned opcode, ILInstr * pTarget)
+    {
+        ILInstr * pNewInstr = NewILInstr();
+        pNewInstr->m_opcode = opcode;
+        pNewInstr->m_pTarget = pTarget;
         InsertBefore(pInsertProbeBeforeThisInstr, pNewInstr);
+        return pNewInstr;
+    }
+
+    // Turns pInstr into another instruction in place, so that branches and EH clauses
+    // referring to it refer to the new one
+    void ReplaceInstr(ILInstr * pInstr, unsigned opcode, INT32 arg32 = 0)
+    {
+        pInstr->m_opcode = opcode;
+        pInstr->m_Arg32 = arg32;
+        AdjustState(pInstr);
+    }
+
+    // The cookie differs from run to run; the rewrite cache re-binds it
+    void AddModuleCookieInstr(ILInstr * pInstr)
+    {
+        m_moduleCookieInstrs.push_back(pInstr);
     }
 
     void InsertNewArrBefore(ILInstr * pInsertProbeBeforeThisInstr, mdToken tk)
@@ -1223,12 +2455,13 @@ public:
         InsertBefore(pInsertProbeBeforeThisInstr, pNewInstr);
     }
 
-    void InsertLdlocBefore(ILInstr * pInsertProbeBeforeThisInstr, int arg1)
+    ILInstr * InsertLdlocBefore(ILInstr * pInsertProbeBeforeThisInstr, int arg1)
     {
         ILInstr * pNewInstr = NewILInstr();
         pNewInstr->m_opcode = CEE_LDLOC;
         pNewInstr->m_Arg16 = (INT16)arg1;
         InsertBefore(pInsertProbeBeforeThisInstr, pNewInstr);
+        return pNewInstr;
     }
 
     void InsertLdArgBefore(ILInstr * pInsertProbeBeforeThisInstr, int arg1)
@@ -1257,6 +2490,31 @@ HRESULT AddProbe(
 {
     ILInstr * pNewInstr = NULL;
 
+    if (moduleInfo.UsesFastProbe() == true)
+    {
+        // Enter(methodToken, moduleCookie); names are resolved by the profiler later
+        pilr->InsertLdc4Before(pInsertProbeBeforeThisInstr, methodDef);
+        pilr->AddModuleCookieInstr(pilr->InsertLdc4Before(pInsertProbeBeforeThisInstr, moduleInfo.m_moduleCookie));
+
+        pNewInstr = pilr->NewILInstr();
+        pNewInstr->m_opcode = CEE_CALL;
+        pNewInstr->m_Arg32 = moduleInfo.m_mdFastEnterProbeRef;
+        pilr->InsertBefore(pInsertProbeBeforeThisInstr, pNewInstr);
+
+        return S_OK;
+    }
+
+    int argCount = pilr->GetArgCount();
+    bool fTypedProbe = pilr->CanUseTypedProbe();
+
+    if (fTypedProbe == true)
+    {
+        // Enter<T1, ..., Tn>(methodToken, moduleCookie, this, ...); the helper looks the
+        // method's name up once by the two instead of walking the stack on every call
+        pilr->InsertLdc4Before(pInsertProbeBeforeThisInstr, methodDef);
+        pilr->AddModuleCookieInstr(pilr->InsertLdc4Before(pInsertProbeBeforeThisInstr, moduleInfo.m_moduleCookie));
+    }
+
     if (pilr->IsStaticMethod() == true)
     {
         pilr->InsertBefore(pInsertProbeBeforeThisInstr, CEE_LDNULL);
@@ -1266,12 +2524,33 @@ HRESULT AddProbe(
         pilr->InsertBefore(pInsertProbeBeforeThisInstr, CEE_LDARG_0);
     }
 
-    int argCount = pilr->GetArgCount();
+    mdToken probeToken = mdTokenNil;
 
-    if (argCount == 0)
+    if (fTypedProbe == true)
+    {
+        // Passing argument(s) as they are to Enter<T1, ..., Tn>, which needs
+        // neither an array nor boxing
+        for (int i = 0; i < argCount; i++)
+        {
+            pilr->InsertLdArgBefore(pInsertProbeBeforeThisInstr, pilr->IsStaticMethod() ? i : i + 1);
+        }
+
+        probeToken = moduleInfo.m_mdTypedEnterProbeRefs[argCount];
+        if (argCount != 0)
+        {
+            probeToken = pilr->DefineTypedProbeSpec(probeToken);
+        }
+
+        if (IsNilToken(probeToken) == true)
+        {
+            return E_FAIL;
+        }
+    }
+    else if (argCount == 0)
     {
         // No argument
         pilr->InsertBefore(pInsertProbeBeforeThisInstr, CEE_LDNULL);
+        probeToken = moduleInfo.m_mdEnterProbeRef;
     }
     else
     {
@@ -1293,6 +2572,15 @@ HRESULT AddProbe(
 
             pilr->InsertLdlocBefore(pInsertProbeBeforeThisInstr, objectArrArgIndex);
             pilr->InsertLdc4Before(pInsertProbeBeforeThisInstr, i);
+
+            if (pilr->IsByRefLike(i) == true)
+            {
+                // Can't be boxed; leave the element null
+                pilr->InsertBefore(pInsertProbeBeforeThisInstr, CEE_LDNULL);
+                pilr->InsertBefore(pInsertProbeBeforeThisInstr, CEE_STELEM_REF);
+                continue;
+            }
+
             pilr->InsertLdArgBefore(pInsertProbeBeforeThisInstr, argIndex);
 
             if (pilr->NeedBox(i) == true)
@@ -1303,6 +2591,10 @@ HRESULT AddProbe(
                 {
                     argToken = pilr->GetGenericTypeToken(i);
                 }
+                else if (pilr->IsValueType(i) == true)
+                {
+                    argToken = pilr->GetArgTypeSpecToken(i);
+                }
                 else
                 {
                     argToken = moduleInfo.m_primitives[pilr->GetArgElementType(i)];
@@ -1315,16 +2607,269 @@ HRESULT AddProbe(
         }
 
         pilr->InsertLdlocBefore(pInsertProbeBeforeThisInstr, objectArrArgIndex);
+        probeToken = moduleInfo.m_mdEnterProbeRef;
     }
 
     pNewInstr = pilr->NewILInstr();
     pNewInstr->m_opcode = CEE_CALL;
-    pNewInstr->m_Arg32 = moduleInfo.m_mdEnterProbeRef;
+    pNewInstr->m_Arg32 = probeToken;
     pilr->InsertBefore(pInsertProbeBeforeThisInstr, pNewInstr);
 
     return S_OK;
 }
 
+// Pushes the arguments of the exit probe that follow the return value and calls it;
+// returns the first instruction it inserted
+static ILInstr * InsertExitProbeCallBefore(
+    ILRewriter * pilr,
+    ILInstr * pWhere,
+    mdMethodDef methodDef,
+    ModuleContext &moduleInfo, int startTimestampLocalIndex, mdToken probeToken)
+{
+    ILInstr * pFirstInstr = pilr->InsertLdc4Before(pWhere, methodDef);
+    pilr->AddModuleCookieInstr(pilr->InsertLdc4Before(pWhere, moduleInfo.m_moduleCookie));
+    pilr->InsertLdlocBefore(pWhere, startTimestampLocalIndex);
+
+    ILInstr * pNewInstr = pilr->NewILInstr();
+    pNewInstr->m_opcode = CEE_CALL;
+    pNewInstr->m_Arg32 = probeToken;
+    pilr->InsertBefore(pWhere, pNewInstr);
+
+    return pFirstInstr;
+}
+
+// Passes the time since startTimestampLocalIndex was set, and with COREPROFILER_RETURN_VALUES
+// the return value when its type allows, to the exit probe.
+//
+// With fProtect the original code becomes the try block of a fault clause whose handler
+// calls the untyped exit probe, so exits by an exception are timed too.  Every ret turns
+// into a leave to one epilogue after the handler, which calls the exit probe and returns
+// the value kept in returnValueLocalIndex (unless the method returns void).  Without
+// fProtect, as for bodies with localloc or jmp, the probe goes before every ret and only
+// normal returns are timed; leaving a protected region reaches a ret too, so leave
+// targets need nothing of their own.
+//
+// With fSampled, calls whose start timestamp the sampling guard left at 0 skip the probe.
+HRESULT AddExitProbes(
+    ILRewriter * pilr,
+    mdMethodDef methodDef,
+    ModuleContext &moduleInfo, int startTimestampLocalIndex, int returnValueLocalIndex, bool fProtect, bool fSampled)
+{
+    ILInstr * pNewInstr = NULL;
+
+    bool fPassReturnValue = moduleInfo.PassesReturnValues() == true && pilr->CanUseTypedExitProbe() == true;
+
+    mdToken probeToken = moduleInfo.m_mdExitProbeRef;
+    if (fPassReturnValue == true)
+    {
+        probeToken = pilr->DefineExitProbeSpec(moduleInfo.m_mdTypedExitProbeRef);
+        if (IsNilToken(probeToken) == true)
+        {
+            return E_FAIL;
+        }
+    }
+
+    ILInstr * pFirstOriginalInstr = pilr->GetILList()->m_pNext;
+
+    // The rets of the original code; the loop below adds new ones
+    vector<ILInstr *> rets;
+    for (ILInstr * pInstr = pFirstOriginalInstr; pInstr != pilr->GetILList(); pInstr = pInstr->m_pNext)
+    {
+        if (pInstr->m_opcode == CEE_RET)
+        {
+            rets.push_back(pInstr);
+        }
+    }
+
+    if (fProtect == true)
+    {
+        // The original code can't fall through its end, so the handler and the epilogue
+        // are appended after it
+        ILInstr * pEnd = pilr->GetILList();
+
+        ILInstr * pEndFinally = pilr->NewILInstr();
+        pEndFinally->m_opcode = CEE_ENDFINALLY;
+        pilr->InsertBefore(pEnd, pEndFinally);
+
+        ILInstr * pHandlerBegin = InsertExitProbeCallBefore(pilr, pEndFinally, methodDef, moduleInfo,
+            startTimestampLocalIndex, moduleInfo.m_mdExitProbeRef);
+        if (fSampled == true)
+        {
+            ILInstr * pProbe = pHandlerBegin;
+            pHandlerBegin = pilr->InsertLdlocBefore(pProbe, startTimestampLocalIndex);
+            pilr->InsertBranchBefore(pProbe, CEE_BRFALSE, pEndFinally);
+        }
+
+        // Epilogue: Exit(...) or Exit<TResult>(returnValue, ...), then the return
+        ILInstr * pRet = pilr->NewILInstr();
+        pRet->m_opcode = CEE_RET;
+        pilr->InsertBefore(pEnd, pRet);
+
+        ILInstr * pReturn = pRet;
+        if (returnValueLocalIndex >= 0)
+        {
+            pReturn = pilr->InsertLdlocBefore(pRet, returnValueLocalIndex);
+        }
+
+        ILInstr * pProbe = NULL;
+        if (fPassReturnValue == true)
+        {
+            pProbe = pilr->InsertLdlocBefore(pReturn, returnValueLocalIndex);
+            InsertExitProbeCallBefore(pilr, pReturn, methodDef, moduleInfo, startTimestampLocalIndex, probeToken);
+        }
+        else
+        {
+            pProbe = InsertExitProbeCallBefore(pilr, pReturn, methodDef, moduleInfo, startTimestampLocalIndex, probeToken);
+        }
+
+        ILInstr * pEpilogue = pProbe;
+        if (fSampled == true)
+        {
+            pEpilogue = pilr->InsertLdlocBefore(pProbe, startTimestampLocalIndex);
+            pilr->InsertBranchBefore(pProbe, CEE_BRFALSE, pReturn);
+        }
+
+        for (ILInstr * pOriginalRet : rets)
+        {
+            // Turned into the leave in place, so that branches to the ret reach it
+            if (returnValueLocalIndex >= 0)
+            {
+                pilr->ReplaceInstr(pOriginalRet, CEE_STLOC);
+                pOriginalRet->m_Arg16 = (INT16)returnValueLocalIndex;
+                pilr->InsertBranchBefore(pOriginalRet->m_pNext, CEE_LEAVE, pEpilogue);
+            }
+            else
+            {
+                pilr->ReplaceInstr(pOriginalRet, CEE_LEAVE);
+                pOriginalRet->m_pTarget = pEpilogue;
+            }
+        }
+
+        EHClause clause = {};
+        clause.m_Flags = COR_ILEXCEPTION_CLAUSE_FAULT;
+        clause.m_pTryBegin = pFirstOriginalInstr;
+        clause.m_pTryEnd = pHandlerBegin;
+        clause.m_pHandlerBegin = pHandlerBegin;
+        clause.m_pHandlerEnd = pEndFinally;
+        IfFailRet(pilr->AddEHClause(clause));
+    }
+    else
+    {
+        for (ILInstr * pRet : rets)
+        {
+            // Branches and EH clauses that refer to the ret keep doing so, so the ret itself
+            // becomes the first instruction of the exit sequence
+            ILInstr * pNewRet = pilr->NewILInstr();
+            pNewRet->m_opcode = CEE_RET;
+            pilr->InsertAfter(pRet, pNewRet);
+
+            if (fSampled == true)
+            {
+                pilr->ReplaceInstr(pRet, CEE_LDLOC, startTimestampLocalIndex);
+                pilr->InsertBranchBefore(pNewRet, CEE_BRFALSE, pNewRet);
+            }
+
+            if (fPassReturnValue == true)
+            {
+                // Exit<TResult>(returnValue, methodToken, moduleCookie, startTimestamp)
+                if (fSampled == true)
+                {
+                    pilr->InsertBefore(pNewRet, CEE_DUP);
+                }
+                else
+                {
+                    pilr->ReplaceInstr(pRet, CEE_DUP);
+                }
+
+                pilr->InsertLdc4Before(pNewRet, methodDef);
+            }
+            else
+            {
+                // Exit(methodToken, moduleCookie, startTimestamp); a return value stays below
+                if (fSampled == true)
+                {
+                    pilr->InsertLdc4Before(pNewRet, methodDef);
+                }
+                else
+                {
+                    pilr->ReplaceInstr(pRet, CEE_LDC_I4, methodDef);
+                }
+            }
+
+            pilr->AddModuleCookieInstr(pilr->InsertLdc4Before(pNewRet, moduleInfo.m_moduleCookie));
+            pilr->InsertLdlocBefore(pNewRet, startTimestampLocalIndex);
+
+            pNewInstr = pilr->NewILInstr();
+            pNewInstr->m_opcode = CEE_CALL;
+            pNewInstr->m_Arg32 = probeToken;
+            pilr->InsertBefore(pNewRet, pNewInstr);
+        }
+    }
+
+    // startTimestamp = EnterTimestamp(), ahead of the original code and after the enter
+    // probe, which is added later
+    pNewInstr = pilr->NewILInstr();
+    pNewInstr->m_opcode = CEE_CALL;
+    pNewInstr->m_Arg32 = moduleInfo.m_mdEnterTimestampRef;
+    pilr->InsertBefore(pFirstOriginalInstr, pNewInstr);
+    pilr->InsertStlocBefore(pFirstOriginalInstr, startTimestampLocalIndex);
+
+    return S_OK;
+}
+
+// Puts the sampling guard in front of the probes at the start of the method: the call
+// runs them only while the sampling window is open and when the method's countdown runs
+// out, which resets it to the current interval.  Skipped calls continue at
+// pFirstOriginalInstr, after clearing the start timestamp of the exit probes if there
+// are any (startTimestampLocalIndex >= 0).
+HRESULT AddSamplingGuard(
+    ILRewriter * pilr,
+    mdMethodDef methodDef,
+    ModuleContext &moduleInfo,
+    ILInstr * pFirstOriginalInstr, int startTimestampLocalIndex)
+{
+    volatile LONG * pCounter = g_probeRegistry.GetSampleCounter(moduleInfo.m_moduleCookie, methodDef);
+    if (pCounter == NULL)
+    {
+        return E_FAIL;
+    }
+
+    ILInstr * pSkip = pFirstOriginalInstr;
+    if (startTimestampLocalIndex >= 0)
+    {
+        pilr->InsertBranchBefore(pFirstOriginalInstr, CEE_BR, pFirstOriginalInstr);
+        pSkip = pilr->InsertLdc8Before(pFirstOriginalInstr, 0);
+        pilr->InsertStlocBefore(pFirstOriginalInstr, startTimestampLocalIndex);
+    }
+
+    ILInstr * pFirstProbeInstr = pilr->GetILList()->m_pNext;
+
+    // if (*pWindowOpen == 0) goto skip;
+    pilr->InsertLdcPtrBefore(pFirstProbeInstr, g_samplingControl.GetWindowOpenCell());
+    pilr->InsertBefore(pFirstProbeInstr, CEE_LDIND_I4);
+    pilr->InsertBranchBefore(pFirstProbeInstr, CEE_BRFALSE, pSkip);
+
+    // if (--*pCounter > 0) goto skip;
+    pilr->InsertLdcPtrBefore(pFirstProbeInstr, pCounter);
+    pilr->InsertBefore(pFirstProbeInstr, CEE_DUP);
+    pilr->InsertBefore(pFirstProbeInstr, CEE_LDIND_I4);
+    pilr->InsertBefore(pFirstProbeInstr, CEE_LDC_I4_1);
+    pilr->InsertBefore(pFirstProbeInstr, CEE_SUB);
+    pilr->InsertBefore(pFirstProbeInstr, CEE_STIND_I4);
+    pilr->InsertLdcPtrBefore(pFirstProbeInstr, pCounter);
+    pilr->InsertBefore(pFirstProbeInstr, CEE_LDIND_I4);
+    pilr->InsertBefore(pFirstProbeInstr, CEE_LDC_I4_0);
+    pilr->InsertBranchBefore(pFirstProbeInstr, CEE_BGT, pSkip);
+
+    // *pCounter = *pInterval;
+    pilr->InsertLdcPtrBefore(pFirstProbeInstr, pCounter);
+    pilr->InsertLdcPtrBefore(pFirstProbeInstr, g_samplingControl.GetIntervalCell());
+    pilr->InsertBefore(pFirstProbeInstr, CEE_LDIND_I4);
+    pilr->InsertBefore(pFirstProbeInstr, CEE_STIND_I4);
+
+    return S_OK;
+}
+
 HRESULT AddEnterProbe(
     ILRewriter * pilr,
     ModuleID moduleID,
@@ -1338,18 +2883,117 @@ HRESULT AddEnterProbe(
 
 // Uses the general-purpose ILRewriter class to import original
 // IL, rewrite it, and send the result to the CLR
-HRESULT RewriteIL(ICorProfilerInfo2 * pICorProfilerInfo, ModuleID moduleID,
-    mdMethodDef methodDef, ModuleContext &moduleInfo)
+HRESULT RewriteIL(ICorProfilerInfo2 * pICorProfilerInfo, std::vector<BYTE> * pReJitBody,
+    ModuleID moduleID, mdMethodDef methodDef, ModuleContext &moduleInfo)
 {
-    ILRewriter rewriter(pICorProfilerInfo, moduleID, methodDef);
+    // Sampling guards embed addresses of this process, so those rewrites aren't cached
+    bool fSampling = g_samplingControl.IsEnabled() == true && moduleInfo.m_moduleCookie >= 0;
+
+    // A body rewritten the same way by an earlier run only needs its tokens re-bound; the
+    // cache sets bodies at first JIT only
+    RewriteCacheKey cacheKey = {};
+    bool fCache = false;
+    if (g_rewriteCache.IsEnabled() == true && fSampling == false && pReJitBody == NULL)
+    {
+        LPCBYTE pMethodBytes = NULL;
+        ULONG cbMethod = 0;
+        IfFailRet(pICorProfilerInfo->GetILFunctionBody(moduleID, methodDef, &pMethodBytes, &cbMethod));
+
+        cacheKey.m_mvid = moduleInfo.m_mvid;
+        cacheKey.m_tkMethod = methodDef;
+        cacheKey.m_flags = (moduleInfo.UsesFastProbe() ? REWRITE_CACHE_FLAG_FAST_PROBE : 0) |
+            (moduleInfo.UsesExitProbe() ? REWRITE_CACHE_FLAG_EXIT_PROBE : 0) |
+            (moduleInfo.PassesReturnValues() ? REWRITE_CACHE_FLAG_RETURN_VALUES : 0);
+        cacheKey.m_ilHash = RewriteCache::HashBody(pMethodBytes, cbMethod);
+        fCache = true;
+
+        if (g_rewriteCache.Apply(pICorProfilerInfo, moduleID, cacheKey, moduleInfo) == S_OK)
+        {
+            return S_OK;
+        }
+    }
+
+    ILRewriter rewriter(pICorProfilerInfo, pReJitBody, moduleID, methodDef);
+
+    IfFailRet(rewriter.Initialize(moduleInfo));
+    IfFailRet(rewriter.Import());
+
+    ILInstr * pFirstOriginalInstr = rewriter.GetILList()->m_pNext;
+
+    // Adds enter/exit probes; the object[] fallback of the enter probe, the start timestamp
+    // of the exit probes and the return value of a body they protect need new locals
+    bool fObjectArray = moduleInfo.UsesFastProbe() == false && rewriter.CanUseTypedProbe() == false;
+    bool fExitProbes = moduleInfo.UsesExitProbe() == true && rewriter.HasTailCall() == false;
+    bool fProtect = fExitProbes == true && rewriter.CanProtectBody() == true;
+    bool fReturnValueLocal = fProtect == true && rewriter.ReturnsValue() == true;
 
-    rewriter.Initialize();
-    rewriter.Import();
+    vector<COR_SIGNATURE> newLocals;
+    if (fObjectArray == true)
+    {
+        newLocals.push_back(ELEMENT_TYPE_SZARRAY);
+        newLocals.push_back(ELEMENT_TYPE_OBJECT);
+    }
+
+    if (fExitProbes == true)
+    {
+        newLocals.push_back(ELEMENT_TYPE_I8);
+    }
+
+    if (fReturnValueLocal == true)
+    {
+        ULONG cbRetSig = 0;
+        PCCOR_SIGNATURE pRetSig = rewriter.GetReturnTypeSig(&cbRetSig);
+        newLocals.insert(newLocals.end(), pRetSig, pRetSig + cbRetSig);
+    }
+
+    UINT iLocalVersion = 0;
+    if (newLocals.empty() == false)
+    {
+        IfFailRet(rewriter.AddNewLocals(newLocals.data(), (ULONG)newLocals.size(),
+            (fObjectArray ? 1 : 0) + (fExitProbes ? 1 : 0) + (fReturnValueLocal ? 1 : 0), &iLocalVersion));
+    }
+
+    int iStartTimestampLocal = fExitProbes ? (int)iLocalVersion + (fObjectArray ? 1 : 0) : -1;
+    int iReturnValueLocal = fReturnValueLocal ? iStartTimestampLocal + 1 : -1;
+    if (fExitProbes == true)
+    {
+        IfFailRet(AddExitProbes(&rewriter, methodDef, moduleInfo, iStartTimestampLocal, iReturnValueLocal,
+            fProtect, fSampling));
+    }
 
-    // Adds enter/exit probes
-    UINT iLocalVersion = rewriter.AddNewLocal();
     IfFailRet(AddEnterProbe(&rewriter, moduleID, methodDef, moduleInfo, iLocalVersion));
+
+    if (fSampling == true)
+    {
+        IfFailRet(AddSamplingGuard(&rewriter, methodDef, moduleInfo, pFirstOriginalInstr, iStartTimestampLocal));
+    }
+    IfFailRet(rewriter.Export());
+
+    if (fCache == true)
+    {
+        RewriteCacheData cacheData;
+        if (rewriter.CaptureForCache(moduleInfo, cacheData) == true)
+        {
+            g_rewriteCache.Add(cacheKey, cacheData);
+        }
+    }
+
+    return S_OK;
+}
+
+HRESULT RoundTripIL(ICorProfilerInfo2 * pICorProfilerInfo, std::vector<BYTE> * pBody,
+    ModuleID moduleID, mdMethodDef methodDef, ModuleContext &moduleInfo)
+{
+    ILRewriter rewriter(pICorProfilerInfo, pBody, moduleID, methodDef);
+
+    IfFailRet(rewriter.Initialize(moduleInfo));
+    IfFailRet(rewriter.Import());
     IfFailRet(rewriter.Export());
 
     return S_OK;
 }
+
+UINT64 GetILArenaAllocatedBytes()
+{
+    return t_cbArenaAllocated;
+}
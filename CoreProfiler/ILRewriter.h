@@ -2,5 +2,19 @@
 
 #include "stdafx.h"
 
-extern HRESULT RewriteIL(ICorProfilerInfo2 * pICorProfilerInfo, ModuleID moduleID,
-    mdMethodDef methodDef, ModuleContext &moduleInfo);
\ No newline at end of file
+// pReJitBody is NULL at first JIT, where the body is set right away.  For a ReJIT it
+// receives the body, since GetReJITParameters may not define the tokens a rewrite needs;
+// the rewrite runs before the ReJIT is requested and GetReJITParameters hands the body over.
+extern HRESULT RewriteIL(ICorProfilerInfo2 * pICorProfilerInfo, std::vector<BYTE> * pReJitBody,
+    ModuleID moduleID, mdMethodDef methodDef, ModuleContext &moduleInfo);
+
+// Imports the body and exports it again without adding anything, into *pBody; what the
+// rewriter does to a body besides the probes
+extern HRESULT RoundTripIL(ICorProfilerInfo2 * pICorProfilerInfo, std::vector<BYTE> * pBody,
+    ModuleID moduleID, mdMethodDef methodDef, ModuleContext &moduleInfo);
+
+// Bytes the rewrites on this thread have taken from their arenas so far
+extern UINT64 GetILArenaAllocatedBytes();
+
+// Length of the method body at pBody, header and extra sections included; 0 if it runs past cbMax
+extern ULONG GetMethodBodySize(LPCBYTE pBody, ULONG cbMax);
\ No newline at end of file
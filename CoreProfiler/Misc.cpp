@@ -1,12 +1,17 @@
-
 #include "stdafx.h"
 #include "Misc.h"
-#include <Strsafe.h>
+
+#ifndef _WIN32
+#include <dlfcn.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
 
 bool containsAtEnd(LPCWSTR wszContainer, LPCWSTR wszProspectiveEnding)
 {
-    size_t cchContainer = wcslen(wszContainer);
-    size_t cchEnding = wcslen(wszProspectiveEnding);
+    size_t cchContainer = std::char_traits<WCHAR>::length(wszContainer);
+    size_t cchEnding = std::char_traits<WCHAR>::length(wszProspectiveEnding);
 
     if (cchContainer < cchEnding)
     {
@@ -18,22 +23,277 @@ bool containsAtEnd(LPCWSTR wszContainer, LPCWSTR wszProspectiveEnding)
         return false;
     }
 
-    if (_wcsicmp(wszProspectiveEnding, &(wszContainer[cchContainer - cchEnding])) != 0)
+    LPCWSTR wszTail = &(wszContainer[cchContainer - cchEnding]);
+    for (size_t i = 0; i < cchEnding; i++)
     {
-        return false;
+        if (towlower(wszTail[i]) != towlower(wszProspectiveEnding[i]))
+        {
+            return false;
+        }
     }
 
     return true;
 }
 
-void outputDebugText(const wchar_t* format, ...)
+void outputDebugText(const char* format, ...)
 {
-    wchar_t buffer[4096];
+    char buffer[4096];
 
     va_list vaList;
     va_start(vaList, format);
-    StringCchVPrintfW(buffer, 4096, format, vaList);
+    vsnprintf(buffer, sizeof(buffer), format, vaList);
 
     va_end(vaList);
-    OutputDebugString(buffer);
-}
\ No newline at end of file
+
+#ifdef _WIN32
+    OutputDebugStringA(buffer);
+#else
+    fputs(buffer, stderr);
+#endif
+}
+
+bool getEnvironmentString(LPCWSTR wszName, WSTRING &value)
+{
+#ifdef _WIN32
+    DWORD cchValue = GetEnvironmentVariable(wszName, nullptr, 0);
+    if (cchValue == 0)
+    {
+        return false;
+    }
+
+    std::vector<WCHAR> buffer(cchValue);
+    cchValue = GetEnvironmentVariable(wszName, buffer.data(), (DWORD)buffer.size());
+    if (cchValue == 0 || cchValue >= buffer.size())
+    {
+        return false;
+    }
+
+    value.assign(buffer.data(), cchValue);
+    return true;
+#else
+    const char * szValue = getenv(toUtf8(wszName).c_str());
+    if (szValue == nullptr || *szValue == '\0')
+    {
+        return false;
+    }
+
+    value = fromUtf8(szValue);
+    return true;
+#endif
+}
+
+std::string toUtf8(const WSTRING &value)
+{
+    std::string result;
+
+#ifdef _WIN32
+    int cbResult = WideCharToMultiByte(CP_UTF8, 0, value.c_str(), (int)value.size(), nullptr, 0, nullptr, nullptr);
+    if (cbResult > 0)
+    {
+        result.resize(cbResult);
+        WideCharToMultiByte(CP_UTF8, 0, value.c_str(), (int)value.size(), &result[0], cbResult, nullptr, nullptr);
+    }
+#else
+    for (size_t i = 0; i < value.size(); i++)
+    {
+        UINT32 codePoint = value[i];
+
+        // Unpaired surrogates become U+FFFD
+        if (codePoint >= 0xd800 && codePoint <= 0xdfff)
+        {
+            if (codePoint <= 0xdbff && i + 1 < value.size() && value[i + 1] >= 0xdc00 && value[i + 1] <= 0xdfff)
+            {
+                codePoint = 0x10000 + ((codePoint - 0xd800) << 10) + (value[i + 1] - 0xdc00);
+                i++;
+            }
+            else
+            {
+                codePoint = 0xfffd;
+            }
+        }
+
+        if (codePoint < 0x80)
+        {
+            result += (char)codePoint;
+        }
+        else if (codePoint < 0x800)
+        {
+            result += (char)(0xc0 | (codePoint >> 6));
+            result += (char)(0x80 | (codePoint & 0x3f));
+        }
+        else if (codePoint < 0x10000)
+        {
+            result += (char)(0xe0 | (codePoint >> 12));
+            result += (char)(0x80 | ((codePoint >> 6) & 0x3f));
+            result += (char)(0x80 | (codePoint & 0x3f));
+        }
+        else
+        {
+            result += (char)(0xf0 | (codePoint >> 18));
+            result += (char)(0x80 | ((codePoint >> 12) & 0x3f));
+            result += (char)(0x80 | ((codePoint >> 6) & 0x3f));
+            result += (char)(0x80 | (codePoint & 0x3f));
+        }
+    }
+#endif
+
+    return result;
+}
+
+WSTRING fromUtf8(const std::string &value)
+{
+    WSTRING result;
+
+#ifdef _WIN32
+    int cchResult = MultiByteToWideChar(CP_UTF8, 0, value.c_str(), (int)value.size(), nullptr, 0);
+    if (cchResult > 0)
+    {
+        result.resize(cchResult);
+        MultiByteToWideChar(CP_UTF8, 0, value.c_str(), (int)value.size(), &result[0], cchResult);
+    }
+#else
+    size_t i = 0;
+    while (i < value.size())
+    {
+        BYTE lead = (BYTE)value[i];
+        int cContinuation = lead < 0x80 ? 0 : (lead & 0xe0) == 0xc0 ? 1 : (lead & 0xf0) == 0xe0 ? 2 : (lead & 0xf8) == 0xf0 ? 3 : -1;
+
+        UINT32 codePoint = cContinuation == 0 ? lead : cContinuation == 1 ? (lead & 0x1f) :
+            cContinuation == 2 ? (lead & 0x0f) : (lead & 0x07);
+
+        bool fValid = cContinuation >= 0 && i + cContinuation < value.size();
+        for (int j = 1; fValid == true && j <= cContinuation; j++)
+        {
+            BYTE next = (BYTE)value[i + j];
+            fValid = (next & 0xc0) == 0x80;
+            codePoint = (codePoint << 6) | (next & 0x3f);
+        }
+
+        // Malformed sequences become U+FFFD, one byte at a time
+        if (fValid == false || codePoint > 0x10ffff || (codePoint >= 0xd800 && codePoint <= 0xdfff))
+        {
+            result += (WCHAR)0xfffd;
+            i++;
+            continue;
+        }
+
+        if (codePoint >= 0x10000)
+        {
+            codePoint -= 0x10000;
+            result += (WCHAR)(0xd800 + (codePoint >> 10));
+            result += (WCHAR)(0xdc00 + (codePoint & 0x3ff));
+        }
+        else
+        {
+            result += (WCHAR)codePoint;
+        }
+
+        i += cContinuation + 1;
+    }
+#endif
+
+    return result;
+}
+
+WSTRING fromPath(const std::filesystem::path &path)
+{
+#ifdef _WIN32
+    return path.wstring();
+#else
+    return path.u16string();
+#endif
+}
+
+FILE * openFile(const WSTRING &path, const char * mode)
+{
+#ifdef _WIN32
+    WSTRING wideMode = fromUtf8(mode);
+
+    FILE * pFile = nullptr;
+    if (_wfopen_s(&pFile, path.c_str(), wideMode.c_str()) != 0)
+    {
+        return nullptr;
+    }
+
+    return pFile;
+#else
+    return fopen(toUtf8(path).c_str(), mode);
+#endif
+}
+
+INT64 getTimestamp()
+{
+#ifdef _WIN32
+    LARGE_INTEGER timestamp;
+    QueryPerformanceCounter(&timestamp);
+    return timestamp.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (INT64)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+INT64 getTimestampFrequency()
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    return frequency.QuadPart;
+#else
+    return 1000000000;
+#endif
+}
+
+DWORD getCurrentThreadId()
+{
+#ifdef _WIN32
+    return GetCurrentThreadId();
+#else
+    return (DWORD)syscall(SYS_gettid);
+#endif
+}
+
+DWORD getCurrentProcessId()
+{
+#ifdef _WIN32
+    return GetCurrentProcessId();
+#else
+    return (DWORD)getpid();
+#endif
+}
+
+bool getProfilerModulePath(std::filesystem::path &path)
+{
+#ifdef _WIN32
+    WCHAR wszPath[MAX_PATH];
+    if (GetModuleFileName((HINSTANCE)_AtlBaseModule.m_hInst, wszPath, MAX_PATH) == 0)
+    {
+        return false;
+    }
+
+    path = wszPath;
+    return true;
+#else
+    Dl_info info;
+    if (dladdr((void *)&getProfilerModulePath, &info) == 0 || info.dli_fname == nullptr)
+    {
+        return false;
+    }
+
+    path = info.dli_fname;
+    return true;
+#endif
+}
+
+bool pinProfilerModule()
+{
+#ifdef _WIN32
+    HMODULE hModule = nullptr;
+    return GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+        (LPCWSTR)_AtlBaseModule.m_hInst, &hModule) == TRUE;
+#else
+    std::filesystem::path path;
+    return getProfilerModulePath(path) == true && dlopen(path.c_str(), RTLD_NOW | RTLD_NODELETE) != nullptr;
+#endif
+}
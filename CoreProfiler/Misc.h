@@ -1,4 +1,54 @@
 #pragma once
 
 bool containsAtEnd(LPCWSTR wszContainer, LPCWSTR wszProspectiveEnding);
-void outputDebugText(const wchar_t* format, ...);
\ No newline at end of file
+void outputDebugText(const char* format, ...);
+bool getEnvironmentString(LPCWSTR wszName, WSTRING &value);
+
+std::string toUtf8(const WSTRING &value);
+WSTRING fromUtf8(const std::string &value);
+WSTRING fromPath(const std::filesystem::path &path);
+FILE * openFile(const WSTRING &path, const char * mode);
+
+// In the units of Stopwatch.GetTimestamp, which the exit probes measure with
+INT64 getTimestamp();
+INT64 getTimestampFrequency();
+
+DWORD getCurrentThreadId();
+DWORD getCurrentProcessId();
+
+// The profiler's own module, which pinProfilerModule keeps loaded until the process exits
+bool getProfilerModulePath(std::filesystem::path &path);
+bool pinProfilerModule();
+
+// Tells a worker thread to stop; the thread waits on it between rounds of work
+class StopSignal
+{
+public:
+    // True once the signal is set, false when timeoutMs passed first
+    bool Wait(DWORD timeoutMs)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_condition.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this] { return m_fSet; });
+    }
+
+    void Set()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_fSet = true;
+        }
+
+        m_condition.notify_all();
+    }
+
+    void Reset()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_fSet = false;
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    bool m_fSet = false;
+};
@@ -0,0 +1,188 @@
+#pragma once
+
+// What Windows and the CoreCLR PAL headers spell differently. WCHAR is wchar_t on
+// Windows and char16_t elsewhere, so wide strings are WSTRING and wide literals W("...").
+//
+// Outside Windows the profiler is built without ATL; the few ATL names it uses outside
+// the COM registration code are defined here.
+
+typedef std::basic_string<WCHAR> WSTRING;
+
+#ifndef W
+#ifdef _WIN32
+#define W(str) L##str
+#else
+#define W(str) u##str
+#endif
+#endif
+
+#ifndef _WIN32
+
+#ifndef _countof
+#define _countof(array) (sizeof(array) / sizeof((array)[0]))
+#endif
+
+#ifndef UNREFERENCED_PARAMETER
+#define UNREFERENCED_PARAMETER(parameter) (void)(parameter)
+#endif
+
+#ifndef MAX_PATH
+#define MAX_PATH 260
+#endif
+
+#ifndef MAXDWORD
+#define MAXDWORD 0xffffffff
+#endif
+
+#define ATL_NO_VTABLE
+#define _ATL_DEBUG_ADDREF_RELEASE_IMPL(className)
+
+// Windows.h has them as macros
+template <class T>
+inline const T & min(const T &left, const T &right)
+{
+    return right < left ? right : left;
+}
+
+template <class T>
+inline const T & max(const T &left, const T &right)
+{
+    return left < right ? right : left;
+}
+
+namespace ATL
+{
+    template <class T>
+    class CComPtr
+    {
+    public:
+        CComPtr() : p(nullptr)
+        {
+        }
+
+        CComPtr(T * pT) : p(pT)
+        {
+            if (p != nullptr)
+            {
+                p->AddRef();
+            }
+        }
+
+        CComPtr(const CComPtr &other) : CComPtr(other.p)
+        {
+        }
+
+        ~CComPtr()
+        {
+            Release();
+        }
+
+        T * operator=(T * pT)
+        {
+            if (pT != nullptr)
+            {
+                pT->AddRef();
+            }
+
+            Release();
+            p = pT;
+            return p;
+        }
+
+        T * operator=(const CComPtr &other)
+        {
+            return *this = other.p;
+        }
+
+        operator T * () const
+        {
+            return p;
+        }
+
+        T * operator->() const
+        {
+            assert(p != nullptr);
+            return p;
+        }
+
+        // For out parameters only
+        T ** operator&()
+        {
+            assert(p == nullptr);
+            return &p;
+        }
+
+        T * Detach()
+        {
+            T * pT = p;
+            p = nullptr;
+            return pT;
+        }
+
+        HRESULT CopyTo(T ** ppT)
+        {
+            if (ppT == nullptr)
+            {
+                return E_POINTER;
+            }
+
+            *ppT = p;
+            if (p != nullptr)
+            {
+                p->AddRef();
+            }
+
+            return S_OK;
+        }
+
+        void Release()
+        {
+            T * pTemp = p;
+            if (pTemp != nullptr)
+            {
+                p = nullptr;
+                pTemp->Release();
+            }
+        }
+
+        T * p;
+    };
+
+    template <class T, const IID * piid = &__uuidof(T)>
+    class CComQIPtr : public CComPtr<T>
+    {
+    public:
+        CComQIPtr()
+        {
+        }
+
+        CComQIPtr(T * pT) : CComPtr<T>(pT)
+        {
+        }
+
+        CComQIPtr(IUnknown * pUnknown)
+        {
+            *this = pUnknown;
+        }
+
+        T * operator=(T * pT)
+        {
+            return CComPtr<T>::operator=(pT);
+        }
+
+        T * operator=(IUnknown * pUnknown)
+        {
+            T * pT = nullptr;
+            if (pUnknown != nullptr)
+            {
+                pUnknown->QueryInterface(*piid, (void **)&pT);
+            }
+
+            this->Release();
+            this->p = pT;
+            return pT;
+        }
+    };
+}
+
+#endif
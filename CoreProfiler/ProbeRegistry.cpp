@@ -0,0 +1,446 @@
+#include "stdafx.h"
+#include "ProbeRegistry.h"
+#include "Constants.h"
+#include "EventTrace.h"
+#include "Misc.h"
+
+ProbeRegistry g_probeRegistry;
+
+// Called by Intercept.Helper.ManagedLayer.Enter(int, int)
+extern "C" void __stdcall OnMethodEnter(int methodToken, int moduleCookie)
+{
+    g_probeRegistry.OnEnter((mdMethodDef)methodToken, moduleCookie);
+    g_eventTrace.Record((mdMethodDef)methodToken, moduleCookie, TRACE_EVENT_ENTER);
+}
+
+// Called by Intercept.Helper.ManagedLayer.Exit(int, int, long) and Exit<TResult>
+extern "C" void __stdcall OnMethodExit(int methodToken, int moduleCookie, INT64 elapsedTicks)
+{
+    g_probeRegistry.OnExit((mdMethodDef)methodToken, moduleCookie, elapsedTicks);
+    g_eventTrace.Record((mdMethodDef)methodToken, moduleCookie, TRACE_EVENT_EXIT);
+}
+
+// Called by Intercept.Helper.TraceWriter, which can't format floating point numbers without
+// allocating a string: writes the shortest %g form that reads back as the same double, or
+// float with fSingle, and returns its length, or 0 if it doesn't fit
+extern "C" int __stdcall FormatFloatingPoint(double value, int fSingle, char * buffer, int cbBuffer)
+{
+    char text[32];
+    int precision = fSingle ? 6 : 15;
+    int maxPrecision = fSingle ? 9 : 17;
+
+    for (; precision <= maxPrecision; precision++)
+    {
+        snprintf(text, sizeof(text), "%.*g", precision, value);
+
+        double parsed = strtod(text, nullptr);
+        if (fSingle ? (float)parsed == (float)value : parsed == value)
+        {
+            break;
+        }
+    }
+
+    int cb = (int)strlen(text);
+    if (cb > cbBuffer)
+    {
+        return 0;
+    }
+
+    memcpy(buffer, text, cb);
+    return cb;
+}
+
+ProbeRegistry::ProbeRegistry()
+{
+    for (int i = 0; i < MAX_PROBE_MODULES; i++)
+    {
+        m_entries[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    m_nextCookie.store(0, std::memory_order_relaxed);
+
+    // Stopwatch ticks at the frequency of getTimestamp
+    INT64 frequency = getTimestampFrequency();
+    if (frequency > 0)
+    {
+        m_ticksPerMicrosecond = frequency / 1000000.0;
+    }
+
+    WSTRING returnValues;
+    m_fReturnValues = getEnvironmentString(ENV_RETURN_VALUES, returnValues) && returnValues == W("1");
+
+    getEnvironmentString(ENV_REPORT_FILE, m_reportPath);
+
+    WSTRING exitProbes;
+    m_fExitProbes = (getEnvironmentString(ENV_EXIT_PROBES, exitProbes) && exitProbes == W("1")) || m_fReturnValues;
+
+    WSTRING modules;
+    if (getEnvironmentString(ENV_FAST_PROBE_MODULES, modules) == false)
+    {
+        return;
+    }
+
+    size_t begin = 0;
+    while (begin <= modules.size())
+    {
+        size_t end = modules.find(W(';'), begin);
+        if (end == WSTRING::npos)
+        {
+            end = modules.size();
+        }
+
+        WSTRING name = modules.substr(begin, end - begin);
+        if (name == W("*"))
+        {
+            m_fAllModules = true;
+        }
+        else if (name.empty() == false)
+        {
+            m_selectedModules.push_back(name);
+        }
+
+        begin = end + 1;
+    }
+}
+
+ProbeRegistry::~ProbeRegistry()
+{
+    for (int i = 0; i < MAX_PROBE_MODULES; i++)
+    {
+        delete m_entries[i].load(std::memory_order_relaxed);
+    }
+
+    if (m_pReportFile != nullptr)
+    {
+        fclose(m_pReportFile);
+    }
+}
+
+bool ProbeRegistry::IsSelected(LPCWSTR wszModulePath)
+{
+    if (m_fAllModules == true)
+    {
+        return true;
+    }
+
+    for (const WSTRING &name : m_selectedModules)
+    {
+        if (containsAtEnd(wszModulePath, name.c_str()) == true)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int ProbeRegistry::Register(ModuleID moduleId, LPCWSTR wszModulePath, IMetaDataImport * pMetaDataImport)
+{
+    CComQIPtr<IMetaDataTables, &IID_IMetaDataTables> pTables = pMetaDataImport;
+    if (pTables == nullptr)
+    {
+        return -1;
+    }
+
+    ULONG cbRow, cRows, cCols, iKey;
+    const char * szName;
+    if (pTables->GetTableInfo(TypeFromToken(mdtMethodDef) >> 24, &cbRow, &cRows, &cCols, &iKey, &szName) != S_OK)
+    {
+        return -1;
+    }
+
+    int cookie = m_nextCookie.fetch_add(1, std::memory_order_relaxed);
+    if (cookie >= MAX_PROBE_MODULES)
+    {
+        return -1;
+    }
+
+    ModuleEntry * pEntry = new ModuleEntry();
+    pEntry->m_moduleId = moduleId;
+    pEntry->m_modulePath = wszModulePath;
+    pEntry->m_pMetaDataImport = pMetaDataImport;
+    pEntry->m_cMethods = cRows;
+    pEntry->m_pHits = new std::atomic<ULONG>[cRows]();
+    pEntry->m_ppLatencies = new std::atomic<LatencyHistogram *>[cRows]();
+    pEntry->m_pSampleCounters = new LONG[cRows]();
+
+    m_entries[cookie].store(pEntry, std::memory_order_release);
+    return cookie;
+}
+
+void ProbeRegistry::OnExit(mdMethodDef tkMethod, int cookie, INT64 elapsedTicks)
+{
+    if (cookie < 0 || cookie >= MAX_PROBE_MODULES || elapsedTicks < 0)
+    {
+        return;
+    }
+
+    ModuleEntry * pEntry = m_entries[cookie].load(std::memory_order_acquire);
+    if (pEntry == nullptr)
+    {
+        return;
+    }
+
+    ULONG rid = RidFromToken(tkMethod);
+    if (rid == 0 || rid > pEntry->m_cMethods)
+    {
+        return;
+    }
+
+    std::atomic<LatencyHistogram *> &latencies = pEntry->m_ppLatencies[rid - 1];
+    LatencyHistogram * pLatencies = latencies.load(std::memory_order_acquire);
+    if (pLatencies == nullptr)
+    {
+        // Racing first exits each allocate; the loser frees its own
+        LatencyHistogram * pNew = new LatencyHistogram();
+        if (latencies.compare_exchange_strong(pLatencies, pNew, std::memory_order_acq_rel) == true)
+        {
+            pLatencies = pNew;
+        }
+        else
+        {
+            delete pNew;
+        }
+    }
+
+    int bucket = 0;
+    for (UINT64 ticks = (UINT64)elapsedTicks; ticks != 0 && bucket < LATENCY_HISTOGRAM_BUCKETS - 1; ticks >>= 1)
+    {
+        bucket++;
+    }
+
+    pLatencies->m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    pLatencies->m_totalTicks.fetch_add((UINT64)elapsedTicks, std::memory_order_relaxed);
+}
+
+void ProbeRegistry::Unregister(int cookie)
+{
+    if (cookie < 0 || cookie >= MAX_PROBE_MODULES)
+    {
+        return;
+    }
+
+    ModuleEntry * pEntry = m_entries[cookie].load(std::memory_order_acquire);
+    if (pEntry == nullptr)
+    {
+        return;
+    }
+
+    CSHolder csHolder(&m_cs);
+    report(pEntry);
+}
+
+void ProbeRegistry::UnregisterAll()
+{
+    int cCookies = min(m_nextCookie.load(std::memory_order_relaxed), MAX_PROBE_MODULES);
+
+    for (int cookie = 0; cookie < cCookies; cookie++)
+    {
+        Unregister(cookie);
+    }
+}
+
+void ProbeRegistry::WriteReport(const char * format, ...)
+{
+    char buffer[4096];
+
+    va_list vaList;
+    va_start(vaList, format);
+    vsnprintf(buffer, sizeof(buffer), format, vaList);
+    va_end(vaList);
+
+    CSHolder csHolder(&m_cs);
+
+    if (m_pReportFile == nullptr && m_reportPath.empty() == false && m_fReportOpenFailed == false)
+    {
+        m_pReportFile = openFile(m_reportPath, "a");
+        if (m_pReportFile == nullptr)
+        {
+            outputDebugText("[CoreProfiler] cannot open report file: %s\n", toUtf8(m_reportPath).c_str());
+            m_fReportOpenFailed = true;
+        }
+    }
+
+    if (m_pReportFile == nullptr)
+    {
+        outputDebugText("%s", buffer);
+        return;
+    }
+
+    fputs(buffer, m_pReportFile);
+    fflush(m_pReportFile);
+}
+
+bool ProbeRegistry::GetMethodName(int cookie, mdMethodDef tkMethod, WSTRING &name)
+{
+    if (cookie < 0 || cookie >= MAX_PROBE_MODULES)
+    {
+        return false;
+    }
+
+    ModuleEntry * pEntry = m_entries[cookie].load(std::memory_order_acquire);
+    if (pEntry == nullptr)
+    {
+        return false;
+    }
+
+    CSHolder csHolder(&m_cs);
+    return resolveMethodName(pEntry, tkMethod, name);
+}
+
+bool ProbeRegistry::GetModulePath(int cookie, WSTRING &path)
+{
+    if (cookie < 0 || cookie >= MAX_PROBE_MODULES)
+    {
+        return false;
+    }
+
+    ModuleEntry * pEntry = m_entries[cookie].load(std::memory_order_acquire);
+    if (pEntry == nullptr)
+    {
+        return false;
+    }
+
+    path = pEntry->m_modulePath;
+    return true;
+}
+
+volatile LONG * ProbeRegistry::GetSampleCounter(int cookie, mdMethodDef tkMethod)
+{
+    if (cookie < 0 || cookie >= MAX_PROBE_MODULES)
+    {
+        return nullptr;
+    }
+
+    ModuleEntry * pEntry = m_entries[cookie].load(std::memory_order_acquire);
+    if (pEntry == nullptr)
+    {
+        return nullptr;
+    }
+
+    ULONG rid = RidFromToken(tkMethod);
+    if (rid == 0 || rid > pEntry->m_cMethods)
+    {
+        return nullptr;
+    }
+
+    return &pEntry->m_pSampleCounters[rid - 1];
+}
+
+bool ProbeRegistry::resolveMethodName(ModuleEntry * pEntry, mdMethodDef tkMethod, WSTRING &name)
+{
+    auto iterator = pEntry->m_names.find(tkMethod);
+    if (iterator != pEntry->m_names.end())
+    {
+        name = iterator->second;
+        return true;
+    }
+
+    if (pEntry->m_pMetaDataImport == nullptr)
+    {
+        return false;
+    }
+
+    WCHAR wszMethod[MAX_PATH];
+    WCHAR wszType[MAX_PATH];
+    mdTypeDef tkType = mdTypeDefNil;
+    ULONG cchName = 0;
+
+    HRESULT hr = pEntry->m_pMetaDataImport->GetMethodProps(tkMethod, &tkType, wszMethod, MAX_PATH, &cchName,
+        nullptr, nullptr, nullptr, nullptr, nullptr);
+    if (hr != S_OK)
+    {
+        return false;
+    }
+
+    wszType[0] = W('\0');
+    if (IsNilToken(tkType) == false)
+    {
+        pEntry->m_pMetaDataImport->GetTypeDefProps(tkType, wszType, MAX_PATH, &cchName, nullptr, nullptr);
+    }
+
+    name = wszType;
+    name += W("::");
+    name += wszMethod;
+
+    pEntry->m_names[tkMethod] = name;
+    return true;
+}
+
+void ProbeRegistry::report(ModuleEntry * pEntry)
+{
+    if (pEntry->m_pMetaDataImport == nullptr)
+    {
+        // Already reported
+        return;
+    }
+
+    for (ULONG i = 0; i < pEntry->m_cMethods; i++)
+    {
+        ULONG hits = pEntry->m_pHits[i].load(std::memory_order_relaxed);
+        LatencyHistogram * pLatencies = pEntry->m_ppLatencies[i].load(std::memory_order_acquire);
+        if (hits == 0 && pLatencies == nullptr)
+        {
+            continue;
+        }
+
+        WSTRING name;
+        if (resolveMethodName(pEntry, TokenFromRid(i + 1, mdtMethodDef), name) == false)
+        {
+            continue;
+        }
+
+        if (hits != 0)
+        {
+            WriteReport("[Profiler] %s called %lu time(s)\n", toUtf8(name).c_str(), (unsigned long)hits);
+        }
+
+        if (pLatencies != nullptr)
+        {
+            reportLatencies(name, pLatencies);
+        }
+    }
+
+    pEntry->m_pMetaDataImport.Release();
+    pEntry->m_names.clear();
+}
+
+void ProbeRegistry::reportLatencies(const WSTRING &name, LatencyHistogram * pLatencies)
+{
+    ULONG counts[LATENCY_HISTOGRAM_BUCKETS];
+    UINT64 cExits = 0;
+
+    for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+    {
+        counts[i] = pLatencies->m_buckets[i].load(std::memory_order_relaxed);
+        cExits += counts[i];
+    }
+
+    if (cExits == 0)
+    {
+        return;
+    }
+
+    double meanMicroseconds = pLatencies->m_totalTicks.load(std::memory_order_relaxed) / m_ticksPerMicrosecond / cExits;
+    WriteReport("[Profiler] %s returned %llu time(s), mean %.3f us\n", toUtf8(name).c_str(), (unsigned long long)cExits, meanMicroseconds);
+
+    for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+    {
+        if (counts[i] == 0)
+        {
+            continue;
+        }
+
+        double lower = (i == 0) ? 0.0 : (double)(1ULL << (i - 1)) / m_ticksPerMicrosecond;
+
+        // OnExit clamps longer durations into the last bucket, which has no upper bound
+        if (i == LATENCY_HISTOGRAM_BUCKETS - 1)
+        {
+            WriteReport("[Profiler]     [%.3f us, +inf) %lu\n", lower, (unsigned long)counts[i]);
+            continue;
+        }
+
+        double upper = (double)(1ULL << i) / m_ticksPerMicrosecond;
+        WriteReport("[Profiler]     [%.3f us, %.3f us) %lu\n", lower, upper, (unsigned long)counts[i]);
+    }
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include "ProfilerData.h"
+
+// Every instrumented module gets a cookie that the probes pass back with the method token.
+//
+// Modules selected by COREPROFILER_FAST_PROBE_MODULES ("*" or a ';' separated list of
+// module file names) are instrumented with Enter(int methodToken, int moduleCookie)
+// instead of the reflection based probes. The managed helper forwards the call to
+// OnMethodEnter, which only counts it and adds it to the trace (see EventTrace.h).
+//
+// With COREPROFILER_EXIT_PROBES=1 the instrumented methods also get exit probes, which
+// forward the time spent in the method to OnMethodExit; it adds it to the method's latency
+// histogram. Return values are only passed to the exit probe, which logs them, with
+// COREPROFILER_RETURN_VALUES=1, which turns on the exit probes too.
+//
+// The hit counts and histograms are reported, with the trace's dropped events, to the text
+// file COREPROFILER_REPORT_FILE names, or by outputDebugText without it.
+//
+// Names are resolved on first use and kept: by the trace drainer while the process runs,
+// and for the reports when the module unloads or the profiler shuts down. The metadata
+// they come from is released once the module's report is written.
+constexpr const int MAX_PROBE_MODULES = 4096;
+
+// Bucket n counts durations in [2^(n-1), 2^n) Stopwatch ticks; bucket 0 counts zero and
+// the last bucket everything from 2^(n-1) up
+#define LATENCY_HISTOGRAM_BUCKETS 32
+
+class ProbeRegistry
+{
+public:
+    ProbeRegistry();
+    ~ProbeRegistry();
+
+    bool IsSelected(LPCWSTR wszModulePath);
+
+    bool UsesExitProbes()
+    {
+        return m_fExitProbes;
+    }
+
+    bool PassesReturnValues()
+    {
+        return m_fReturnValues;
+    }
+
+    // Returns the module's cookie, or -1 if the module can't use the fast probe
+    int Register(ModuleID moduleId, LPCWSTR wszModulePath, IMetaDataImport * pMetaDataImport);
+    void Unregister(int cookie);
+    void UnregisterAll();
+
+    void OnEnter(mdMethodDef tkMethod, int cookie)
+    {
+        if (cookie < 0 || cookie >= MAX_PROBE_MODULES)
+        {
+            return;
+        }
+
+        ModuleEntry * pEntry = m_entries[cookie].load(std::memory_order_acquire);
+        if (pEntry == nullptr)
+        {
+            return;
+        }
+
+        ULONG rid = RidFromToken(tkMethod);
+        if (rid == 0 || rid > pEntry->m_cMethods)
+        {
+            return;
+        }
+
+        pEntry->m_pHits[rid - 1].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void OnExit(mdMethodDef tkMethod, int cookie, INT64 elapsedTicks);
+
+    // Appends a line to the report
+    void WriteReport(const char * format, ...);
+
+    bool GetMethodName(int cookie, mdMethodDef tkMethod, WSTRING &name);
+    bool GetModulePath(int cookie, WSTRING &path);
+
+    // The method's countdown for the sampling guard (see Sampling.h); stays valid until
+    // the registry is destroyed
+    volatile LONG * GetSampleCounter(int cookie, mdMethodDef tkMethod);
+
+private:
+    struct LatencyHistogram
+    {
+        std::atomic<ULONG> m_buckets[LATENCY_HISTOGRAM_BUCKETS];
+        std::atomic<UINT64> m_totalTicks;
+
+        LatencyHistogram()
+        {
+            for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+            {
+                m_buckets[i].store(0, std::memory_order_relaxed);
+            }
+
+            m_totalTicks.store(0, std::memory_order_relaxed);
+        }
+    };
+
+    struct ModuleEntry
+    {
+        ModuleID m_moduleId = 0;
+        WSTRING m_modulePath;
+        CComPtr<IMetaDataImport> m_pMetaDataImport;     // released once reported
+
+        ULONG m_cMethods = 0;
+        std::atomic<ULONG> * m_pHits = nullptr;         // by method RID - 1
+
+        // By method RID - 1, allocated on the method's first exit
+        std::atomic<LatencyHistogram *> * m_ppLatencies = nullptr;
+
+        volatile LONG * m_pSampleCounters = nullptr;    // by method RID - 1
+
+        std::map<mdMethodDef, WSTRING> m_names;    // resolved lazily
+
+        ~ModuleEntry()
+        {
+            for (ULONG i = 0; i < m_cMethods && m_ppLatencies != nullptr; i++)
+            {
+                delete m_ppLatencies[i].load(std::memory_order_relaxed);
+            }
+
+            delete[] m_ppLatencies;
+            delete[] m_pHits;
+            delete[] m_pSampleCounters;
+        }
+    };
+
+    bool resolveMethodName(ModuleEntry * pEntry, mdMethodDef tkMethod, WSTRING &name);
+    void report(ModuleEntry * pEntry);
+    void reportLatencies(const WSTRING &name, LatencyHistogram * pLatencies);
+
+    bool m_fAllModules = false;
+    bool m_fExitProbes = false;
+    bool m_fReturnValues = false;
+    std::vector<WSTRING> m_selectedModules;
+
+    // Entries are never freed before the registry itself, so a probe still running
+    // while its module unloads only counts into a retired entry.
+    std::atomic<ModuleEntry *> m_entries[MAX_PROBE_MODULES];
+    std::atomic<int> m_nextCookie;
+
+    double m_ticksPerMicrosecond = 1.0;
+
+    WSTRING m_reportPath;
+    FILE * m_pReportFile = nullptr;
+    bool m_fReportOpenFailed = false;
+
+    std::recursive_mutex m_cs;
+};
+
+extern ProbeRegistry g_probeRegistry;
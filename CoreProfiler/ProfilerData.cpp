@@ -1,3 +1,338 @@
 
 #include "stdafx.h"
-#include "ProfilerData.h"
\ No newline at end of file
+#include "ProfilerData.h"
+#include "Constants.h"
+
+#include <algorithm>
+
+GenericSpecIndex::GenericSpecIndex()
+{
+    for (int i = 0; i < GENERIC_SPEC_INDEX_SIZE; i++)
+    {
+        m_varSpecs[i].store(mdTypeSpecNil, std::memory_order_relaxed);
+        m_mvarSpecs[i].store(mdTypeSpecNil, std::memory_order_relaxed);
+    }
+
+    m_fBuilt.store(false, std::memory_order_relaxed);
+}
+
+std::atomic<mdTypeSpec> * GenericSpecIndex::GetSlot(CorElementType genericType, ULONG number)
+{
+    if (number >= GENERIC_SPEC_INDEX_SIZE)
+    {
+        return nullptr;
+    }
+
+    if (genericType == ELEMENT_TYPE_VAR)
+    {
+        return &m_varSpecs[number];
+    }
+
+    if (genericType == ELEMENT_TYPE_MVAR)
+    {
+        return &m_mvarSpecs[number];
+    }
+
+    return nullptr;
+}
+
+mdTypeSpec GenericSpecIndex::GetToken(IMetaDataImport * pMetaDataImport, IMetaDataEmit * pMetaDataEmit,
+    CorElementType genericType, ULONG number)
+{
+    if (genericType != ELEMENT_TYPE_VAR && genericType != ELEMENT_TYPE_MVAR)
+    {
+        return mdTypeSpecNil;
+    }
+
+    std::atomic<mdTypeSpec> * pSlot = GetSlot(genericType, number);
+    if (pSlot != nullptr)
+    {
+        if (m_fBuilt.load(std::memory_order_acquire) == false)
+        {
+            CSHolder csHolder(&m_cs);
+            if (m_fBuilt.load(std::memory_order_relaxed) == false)
+            {
+                Build(pMetaDataImport);
+                m_fBuilt.store(true, std::memory_order_release);
+            }
+        }
+
+        mdTypeSpec tkSpec = pSlot->load(std::memory_order_acquire);
+        if (IsNilToken(tkSpec) == false)
+        {
+            return tkSpec;
+        }
+    }
+
+    COR_SIGNATURE sig[5];   // element type and the ordinal, compressed to at most 4 bytes
+    sig[0] = (COR_SIGNATURE)genericType;
+    ULONG cbSig = 1 + CorSigCompressData(number, &sig[1]);
+
+    // Finds an identical TypeSpec defined meanwhile, or defines a new one
+    CSHolder csHolder(&m_cs);
+
+    mdTypeSpec tkSpec = mdTypeSpecNil;
+    if (FAILED(pMetaDataEmit->GetTokenFromTypeSpec(sig, cbSig, &tkSpec)))
+    {
+        return mdTypeSpecNil;
+    }
+
+    if (pSlot != nullptr)
+    {
+        pSlot->store(tkSpec, std::memory_order_release);
+    }
+
+    return tkSpec;
+}
+
+void GenericSpecIndex::Build(IMetaDataImport * pMetaDataImport)
+{
+    HCORENUM hCorEnum = 0;
+    ULONG cEnumResult = 0;
+    mdTypeSpec typeSpecs[MAX_LOOKUP_OF_TYPESPEC];
+
+    while (pMetaDataImport->EnumTypeSpecs(&hCorEnum, typeSpecs, MAX_LOOKUP_OF_TYPESPEC, &cEnumResult) == S_OK &&
+        cEnumResult > 0)
+    {
+        for (ULONG i = 0; i < cEnumResult; i++)
+        {
+            PCCOR_SIGNATURE pvSig = nullptr;
+            ULONG cbSig = 0;
+            if (pMetaDataImport->GetTypeSpecFromToken(typeSpecs[i], &pvSig, &cbSig) != S_OK || cbSig < 2)
+            {
+                continue;
+            }
+
+            ULONG number = 0;
+            ULONG cbNumber = CorSigUncompressData(pvSig + 1, &number);
+            if (1 + cbNumber != cbSig)
+            {
+                continue;
+            }
+
+            std::atomic<mdTypeSpec> * pSlot = GetSlot((CorElementType)pvSig[0], number);
+            if (pSlot != nullptr && IsNilToken(pSlot->load(std::memory_order_relaxed)) == true)
+            {
+                pSlot->store(typeSpecs[i], std::memory_order_relaxed);
+            }
+        }
+    }
+
+    if (hCorEnum != 0)
+    {
+        pMetaDataImport->CloseEnum(hCorEnum);
+    }
+}
+
+#define BYREFLIKE_ATTRIBUTE W("System.Runtime.CompilerServices.IsByRefLikeAttribute")
+
+// Forwarders and enclosing types may chain; past this depth a TypeRef counts as unresolved
+#define MAX_TYPEREF_RESOLVE_DEPTH 8
+
+// The manifest module of a loaded assembly, by the assembly's simple name.  Only a name
+// that isn't known yet costs a scan of the loaded modules.
+bool ByRefLikeIndex::findLoadedAssembly(ICorProfilerInfo3 * pICorProfilerInfo3, LPCWSTR wszAssemblyName,
+    IMetaDataImport ** ppMetaDataImport)
+{
+    WSTRING wanted(wszAssemblyName);
+    std::transform(wanted.begin(), wanted.end(), wanted.begin(), towlower);
+
+    {
+        CSHolder csHolder(&m_cs);
+
+        auto it = m_assemblies.find(wanted);
+        if (it != m_assemblies.end())
+        {
+            return it->second.CopyTo(ppMetaDataImport) == S_OK;
+        }
+    }
+
+    CComPtr<ICorProfilerModuleEnum> pModuleEnum;
+    if (FAILED(pICorProfilerInfo3->EnumModules(&pModuleEnum)))
+    {
+        return false;
+    }
+
+    ModuleID moduleIds[64];
+    ULONG cModuleIds = 0;
+    std::vector<std::pair<WSTRING, CComPtr<IMetaDataImport>>> found;
+
+    while (SUCCEEDED(pModuleEnum->Next(_countof(moduleIds), moduleIds, &cModuleIds)) && cModuleIds > 0)
+    {
+        for (ULONG i = 0; i < cModuleIds; i++)
+        {
+            CComPtr<IMetaDataAssemblyImport> pAssemblyImport;
+            mdAssembly tkAssembly = mdTokenNil;
+            WCHAR wszName[MAX_ASSEMBLY_NAME_BUF];
+            ULONG cchName = 0;
+
+            if (pICorProfilerInfo3->GetModuleMetaData(moduleIds[i], ofRead, IID_IMetaDataAssemblyImport,
+                    (LPUNKNOWN *)&pAssemblyImport) != S_OK ||
+                pAssemblyImport->GetAssemblyFromScope(&tkAssembly) != S_OK ||
+                pAssemblyImport->GetAssemblyProps(tkAssembly, nullptr, nullptr, nullptr,
+                    wszName, MAX_ASSEMBLY_NAME_BUF, &cchName, nullptr, nullptr) != S_OK)
+            {
+                continue;
+            }
+
+            CComPtr<IMetaDataImport> pImport;
+            if (pAssemblyImport->QueryInterface(IID_IMetaDataImport, (LPVOID *)&pImport) != S_OK)
+            {
+                continue;
+            }
+
+            WSTRING name(wszName);
+            std::transform(name.begin(), name.end(), name.begin(), towlower);
+            found.push_back(std::make_pair(name, pImport));
+        }
+    }
+
+    CSHolder csHolder(&m_cs);
+
+    // The first of the modules with a name wins, as it would in the scan
+    for (auto &assembly : found)
+    {
+        m_assemblies.insert(assembly);
+    }
+
+    auto it = m_assemblies.find(wanted);
+    if (it == m_assemblies.end())
+    {
+        return false;
+    }
+
+    return it->second.CopyTo(ppMetaDataImport) == S_OK;
+}
+
+// Finds the TypeDef named wszTypeName (nested in tdEnclosing unless nil) in the assembly
+// tkAssemblyRef of pMetaDataImport refers to, following the type forwarders on the way
+bool ByRefLikeIndex::resolveInAssembly(ICorProfilerInfo3 * pICorProfilerInfo3, IMetaDataImport * pMetaDataImport,
+    mdAssemblyRef tkAssemblyRef, LPCWSTR wszTypeName, int depth, IMetaDataImport ** ppDefImport, mdTypeDef * ptd)
+{
+    CComQIPtr<IMetaDataAssemblyImport, &IID_IMetaDataAssemblyImport> pAssemblyImport = pMetaDataImport;
+    WCHAR wszAssemblyName[MAX_ASSEMBLY_NAME_BUF];
+    ULONG cchAssemblyName = 0;
+
+    if (pAssemblyImport == NULL ||
+        pAssemblyImport->GetAssemblyRefProps(tkAssemblyRef, nullptr, nullptr, wszAssemblyName,
+            MAX_ASSEMBLY_NAME_BUF, &cchAssemblyName, nullptr, nullptr, nullptr, nullptr) != S_OK)
+    {
+        return false;
+    }
+
+    CComPtr<IMetaDataImport> pTargetImport;
+    if (findLoadedAssembly(pICorProfilerInfo3, wszAssemblyName, &pTargetImport) == false)
+    {
+        return false;
+    }
+
+    if (pTargetImport->FindTypeDefByName(wszTypeName, mdTokenNil, ptd) == S_OK)
+    {
+        *ppDefImport = pTargetImport.Detach();
+        return true;
+    }
+
+    // System.Runtime and the like forward most of their types to System.Private.CoreLib
+    CComQIPtr<IMetaDataAssemblyImport, &IID_IMetaDataAssemblyImport> pTargetAssemblyImport(pTargetImport);
+    mdExportedType tkExportedType = mdTokenNil;
+    mdToken tkImplementation = mdTokenNil;
+
+    if (depth >= MAX_TYPEREF_RESOLVE_DEPTH || pTargetAssemblyImport == NULL ||
+        pTargetAssemblyImport->FindExportedTypeByName(wszTypeName, mdTokenNil, &tkExportedType) != S_OK ||
+        pTargetAssemblyImport->GetExportedTypeProps(tkExportedType, nullptr, 0, nullptr,
+            &tkImplementation, nullptr, nullptr) != S_OK ||
+        TypeFromToken(tkImplementation) != mdtAssemblyRef)
+    {
+        return false;
+    }
+
+    return resolveInAssembly(pICorProfilerInfo3, pTargetImport, tkImplementation, wszTypeName, depth + 1,
+        ppDefImport, ptd);
+}
+
+bool ByRefLikeIndex::resolveTypeRef(ICorProfilerInfo3 * pICorProfilerInfo3, IMetaDataImport * pMetaDataImport,
+    mdTypeRef tkTypeRef, int depth, IMetaDataImport ** ppDefImport, mdTypeDef * ptd)
+{
+    mdToken tkScope = mdTokenNil;
+    WCHAR wszTypeName[MAX_CLASS_NAME];
+    ULONG cchTypeName = 0;
+
+    if (depth >= MAX_TYPEREF_RESOLVE_DEPTH ||
+        pMetaDataImport->GetTypeRefProps(tkTypeRef, &tkScope, wszTypeName, MAX_CLASS_NAME, &cchTypeName) != S_OK)
+    {
+        return false;
+    }
+
+    switch (TypeFromToken(tkScope))
+    {
+    case mdtAssemblyRef:
+        return resolveInAssembly(pICorProfilerInfo3, pMetaDataImport, tkScope, wszTypeName, depth, ppDefImport, ptd);
+
+    case mdtTypeRef:
+    {
+        // Nested in another type; the enclosing one says where both live
+        CComPtr<IMetaDataImport> pEnclosingImport;
+        mdTypeDef tdEnclosing = mdTypeDefNil;
+
+        if (resolveTypeRef(pICorProfilerInfo3, pMetaDataImport, tkScope, depth + 1, &pEnclosingImport, &tdEnclosing) == false ||
+            pEnclosingImport->FindTypeDefByName(wszTypeName, tdEnclosing, ptd) != S_OK)
+        {
+            return false;
+        }
+
+        *ppDefImport = pEnclosingImport.Detach();
+        return true;
+    }
+
+    case mdtModule:
+        if (pMetaDataImport->FindTypeDefByName(wszTypeName, mdTokenNil, ptd) != S_OK)
+        {
+            return false;
+        }
+
+        pMetaDataImport->AddRef();
+        *ppDefImport = pMetaDataImport;
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+bool ByRefLikeIndex::IsByRefLike(ICorProfilerInfo2 * pICorProfilerInfo, IMetaDataImport * pMetaDataImport, mdToken tkType)
+{
+    {
+        CSHolder csHolder(&m_cs);
+
+        auto it = m_answers.find(tkType);
+        if (it != m_answers.end())
+        {
+            return it->second;
+        }
+    }
+
+    // Rewrites racing on the same token both resolve it, to the same answer
+
+    bool fByRefLike = true;
+
+    if (TypeFromToken(tkType) == mdtTypeDef)
+    {
+        fByRefLike = pMetaDataImport->GetCustomAttributeByName(tkType, BYREFLIKE_ATTRIBUTE, nullptr, nullptr) == S_OK;
+    }
+    else if (TypeFromToken(tkType) == mdtTypeRef)
+    {
+        CComQIPtr<ICorProfilerInfo3, &IID_ICorProfilerInfo3> pICorProfilerInfo3 = pICorProfilerInfo;
+        CComPtr<IMetaDataImport> pDefImport;
+        mdTypeDef td = mdTypeDefNil;
+
+        if (pICorProfilerInfo3 != NULL &&
+            resolveTypeRef(pICorProfilerInfo3, pMetaDataImport, tkType, 0, &pDefImport, &td) == true)
+        {
+            fByRefLike = pDefImport->GetCustomAttributeByName(td, BYREFLIKE_ATTRIBUTE, nullptr, nullptr) == S_OK;
+        }
+    }
+
+    CSHolder csHolder(&m_cs);
+    m_answers[tkType] = fByRefLike;
+    return fByRefLike;
+}
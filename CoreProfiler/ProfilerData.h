@@ -1,25 +1,29 @@
 #pragma once
 
 #include "stdafx.h"
+#include "Filter.h"
 
+#include <algorithm>
+
+using namespace ATL;
 
 class CSHolder
 {
 public:
-    CSHolder(CRITICAL_SECTION * pcs)
+    CSHolder(std::recursive_mutex * pcs)
     {
         m_pcs = pcs;
-        EnterCriticalSection(m_pcs);
+        m_pcs->lock();
     }
 
     ~CSHolder()
     {
         assert(m_pcs != NULL);
-        LeaveCriticalSection(m_pcs);
+        m_pcs->unlock();
     }
 
 private:
-    CRITICAL_SECTION * m_pcs;
+    std::recursive_mutex * m_pcs;
 };
 
 
@@ -32,11 +36,6 @@ public:
     typedef typename Map::const_iterator Const_Iterator;
     typedef typename Map::size_type Size_type;
 
-    IDToInfoMap()
-    {
-        InitializeCriticalSection(&m_cs);
-    }
-
     Size_type GetCount()
     {
         CSHolder csHolder(&m_cs);
@@ -114,22 +113,630 @@ public:
 
 private:
     Map m_map;
-    CRITICAL_SECTION m_cs;
+    std::recursive_mutex m_cs;
+};
+
+// Read-mostly variant of IDToInfoMap for lookups on the JIT path.
+//
+// Lookups are wait-free: the slot array is open addressed (linear probing, never more
+// than half full) and every slot is published with release/acquire ordering, so a
+// reader only ever loads the current table and probes at most its capacity.  Writers
+// (module load/unload) are rare and serialized by a critical section; a write either
+// fills an empty slot in place or publishes a rebuilt table.
+//
+// Replaced tables and infos are reclaimed by epochs: a reader holds a ReadHolder, which
+// announces the epoch it started in, for as long as it uses what Find returned.  A writer
+// tags what it retires with the epoch it was unlinked in, and frees it on a later write
+// once no reader announces that epoch or an older one.
+template <class _ID, class _Info>
+class ConcurrentIDToInfoMap
+{
+public:
+    typedef size_t Size_type;
+
+    // Keeps the tables and infos the thread finds alive until it is destroyed.  Holders
+    // may nest; a thread beyond READER_SLOT_COUNT waits for another to release its slot.
+    class ReadHolder
+    {
+    public:
+        ReadHolder(ConcurrentIDToInfoMap<_ID, _Info> * pMap)
+        {
+            size_t index = std::hash<std::thread::id>()(std::this_thread::get_id());
+            for (;; index++)
+            {
+                ReaderSlot & slot = pMap->m_readers[index % READER_SLOT_COUNT];
+
+                UINT64 unused = 0;
+                if (slot.m_epoch.load(std::memory_order_relaxed) == 0 &&
+                    slot.m_epoch.compare_exchange_strong(unused, pMap->m_epoch.load(std::memory_order_acquire),
+                        std::memory_order_acq_rel))
+                {
+                    m_pEpoch = &slot.m_epoch;
+                    break;
+                }
+
+                if (index % READER_SLOT_COUNT == READER_SLOT_COUNT - 1)
+                {
+                    std::this_thread::yield();
+                }
+            }
+
+            // Pairs with the fence of Reclaim: either the writer sees the epoch, or this
+            // thread sees the table without what the writer unlinked
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+
+        ~ReadHolder()
+        {
+            m_pEpoch->store(0, std::memory_order_release);
+        }
+
+        ReadHolder(const ReadHolder &) = delete;
+        ReadHolder & operator=(const ReadHolder &) = delete;
+
+    private:
+        std::atomic<UINT64> * m_pEpoch;
+    };
+
+    ConcurrentIDToInfoMap()
+    {
+        m_pTable.store(NewTable(k_initialCapacity), std::memory_order_release);
+    }
+
+    ~ConcurrentIDToInfoMap()
+    {
+        Table * pTable = m_pTable.load(std::memory_order_acquire);
+        for (size_t i = 0; i < pTable->m_capacity; i++)
+        {
+            delete pTable->m_pSlots[i].m_pInfo.load(std::memory_order_relaxed);
+        }
+        DeleteTable(pTable);
+
+        for (const auto &retired : m_retiredTables)
+        {
+            DeleteTable(retired.second);
+        }
+
+        for (const auto &retired : m_retiredInfos)
+        {
+            delete retired.second;
+        }
+    }
+
+    Size_type GetCount()
+    {
+        CSHolder csHolder(&m_cs);
+        return m_count;
+    }
+
+    // Returns the published info for id, or nullptr.  The caller holds a ReadHolder,
+    // and the pointer stays valid as long as it does, even if the entry is updated or
+    // erased meanwhile.
+    _Info * Find(_ID id) const
+    {
+        const Table * pTable = m_pTable.load(std::memory_order_acquire);
+        size_t mask = pTable->m_capacity - 1;
+        size_t index = Hash(id) & mask;
+
+        for (size_t probe = 0; probe <= mask; probe++, index = (index + 1) & mask)
+        {
+            const Slot & slot = pTable->m_pSlots[index];
+            _ID slotId = slot.m_id.load(std::memory_order_acquire);
+            if (slotId == id)
+            {
+                return slot.m_pInfo.load(std::memory_order_acquire);
+            }
+
+            if (slotId == k_emptyID)
+            {
+                break;
+            }
+        }
+
+        return nullptr;
+    }
+
+    void EraseIfExists(_ID id)
+    {
+        CSHolder csHolder(&m_cs);
+
+        Slot * pSlot = FindSlot(m_pTable.load(std::memory_order_relaxed), id);
+        if (pSlot == nullptr)
+        {
+            return;
+        }
+
+        // The ID stays behind as a tombstone so probe chains through it remain intact.
+        _Info * pOld = pSlot->m_pInfo.exchange(nullptr, std::memory_order_acq_rel);
+        if (pOld != nullptr)
+        {
+            Retire(pOld);
+            m_count--;
+        }
+
+        Reclaim();
+    }
+
+    void Erase(_ID id)
+    {
+        EraseIfExists(id);
+    }
+
+    // Publishes pInfo for id; the map takes ownership of it.
+    void Adopt(_ID id, _Info * pInfo)
+    {
+        assert(id != k_emptyID);
+        assert(pInfo != nullptr);
+
+        CSHolder csHolder(&m_cs);
+
+        Table * pTable = m_pTable.load(std::memory_order_relaxed);
+        Slot * pSlot = FindSlot(pTable, id);
+        if (pSlot != nullptr)
+        {
+            _Info * pOld = pSlot->m_pInfo.exchange(pInfo, std::memory_order_acq_rel);
+            if (pOld != nullptr)
+            {
+                Retire(pOld);
+            }
+            else
+            {
+                m_count++;
+            }
+        }
+        else
+        {
+            if ((m_used + 1) * 2 > pTable->m_capacity)
+            {
+                pTable = Rebuild(pTable);
+            }
+
+            InsertSlot(pTable, id, pInfo);
+            m_used++;
+            m_count++;
+        }
+
+        Reclaim();
+    }
+
+    // Calls callback(id, pInfo) for every live entry while holding the writer lock, so
+    // the callback mustn't wait for a module load or unload
+    template <class _Callback>
+    void ForEach(_Callback callback)
+    {
+        CSHolder csHolder(&m_cs);
+
+        Table * pTable = m_pTable.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < pTable->m_capacity; i++)
+        {
+            _Info * pInfo = pTable->m_pSlots[i].m_pInfo.load(std::memory_order_relaxed);
+            if (pInfo != nullptr)
+            {
+                callback(pTable->m_pSlots[i].m_id.load(std::memory_order_relaxed), pInfo);
+            }
+        }
+    }
+
+private:
+    static const size_t k_initialCapacity = 64;
+    static const _ID k_emptyID = 0;
+    static const size_t READER_SLOT_COUNT = 64;
+
+    // The epoch a reader started in, or 0; one per cache line, since readers write it
+    struct alignas(64) ReaderSlot
+    {
+        std::atomic<UINT64> m_epoch { 0 };
+    };
+
+    struct Slot
+    {
+        std::atomic<_ID> m_id;
+        std::atomic<_Info *> m_pInfo;
+    };
+
+    struct Table
+    {
+        size_t m_capacity;
+        Slot * m_pSlots;
+    };
+
+    static size_t Hash(_ID id)
+    {
+        // IDs are aligned pointers; drop the low bits and spread with Fibonacci hashing.
+        UINT64 h = ((UINT64)id >> 3) * 0x9E3779B97F4A7C15ULL;
+        return (size_t)(h >> 32);
+    }
+
+    static Table * NewTable(size_t capacity)
+    {
+        Table * pTable = new Table;
+        pTable->m_capacity = capacity;
+        pTable->m_pSlots = new Slot[capacity];
+
+        for (size_t i = 0; i < capacity; i++)
+        {
+            pTable->m_pSlots[i].m_id.store(k_emptyID, std::memory_order_relaxed);
+            pTable->m_pSlots[i].m_pInfo.store(nullptr, std::memory_order_relaxed);
+        }
+
+        return pTable;
+    }
+
+    static void DeleteTable(Table * pTable)
+    {
+        delete[] pTable->m_pSlots;
+        delete pTable;
+    }
+
+    static Slot * FindSlot(Table * pTable, _ID id)
+    {
+        size_t mask = pTable->m_capacity - 1;
+        size_t index = Hash(id) & mask;
+
+        for (size_t probe = 0; probe <= mask; probe++, index = (index + 1) & mask)
+        {
+            _ID slotId = pTable->m_pSlots[index].m_id.load(std::memory_order_relaxed);
+            if (slotId == id)
+            {
+                return &pTable->m_pSlots[index];
+            }
+
+            if (slotId == k_emptyID)
+            {
+                break;
+            }
+        }
+
+        return nullptr;
+    }
+
+    static void InsertSlot(Table * pTable, _ID id, _Info * pInfo)
+    {
+        size_t mask = pTable->m_capacity - 1;
+        size_t index = Hash(id) & mask;
+
+        while (pTable->m_pSlots[index].m_id.load(std::memory_order_relaxed) != k_emptyID)
+        {
+            index = (index + 1) & mask;
+        }
+
+        // Info first, then the ID with release: a reader that sees the ID sees the info.
+        pTable->m_pSlots[index].m_pInfo.store(pInfo, std::memory_order_relaxed);
+        pTable->m_pSlots[index].m_id.store(id, std::memory_order_release);
+    }
+
+    // Copies live entries into a larger table (dropping tombstones) and publishes it.
+    Table * Rebuild(Table * pOldTable)
+    {
+        size_t capacity = k_initialCapacity;
+        while (capacity < (m_count + 1) * 4)
+        {
+            capacity *= 2;
+        }
+
+        Table * pNewTable = NewTable(capacity);
+        m_used = 0;
+
+        for (size_t i = 0; i < pOldTable->m_capacity; i++)
+        {
+            _Info * pInfo = pOldTable->m_pSlots[i].m_pInfo.load(std::memory_order_relaxed);
+            if (pInfo != nullptr)
+            {
+                InsertSlot(pNewTable, pOldTable->m_pSlots[i].m_id.load(std::memory_order_relaxed), pInfo);
+                m_used++;
+            }
+        }
+
+        m_pTable.store(pNewTable, std::memory_order_release);
+        m_retiredTables.push_back(std::make_pair(m_epoch.fetch_add(1, std::memory_order_acq_rel), pOldTable));
+
+        return pNewTable;
+    }
+
+    // Called once pInfo is unlinked; a reader that starts in a later epoch can't find it
+    void Retire(_Info * pInfo)
+    {
+        m_retiredInfos.push_back(std::make_pair(m_epoch.fetch_add(1, std::memory_order_acq_rel), pInfo));
+    }
+
+    // Frees what was retired before the oldest epoch a reader announces.  A reader that
+    // announced an epoch may hold anything retired in it or later.
+    void Reclaim()
+    {
+        if (m_retiredTables.empty() == true && m_retiredInfos.empty() == true)
+        {
+            return;
+        }
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        UINT64 oldest = ~(UINT64)0;
+        for (const ReaderSlot &slot : m_readers)
+        {
+            UINT64 epoch = slot.m_epoch.load(std::memory_order_acquire);
+            if (epoch != 0 && epoch < oldest)
+            {
+                oldest = epoch;
+            }
+        }
+
+        auto end = std::remove_if(m_retiredTables.begin(), m_retiredTables.end(),
+            [oldest](const std::pair<UINT64, Table *> &retired)
+            {
+                if (retired.first >= oldest)
+                {
+                    return false;
+                }
+
+                DeleteTable(retired.second);
+                return true;
+            });
+        m_retiredTables.erase(end, m_retiredTables.end());
+
+        auto endInfos = std::remove_if(m_retiredInfos.begin(), m_retiredInfos.end(),
+            [oldest](const std::pair<UINT64, _Info *> &retired)
+            {
+                if (retired.first >= oldest)
+                {
+                    return false;
+                }
+
+                delete retired.second;
+                return true;
+            });
+        m_retiredInfos.erase(endInfos, m_retiredInfos.end());
+    }
+
+    std::atomic<Table *> m_pTable;
+
+    // Epoch of the next retirement; readers announce the one they start in
+    std::atomic<UINT64> m_epoch { 1 };
+    ReaderSlot m_readers[READER_SLOT_COUNT];
+
+    // Writer-side state, guarded by m_cs
+    std::recursive_mutex m_cs;
+    size_t m_count = 0;     // live entries
+    size_t m_used = 0;      // live entries + tombstones
+    std::vector<std::pair<UINT64, Table *>> m_retiredTables;   // (epoch, table)
+    std::vector<std::pair<UINT64, _Info *>> m_retiredInfos;    // (epoch, info)
 };
 
 #define PRIMITIVE_COUNT (ELEMENT_TYPE_R8 - ELEMENT_TYPE_BOOLEAN + 1)
+
+// Generic parameters with a higher ordinal bypass the index
+#define GENERIC_SPEC_INDEX_SIZE 64
+
+// Maps !n and !!n to the module's TypeSpec token for them.  The module's existing
+// TypeSpecs are scanned once, on first use; a miss after that defines the TypeSpec and
+// records it.  Lookups of recorded tokens take no lock.
+class GenericSpecIndex
+{
+public:
+    GenericSpecIndex();
+
+    GenericSpecIndex(const GenericSpecIndex &) = delete;
+    GenericSpecIndex & operator=(const GenericSpecIndex &) = delete;
+
+    mdTypeSpec GetToken(IMetaDataImport * pMetaDataImport, IMetaDataEmit * pMetaDataEmit,
+        CorElementType genericType, ULONG number);
+
+private:
+    std::atomic<mdTypeSpec> * GetSlot(CorElementType genericType, ULONG number);
+    void Build(IMetaDataImport * pMetaDataImport);
+
+    std::atomic<mdTypeSpec> m_varSpecs[GENERIC_SPEC_INDEX_SIZE];
+    std::atomic<mdTypeSpec> m_mvarSpecs[GENERIC_SPEC_INDEX_SIZE];
+    std::atomic<bool> m_fBuilt;
+
+    std::recursive_mutex m_cs;
+};
+
+// Whether value types named in the module's signatures are byref-like (ref structs such as
+// Span<T>), which can be neither boxed nor used as generic arguments.  TypeRefs are followed
+// into the loaded module of their assembly and through its type forwarders; one that can't
+// be resolved counts as byref-like.  Answers are kept per token, and the metadata of the
+// assemblies found on the way per assembly name.  Resolving runs outside the lock.
+class ByRefLikeIndex
+{
+public:
+    ByRefLikeIndex() = default;
+
+    ByRefLikeIndex(const ByRefLikeIndex &) = delete;
+    ByRefLikeIndex & operator=(const ByRefLikeIndex &) = delete;
+
+    bool IsByRefLike(ICorProfilerInfo2 * pICorProfilerInfo, IMetaDataImport * pMetaDataImport, mdToken tkType);
+
+private:
+    bool findLoadedAssembly(ICorProfilerInfo3 * pICorProfilerInfo3, LPCWSTR wszAssemblyName,
+        IMetaDataImport ** ppMetaDataImport);
+    bool resolveInAssembly(ICorProfilerInfo3 * pICorProfilerInfo3, IMetaDataImport * pMetaDataImport,
+        mdAssemblyRef tkAssemblyRef, LPCWSTR wszTypeName, int depth, IMetaDataImport ** ppDefImport, mdTypeDef * ptd);
+    bool resolveTypeRef(ICorProfilerInfo3 * pICorProfilerInfo3, IMetaDataImport * pMetaDataImport,
+        mdTypeRef tkTypeRef, int depth, IMetaDataImport ** ppDefImport, mdTypeDef * ptd);
+
+    std::unordered_map<mdToken, bool> m_answers;
+
+    // Manifest modules of loaded assemblies by lower case simple name; filled with every
+    // assembly a scan of the loaded modules comes across
+    std::unordered_map<WSTRING, CComPtr<IMetaDataImport>> m_assemblies;
+
+    std::recursive_mutex m_cs;
+};
+
+// Methods with up to this many arguments call Enter<T1, ..., Tn>(object, T1, ..., Tn)
+#define TYPED_PROBE_MAX_ARGS 8
+
+// What a token taken from a ModuleContext stands for; tokens differ from run to run,
+// roles don't, so cached rewrites record roles and are re-bound when applied.
+enum TokenRole : BYTE
+{
+    ROLE_NONE,
+    ROLE_ENTER_PROBE,
+    ROLE_TYPED_ENTER_PROBE,     // indexed by arity
+    ROLE_FAST_ENTER_PROBE,
+    ROLE_OBJECT,
+    ROLE_PRIMITIVE,             // indexed by element type
+    ROLE_ENTER_TIMESTAMP,
+    ROLE_EXIT_PROBE,
+    ROLE_TYPED_EXIT_PROBE,
+};
+
 struct ModuleContext
 {
-    mdToken m_mdEnterProbeRef = 0;
+    enum PrepareState
+    {
+        Unprepared,
+        Prepared,
+        PrepareFailed,
+    };
+
+    ModuleContext()
+    {
+        m_prepareState.store(Unprepared, std::memory_order_relaxed);
+    }
+
+    // Everything below but the method filter is filled in by ClrModule::PrepareModuleContext,
+    // which runs once per module under m_prepareLock; readers check m_prepareState first.
+    std::atomic<int> m_prepareState;
+    std::recursive_mutex m_prepareLock;
+
+    mdToken m_mdEnterProbeRef = 0;      // Enter(object, object[])
     mdToken m_mdObjectToken = 0;
 
+    // Enter(object) and the generic Enter<T1, ..., Tn>(object, T1, ..., Tn), by arity
+    mdToken m_mdTypedEnterProbeRefs[TYPED_PROBE_MAX_ARGS + 1] = {};
+
+    // Enter(int, int), used instead of the probes above in modules selected for the fast probe
+    mdToken m_mdFastEnterProbeRef = 0;
+
+    // long EnterTimestamp(), Exit(int, int, long) and Exit<TResult>(TResult, int, int, long);
+    // only with COREPROFILER_EXIT_PROBES, and the last only with COREPROFILER_RETURN_VALUES
+    mdToken m_mdEnterTimestampRef = 0;
+    mdToken m_mdExitProbeRef = 0;
+    mdToken m_mdTypedExitProbeRef = 0;
+
+    // Identifies the module to the probe registry in the calls above
+    int m_moduleCookie = -1;
+
     mdToken m_primitives[ELEMENT_TYPE_MAX];
 
+    ModuleMethodFilter m_methodFilter;
+
+    GenericSpecIndex m_genericSpecIndex;
+
+    ByRefLikeIndex m_byRefLikeIndex;
+
+    // Acquired once when the module is prepared and shared by every rewrite in the module;
+    // never released before the context itself, since rewrites borrow them without a reference
+    CComPtr<IMetaDataImport> m_pMetaDataImport;
+    CComPtr<IMetaDataImport2> m_pMetaDataImport2;
+    CComPtr<IMetaDataEmit> m_pMetaDataEmit;
+    CComPtr<IMetaDataEmit2> m_pMetaDataEmit2;
+    CComPtr<IMethodMalloc> m_pMethodMalloc;
+
+    GUID m_mvid = {};
+
     bool IsValid()
     {
         return IsNilToken(m_mdEnterProbeRef) == false &&
             IsNilToken(m_mdObjectToken) == false;
     }
+
+    bool UsesFastProbe()
+    {
+        return m_moduleCookie >= 0 && IsNilToken(m_mdFastEnterProbeRef) == false;
+    }
+
+    bool UsesExitProbe()
+    {
+        return m_moduleCookie >= 0 && IsNilToken(m_mdEnterTimestampRef) == false &&
+            IsNilToken(m_mdExitProbeRef) == false;
+    }
+
+    bool PassesReturnValues()
+    {
+        return UsesExitProbe() == true && UsesFastProbe() == false && IsNilToken(m_mdTypedExitProbeRef) == false;
+    }
+
+    TokenRole FindTokenRole(mdToken token, int * pIndex)
+    {
+        *pIndex = 0;
+
+        if (token == m_mdEnterProbeRef)
+        {
+            return ROLE_ENTER_PROBE;
+        }
+
+        if (token == m_mdFastEnterProbeRef)
+        {
+            return ROLE_FAST_ENTER_PROBE;
+        }
+
+        if (token == m_mdObjectToken)
+        {
+            return ROLE_OBJECT;
+        }
+
+        if (token == m_mdEnterTimestampRef)
+        {
+            return ROLE_ENTER_TIMESTAMP;
+        }
+
+        if (token == m_mdExitProbeRef)
+        {
+            return ROLE_EXIT_PROBE;
+        }
+
+        if (token == m_mdTypedExitProbeRef)
+        {
+            return ROLE_TYPED_EXIT_PROBE;
+        }
+
+        for (int i = 0; i <= TYPED_PROBE_MAX_ARGS; i++)
+        {
+            if (token == m_mdTypedEnterProbeRefs[i])
+            {
+                *pIndex = i;
+                return ROLE_TYPED_ENTER_PROBE;
+            }
+        }
+
+        for (int i = ELEMENT_TYPE_BOOLEAN; i < (ELEMENT_TYPE_BOOLEAN + PRIMITIVE_COUNT); i++)
+        {
+            if (token == m_primitives[i])
+            {
+                *pIndex = i;
+                return ROLE_PRIMITIVE;
+            }
+        }
+
+        return ROLE_NONE;
+    }
+
+    mdToken GetTokenByRole(TokenRole role, int index)
+    {
+        switch (role)
+        {
+        case ROLE_ENTER_PROBE:
+            return m_mdEnterProbeRef;
+        case ROLE_TYPED_ENTER_PROBE:
+            return (index >= 0 && index <= TYPED_PROBE_MAX_ARGS) ? m_mdTypedEnterProbeRefs[index] : mdTokenNil;
+        case ROLE_FAST_ENTER_PROBE:
+            return m_mdFastEnterProbeRef;
+        case ROLE_OBJECT:
+            return m_mdObjectToken;
+        case ROLE_PRIMITIVE:
+            return (index >= ELEMENT_TYPE_BOOLEAN && index < (ELEMENT_TYPE_BOOLEAN + PRIMITIVE_COUNT)) ? m_primitives[index] : mdTokenNil;
+        case ROLE_ENTER_TIMESTAMP:
+            return m_mdEnterTimestampRef;
+        case ROLE_EXIT_PROBE:
+            return m_mdExitProbeRef;
+        case ROLE_TYPED_EXIT_PROBE:
+            return m_mdTypedExitProbeRef;
+        default:
+            return mdTokenNil;
+        }
+    }
 };
 
-typedef IDToInfoMap<ModuleID, ModuleContext> ModuleIDToInfoMap;
\ No newline at end of file
+typedef ConcurrentIDToInfoMap<ModuleID, ModuleContext> ModuleIDToInfoMap;
\ No newline at end of file
@@ -0,0 +1,435 @@
+#include "stdafx.h"
+#include "RewriteCache.h"
+#include "Constants.h"
+#include "Misc.h"
+
+#include <algorithm>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+RewriteCache g_rewriteCache;
+
+static bool keyLess(const RewriteCacheKey &left, const RewriteCacheKey &right)
+{
+    return memcmp(&left, &right, sizeof(RewriteCacheKey)) < 0;
+}
+
+static bool keyEquals(const RewriteCacheKey &left, const RewriteCacheKey &right)
+{
+    return memcmp(&left, &right, sizeof(RewriteCacheKey)) == 0;
+}
+
+static DWORD alignUp(DWORD offset)
+{
+    return (offset + 7) & ~7;
+}
+
+RewriteCache::RewriteCache()
+{
+    WSTRING filePath;
+    if (getEnvironmentString(ENV_REWRITE_CACHE, filePath) == true)
+    {
+        Open(filePath);
+    }
+}
+
+RewriteCache::~RewriteCache()
+{
+    closeMapping();
+}
+
+bool RewriteCache::Open(const WSTRING &filePath)
+{
+    CSHolder csHolder(&m_cs);
+
+    closeMapping();
+    m_added.clear();
+
+    m_filePath = filePath;
+    return openMapping();
+}
+
+UINT64 RewriteCache::HashBody(LPCBYTE pBody, ULONG cbBody)
+{
+    UINT64 hash = 0xcbf29ce484222325ULL;
+    for (ULONG i = 0; i < cbBody; i++)
+    {
+        hash ^= pBody[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+bool RewriteCache::openMapping()
+{
+#ifdef _WIN32
+    m_hFile = CreateFile(m_filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(m_hFile, &size) == FALSE || size.QuadPart < (LONGLONG)sizeof(RewriteCacheHeader) ||
+        size.QuadPart > MAXDWORD)
+    {
+        closeMapping();
+        return false;
+    }
+
+    m_hMapping = CreateFileMapping(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_hMapping == nullptr)
+    {
+        closeMapping();
+        return false;
+    }
+
+    m_pView = (const BYTE *)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (m_pView == nullptr)
+    {
+        closeMapping();
+        return false;
+    }
+
+    m_cbView = size.QuadPart;
+#else
+    // The view outlives the descriptor
+    int fd = open(toUtf8(m_filePath).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return false;
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size < (off_t)sizeof(RewriteCacheHeader) || status.st_size > MAXDWORD)
+    {
+        close(fd);
+        return false;
+    }
+
+    void * pView = mmap(nullptr, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pView == MAP_FAILED)
+    {
+        return false;
+    }
+
+    m_pView = (const BYTE *)pView;
+    m_cbView = (ULONGLONG)status.st_size;
+#endif
+
+    const RewriteCacheHeader * pHeader = (const RewriteCacheHeader *)m_pView;
+    if (pHeader->m_magic != REWRITE_CACHE_MAGIC || pHeader->m_version != REWRITE_CACHE_VERSION ||
+        sizeof(RewriteCacheHeader) + (ULONGLONG)pHeader->m_cEntries * sizeof(RewriteCacheEntry) > m_cbView)
+    {
+        closeMapping();
+        return false;
+    }
+
+    m_pEntries = (const RewriteCacheEntry *)(pHeader + 1);
+    m_cEntries = pHeader->m_cEntries;
+    return true;
+}
+
+void RewriteCache::closeMapping()
+{
+#ifdef _WIN32
+    if (m_pView != nullptr)
+    {
+        UnmapViewOfFile(m_pView);
+        m_pView = nullptr;
+    }
+
+    if (m_hMapping != nullptr)
+    {
+        CloseHandle(m_hMapping);
+        m_hMapping = nullptr;
+    }
+
+    if (m_hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (m_pView != nullptr)
+    {
+        munmap((void *)m_pView, (size_t)m_cbView);
+        m_pView = nullptr;
+    }
+#endif
+
+    m_cbView = 0;
+    m_pEntries = nullptr;
+    m_cEntries = 0;
+}
+
+const RewriteCacheEntry * RewriteCache::find(const RewriteCacheKey &key)
+{
+    const RewriteCacheEntry * pEnd = m_pEntries + m_cEntries;
+    const RewriteCacheEntry * pEntry = std::lower_bound(m_pEntries, pEnd, key,
+        [](const RewriteCacheEntry &entry, const RewriteCacheKey &key) { return keyLess(entry.m_key, key); });
+
+    if (pEntry == pEnd || keyEquals(pEntry->m_key, key) == false)
+    {
+        return nullptr;
+    }
+
+    // The file may be truncated or stale; never read past the view
+    if ((ULONGLONG)pEntry->m_bodyOffset + pEntry->m_cbBody > m_cbView ||
+        (ULONGLONG)pEntry->m_relocOffset + (ULONGLONG)pEntry->m_cRelocs * sizeof(RewriteCacheReloc) > m_cbView ||
+        (ULONGLONG)pEntry->m_blobOffset + pEntry->m_cbBlobs > m_cbView)
+    {
+        return nullptr;
+    }
+
+    return pEntry;
+}
+
+mdToken RewriteCache::rebind(const RewriteCacheReloc &reloc, const BYTE * pBlobs, ModuleContext &moduleInfo)
+{
+    PCCOR_SIGNATURE pBlob = pBlobs + reloc.m_blobOffset;
+    mdToken token = mdTokenNil;
+
+    switch (reloc.m_kind)
+    {
+    case RELOC_ROLE_TOKEN:
+        return moduleInfo.GetTokenByRole((TokenRole)reloc.m_role, reloc.m_index);
+
+    case RELOC_TYPESPEC:
+        if (FAILED(moduleInfo.m_pMetaDataEmit->GetTokenFromTypeSpec(pBlob, reloc.m_cbBlob, &token)))
+        {
+            return mdTokenNil;
+        }
+        return token;
+
+    case RELOC_METHODSPEC:
+    {
+        mdToken tkParent = moduleInfo.GetTokenByRole((TokenRole)reloc.m_role, reloc.m_index);
+        if (IsNilToken(tkParent) == true || moduleInfo.m_pMetaDataEmit2 == nullptr ||
+            FAILED(moduleInfo.m_pMetaDataEmit2->DefineMethodSpec(tkParent, pBlob, reloc.m_cbBlob, &token)))
+        {
+            return mdTokenNil;
+        }
+        return token;
+    }
+
+    case RELOC_LOCAL_SIG:
+        if (FAILED(moduleInfo.m_pMetaDataEmit->GetTokenFromSig(pBlob, reloc.m_cbBlob, &token)))
+        {
+            return mdTokenNil;
+        }
+        return token;
+
+    case RELOC_MODULE_COOKIE:
+        return moduleInfo.m_moduleCookie >= 0 ? (mdToken)moduleInfo.m_moduleCookie : mdTokenNil;
+
+    default:
+        return mdTokenNil;
+    }
+}
+
+HRESULT RewriteCache::Apply(ICorProfilerInfo2 * pICorProfilerInfo, ModuleID moduleId, const RewriteCacheKey &key,
+    ModuleContext &moduleInfo)
+{
+    const RewriteCacheEntry * pEntry = find(key);
+    if (pEntry == nullptr)
+    {
+        return S_FALSE;
+    }
+
+    const BYTE * pCachedBody = m_pView + pEntry->m_bodyOffset;
+    const RewriteCacheReloc * pRelocs = (const RewriteCacheReloc *)(m_pView + pEntry->m_relocOffset);
+    const BYTE * pBlobs = m_pView + pEntry->m_blobOffset;
+
+    // Everything is re-bound before allocating, as the CLR's IL allocator can't free
+    std::vector<mdToken> tokens(pEntry->m_cRelocs);
+    for (DWORD i = 0; i < pEntry->m_cRelocs; i++)
+    {
+        const RewriteCacheReloc &reloc = pRelocs[i];
+        if ((ULONGLONG)reloc.m_offset + sizeof(mdToken) > pEntry->m_cbBody ||
+            (ULONGLONG)reloc.m_blobOffset + reloc.m_cbBlob > pEntry->m_cbBlobs)
+        {
+            return S_FALSE;
+        }
+
+        tokens[i] = rebind(reloc, pBlobs, moduleInfo);
+        if (IsNilToken(tokens[i]) == true && reloc.m_kind != RELOC_MODULE_COOKIE)
+        {
+            return S_FALSE;
+        }
+    }
+
+    LPBYTE pBody = (LPBYTE)moduleInfo.m_pMethodMalloc->Alloc(pEntry->m_cbBody);
+    if (pBody == nullptr)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    memcpy(pBody, pCachedBody, pEntry->m_cbBody);
+    for (DWORD i = 0; i < pEntry->m_cRelocs; i++)
+    {
+        *(UNALIGNED mdToken *)(pBody + pRelocs[i].m_offset) = tokens[i];
+    }
+
+    return pICorProfilerInfo->SetILFunctionBody(moduleId, key.m_tkMethod, pBody);
+}
+
+void RewriteCache::Add(const RewriteCacheKey &key, RewriteCacheData &data)
+{
+    CSHolder csHolder(&m_cs);
+
+    m_added.push_back(std::make_pair(key, std::move(data)));
+}
+
+void RewriteCache::Flush()
+{
+    CSHolder csHolder(&m_cs);
+
+    if (IsEnabled() == false || m_added.empty() == true)
+    {
+        return;
+    }
+
+    // New entries win over mapped ones with the same key
+    std::sort(m_added.begin(), m_added.end(),
+        [](const std::pair<RewriteCacheKey, RewriteCacheData> &left, const std::pair<RewriteCacheKey, RewriteCacheData> &right)
+        {
+            return keyLess(left.first, right.first);
+        });
+
+    struct Source
+    {
+        RewriteCacheKey m_key;
+        const BYTE * m_pBody;
+        DWORD m_cbBody;
+        const BYTE * m_pRelocs;
+        DWORD m_cRelocs;
+        const BYTE * m_pBlobs;
+        DWORD m_cbBlobs;
+    };
+
+    std::vector<Source> sources;
+    size_t iAdded = 0;
+    DWORD iMapped = 0;
+
+    while (iAdded < m_added.size() || iMapped < m_cEntries)
+    {
+        bool fTakeAdded = iMapped == m_cEntries ||
+            (iAdded < m_added.size() && keyLess(m_pEntries[iMapped].m_key, m_added[iAdded].first) == false);
+
+        if (fTakeAdded == true)
+        {
+            const RewriteCacheData &data = m_added[iAdded].second;
+            Source source = { m_added[iAdded].first, data.m_body.data(), (DWORD)data.m_body.size(),
+                (const BYTE *)data.m_relocs.data(), (DWORD)data.m_relocs.size(), data.m_blobs.data(), (DWORD)data.m_blobs.size() };
+
+            if (iMapped < m_cEntries && keyEquals(m_pEntries[iMapped].m_key, m_added[iAdded].first) == true)
+            {
+                iMapped++;
+            }
+
+            if (sources.empty() == true || keyEquals(sources.back().m_key, source.m_key) == false)
+            {
+                sources.push_back(source);
+            }
+
+            iAdded++;
+        }
+        else
+        {
+            const RewriteCacheEntry * pEntry = find(m_pEntries[iMapped].m_key);
+            if (pEntry != nullptr)
+            {
+                Source source = { pEntry->m_key, m_pView + pEntry->m_bodyOffset, pEntry->m_cbBody,
+                    m_pView + pEntry->m_relocOffset, pEntry->m_cRelocs, m_pView + pEntry->m_blobOffset, pEntry->m_cbBlobs };
+                sources.push_back(source);
+            }
+
+            iMapped++;
+        }
+    }
+
+    std::vector<RewriteCacheEntry> entries(sources.size());
+    DWORD offset = alignUp((DWORD)(sizeof(RewriteCacheHeader) + sizeof(RewriteCacheEntry) * entries.size()));
+
+    for (size_t i = 0; i < sources.size(); i++)
+    {
+        entries[i].m_key = sources[i].m_key;
+        entries[i].m_cbBody = sources[i].m_cbBody;
+        entries[i].m_cRelocs = sources[i].m_cRelocs;
+        entries[i].m_cbBlobs = sources[i].m_cbBlobs;
+
+        entries[i].m_bodyOffset = offset;
+        offset = alignUp(offset + sources[i].m_cbBody);
+        entries[i].m_relocOffset = offset;
+        offset = alignUp(offset + sources[i].m_cRelocs * sizeof(RewriteCacheReloc));
+        entries[i].m_blobOffset = offset;
+        offset = alignUp(offset + sources[i].m_cbBlobs);
+    }
+
+    // Processes sharing the cache may flush at the same time; each writes a file of its
+    // own, and the last rename wins with a complete file
+    WSTRING tempPath = m_filePath + W(".") + fromUtf8(std::to_string(getCurrentProcessId())) + W(".tmp");
+    FILE * pFile = openFile(tempPath, "wb");
+    if (pFile == nullptr)
+    {
+        return;
+    }
+
+    RewriteCacheHeader header = {};
+    header.m_magic = REWRITE_CACHE_MAGIC;
+    header.m_version = REWRITE_CACHE_VERSION;
+    header.m_cEntries = (DWORD)entries.size();
+
+    const BYTE padding[8] = {};
+    DWORD written = 0;
+    auto write = [&](const void * pData, DWORD cbData)
+    {
+        fwrite(pData, 1, cbData, pFile);
+        written += cbData;
+    };
+    auto pad = [&]()
+    {
+        write(padding, alignUp(written) - written);
+    };
+
+    write(&header, sizeof(header));
+    write(entries.data(), (DWORD)(sizeof(RewriteCacheEntry) * entries.size()));
+    pad();
+
+    for (const Source &source : sources)
+    {
+        write(source.m_pBody, source.m_cbBody);
+        pad();
+        write(source.m_pRelocs, source.m_cRelocs * sizeof(RewriteCacheReloc));
+        pad();
+        write(source.m_pBlobs, source.m_cbBlobs);
+        pad();
+    }
+
+    bool fWritten = ferror(pFile) == 0;
+    fWritten = fclose(pFile) == 0 && fWritten == true;
+
+    // The mapped entries have been copied; the old file can go
+    closeMapping();
+    m_added.clear();
+
+    std::error_code error;
+    if (fWritten == true)
+    {
+        std::filesystem::rename(std::filesystem::path(tempPath), std::filesystem::path(m_filePath), error);
+    }
+
+    if (fWritten == false || error)
+    {
+        std::filesystem::remove(std::filesystem::path(tempPath), error);
+    }
+}
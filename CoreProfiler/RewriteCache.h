@@ -0,0 +1,146 @@
+#pragma once
+
+#include "ProfilerData.h"
+
+// Rewritten method bodies persisted across runs in the file named by
+// COREPROFILER_REWRITE_CACHE.  An entry is keyed by the module's MVID, the method token
+// and a hash of the original body, and holds the encoded body plus relocations for the
+// tokens the rewrite took from its ModuleContext or defined itself; those are re-bound
+// in the running process before the body is handed to the CLR.
+//
+// The file is mapped read-only at startup.  Rewrites that miss are kept in memory and
+// merged into a new file at shutdown.
+//
+// File layout: RewriteCacheHeader, RewriteCacheEntry[m_cEntries] sorted by key, then
+// the bodies, relocations and blobs the entries point to.
+
+constexpr const DWORD REWRITE_CACHE_MAGIC = 0x43575243;    // "CRWC"
+
+// Bump whenever the rewrite itself changes, so stale entries are never applied
+constexpr const DWORD REWRITE_CACHE_VERSION = 6;
+
+#define REWRITE_CACHE_FLAG_FAST_PROBE 0x1
+#define REWRITE_CACHE_FLAG_EXIT_PROBE 0x2
+#define REWRITE_CACHE_FLAG_RETURN_VALUES 0x4
+
+struct RewriteCacheKey
+{
+    GUID    m_mvid;
+    DWORD   m_tkMethod;
+    DWORD   m_flags;        // REWRITE_CACHE_FLAG_*
+    UINT64  m_ilHash;       // FNV-1a of the original method body
+};
+
+enum RewriteCacheRelocKind : BYTE
+{
+    RELOC_ROLE_TOKEN,       // token of m_role/m_index in the ModuleContext
+    RELOC_TYPESPEC,         // TypeSpec of the blob
+    RELOC_METHODSPEC,       // instantiation blob of the generic method of m_role/m_index
+    RELOC_LOCAL_SIG,        // standalone signature of the blob
+    RELOC_MODULE_COOKIE,    // the module's probe registry cookie
+};
+
+struct RewriteCacheReloc
+{
+    DWORD   m_offset;       // of the 4 bytes to patch in the body
+    BYTE    m_kind;         // RewriteCacheRelocKind
+    BYTE    m_role;         // TokenRole
+    WORD    m_index;
+    DWORD   m_blobOffset;   // into the entry's blobs
+    DWORD   m_cbBlob;
+};
+
+struct RewriteCacheHeader
+{
+    DWORD   m_magic;
+    DWORD   m_version;
+    DWORD   m_cEntries;
+    DWORD   m_reserved;
+};
+
+struct RewriteCacheEntry
+{
+    RewriteCacheKey m_key;
+    DWORD   m_bodyOffset;   // offsets are from the start of the file
+    DWORD   m_cbBody;
+    DWORD   m_relocOffset;
+    DWORD   m_cRelocs;
+    DWORD   m_blobOffset;
+    DWORD   m_cbBlobs;
+};
+
+// A rewrite captured for the cache
+struct RewriteCacheData
+{
+    std::vector<BYTE> m_body;
+    std::vector<RewriteCacheReloc> m_relocs;
+    std::vector<BYTE> m_blobs;
+
+    void AddReloc(DWORD offset, RewriteCacheRelocKind kind, TokenRole role, int index,
+        const BYTE * pBlob = nullptr, ULONG cbBlob = 0)
+    {
+        RewriteCacheReloc reloc = {};
+        reloc.m_offset = offset;
+        reloc.m_kind = (BYTE)kind;
+        reloc.m_role = (BYTE)role;
+        reloc.m_index = (WORD)index;
+        reloc.m_blobOffset = (DWORD)m_blobs.size();
+        reloc.m_cbBlob = cbBlob;
+
+        m_relocs.push_back(reloc);
+        if (cbBlob != 0)
+        {
+            m_blobs.insert(m_blobs.end(), pBlob, pBlob + cbBlob);
+        }
+    }
+};
+
+class RewriteCache
+{
+public:
+    RewriteCache();
+    ~RewriteCache();
+
+    bool IsEnabled()
+    {
+        return m_filePath.empty() == false;
+    }
+
+    // Uses the file at filePath from now on, dropping the entries not flushed; the
+    // constructor opens the one named by COREPROFILER_REWRITE_CACHE.  No rewrite may run
+    // meanwhile.
+    bool Open(const WSTRING &filePath);
+
+    static UINT64 HashBody(LPCBYTE pBody, ULONG cbBody);
+
+    // S_OK when a cached body was re-bound and set, S_FALSE on a miss
+    HRESULT Apply(ICorProfilerInfo2 * pICorProfilerInfo, ModuleID moduleId, const RewriteCacheKey &key,
+        ModuleContext &moduleInfo);
+
+    void Add(const RewriteCacheKey &key, RewriteCacheData &data);
+
+    // Merges the mapped entries with the new ones into a fresh file
+    void Flush();
+
+private:
+    bool openMapping();
+    void closeMapping();
+    const RewriteCacheEntry * find(const RewriteCacheKey &key);
+    mdToken rebind(const RewriteCacheReloc &reloc, const BYTE * pBlobs, ModuleContext &moduleInfo);
+
+    WSTRING m_filePath;
+
+#ifdef _WIN32
+    HANDLE m_hFile = INVALID_HANDLE_VALUE;
+    HANDLE m_hMapping = nullptr;
+#endif
+    const BYTE * m_pView = nullptr;
+    ULONGLONG m_cbView = 0;
+    const RewriteCacheEntry * m_pEntries = nullptr;
+    DWORD m_cEntries = 0;
+
+    std::recursive_mutex m_cs;
+    std::vector<std::pair<RewriteCacheKey, RewriteCacheData>> m_added;
+};
+
+extern RewriteCache g_rewriteCache;
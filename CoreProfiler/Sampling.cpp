@@ -0,0 +1,91 @@
+#include "stdafx.h"
+#include "Sampling.h"
+#include "Constants.h"
+#include "Misc.h"
+
+SamplingControl g_samplingControl;
+
+// May be called by the application, e.g. through Intercept.Helper.ManagedLayer.SetSamplingInterval
+extern "C" void __stdcall SetSamplingInterval(int interval)
+{
+    g_samplingControl.SetInterval(interval);
+}
+
+SamplingControl::SamplingControl()
+{
+    WSTRING value;
+    if (getEnvironmentString(ENV_SAMPLING, value) == true)
+    {
+        LONG interval = strtol(toUtf8(value).c_str(), nullptr, 0);
+        if (interval > 0)
+        {
+            m_fEnabled = true;
+            m_interval = interval;
+        }
+    }
+
+    if (getEnvironmentString(ENV_SAMPLING_WINDOW, value) == true)
+    {
+        unsigned long onMs = 0;
+        unsigned long periodMs = 0;
+        if (sscanf(toUtf8(value).c_str(), "%lu/%lu", &onMs, &periodMs) == 2 && onMs < periodMs)
+        {
+            m_fEnabled = true;
+            m_windowOnMs = onMs;
+            m_windowPeriodMs = periodMs;
+        }
+    }
+}
+
+void SamplingControl::SetInterval(LONG interval)
+{
+    if (interval < 1)
+    {
+        interval = 1;
+    }
+
+    InterlockedExchange(&m_interval, interval);
+}
+
+void SamplingControl::Start()
+{
+    if (m_windowPeriodMs == 0 || m_windowThread.joinable() == true)
+    {
+        return;
+    }
+
+    m_stopSignal.Reset();
+    m_windowThread = std::thread(&SamplingControl::windowThread, this);
+}
+
+void SamplingControl::Stop()
+{
+    if (m_windowThread.joinable() == false)
+    {
+        return;
+    }
+
+    m_stopSignal.Set();
+    m_windowThread.join();
+}
+
+void SamplingControl::windowThread()
+{
+    for (;;)
+    {
+        InterlockedExchange(&m_windowOpen, 1);
+        if (m_stopSignal.Wait(m_windowOnMs) == true)
+        {
+            break;
+        }
+
+        InterlockedExchange(&m_windowOpen, 0);
+        if (m_stopSignal.Wait(m_windowPeriodMs - m_windowOnMs) == true)
+        {
+            break;
+        }
+    }
+
+    // Leave the guards open once sampling by time stops
+    InterlockedExchange(&m_windowOpen, 1);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "Misc.h"
+
+// With COREPROFILER_SAMPLING=N every rewritten method starts with a guard that lets only
+// every Nth call through to the probes. The guard is inline IL: it counts the calls down
+// in a native counter of the method (see ProbeRegistry) and reads N from here when the
+// counter runs out, so SetSamplingInterval changes the rate without a re-JIT.
+//
+// COREPROFILER_SAMPLING_WINDOW=on/period (milliseconds) additionally opens the guards
+// for the first 'on' milliseconds of every period only.
+//
+// Calls the guard skips run neither the enter nor the exit probes.
+class SamplingControl
+{
+public:
+    SamplingControl();
+
+    // Decided once at startup; guards are only emitted when sampling was asked for
+    bool IsEnabled()
+    {
+        return m_fEnabled;
+    }
+
+    // Read by the guards
+    volatile LONG * GetIntervalCell()
+    {
+        return &m_interval;
+    }
+
+    volatile LONG * GetWindowOpenCell()
+    {
+        return &m_windowOpen;
+    }
+
+    void SetInterval(LONG interval);
+
+    // Starts and stops the thread that opens and closes the window; called from
+    // Initialize and Shutdown
+    void Start();
+    void Stop();
+
+private:
+    void windowThread();
+
+    bool m_fEnabled = false;
+    volatile LONG m_interval = 1;
+    volatile LONG m_windowOpen = 1;
+
+    DWORD m_windowOnMs = 0;
+    DWORD m_windowPeriodMs = 0;
+
+    std::thread m_windowThread;
+    StopSignal m_stopSignal;
+};
+
+extern SamplingControl g_samplingControl;
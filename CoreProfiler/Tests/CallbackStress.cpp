@@ -0,0 +1,507 @@
+#include "stdafx.h"
+#include "BasicClrProfiler.h"
+#include "Mocks.h"
+#include "MetadataReader.h"
+
+#include <random>
+#include <thread>
+
+// Drives CBasicClrProfiler's JIT, module load and unload callbacks from many threads at once
+// against the mocks, the way the runtime calls them: JITCompilationStarted on every thread
+// that compiles a method, concurrently with modules of the same images loading and unloading
+// on others.  Build with COREPROFILER_TSAN for ThreadSanitizer to check the callbacks.
+//
+//     CallbackStress [--threads N] [--jits N] [--loads N] [assembly.dll...]
+//     CallbackStress --scaling [--jits N] [assembly.dll...]
+//     CallbackStress --calls [--jits N] [assembly.dll...]
+//     CallbackStress --prepare [--loads N] [assembly.dll...]
+//
+// The modules are generated, or filled from the assemblies given.  --scaling instead keeps
+// every module loaded and measures the rewrites per second with 1, 2, 4, ... threads, each
+// compiling --jits methods; on fewer cores than threads, that measures contention only.
+// --calls counts the calls to the runtime's interfaces per module load, per first JIT event
+// of a module, which prepares it, and per JIT event after, over --jits events; it fails if
+// the JIT events after the first acquire the module's interfaces again.  --prepare measures
+// the latency of a module load of each image, and of the first JIT event after it, which
+// prepares the module, loading each image --loads times.
+
+// Images the modules are loaded from; a module unloaded is loaded again under a new ModuleID
+#define IMAGE_COUNT 16
+
+struct Image
+{
+    MockMetaData m_metaData;
+    MockMethodMalloc m_methodMalloc;
+    WSTRING m_path;
+    std::vector<mdMethodDef> m_methods;
+
+    // ModuleID of the module loaded from the image, or 0
+    std::atomic<ModuleID> m_moduleId { 0 };
+};
+
+static std::atomic<ModuleID> s_nextModuleId { 1 };
+
+// Methods with 0 to TYPED_PROBE_MAX_ARGS int arguments, so that every typed probe is used;
+// each pushes its arguments, pops them and returns
+static void generateMethods(MockMetaData * pMetaData, int cMethods)
+{
+    for (int i = 0; i < cMethods; i++)
+    {
+        BYTE cArgs = (BYTE)(i % (TYPED_PROBE_MAX_ARGS + 1));
+
+        std::vector<BYTE> sig = { IMAGE_CEE_CS_CALLCONV_DEFAULT, cArgs, ELEMENT_TYPE_VOID };
+        sig.insert(sig.end(), cArgs, ELEMENT_TYPE_I4);
+
+        std::vector<BYTE> code;
+        for (BYTE arg = 0; arg < cArgs; arg++)
+        {
+            code.push_back(0x0E);       // ldarg.s
+            code.push_back(arg);
+        }
+
+        code.insert(code.end(), cArgs, 0x26);  // pop
+        code.push_back(0x2A);                   // ret
+
+        std::vector<BYTE> body = { (BYTE)((code.size() << 2) | CorILMethod_TinyFormat) };
+        body.insert(body.end(), code.begin(), code.end());
+
+        pMetaData->AddMethod(sig, body);
+    }
+}
+
+static bool loadImages(const std::vector<const char *> &paths, std::vector<std::unique_ptr<Image>> &images)
+{
+    for (int i = 0; i < IMAGE_COUNT; i++)
+    {
+        std::unique_ptr<Image> pImage(new Image());
+
+        if (paths.empty() == true)
+        {
+            generateMethods(&pImage->m_metaData, 200);
+            pImage->m_path = fromUtf8("/mock/Module" + std::to_string(i) + ".dll");
+        }
+        else
+        {
+            const char * szPath = paths[i % paths.size()];
+
+            MetadataReader reader;
+            if (reader.Load(szPath) == false || reader.Fill(&pImage->m_metaData) == false)
+            {
+                fprintf(stderr, "%s: %s\n", szPath, reader.GetError().c_str());
+                return false;
+            }
+
+            pImage->m_path = fromUtf8(std::string(szPath) + "." + std::to_string(i));
+        }
+
+        // What ClrModule looks up in a module to make the probe references
+        mdAssemblyRef tkMscorlib = pImage->m_metaData.AddAssemblyRef(W("mscorlib"));
+        pImage->m_metaData.AddTypeRef(tkMscorlib, W("System.Object"));
+
+        for (const auto &method : pImage->m_metaData.GetMethods())
+        {
+            if (method.second.m_body.empty() == false)
+            {
+                pImage->m_methods.push_back(method.first);
+            }
+        }
+
+        images.push_back(std::move(pImage));
+    }
+
+    return true;
+}
+
+static void loadModule(CBasicClrProfiler * pProfiler, MockProfilerInfo * pProfilerInfo, Image * pImage)
+{
+    ModuleID moduleId = s_nextModuleId.fetch_add(1, std::memory_order_relaxed);
+    pProfilerInfo->AddModule(moduleId, &pImage->m_metaData, &pImage->m_methodMalloc, pImage->m_path);
+
+    pProfiler->ModuleLoadFinished(moduleId, S_OK);
+    pImage->m_moduleId.store(moduleId, std::memory_order_release);
+}
+
+static void unloadModule(CBasicClrProfiler * pProfiler, Image * pImage)
+{
+    ModuleID moduleId = pImage->m_moduleId.exchange(0, std::memory_order_acq_rel);
+    if (moduleId != 0)
+    {
+        pProfiler->ModuleUnloadStarted(moduleId);
+    }
+}
+
+// Compiles cJits methods of whichever modules are loaded; the module of a method can be
+// unloading while it compiles, as in the runtime
+static void jitThread(CBasicClrProfiler * pProfiler, std::vector<std::unique_ptr<Image>> * pImages, int cJits, unsigned seed)
+{
+    std::minstd_rand random(seed);
+
+    for (int i = 0; i < cJits; i++)
+    {
+        Image * pImage = (*pImages)[random() % pImages->size()].get();
+
+        ModuleID moduleId = pImage->m_moduleId.load(std::memory_order_acquire);
+        if (moduleId == 0 || pImage->m_methods.empty() == true)
+        {
+            continue;
+        }
+
+        mdMethodDef tkMethod = pImage->m_methods[random() % pImage->m_methods.size()];
+        pProfiler->JITCompilationStarted(MakeMockFunctionID(moduleId, tkMethod), TRUE);
+    }
+}
+
+static int stress(CBasicClrProfiler * pProfiler, MockProfilerInfo * pProfilerInfo,
+    std::vector<std::unique_ptr<Image>> &images, int cThreads, int cJits, int cLoads)
+{
+    for (auto &pImage : images)
+    {
+        loadModule(pProfiler, pProfilerInfo, pImage.get());
+    }
+
+    std::atomic<bool> fDone { false };
+    std::atomic<int> cLoadsLeft { cLoads };
+
+    // Two loaders, each over its half of the images
+    std::vector<std::thread> loaders;
+    for (size_t first = 0; first < 2; first++)
+    {
+        loaders.emplace_back([&, first]()
+        {
+            for (size_t i = first; fDone.load(std::memory_order_relaxed) == false; i = (i + 2) % images.size())
+            {
+                if (cLoadsLeft.fetch_sub(1, std::memory_order_relaxed) <= 0)
+                {
+                    break;
+                }
+
+                unloadModule(pProfiler, images[i].get());
+                loadModule(pProfiler, pProfilerInfo, images[i].get());
+                std::this_thread::yield();
+            }
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> jitters;
+    for (int i = 0; i < cThreads; i++)
+    {
+        jitters.emplace_back(jitThread, pProfiler, &images, cJits / cThreads, (unsigned)i + 1);
+    }
+
+    for (std::thread &jitter : jitters)
+    {
+        jitter.join();
+    }
+
+    fDone.store(true, std::memory_order_relaxed);
+    for (std::thread &loader : loaders)
+    {
+        loader.join();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (auto &pImage : images)
+    {
+        unloadModule(pProfiler, pImage.get());
+    }
+
+    ULONG cRewrites = pProfilerInfo->GetSetBodyCount();
+    printf("%d threads: %d JIT events, %lu rewrites, %d loads in %.2f s\n", cThreads, cJits,
+        (unsigned long)cRewrites, cLoads - max(cLoadsLeft.load(), 0), seconds);
+
+    // Events for a module that is unloading are skipped; the others rewrite their method
+    if (cRewrites == 0)
+    {
+        fprintf(stderr, "no method was rewritten\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static int measureScaling(CBasicClrProfiler * pProfiler, MockProfilerInfo * pProfilerInfo,
+    std::vector<std::unique_ptr<Image>> &images, int cMaxThreads, int cJitsPerThread)
+{
+    for (auto &pImage : images)
+    {
+        loadModule(pProfiler, pProfilerInfo, pImage.get());
+
+        // Prepares the module and defines the specs of the probes, which a module does once
+        for (mdMethodDef tkMethod : pImage->m_methods)
+        {
+            pProfiler->JITCompilationStarted(MakeMockFunctionID(pImage->m_moduleId.load(), tkMethod), TRUE);
+        }
+
+        pImage->m_methodMalloc.Reset();
+    }
+
+    double oneThread = 0;
+    int result = 0;
+    for (int cThreads = 1; cThreads <= cMaxThreads; cThreads *= 2)
+    {
+        ULONG cRewritesBefore = pProfilerInfo->GetSetBodyCount();
+        auto start = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> jitters;
+        for (int i = 0; i < cThreads; i++)
+        {
+            jitters.emplace_back(jitThread, pProfiler, &images, cJitsPerThread, (unsigned)i + 1);
+        }
+
+        for (std::thread &jitter : jitters)
+        {
+            jitter.join();
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        ULONG cRewrites = pProfilerInfo->GetSetBodyCount() - cRewritesBefore;
+
+        // With every module loaded each JIT event rewrites its method
+        if (cRewrites != (ULONG)(cThreads * cJitsPerThread))
+        {
+            fprintf(stderr, "%d threads: %lu of %d methods rewritten\n", cThreads, (unsigned long)cRewrites,
+                cThreads * cJitsPerThread);
+            result = 1;
+        }
+
+        double rate = cRewrites / seconds;
+        if (cThreads == 1)
+        {
+            oneThread = rate;
+        }
+
+        printf("%2d threads: %10.0f rewrites/s  %5.2fx  %5.1f%% per thread\n", cThreads, rate,
+            rate / oneThread, rate / oneThread / cThreads * 100);
+
+        for (auto &pImage : images)
+        {
+            pImage->m_methodMalloc.Reset();
+        }
+    }
+
+    for (auto &pImage : images)
+    {
+        unloadModule(pProfiler, pImage.get());
+    }
+
+    return result;
+}
+
+static void printCalls(const char * szWhat, const std::map<std::string, ULONG> &counts, ULONG cEvents)
+{
+    ULONG cCalls = 0;
+    for (const auto &count : counts)
+    {
+        cCalls += count.second;
+    }
+
+    printf("%s: %.2f calls per event over %lu\n", szWhat, (double)cCalls / cEvents, (unsigned long)cEvents);
+    for (const auto &count : counts)
+    {
+        printf("    %-40s %8.2f\n", count.first.c_str(), (double)count.second / cEvents);
+    }
+}
+
+static int countCalls(CBasicClrProfiler * pProfiler, MockProfilerInfo * pProfilerInfo,
+    std::vector<std::unique_ptr<Image>> &images, int cJits)
+{
+    g_mockCalls.TakeCounts();
+    g_mockCalls.Enable(true);
+
+    for (auto &pImage : images)
+    {
+        loadModule(pProfiler, pProfilerInfo, pImage.get());
+    }
+
+    printCalls("module load", g_mockCalls.TakeCounts(), (ULONG)images.size());
+
+    ULONG cModules = 0;
+    for (auto &pImage : images)
+    {
+        if (pImage->m_methods.empty() == false)
+        {
+            pProfiler->JITCompilationStarted(MakeMockFunctionID(pImage->m_moduleId.load(), pImage->m_methods[0]), TRUE);
+            cModules++;
+        }
+    }
+
+    printCalls("first JIT event of a module", g_mockCalls.TakeCounts(), cModules);
+
+    jitThread(pProfiler, &images, cJits, 1);
+
+    std::map<std::string, ULONG> counts = g_mockCalls.TakeCounts();
+    g_mockCalls.Enable(false);
+    printCalls("JIT event", counts, (ULONG)cJits);
+
+    // The module's context keeps its interfaces, so that the events after the first don't
+    // acquire them again
+    int result = 0;
+    for (const char * szAcquisition : { "MockProfilerInfo::GetModuleMetaData", "MockProfilerInfo::GetILFunctionBodyAllocator",
+        "MockMetaData::QueryInterface", "MockMethodMalloc::QueryInterface" })
+    {
+        if (counts.find(szAcquisition) != counts.end())
+        {
+            fprintf(stderr, "%s called %lu times by %d JIT events\n", szAcquisition, (unsigned long)counts[szAcquisition], cJits);
+            result = 1;
+        }
+    }
+
+    for (auto &pImage : images)
+    {
+        unloadModule(pProfiler, pImage.get());
+    }
+
+    return result;
+}
+
+static double median(std::vector<double> &values)
+{
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+static int measurePrepare(CBasicClrProfiler * pProfiler, MockProfilerInfo * pProfilerInfo,
+    std::vector<std::unique_ptr<Image>> &images, size_t cImages, int cLoads)
+{
+    printf("%-40s %8s %14s %14s %14s\n", "image", "TypeRefs", "load us", "first JIT us", "next JIT us");
+
+    // The images after the first cImages load the same assemblies again
+    for (size_t image = 0; image < cImages; image++)
+    {
+        Image * pImage = images[image].get();
+        if (pImage->m_methods.empty() == true)
+        {
+            continue;
+        }
+
+        HCORENUM hEnum = NULL;
+        mdTypeRef tkTypeRef;
+        ULONG cTypeRefs = 0;
+        pImage->m_metaData.EnumTypeRefs(&hEnum, &tkTypeRef, 1, &cTypeRefs);
+        pImage->m_metaData.CountEnum(hEnum, &cTypeRefs);
+        pImage->m_metaData.CloseEnum(hEnum);
+
+        std::vector<double> loadTimes;
+        std::vector<double> firstJitTimes;
+        std::vector<double> nextJitTimes;
+
+        for (int i = 0; i < cLoads; i++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            loadModule(pProfiler, pProfilerInfo, pImage);
+            auto loaded = std::chrono::steady_clock::now();
+
+            FunctionID functionId = MakeMockFunctionID(pImage->m_moduleId.load(), pImage->m_methods[0]);
+            pProfiler->JITCompilationStarted(functionId, TRUE);
+            auto firstJit = std::chrono::steady_clock::now();
+
+            pProfiler->JITCompilationStarted(functionId, TRUE);
+            auto nextJit = std::chrono::steady_clock::now();
+
+            unloadModule(pProfiler, pImage);
+            pImage->m_methodMalloc.Reset();
+
+            loadTimes.push_back(std::chrono::duration<double, std::micro>(loaded - start).count());
+            firstJitTimes.push_back(std::chrono::duration<double, std::micro>(firstJit - loaded).count());
+            nextJitTimes.push_back(std::chrono::duration<double, std::micro>(nextJit - firstJit).count());
+        }
+
+        std::string path = toUtf8(pImage->m_path);
+        path = path.substr(path.find_last_of('/') + 1);
+        printf("%-40s %8lu %14.1f %14.1f %14.1f\n", path.substr(0, path.find_last_of('.')).c_str(),
+            (unsigned long)cTypeRefs, median(loadTimes), median(firstJitTimes), median(nextJitTimes));
+    }
+
+    return 0;
+}
+
+int main(int argc, char * argv[])
+{
+    int cThreads = 8;
+    int cJits = 100000;
+    int cLoads = 1000;
+    bool fScaling = false;
+    bool fCalls = false;
+    bool fPrepare = false;
+    std::vector<const char *> paths;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            cThreads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--jits") == 0 && i + 1 < argc)
+        {
+            cJits = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--loads") == 0 && i + 1 < argc)
+        {
+            cLoads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--scaling") == 0)
+        {
+            fScaling = true;
+        }
+        else if (strcmp(argv[i], "--calls") == 0)
+        {
+            fCalls = true;
+        }
+        else if (strcmp(argv[i], "--prepare") == 0)
+        {
+            fPrepare = true;
+        }
+        else
+        {
+            paths.push_back(argv[i]);
+        }
+    }
+
+    if (cThreads <= 0 || cJits <= 0 || cLoads < 0)
+    {
+        fprintf(stderr, "usage: CallbackStress [--threads N] [--jits N] [--loads N] [--scaling | --calls | --prepare] [assembly.dll...]\n");
+        return 2;
+    }
+
+    std::vector<std::unique_ptr<Image>> images;
+    if (loadImages(paths, images) == false)
+    {
+        return 1;
+    }
+
+    // Modules the images aren't added for don't exist
+    MockMetaData emptyMetaData;
+    MockMethodMalloc emptyMethodMalloc;
+    MockProfilerInfo profilerInfo(&emptyMetaData, &emptyMethodMalloc);
+
+    CBasicClrProfiler * pProfiler = new CBasicClrProfiler();
+    pProfiler->AddRef();
+    pProfiler->Initialize(static_cast<ICorProfilerInfo2 *>(&profilerInfo));
+
+    int result;
+    if (fPrepare == true)
+    {
+        result = measurePrepare(pProfiler, &profilerInfo, images, min(max(paths.size(), (size_t)1), images.size()),
+            max(cLoads, 1));
+    }
+    else if (fCalls == true)
+    {
+        result = countCalls(pProfiler, &profilerInfo, images, cJits);
+    }
+    else if (fScaling == true)
+    {
+        result = measureScaling(pProfiler, &profilerInfo, images, max(cThreads, (int)std::thread::hardware_concurrency()),
+            cJits);
+    }
+    else
+    {
+        result = stress(pProfiler, &profilerInfo, images, cThreads, cJits, cLoads);
+    }
+
+    pProfiler->Shutdown();
+    pProfiler->Release();
+    return result;
+}
@@ -0,0 +1,736 @@
+#include "stdafx.h"
+#include "ProfilerData.h"
+#include "ILRewriter.h"
+#include "Mocks.h"
+#include "ILDecoder.h"
+#include "Filter.h"
+#include "EventTrace.h"
+#include "Constants.h"
+
+#include <thread>
+
+// Rewrites hand-written bodies through RewriteIL against the mocks and checks what comes out,
+// then the method filter, the trace rings and the trace file encoding.  Exits with the number
+// of failed checks.
+
+static int g_cFailures = 0;
+
+#define CHECK(condition) \
+    do \
+    { \
+        if ((condition) == false) \
+        { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            g_cFailures++; \
+        } \
+    } while (0)
+
+// One-byte opcodes come first, so their values are their encodings
+typedef enum
+{
+#define OPDEF(c,s,pop,push,args,type,l,s1,s2,ctrl) c,
+#include "opcode.def"
+#undef OPDEF
+} OPCODE;
+
+static const ModuleID k_moduleId = 1;
+
+static void appendUInt16(std::vector<BYTE> &bytes, UINT16 value)
+{
+    bytes.push_back((BYTE)value);
+    bytes.push_back((BYTE)(value >> 8));
+}
+
+static void appendUInt32(std::vector<BYTE> &bytes, UINT32 value)
+{
+    appendUInt16(bytes, (UINT16)value);
+    appendUInt16(bytes, (UINT16)(value >> 16));
+}
+
+// A fat body with the code and one small EH section holding clauses of
+// { flags, tryOffset, tryLength, handlerOffset, handlerLength, classToken }
+static std::vector<BYTE> makeFatBody(const std::vector<BYTE> &code, UINT16 maxStack, mdSignature tkLocals,
+    const std::vector<std::vector<UINT32>> &clauses = {})
+{
+    std::vector<BYTE> body;
+
+    UINT16 flags = CorILMethod_FatFormat | (clauses.empty() ? 0 : CorILMethod_MoreSects);
+    appendUInt16(body, flags | (3 << 12));
+    appendUInt16(body, maxStack);
+    appendUInt32(body, (UINT32)code.size());
+    appendUInt32(body, tkLocals);
+    body.insert(body.end(), code.begin(), code.end());
+
+    if (clauses.empty() == false)
+    {
+        while (body.size() % 4 != 0)
+        {
+            body.push_back(0);
+        }
+
+        body.push_back(CorILMethod_Sect_EHTable);
+        body.push_back((BYTE)(4 + clauses.size() * 12));
+        appendUInt16(body, 0);
+
+        for (const std::vector<UINT32> &clause : clauses)
+        {
+            appendUInt16(body, (UINT16)clause[0]);
+            appendUInt16(body, (UINT16)clause[1]);
+            body.push_back((BYTE)clause[2]);
+            appendUInt16(body, (UINT16)clause[3]);
+            body.push_back((BYTE)clause[4]);
+            appendUInt32(body, clause[5]);
+        }
+    }
+
+    return body;
+}
+
+static UINT32 readUInt32(LPCBYTE p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+// static void M(int x) { if (x != 0) { ... } try { } catch (object) { } }
+static void testTypedProbeShiftsBranchesAndClauses()
+{
+    MockMetaData metaData;
+    MockMethodMalloc methodMalloc;
+    MockProfilerInfo profilerInfo(&metaData, &methodMalloc);
+    ModuleContext context;
+    PrepareMockModuleContext(&metaData, &methodMalloc, context);
+
+    std::vector<BYTE> code = {
+        CEE_LDARG_0,                    // 0
+        CEE_BRFALSE_S, 3,               // 1: -> 6
+        CEE_NOP, CEE_NOP, CEE_NOP,      // 3
+        CEE_NOP,                        // 6: try
+        CEE_LEAVE_S, 3,                 // 7: -> 12
+        CEE_POP,                        // 9: catch
+        CEE_LEAVE_S, 0,                 // 10: -> 12
+        CEE_RET,                        // 12
+    };
+
+    std::vector<BYTE> body = makeFatBody(code, 1, mdTokenNil,
+        { { COR_ILEXCEPTION_CLAUSE_NONE, 6, 3, 9, 3, context.m_mdObjectToken } });
+
+    mdMethodDef tkMethod = metaData.AddMethod({ IMAGE_CEE_CS_CALLCONV_DEFAULT, 1, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I4 }, body);
+
+    CHECK(RewriteIL(&profilerInfo, NULL, k_moduleId, tkMethod, context) == S_OK);
+
+    LPCBYTE pNewBody = profilerInfo.GetNewBody(tkMethod);
+    CHECK(pNewBody != NULL);
+    if (pNewBody == NULL)
+    {
+        return;
+    }
+
+    COR_ILMETHOD_DECODER decoder((const COR_ILMETHOD *)pNewBody);
+
+    // ldc.i4 token; ldc.i4 cookie; ldnull; ldarg 0; call Enter<int>(int, int, object, int)
+    // ahead of the original code
+    const unsigned cbProbe = 20;
+    CHECK(decoder.GetCodeSize() == code.size() + cbProbe);
+    CHECK(decoder.Code[0] == CEE_LDC_I4);
+    CHECK(readUInt32(decoder.Code + 1) == tkMethod);
+    CHECK(decoder.Code[5] == CEE_LDC_I4);
+    CHECK((int)readUInt32(decoder.Code + 6) == context.m_moduleCookie);
+    CHECK(decoder.Code[10] == CEE_LDNULL);
+    CHECK(decoder.Code[11] == 0xFE && decoder.Code[12] == 0x09 && decoder.Code[13] == 0 && decoder.Code[14] == 0);
+    CHECK(decoder.Code[15] == CEE_CALL);
+    CHECK(TypeFromToken(readUInt32(decoder.Code + 16)) == mdtMethodSpec);
+    CHECK(metaData.GetDefinedMethodSpecCount() == 1);
+    CHECK(memcmp(decoder.Code + cbProbe, code.data(), code.size()) == 0);
+
+    // The probe needs four slots
+    CHECK(decoder.GetMaxStack() == 4);
+
+    CHECK(decoder.EH != NULL);
+    if (decoder.EH != NULL)
+    {
+        CHECK(decoder.EH->EHCount() == 1);
+
+        COR_ILMETHOD_SECT_EH_CLAUSE_FAT buffer;
+        const COR_ILMETHOD_SECT_EH_CLAUSE_FAT * pClause = decoder.EH->EHClause(0, &buffer);
+        CHECK(pClause->GetTryOffset() == 6 + cbProbe);
+        CHECK(pClause->GetTryLength() == 3);
+        CHECK(pClause->GetHandlerOffset() == 9 + cbProbe);
+        CHECK(pClause->GetHandlerLength() == 3);
+        CHECK(pClause->GetClassToken() == context.m_mdObjectToken);
+    }
+}
+
+// Nine arguments are more than the typed probes take, so they go into an object[] local
+static void testObjectArrayProbeAddsLocal()
+{
+    MockMetaData metaData;
+    MockMethodMalloc methodMalloc;
+    MockProfilerInfo profilerInfo(&metaData, &methodMalloc);
+    ModuleContext context;
+    PrepareMockModuleContext(&metaData, &methodMalloc, context);
+
+    const int argCount = TYPED_PROBE_MAX_ARGS + 1;
+    std::vector<BYTE> sig = { IMAGE_CEE_CS_CALLCONV_DEFAULT, (BYTE)argCount, ELEMENT_TYPE_VOID };
+    sig.insert(sig.end(), argCount, ELEMENT_TYPE_I4);
+
+    std::vector<BYTE> code = { CEE_RET };
+    mdMethodDef tkMethod = metaData.AddMethod(sig, makeFatBody(code, 0, mdTokenNil));
+
+    std::vector<BYTE> reJitBody;
+    CHECK(RewriteIL(&profilerInfo, &reJitBody, k_moduleId, tkMethod, context) == S_OK);
+
+    // A ReJIT body is handed back instead of being set
+    CHECK(profilerInfo.GetNewBody(tkMethod) == NULL);
+    CHECK(reJitBody.empty() == false);
+    if (reJitBody.empty() == true)
+    {
+        return;
+    }
+
+    CHECK(GetMethodBodySize(reJitBody.data(), (ULONG)reJitBody.size()) == reJitBody.size());
+
+    COR_ILMETHOD_DECODER decoder((const COR_ILMETHOD *)reJitBody.data());
+    CHECK(metaData.GetDefinedSignatureCount() == 1);
+    CHECK(decoder.GetLocalVarSigTok() == TokenFromRid(1, mdtSignature));
+    CHECK(decoder.Code[decoder.GetCodeSize() - 1] == CEE_RET);
+
+    // ldnull; ldc.i4 9; newarr object; ...
+    CHECK(decoder.Code[0] == CEE_LDNULL);
+    CHECK(decoder.Code[1] == CEE_LDC_I4);
+    CHECK(readUInt32(decoder.Code + 2) == argCount);
+    CHECK(decoder.Code[6] == CEE_NEWARR);
+    CHECK(readUInt32(decoder.Code + 7) == context.m_mdObjectToken);
+
+    int cBoxes = 0;
+    for (unsigned i = 0; i + 4 < decoder.GetCodeSize(); i++)
+    {
+        if (decoder.Code[i] == CEE_BOX && readUInt32(decoder.Code + i + 1) == context.m_primitives[ELEMENT_TYPE_I4])
+        {
+            cBoxes++;
+        }
+    }
+
+    CHECK(cBoxes == argCount);
+}
+
+// static int M(int x) { if (x == 0) return 1; try { } finally { } return 2; }
+//
+// With exit probes the original code becomes the try block of a fault clause, listed after
+// the method's own clause, and both rets leave for one epilogue that calls the exit probe
+static void testExitProbesProtectBody()
+{
+    MockMetaData metaData;
+    MockMethodMalloc methodMalloc;
+    MockProfilerInfo profilerInfo(&metaData, &methodMalloc);
+    ModuleContext context;
+    PrepareMockModuleContext(&metaData, &methodMalloc, context);
+    context.m_moduleCookie = 7;
+
+    std::vector<BYTE> code = {
+        CEE_LDARG_0,                    // 0
+        CEE_BRTRUE_S, 2,                // 1: -> 5
+        CEE_LDC_I4_1,                   // 3
+        CEE_RET,                        // 4
+        CEE_NOP,                        // 5: try
+        CEE_LEAVE_S, 1,                 // 6: -> 9
+        CEE_ENDFINALLY,                 // 8: finally
+        CEE_LDC_I4_2,                   // 9
+        CEE_RET,                        // 10
+    };
+
+    std::vector<BYTE> body = makeFatBody(code, 1, mdTokenNil,
+        { { COR_ILEXCEPTION_CLAUSE_FINALLY, 5, 3, 8, 1, 0 } });
+
+    mdMethodDef tkMethod = metaData.AddMethod({ IMAGE_CEE_CS_CALLCONV_DEFAULT, 1, ELEMENT_TYPE_I4, ELEMENT_TYPE_I4 }, body);
+
+    CHECK(RewriteIL(&profilerInfo, NULL, k_moduleId, tkMethod, context) == S_OK);
+
+    LPCBYTE pNewBody = profilerInfo.GetNewBody(tkMethod);
+    CHECK(pNewBody != NULL);
+    if (pNewBody == NULL)
+    {
+        return;
+    }
+
+    COR_ILMETHOD_DECODER decoder((const COR_ILMETHOD *)pNewBody);
+
+    // The start timestamp and the return value
+    mdSignature tkLocals = decoder.GetLocalVarSigTok();
+    PCCOR_SIGNATURE pLocalsSig = NULL;
+    ULONG cbLocalsSig = 0;
+    CHECK(metaData.GetSigFromToken(tkLocals, &pLocalsSig, &cbLocalsSig) == S_OK);
+    CHECK(cbLocalsSig == 4 && memcmp(pLocalsSig, "\x07\x02\x0a\x08", 4) == 0);
+
+    std::vector<ILDecodedInstr> instrs;
+    CHECK(DecodeIL(decoder.Code, decoder.GetCodeSize(), &instrs) == true);
+    CHECK(decoder.EH != NULL && decoder.EH->EHCount() == 2);
+    if (instrs.empty() == true || decoder.EH == NULL || decoder.EH->EHCount() != 2)
+    {
+        return;
+    }
+
+    auto findInstr = [&instrs](unsigned offset)
+    {
+        for (size_t i = 0; i < instrs.size(); i++)
+        {
+            if (instrs[i].m_offset == offset)
+            {
+                return (int)i;
+            }
+        }
+
+        return -1;
+    };
+
+    COR_ILMETHOD_SECT_EH_CLAUSE_FAT buffer[2];
+    const COR_ILMETHOD_SECT_EH_CLAUSE_FAT * pFinally = decoder.EH->EHClause(0, &buffer[0]);
+    const COR_ILMETHOD_SECT_EH_CLAUSE_FAT * pFault = decoder.EH->EHClause(1, &buffer[1]);
+    CHECK(pFinally->GetFlags() == COR_ILEXCEPTION_CLAUSE_FINALLY);
+    CHECK(pFault->GetFlags() == COR_ILEXCEPTION_CLAUSE_FAULT);
+
+    // The fault's try block starts with the original ldarg.0 and holds the finally clause
+    int iTryBegin = findInstr(pFault->GetTryOffset());
+    int iHandlerBegin = findInstr(pFault->GetHandlerOffset());
+    int iHandlerEnd = findInstr(pFault->GetHandlerOffset() + pFault->GetHandlerLength());
+    CHECK(iTryBegin >= 0 && iHandlerBegin > iTryBegin && iHandlerEnd > iHandlerBegin);
+    if (iTryBegin < 0 || iHandlerBegin <= iTryBegin || iHandlerEnd <= iHandlerBegin)
+    {
+        return;
+    }
+
+    CHECK(instrs[iTryBegin].m_encoding == CEE_LDARG_0);
+    CHECK(pFault->GetTryOffset() + pFault->GetTryLength() == pFault->GetHandlerOffset());
+    CHECK(pFinally->GetTryOffset() > pFault->GetTryOffset());
+    CHECK(pFinally->GetHandlerOffset() + pFinally->GetHandlerLength() <= pFault->GetHandlerOffset());
+
+    // Handler: ldc.i4 token; ldc.i4 cookie; ldloc start; call Exit; endfinally
+    CHECK(iHandlerEnd - iHandlerBegin == 5);
+    CHECK(instrs[iHandlerBegin].m_operand == (INT64)tkMethod);
+    CHECK(instrs[iHandlerBegin + 1].m_operand == 7);
+    CHECK(instrs[iHandlerBegin + 3].m_operand == (INT64)context.m_mdExitProbeRef);
+    CHECK(instrs[iHandlerEnd - 1].m_encoding == CEE_ENDFINALLY);
+
+    // Epilogue: the probe again, then ldloc result; ret, the body's only ret
+    CHECK(instrs.size() - iHandlerEnd == 6);
+    CHECK(instrs[iHandlerEnd + 3].m_operand == (INT64)context.m_mdExitProbeRef);
+    CHECK(instrs[iHandlerEnd + 4].m_encoding == 0xFE0C && instrs[iHandlerEnd + 4].m_operand == 1);
+    CHECK(instrs.back().m_encoding == CEE_RET);
+
+    // Each original ret became stloc result; leave epilogue
+    int cLeaves = 0;
+    for (int i = iTryBegin; i < iHandlerBegin; i++)
+    {
+        CHECK(instrs[i].m_encoding != CEE_RET);
+
+        if (instrs[i].m_encoding == CEE_LEAVE || instrs[i].m_encoding == CEE_LEAVE_S)
+        {
+            if (instrs[i].m_operand == instrs[iHandlerEnd].m_offset)
+            {
+                CHECK(instrs[i - 1].m_encoding == 0xFE0E && instrs[i - 1].m_operand == 1);
+                cLeaves++;
+            }
+        }
+    }
+
+    CHECK(cLeaves == 2);
+}
+
+// Code that runs past the end of the body is refused before anything is set
+static void testMalformedBodyIsRefused()
+{
+    MockMetaData metaData;
+    MockMethodMalloc methodMalloc;
+    MockProfilerInfo profilerInfo(&metaData, &methodMalloc);
+    ModuleContext context;
+    PrepareMockModuleContext(&metaData, &methodMalloc, context);
+
+    std::vector<BYTE> body = makeFatBody({ CEE_NOP, CEE_RET }, 0, mdTokenNil);
+    body[4] = 0x40;     // CodeSize
+
+    mdMethodDef tkMethod = metaData.AddMethod({ IMAGE_CEE_CS_CALLCONV_DEFAULT, 0, ELEMENT_TYPE_VOID }, body);
+
+    CHECK(FAILED(RewriteIL(&profilerInfo, NULL, k_moduleId, tkMethod, context)));
+    CHECK(profilerInfo.GetNewBody(tkMethod) == NULL);
+}
+
+// A tiny header of odd code size has CorILMethod_TinyFormat1 in its low three bits
+static void testTinyBodyOfOddSize()
+{
+    MockMetaData metaData;
+    MockMethodMalloc methodMalloc;
+    MockProfilerInfo profilerInfo(&metaData, &methodMalloc);
+    ModuleContext context;
+    PrepareMockModuleContext(&metaData, &methodMalloc, context);
+
+    std::vector<BYTE> body = { (BYTE)(CorILMethod_TinyFormat | (3 << 2)), CEE_NOP, CEE_NOP, CEE_RET };
+    CHECK(GetMethodBodySize(body.data(), (ULONG)body.size()) == body.size());
+
+    mdMethodDef tkMethod = metaData.AddMethod({ IMAGE_CEE_CS_CALLCONV_DEFAULT, 0, ELEMENT_TYPE_VOID }, body);
+
+    CHECK(RewriteIL(&profilerInfo, NULL, k_moduleId, tkMethod, context) == S_OK);
+    CHECK(profilerInfo.GetNewBody(tkMethod) != NULL);
+}
+
+// The last matching rule wins, by assembly, type with its enclosing types, and method
+static void testFilterRules()
+{
+    MockMetaData metaData;
+    mdTypeDef tkService = metaData.AddTypeDef(false, W("MyApp.Service"));
+    mdTypeDef tkNested = metaData.AddTypeDef(false, W("Nested"), tkService);
+    mdTypeDef tkCache = metaData.AddTypeDef(false, W("MyApp.Internal.Cache"));
+    mdTypeDef tkController = metaData.AddTypeDef(false, W("Shop.HomeController"));
+
+    std::vector<BYTE> sig = { IMAGE_CEE_CS_CALLCONV_DEFAULT, 0, ELEMENT_TYPE_VOID };
+    std::vector<BYTE> body = { (BYTE)(CorILMethod_TinyFormat | (1 << 2)), CEE_RET };
+    mdMethodDef tkRun = metaData.AddMethod(sig, body, tkService, W("Run"));
+    mdMethodDef tkNestedRun = metaData.AddMethod(sig, body, tkNested, W("Run"));
+    mdMethodDef tkCacheGet = metaData.AddMethod(sig, body, tkCache, W("Get"));
+    mdMethodDef tkGetIndex = metaData.AddMethod(sig, body, tkController, W("GetIndex"));
+    mdMethodDef tkPost = metaData.AddMethod(sig, body, tkController, W("Post"));
+    mdMethodDef tkUnlisted = TokenFromRid(100, mdtMethodDef);
+
+    MethodFilter filter(W(" +MyApp ; -MyApp!MyApp.Internal.*;;-MyApp!MyApp.Service+*;+*!*Controller::Get*"));
+    ModuleMethodFilter moduleFilter;
+
+    // Assembly names match case-insensitively
+    CHECK(filter.BuildModuleFilter(W("MYAPP"), &metaData, moduleFilter) == true);
+    CHECK(moduleFilter.IsIncluded(tkRun) == true);
+    CHECK(moduleFilter.IsIncluded(tkNestedRun) == false);
+    CHECK(moduleFilter.IsIncluded(tkCacheGet) == false);
+    CHECK(moduleFilter.IsIncluded(tkGetIndex) == true);
+    CHECK(moduleFilter.IsIncluded(tkPost) == true);
+    CHECK(moduleFilter.IsIncluded(tkUnlisted) == true);
+
+    // With '+' rules, what no rule includes is left out
+    CHECK(filter.BuildModuleFilter(W("Shop"), &metaData, moduleFilter) == true);
+    CHECK(moduleFilter.IsIncluded(tkRun) == false);
+    CHECK(moduleFilter.IsIncluded(tkGetIndex) == true);
+    CHECK(moduleFilter.IsIncluded(tkPost) == false);
+    CHECK(moduleFilter.IsIncluded(tkUnlisted) == false);
+
+    // Without them, what no rule excludes is kept, and whole-assembly rules need no metadata
+    MethodFilter excluding(W("-My?pp*"));
+    CHECK(excluding.BuildModuleFilter(W("MyApp"), nullptr, moduleFilter) == false);
+    CHECK(excluding.BuildModuleFilter(W("MyApp.Tests"), nullptr, moduleFilter) == false);
+    CHECK(excluding.BuildModuleFilter(W("Mypp"), nullptr, moduleFilter) == true);
+    CHECK(moduleFilter.IsIncluded(tkRun) == true);
+
+    MethodFilter empty(W(" ; "));
+    CHECK(empty.BuildModuleFilter(W("MyApp"), nullptr, moduleFilter) == true);
+    CHECK(moduleFilter.IsIncluded(tkCacheGet) == true);
+}
+
+// A name reaches the patterns whose literal prefix it starts with, shortest first
+static void testFilterTrieCandidates()
+{
+    FilterTrie trie;
+    trie.Insert(W("abc*"), 0);
+    trie.Insert(W("ab"), 1);
+    trie.Insert(W("*x"), 2);
+    trie.Insert(W("abd?"), 3);
+
+    std::vector<int> candidates;
+    auto collect = [&](int ruleIndex) { candidates.push_back(ruleIndex); };
+
+    trie.ForEachCandidate(W("abcx"), collect);
+    CHECK(candidates == std::vector<int>({ 2, 1, 0 }));
+
+    candidates.clear();
+    trie.ForEachCandidate(W("abdx"), collect);
+    CHECK(candidates == std::vector<int>({ 2, 1, 3 }));
+
+    candidates.clear();
+    trie.ForEachCandidate(W("x"), collect);
+    CHECK(candidates == std::vector<int>({ 2 }));
+}
+
+// Pushes report the fill level until the ring is full, and the indexes wrap around
+static void testTraceRingFillsAndWraps()
+{
+    std::unique_ptr<TraceRing> pRing(new TraceRing());
+    std::vector<TraceEvent> buffer(TRACE_RING_CAPACITY);
+    TraceEvent event = {};
+
+    bool fOneAtATime = true;
+    for (DWORD i = 0; i < 100; i++)
+    {
+        event.m_tkMethod = i;
+        fOneAtATime &= pRing->TryPush(event) == 1;
+        fOneAtATime &= pRing->Drain(buffer.data(), TRACE_RING_CAPACITY) == 1;
+    }
+    CHECK(fOneAtATime == true);
+
+    bool fFillLevels = true;
+    for (DWORD i = 0; i < TRACE_RING_CAPACITY; i++)
+    {
+        event.m_tkMethod = i;
+        fFillLevels &= pRing->TryPush(event) == i + 1;
+    }
+    CHECK(fFillLevels == true);
+
+    CHECK(pRing->TryPush(event) == 0);
+
+    CHECK(pRing->Drain(buffer.data(), 10) == 10);
+    CHECK(buffer[0].m_tkMethod == 0 && buffer[9].m_tkMethod == 9);
+
+    event.m_tkMethod = TRACE_RING_CAPACITY;
+    CHECK(pRing->TryPush(event) == TRACE_RING_CAPACITY - 9);
+
+    // Abandoned, the ring goes to another thread only once empty
+    pRing->Abandon();
+    CHECK(pRing->TryAdopt() == false);
+
+    CHECK(pRing->Drain(buffer.data(), TRACE_RING_CAPACITY) == TRACE_RING_CAPACITY - 9);
+    bool fInOrder = true;
+    for (DWORD i = 0; i < TRACE_RING_CAPACITY - 9; i++)
+    {
+        fInOrder &= buffer[i].m_tkMethod == i + 10;
+    }
+    CHECK(fInOrder == true);
+
+    CHECK(pRing->Drain(buffer.data(), TRACE_RING_CAPACITY) == 0);
+    CHECK(pRing->TryAdopt() == true);
+    CHECK(pRing->TryAdopt() == false);
+}
+
+static void testTraceVarints()
+{
+    const uint64_t values[] = { 0, 1, 0x7f, 0x80, 0x3fff, 0x4000, 0xffffffff, UINT64_MAX };
+    const int64_t signedValues[] = { 0, 1, -1, 63, -64, 64, INT32_MIN, INT64_MAX, INT64_MIN };
+
+    std::vector<uint8_t> buffer;
+    for (uint64_t value : values)
+    {
+        TracePutVarint(buffer, value);
+    }
+
+    for (int64_t value : signedValues)
+    {
+        TracePutSignedVarint(buffer, value);
+    }
+
+    // One byte per 7 bits
+    CHECK(buffer.size() == 1 + 1 + 1 + 2 + 2 + 3 + 5 + 10 + 1 + 1 + 1 + 1 + 1 + 2 + 5 + 10 + 10);
+
+    const uint8_t * pCur = buffer.data();
+    const uint8_t * pEnd = pCur + buffer.size();
+
+    for (uint64_t expected : values)
+    {
+        uint64_t value = 0;
+        CHECK(TraceGetVarint(pCur, pEnd, value) == true && value == expected);
+    }
+
+    for (int64_t expected : signedValues)
+    {
+        int64_t value = 0;
+        CHECK(TraceGetSignedVarint(pCur, pEnd, value) == true && value == expected);
+    }
+
+    uint64_t value = 0;
+    CHECK(pCur == pEnd && TraceGetVarint(pCur, pEnd, value) == false);
+
+    // Cut short, and longer than 64 bits
+    const uint8_t truncated[] = { 0x80, 0x80 };
+    pCur = truncated;
+    CHECK(TraceGetVarint(pCur, truncated + sizeof(truncated), value) == false);
+
+    const uint8_t overlong[] = { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01 };
+    pCur = overlong;
+    CHECK(TraceGetVarint(pCur, overlong + sizeof(overlong), value) == false);
+}
+
+static bool compressRoundTrips(const std::vector<uint8_t> &raw)
+{
+    std::vector<uint8_t> compressed;
+    TraceCompress(raw.data(), raw.size(), compressed);
+
+    std::vector<uint8_t> decompressed(raw.size() + 1);
+    if (TraceDecompress(compressed.data(), compressed.size(), decompressed.data(), raw.size()) == false ||
+        memcmp(decompressed.data(), raw.data(), raw.size()) != 0)
+    {
+        return false;
+    }
+
+    // Any other size is refused
+    return TraceDecompress(compressed.data(), compressed.size(), decompressed.data(), raw.size() + 1) == false &&
+        (raw.empty() == true ||
+            TraceDecompress(compressed.data(), compressed.size(), decompressed.data(), raw.size() - 1) == false);
+}
+
+static void testTraceCompression()
+{
+    CHECK(compressRoundTrips({}));
+    CHECK(compressRoundTrips({ 1, 2, 3 }));
+
+    // Long runs, overlapping matches, and lengths past the 15 of the token
+    std::vector<uint8_t> runs(1000, 7);
+    runs.insert(runs.end(), 300, 9);
+    CHECK(compressRoundTrips(runs));
+
+    std::vector<uint8_t> mixed;
+    uint32_t seed = 1;
+    for (int i = 0; i < 100000; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        mixed.push_back(i % 3000 < 1500 ? (uint8_t)(seed >> 16) : (uint8_t)(i % 17));
+    }
+    CHECK(compressRoundTrips(mixed));
+
+    std::vector<uint8_t> compressed;
+    TraceCompress(runs.data(), runs.size(), compressed);
+    CHECK(compressed.size() < runs.size() / 50);
+
+    // A match reaching back before the start of the output
+    std::vector<uint8_t> out(64);
+    const uint8_t badOffset[] = { 0x10, 'a', 0x05, 0x00 };
+    CHECK(TraceDecompress(badOffset, sizeof(badOffset), out.data(), 5) == false);
+}
+
+// Events recorded through EventTrace decode from the file as they were recorded
+static void testTraceFileRoundTrip()
+{
+    std::string path = (std::filesystem::temp_directory_path() /
+        ("CoreProfilerTests." + std::to_string(getCurrentProcessId()) + ".trace")).string();
+    setenv(toUtf8(ENV_TRACE_FILE).c_str(), path.c_str(), 1);
+
+    // Unregistered cookies, so no names are written
+    const int cEvents = 3 * TRACE_RING_CAPACITY;
+    auto expectedToken = [](int i) { return (mdMethodDef)TokenFromRid(i % 300 + 1, mdtMethodDef); };
+    auto expectedCookie = [](int i) { return i % 7 == 0 ? -1 : 1000 + i % 3; };
+    auto expectedFlags = [](int i) { return (DWORD)(i % 2 == 0 ? TRACE_EVENT_ENTER : TRACE_EVENT_EXIT); };
+
+    DWORD threadId = 0;
+    UINT64 cDropped = 0;
+    {
+        EventTrace trace;
+        trace.Start();
+
+        // Its own thread, whose ring is abandoned when it ends, before the trace goes
+        std::thread thread([&]()
+        {
+            threadId = getCurrentThreadId();
+            for (int i = 0; i < cEvents; i++)
+            {
+                trace.Record(expectedToken(i), expectedCookie(i), expectedFlags(i));
+
+                // Leaves the drainer time to keep up
+                if (i % 1024 == 1023)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                }
+            }
+        });
+        thread.join();
+
+        trace.Stop();
+        cDropped = trace.GetDroppedCount();
+    }
+
+    unsetenv(toUtf8(ENV_TRACE_FILE).c_str());
+    CHECK(cDropped == 0);
+
+    std::ifstream file(path, std::ios::binary);
+    std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    file.close();
+    std::filesystem::remove(path);
+
+    TraceFileHeader header = {};
+    CHECK(bytes.size() >= sizeof(header));
+    if (bytes.size() < sizeof(header))
+    {
+        return;
+    }
+
+    memcpy(&header, bytes.data(), sizeof(header));
+    CHECK(header.m_magic == TRACE_FILE_MAGIC);
+    CHECK(header.m_version == TRACE_FILE_VERSION);
+    CHECK(header.m_timestampFrequency != 0);
+
+    int cDecoded = 0;
+    int cWrong = 0;
+    int cChunks = 0;
+    int64_t lastTimestamp = 0;
+
+    size_t offset = sizeof(header);
+    while (offset + sizeof(TraceChunkHeader) <= bytes.size())
+    {
+        TraceChunkHeader chunk = {};
+        memcpy(&chunk, bytes.data() + offset, sizeof(chunk));
+        offset += sizeof(chunk);
+
+        CHECK(chunk.m_kind == TRACE_CHUNK_EVENTS);
+        CHECK(chunk.m_cbRaw <= TRACE_CHUNK_MAX_RAW_SIZE);
+        if (chunk.m_cbStored > bytes.size() - offset || chunk.m_cbRaw > TRACE_CHUNK_MAX_RAW_SIZE)
+        {
+            break;
+        }
+
+        std::vector<uint8_t> raw(bytes.data() + offset, bytes.data() + offset + chunk.m_cbStored);
+        if ((chunk.m_flags & TRACE_CHUNK_COMPRESSED) != 0)
+        {
+            raw.assign(chunk.m_cbRaw, 0);
+            CHECK(TraceDecompress(bytes.data() + offset, chunk.m_cbStored, raw.data(), raw.size()) == true);
+        }
+        offset += chunk.m_cbStored;
+        cChunks++;
+
+        // Every chunk starts from zero
+        const uint8_t * pCur = raw.data();
+        const uint8_t * pEnd = pCur + raw.size();
+        int64_t fields[4] = {};
+
+        for (uint32_t record = 0; record < chunk.m_cRecords && pCur < pEnd; record++)
+        {
+            DWORD flags = *pCur++;
+            for (int64_t &field : fields)
+            {
+                int64_t delta = 0;
+                if (TraceGetSignedVarint(pCur, pEnd, delta) == false)
+                {
+                    cWrong++;
+                }
+                field += delta;
+            }
+
+            if (flags != expectedFlags(cDecoded) || fields[0] != (int64_t)threadId ||
+                fields[1] != expectedCookie(cDecoded) || fields[2] != (int64_t)expectedToken(cDecoded) ||
+                fields[3] < lastTimestamp)
+            {
+                cWrong++;
+            }
+
+            lastTimestamp = fields[3];
+            cDecoded++;
+        }
+
+        CHECK(pCur == pEnd);
+    }
+
+    CHECK(offset == bytes.size());
+    CHECK(cChunks > 0);
+    CHECK(cDecoded == cEvents);
+    CHECK(cWrong == 0);
+}
+
+int main()
+{
+    testTypedProbeShiftsBranchesAndClauses();
+    testObjectArrayProbeAddsLocal();
+    testExitProbesProtectBody();
+    testMalformedBodyIsRefused();
+    testTinyBodyOfOddSize();
+    testFilterRules();
+    testFilterTrieCandidates();
+    testTraceRingFillsAndWraps();
+    testTraceVarints();
+    testTraceCompression();
+    testTraceFileRoundTrip();
+
+    if (g_cFailures != 0)
+    {
+        fprintf(stderr, "%d check(s) failed\n", g_cFailures);
+    }
+
+    return g_cFailures;
+}
@@ -0,0 +1,225 @@
+#include "stdafx.h"
+#include "ILDecoder.h"
+
+struct ILOpcodeInfo
+{
+    bool m_fValid;
+    ILOperandKind m_operandKind;
+    unsigned m_cbOperand;
+};
+
+struct ILOpcodeDef
+{
+    unsigned m_length;
+    unsigned m_byte1;
+    unsigned m_byte2;
+    bool m_fInternal;
+    ILOperandKind m_operandKind;
+    unsigned m_cbOperand;
+};
+
+static const ILOpcodeDef s_opcodeDefs[] =
+{
+#define InlineNone           OperandNone, 0
+#define ShortInlineVar       OperandVar, 1
+#define InlineVar            OperandVar, 2
+#define ShortInlineI         OperandInt, 1
+#define InlineI              OperandInt, 4
+#define InlineI8             OperandInt, 8
+#define ShortInlineR         OperandReal, 4
+#define InlineR              OperandReal, 8
+#define ShortInlineBrTarget  OperandBranch, 1
+#define InlineBrTarget       OperandBranch, 4
+#define InlineMethod         OperandToken, 4
+#define InlineField          OperandToken, 4
+#define InlineType           OperandToken, 4
+#define InlineString         OperandToken, 4
+#define InlineSig            OperandToken, 4
+#define InlineRVA            OperandToken, 4
+#define InlineTok            OperandToken, 4
+#define InlineSwitch         OperandSwitch, 4
+#define IPrimitive           false
+#define IMacro               false
+#define IObjModel            false
+#define IPrefix              false
+#define IInternal            true
+
+#define OPDEF(c,s,pop,push,args,type,l,s1,s2,flow) { l, s1, s2, type, args },
+#include "opcode.def"
+#undef OPDEF
+
+#undef InlineNone
+#undef ShortInlineVar
+#undef InlineVar
+#undef ShortInlineI
+#undef InlineI
+#undef InlineI8
+#undef ShortInlineR
+#undef InlineR
+#undef ShortInlineBrTarget
+#undef InlineBrTarget
+#undef InlineMethod
+#undef InlineField
+#undef InlineType
+#undef InlineString
+#undef InlineSig
+#undef InlineRVA
+#undef InlineTok
+#undef InlineSwitch
+#undef IPrimitive
+#undef IMacro
+#undef IObjModel
+#undef IPrefix
+#undef IInternal
+};
+
+// Indexed by the last byte of the encoding: [0] one-byte opcodes, [1] those after 0xFE
+class ILOpcodeTable
+{
+public:
+    ILOpcodeTable()
+    {
+        for (const ILOpcodeDef &def : s_opcodeDefs)
+        {
+            if (def.m_fInternal == true || (def.m_length == 1 && def.m_byte1 != 0xFF) ||
+                (def.m_length == 2 && def.m_byte1 != 0xFE) || def.m_length == 0 || def.m_length > 2)
+            {
+                continue;
+            }
+
+            ILOpcodeInfo &info = m_infos[def.m_length - 1][def.m_byte2];
+            info.m_fValid = true;
+            info.m_operandKind = def.m_operandKind;
+            info.m_cbOperand = def.m_cbOperand;
+        }
+    }
+
+    const ILOpcodeInfo &Get(bool fTwoByte, BYTE b)
+    {
+        return m_infos[fTwoByte ? 1 : 0][b];
+    }
+
+private:
+    ILOpcodeInfo m_infos[2][256] = {};
+};
+
+static ILOpcodeTable s_opcodeTable;
+
+static INT64 readOperand(LPCBYTE p, unsigned cb)
+{
+    switch (cb)
+    {
+    case 1:
+        return (INT8)p[0];
+    case 2:
+        return (INT16)(p[0] | (p[1] << 8));
+    case 4:
+        return (INT32)(p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32)p[3] << 24));
+    default:
+        return (INT64)((UINT64)(UINT32)readOperand(p, 4) | ((UINT64)(UINT32)readOperand(p + 4, 4) << 32));
+    }
+}
+
+bool GetILOperand(unsigned encoding, ILOperandKind * pOperandKind, unsigned * pcbOperand)
+{
+    bool fTwoByte = (encoding & 0xFF00) == 0xFE00;
+    if (encoding > 0xFF && fTwoByte == false)
+    {
+        return false;
+    }
+
+    const ILOpcodeInfo &info = s_opcodeTable.Get(fTwoByte, (BYTE)encoding);
+    if (info.m_fValid == false)
+    {
+        return false;
+    }
+
+    *pOperandKind = info.m_operandKind;
+    *pcbOperand = info.m_cbOperand;
+    return true;
+}
+
+unsigned GetShortBranchEncoding(unsigned encoding)
+{
+    // br ... blt.un pair with br.s ... blt.un.s, and leave with leave.s
+    if (encoding >= 0x38 && encoding <= 0x44)
+    {
+        return encoding - 0x38 + 0x2B;
+    }
+
+    if (encoding == 0xDD)
+    {
+        return 0xDE;
+    }
+
+    return encoding;
+}
+
+bool DecodeIL(LPCBYTE pCode, unsigned cbCode, std::vector<ILDecodedInstr> * pInstrs)
+{
+    pInstrs->clear();
+
+    unsigned offset = 0;
+    while (offset < cbCode)
+    {
+        ILDecodedInstr instr = {};
+        instr.m_offset = offset;
+
+        bool fTwoByte = pCode[offset] == 0xFE;
+        if (fTwoByte == true)
+        {
+            if (++offset >= cbCode)
+            {
+                return false;
+            }
+        }
+
+        const ILOpcodeInfo &info = s_opcodeTable.Get(fTwoByte, pCode[offset]);
+        if (info.m_fValid == false)
+        {
+            return false;
+        }
+
+        instr.m_encoding = fTwoByte ? (0xFE00 | pCode[offset]) : pCode[offset];
+        instr.m_operandKind = info.m_operandKind;
+        instr.m_cbOperand = info.m_cbOperand;
+        offset++;
+
+        if ((UINT64)offset + info.m_cbOperand > cbCode)
+        {
+            return false;
+        }
+
+        if (info.m_cbOperand != 0)
+        {
+            instr.m_operand = readOperand(pCode + offset, info.m_cbOperand);
+        }
+        offset += info.m_cbOperand;
+
+        if (info.m_operandKind == OperandSwitch)
+        {
+            UINT32 cTargets = (UINT32)instr.m_operand;
+            if ((UINT64)offset + (UINT64)cTargets * 4 > cbCode)
+            {
+                return false;
+            }
+
+            unsigned next = offset + cTargets * 4;
+            for (UINT32 i = 0; i < cTargets; i++)
+            {
+                instr.m_switchTargets.push_back((unsigned)(next + (INT32)readOperand(pCode + offset + i * 4, 4)));
+            }
+
+            offset = next;
+        }
+        else if (info.m_operandKind == OperandBranch)
+        {
+            instr.m_operand = (INT64)offset + instr.m_operand;
+        }
+
+        instr.m_cbInstr = offset - instr.m_offset;
+        pInstrs->push_back(std::move(instr));
+    }
+
+    return true;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "stdafx.h"
+
+// Decodes IL code on its own, independently of ILRewriter, for the tools that check or
+// measure what the rewriter does.
+
+enum ILOperandKind
+{
+    OperandNone,
+    OperandVar,         // ldarg, stloc, ...; 1 or 2 bytes
+    OperandInt,         // 1, 4 or 8 bytes
+    OperandReal,        // 4 or 8 bytes
+    OperandBranch,      // 1 or 4 bytes of displacement
+    OperandToken,
+    OperandSwitch,
+};
+
+struct ILDecodedInstr
+{
+    unsigned m_offset;
+    unsigned m_cbInstr;
+
+    // The encoding: 0xFExx for two-byte opcodes
+    unsigned m_encoding;
+
+    ILOperandKind m_operandKind;
+    unsigned m_cbOperand;
+
+    // The operand; for a branch its target offset
+    INT64 m_operand;
+
+    // Target offsets of a switch
+    std::vector<unsigned> m_switchTargets;
+};
+
+// Decodes cbCode bytes of code into pInstrs. Returns false for an unknown opcode or an
+// operand that runs past the end of the code; branch targets aren't checked.
+bool DecodeIL(LPCBYTE pCode, unsigned cbCode, std::vector<ILDecodedInstr> * pInstrs);
+
+// The operand of the opcode with this encoding; false if there is no such opcode
+bool GetILOperand(unsigned encoding, ILOperandKind * pOperandKind, unsigned * pcbOperand);
+
+// The short form of a branch, or the encoding itself if it has none
+unsigned GetShortBranchEncoding(unsigned encoding);
@@ -0,0 +1,211 @@
+#include "stdafx.h"
+#include "ProfilerData.h"
+
+#include <random>
+
+// Lookups of ConcurrentIDToInfoMap under contention: --threads readers, 1, 2, 4, ... of them,
+// each look up --lookups IDs of the map under a ReadHolder, first alone, then while a writer
+// keeps replacing, erasing and adding entries as module loads and unloads do.  Every info found
+// must carry the ID it was found by, and once the writer stops, every info it retired must be
+// freed.  Build with COREPROFILER_TSAN for ThreadSanitizer to check the reclamation.
+//
+//     MapContention [--threads N] [--lookups N]
+
+#define MAP_ID_COUNT 256
+
+struct CountedInfo
+{
+    CountedInfo(UINT_PTR id) :
+        m_id(id)
+    {
+        s_cLive.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    ~CountedInfo()
+    {
+        m_id = 0;
+        s_cLive.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    UINT_PTR m_id;
+
+    static std::atomic<long> s_cLive;
+};
+
+std::atomic<long> CountedInfo::s_cLive { 0 };
+
+typedef ConcurrentIDToInfoMap<UINT_PTR, CountedInfo> CountedMap;
+
+// IDs are aligned like the ModuleIDs of the runtime
+static UINT_PTR makeID(size_t i)
+{
+    return (i + 1) * 0x40;
+}
+
+static void readerThread(CountedMap * pMap, int cLookups, unsigned seed, std::atomic<long> * pcFound,
+    std::atomic<long> * pcWrong)
+{
+    std::minstd_rand random(seed);
+    long cFound = 0;
+    long cWrong = 0;
+
+    for (int i = 0; i < cLookups; i++)
+    {
+        // One holder per lookup, as a JIT event takes
+        UINT_PTR id = makeID(random() % MAP_ID_COUNT);
+
+        CountedMap::ReadHolder readHolder(pMap);
+        CountedInfo * pInfo = pMap->Find(id);
+        if (pInfo != nullptr)
+        {
+            cFound++;
+            if (pInfo->m_id != id)
+            {
+                cWrong++;
+            }
+        }
+    }
+
+    pcFound->fetch_add(cFound, std::memory_order_relaxed);
+    pcWrong->fetch_add(cWrong, std::memory_order_relaxed);
+}
+
+// Replaces, erases and adds back entries until told to stop; returns the number of writes
+static long writerThread(CountedMap * pMap, std::atomic<bool> * pfStop)
+{
+    std::minstd_rand random(0);
+    long cWrites = 0;
+
+    while (pfStop->load(std::memory_order_relaxed) == false)
+    {
+        UINT_PTR id = makeID(random() % MAP_ID_COUNT);
+        if (random() % 2 == 0)
+        {
+            pMap->EraseIfExists(id);
+        }
+        else
+        {
+            pMap->Adopt(id, new CountedInfo(id));
+        }
+
+        cWrites++;
+    }
+
+    return cWrites;
+}
+
+static int measure(CountedMap * pMap, int cThreads, int cLookups, bool fWriter, double * pOneThread)
+{
+    std::atomic<long> cFound { 0 };
+    std::atomic<long> cWrong { 0 };
+    std::atomic<bool> fStop { false };
+    long cWrites = 0;
+
+    std::thread writer;
+    if (fWriter == true)
+    {
+        writer = std::thread([&]() { cWrites = writerThread(pMap, &fStop); });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < cThreads; i++)
+    {
+        readers.emplace_back(readerThread, pMap, cLookups, (unsigned)i + 1, &cFound, &cWrong);
+    }
+
+    for (std::thread &reader : readers)
+    {
+        reader.join();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    fStop.store(true, std::memory_order_relaxed);
+    if (writer.joinable() == true)
+    {
+        writer.join();
+    }
+
+    double rate = (double)cThreads * cLookups / seconds;
+    if (cThreads == 1)
+    {
+        *pOneThread = rate;
+    }
+
+    printf("%2d readers%s: %12.0f lookups/s  %5.2fx  %5.1f%% per thread  %ld found  %ld writes\n", cThreads,
+        fWriter ? " + writer" : "         ", rate, rate / *pOneThread, rate / *pOneThread / cThreads * 100,
+        cFound.load(), cWrites);
+
+    if (cWrong.load() != 0)
+    {
+        fprintf(stderr, "%ld lookups found the info of another ID\n", cWrong.load());
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char * argv[])
+{
+    int cMaxThreads = max(8, (int)std::thread::hardware_concurrency());
+    int cLookups = 1000000;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            cMaxThreads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--lookups") == 0 && i + 1 < argc)
+        {
+            cLookups = atoi(argv[++i]);
+        }
+        else
+        {
+            cMaxThreads = 0;
+            break;
+        }
+    }
+
+    if (cMaxThreads <= 0 || cLookups <= 0)
+    {
+        fprintf(stderr, "usage: MapContention [--threads N] [--lookups N]\n");
+        return 2;
+    }
+
+    int result = 0;
+    {
+        CountedMap map;
+        for (size_t i = 0; i < MAP_ID_COUNT; i++)
+        {
+            map.Adopt(makeID(i), new CountedInfo(makeID(i)));
+        }
+
+        for (int pass = 0; pass < 2; pass++)
+        {
+            double oneThread = 0;
+            for (int cThreads = 1; cThreads <= cMaxThreads; cThreads *= 2)
+            {
+                result |= measure(&map, cThreads, cLookups, pass == 1, &oneThread);
+            }
+        }
+
+        // With no reader left, the next write frees everything retired
+        map.EraseIfExists(makeID(0));
+        if (CountedInfo::s_cLive.load() != (long)map.GetCount())
+        {
+            fprintf(stderr, "%ld infos live for %zu entries\n", CountedInfo::s_cLive.load(), map.GetCount());
+            result = 1;
+        }
+    }
+
+    if (CountedInfo::s_cLive.load() != 0)
+    {
+        fprintf(stderr, "%ld infos leaked\n", CountedInfo::s_cLive.load());
+        result = 1;
+    }
+
+    return result;
+}
@@ -0,0 +1,636 @@
+#include "stdafx.h"
+#include "ProfilerData.h"
+#include "ILRewriter.h"
+#include "Misc.h"
+#include "MetadataReader.h"
+
+// ECMA-335 II.22, enough of it to find every table's rows
+
+enum ColumnType
+{
+    ColU16 = 0x1000,
+    ColU32,
+    ColString,
+    ColGuid,
+    ColBlob,
+};
+
+// Other columns are an index into the table of that number, or a coded index
+#define COL_CODED(kind) (0x100 + (kind))
+
+enum CodedKind
+{
+    CodedTypeDefOrRef,
+    CodedHasConstant,
+    CodedHasCustomAttribute,
+    CodedHasFieldMarshal,
+    CodedHasDeclSecurity,
+    CodedMemberRefParent,
+    CodedHasSemantics,
+    CodedMethodDefOrRef,
+    CodedMemberForwarded,
+    CodedImplementation,
+    CodedCustomAttributeType,
+    CodedResolutionScope,
+    CodedTypeOrMethodDef,
+    CodedKindCount,
+};
+
+struct CodedIndexSchema
+{
+    unsigned m_cTagBits;
+    int m_cTables;
+    int m_tables[22];       // -1 for tags that are not used
+};
+
+static const CodedIndexSchema s_codedIndexes[CodedKindCount] =
+{
+    { 2, 3, { 0x02, 0x01, 0x1B } },
+    { 2, 3, { 0x04, 0x08, 0x17 } },
+    { 5, 22, { 0x06, 0x04, 0x01, 0x02, 0x08, 0x09, 0x0A, 0x00, 0x0E, 0x17, 0x14, 0x11, 0x1A, 0x1B, 0x20, 0x23,
+        0x26, 0x27, 0x28, 0x2A, 0x2C, 0x2B } },
+    { 1, 2, { 0x04, 0x08 } },
+    { 2, 3, { 0x02, 0x06, 0x20 } },
+    { 3, 5, { 0x02, 0x01, 0x1A, 0x06, 0x1B } },
+    { 1, 2, { 0x14, 0x17 } },
+    { 1, 2, { 0x06, 0x0A } },
+    { 1, 2, { 0x04, 0x06 } },
+    { 2, 3, { 0x26, 0x23, 0x27 } },
+    { 3, 5, { -1, -1, 0x06, 0x0A, -1 } },
+    { 2, 4, { 0x00, 0x1A, 0x23, 0x01 } },
+    { 1, 2, { 0x02, 0x06 } },
+};
+
+struct TableSchema
+{
+    int m_cColumns;
+    int m_columns[9];
+};
+
+static const TableSchema s_tables[] =
+{
+    { 5, { ColU16, ColString, ColGuid, ColGuid, ColGuid } },                                        // Module
+    { 3, { COL_CODED(CodedResolutionScope), ColString, ColString } },                               // TypeRef
+    { 6, { ColU32, ColString, ColString, COL_CODED(CodedTypeDefOrRef), 0x04, 0x06 } },              // TypeDef
+    { 1, { 0x04 } },                                                                                // FieldPtr
+    { 3, { ColU16, ColString, ColBlob } },                                                          // Field
+    { 1, { 0x06 } },                                                                                // MethodPtr
+    { 6, { ColU32, ColU16, ColU16, ColString, ColBlob, 0x08 } },                                    // MethodDef
+    { 1, { 0x08 } },                                                                                // ParamPtr
+    { 3, { ColU16, ColU16, ColString } },                                                           // Param
+    { 2, { 0x02, COL_CODED(CodedTypeDefOrRef) } },                                                  // InterfaceImpl
+    { 3, { COL_CODED(CodedMemberRefParent), ColString, ColBlob } },                                 // MemberRef
+    { 3, { ColU16, COL_CODED(CodedHasConstant), ColBlob } },                                        // Constant
+    { 3, { COL_CODED(CodedHasCustomAttribute), COL_CODED(CodedCustomAttributeType), ColBlob } },    // CustomAttribute
+    { 2, { COL_CODED(CodedHasFieldMarshal), ColBlob } },                                            // FieldMarshal
+    { 3, { ColU16, COL_CODED(CodedHasDeclSecurity), ColBlob } },                                    // DeclSecurity
+    { 3, { ColU16, ColU32, 0x02 } },                                                                // ClassLayout
+    { 2, { ColU32, 0x04 } },                                                                        // FieldLayout
+    { 1, { ColBlob } },                                                                             // StandAloneSig
+    { 2, { 0x02, 0x14 } },                                                                          // EventMap
+    { 1, { 0x14 } },                                                                                // EventPtr
+    { 3, { ColU16, ColString, COL_CODED(CodedTypeDefOrRef) } },                                     // Event
+    { 2, { 0x02, 0x17 } },                                                                          // PropertyMap
+    { 1, { 0x17 } },                                                                                // PropertyPtr
+    { 3, { ColU16, ColString, ColBlob } },                                                          // Property
+    { 3, { ColU16, 0x06, COL_CODED(CodedHasSemantics) } },                                          // MethodSemantics
+    { 3, { 0x02, COL_CODED(CodedMethodDefOrRef), COL_CODED(CodedMethodDefOrRef) } },                // MethodImpl
+    { 1, { ColString } },                                                                           // ModuleRef
+    { 1, { ColBlob } },                                                                             // TypeSpec
+    { 4, { ColU16, COL_CODED(CodedMemberForwarded), ColString, 0x1A } },                            // ImplMap
+    { 2, { ColU32, 0x04 } },                                                                        // FieldRVA
+    { 2, { ColU32, ColU32 } },                                                                      // EncLog
+    { 1, { ColU32 } },                                                                              // EncMap
+    { 9, { ColU32, ColU16, ColU16, ColU16, ColU16, ColU32, ColBlob, ColString, ColString } },       // Assembly
+    { 1, { ColU32 } },                                                                              // AssemblyProcessor
+    { 3, { ColU32, ColU32, ColU32 } },                                                              // AssemblyOS
+    { 9, { ColU16, ColU16, ColU16, ColU16, ColU32, ColBlob, ColString, ColString, ColBlob } },       // AssemblyRef
+    { 2, { ColU32, 0x23 } },                                                                        // AssemblyRefProcessor
+    { 4, { ColU32, ColU32, ColU32, 0x23 } },                                                        // AssemblyRefOS
+    { 3, { ColU32, ColString, ColBlob } },                                                          // File
+    { 5, { ColU32, ColU32, ColString, ColString, COL_CODED(CodedImplementation) } },                // ExportedType
+    { 4, { ColU32, ColU32, ColString, COL_CODED(CodedImplementation) } },                           // ManifestResource
+    { 2, { 0x02, 0x02 } },                                                                          // NestedClass
+    { 4, { ColU16, ColU16, COL_CODED(CodedTypeOrMethodDef), ColString } },                          // GenericParam
+    { 2, { COL_CODED(CodedMethodDefOrRef), ColBlob } },                                             // MethodSpec
+    { 2, { 0x2A, COL_CODED(CodedTypeDefOrRef) } },                                                  // GenericParamConstraint
+};
+
+static_assert(sizeof(s_tables) / sizeof(s_tables[0]) == 0x2D, "a schema for every table");
+
+enum
+{
+    TableTypeRef = 0x01,
+    TableTypeDef = 0x02,
+    TableMethodDef = 0x06,
+    TableMemberRef = 0x0A,
+    TableCustomAttribute = 0x0C,
+    TableStandAloneSig = 0x11,
+    TableTypeSpec = 0x1B,
+    TableAssemblyRef = 0x23,
+    TableMethodSpec = 0x2B,
+};
+
+bool MetadataReader::fail(const char * szError)
+{
+    m_error = szError;
+    return false;
+}
+
+bool MetadataReader::Load(const char * szPath)
+{
+    std::ifstream file(szPath, std::ios::binary);
+    if (file.is_open() == false)
+    {
+        return fail("cannot open the file");
+    }
+
+    m_file.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return readPE();
+}
+
+UINT32 MetadataReader::readUInt(LPCBYTE p, unsigned cb)
+{
+    UINT32 value = 0;
+    for (unsigned i = 0; i < cb; i++)
+    {
+        value |= (UINT32)p[i] << (i * 8);
+    }
+
+    return value;
+}
+
+LPCBYTE MetadataReader::getRva(UINT32 rva, UINT32 * pcbAvailable)
+{
+    for (const Section &section : m_sections)
+    {
+        if (rva >= section.m_virtualAddress && rva - section.m_virtualAddress < section.m_rawSize)
+        {
+            UINT64 offset = (UINT64)section.m_rawOffset + (rva - section.m_virtualAddress);
+            UINT64 end = (UINT64)section.m_rawOffset + section.m_rawSize;
+            if (end > m_file.size() || offset >= end)
+            {
+                return nullptr;
+            }
+
+            *pcbAvailable = (UINT32)(end - offset);
+            return m_file.data() + offset;
+        }
+    }
+
+    return nullptr;
+}
+
+bool MetadataReader::readPE()
+{
+    if (m_file.size() < 0x40 || m_file[0] != 'M' || m_file[1] != 'Z')
+    {
+        return fail("not a PE file");
+    }
+
+    UINT64 peOffset = readUInt(&m_file[0x3C], 4);
+    if (peOffset + 24 > m_file.size() || memcmp(&m_file[peOffset], "PE\0\0", 4) != 0)
+    {
+        return fail("not a PE file");
+    }
+
+    LPCBYTE pCoff = &m_file[peOffset + 4];
+    unsigned cSections = readUInt(pCoff + 2, 2);
+    unsigned cbOptionalHeader = readUInt(pCoff + 16, 2);
+
+    UINT64 optionalOffset = peOffset + 24;
+    UINT64 sectionsOffset = optionalOffset + cbOptionalHeader;
+    if (sectionsOffset + (UINT64)cSections * 40 > m_file.size())
+    {
+        return fail("truncated PE headers");
+    }
+
+    LPCBYTE pOptional = &m_file[optionalOffset];
+    unsigned magic = readUInt(pOptional, 2);
+    unsigned dataDirectoriesOffset = magic == 0x20B ? 112 : 96;
+    unsigned cDataDirectoriesOffset = dataDirectoriesOffset - 4;
+
+    // The CLI header is the 15th data directory
+    const unsigned cliHeaderIndex = 14;
+    if (cbOptionalHeader < dataDirectoriesOffset + (cliHeaderIndex + 1) * 8 ||
+        readUInt(pOptional + cDataDirectoriesOffset, 4) <= cliHeaderIndex)
+    {
+        return fail("no CLI header");
+    }
+
+    UINT32 cliHeaderRva = readUInt(pOptional + dataDirectoriesOffset + cliHeaderIndex * 8, 4);
+
+    for (unsigned i = 0; i < cSections; i++)
+    {
+        LPCBYTE pSection = &m_file[sectionsOffset + i * 40];
+
+        Section section;
+        section.m_virtualSize = readUInt(pSection + 8, 4);
+        section.m_virtualAddress = readUInt(pSection + 12, 4);
+        section.m_rawSize = readUInt(pSection + 16, 4);
+        section.m_rawOffset = readUInt(pSection + 20, 4);
+        m_sections.push_back(section);
+    }
+
+    UINT32 cbAvailable = 0;
+    LPCBYTE pCliHeader = getRva(cliHeaderRva, &cbAvailable);
+    if (pCliHeader == nullptr || cbAvailable < 16)
+    {
+        return fail("no CLI header");
+    }
+
+    return readMetadataRoot(readUInt(pCliHeader + 8, 4), readUInt(pCliHeader + 12, 4));
+}
+
+bool MetadataReader::readMetadataRoot(UINT32 rva, UINT32 cbMetadata)
+{
+    UINT32 cbAvailable = 0;
+    LPCBYTE pRoot = getRva(rva, &cbAvailable);
+    if (pRoot == nullptr || cbAvailable < cbMetadata || cbMetadata < 20 || readUInt(pRoot, 4) != 0x424A5342)
+    {
+        return fail("no metadata");
+    }
+
+    UINT32 cbVersion = readUInt(pRoot + 12, 4);
+    UINT64 offset = 16 + (UINT64)cbVersion + 2;
+    if (offset + 2 > cbMetadata)
+    {
+        return fail("truncated metadata root");
+    }
+
+    unsigned cStreams = readUInt(pRoot + offset, 2);
+    offset += 2;
+
+    LPCBYTE pTables = nullptr;
+    UINT32 cbTables = 0;
+
+    for (unsigned i = 0; i < cStreams; i++)
+    {
+        if (offset + 8 > cbMetadata)
+        {
+            return fail("truncated stream headers");
+        }
+
+        UINT32 streamOffset = readUInt(pRoot + offset, 4);
+        UINT32 cbStream = readUInt(pRoot + offset + 4, 4);
+        offset += 8;
+
+        const char * szName = (const char *)pRoot + offset;
+        size_t cchName = strnlen(szName, (size_t)(cbMetadata - offset));
+        offset += (cchName + 4) & ~(size_t)3;
+
+        if ((UINT64)streamOffset + cbStream > cbMetadata)
+        {
+            return fail("stream out of the metadata");
+        }
+
+        LPCBYTE pStream = pRoot + streamOffset;
+        if (strcmp(szName, "#~") == 0 || strcmp(szName, "#-") == 0)
+        {
+            pTables = pStream;
+            cbTables = cbStream;
+        }
+        else if (strcmp(szName, "#Strings") == 0)
+        {
+            m_pStrings = pStream;
+            m_cbStrings = cbStream;
+        }
+        else if (strcmp(szName, "#Blob") == 0)
+        {
+            m_pBlobs = pStream;
+            m_cbBlobs = cbStream;
+        }
+    }
+
+    if (pTables == nullptr)
+    {
+        return fail("no metadata tables");
+    }
+
+    return readTables(pTables, cbTables);
+}
+
+unsigned MetadataReader::getColumnSize(int column)
+{
+    switch (column)
+    {
+    case ColU16:
+        return 2;
+    case ColU32:
+        return 4;
+    case ColString:
+        return (m_heapSizes & 0x01) ? 4 : 2;
+    case ColGuid:
+        return (m_heapSizes & 0x02) ? 4 : 2;
+    case ColBlob:
+        return (m_heapSizes & 0x04) ? 4 : 2;
+    }
+
+    if (column >= COL_CODED(0))
+    {
+        const CodedIndexSchema &coded = s_codedIndexes[column - COL_CODED(0)];
+
+        UINT32 maxRows = 0;
+        for (int i = 0; i < coded.m_cTables; i++)
+        {
+            if (coded.m_tables[i] >= 0)
+            {
+                maxRows = std::max(maxRows, m_rows[coded.m_tables[i]]);
+            }
+        }
+
+        return maxRows < (1u << (16 - coded.m_cTagBits)) ? 2 : 4;
+    }
+
+    return m_rows[column] < 0x10000 ? 2 : 4;
+}
+
+bool MetadataReader::readTables(LPCBYTE pStream, UINT32 cbStream)
+{
+    if (cbStream < 24)
+    {
+        return fail("truncated table stream");
+    }
+
+    m_heapSizes = pStream[6];
+    UINT64 valid = (UINT64)readUInt(pStream + 8, 4) | ((UINT64)readUInt(pStream + 12, 4) << 32);
+
+    UINT64 offset = 24;
+    for (int table = 0; table < 64; table++)
+    {
+        if ((valid & (1ull << table)) == 0)
+        {
+            continue;
+        }
+
+        if (table >= TableCount)
+        {
+            return fail("unknown metadata table");
+        }
+
+        if (offset + 4 > cbStream)
+        {
+            return fail("truncated table stream");
+        }
+
+        m_rows[table] = readUInt(pStream + offset, 4);
+        offset += 4;
+    }
+
+    // Uncompressed (#-) tables may carry 4 extra bytes
+    if (m_heapSizes & 0x40)
+    {
+        offset += 4;
+    }
+
+    for (int table = 0; table < TableCount; table++)
+    {
+        const TableSchema &schema = s_tables[table];
+
+        unsigned cbRow = 0;
+        for (int i = 0; i < schema.m_cColumns; i++)
+        {
+            cbRow += getColumnSize(schema.m_columns[i]);
+        }
+
+        m_cbRows[table] = cbRow;
+        m_pTables[table] = pStream + offset;
+        offset += (UINT64)cbRow * m_rows[table];
+
+        if (offset > cbStream)
+        {
+            return fail("truncated tables");
+        }
+    }
+
+    return true;
+}
+
+UINT32 MetadataReader::getCell(int table, UINT32 rid, int column)
+{
+    const TableSchema &schema = s_tables[table];
+    LPCBYTE pCell = m_pTables[table] + (UINT64)(rid - 1) * m_cbRows[table];
+
+    for (int i = 0; i < column; i++)
+    {
+        pCell += getColumnSize(schema.m_columns[i]);
+    }
+
+    return readUInt(pCell, getColumnSize(schema.m_columns[column]));
+}
+
+bool MetadataReader::getBlob(UINT32 index, std::vector<BYTE> * pBlob)
+{
+    pBlob->clear();
+    if (index >= m_cbBlobs)
+    {
+        return index == 0;
+    }
+
+    LPCBYTE p = m_pBlobs + index;
+    UINT32 cbAvailable = m_cbBlobs - index;
+
+    UINT32 cbBlob;
+    unsigned cbLength;
+    if ((p[0] & 0x80) == 0)
+    {
+        cbBlob = p[0];
+        cbLength = 1;
+    }
+    else if ((p[0] & 0xC0) == 0x80 && cbAvailable >= 2)
+    {
+        cbBlob = ((p[0] & 0x3F) << 8) | p[1];
+        cbLength = 2;
+    }
+    else if ((p[0] & 0xE0) == 0xC0 && cbAvailable >= 4)
+    {
+        cbBlob = ((p[0] & 0x1F) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        cbLength = 4;
+    }
+    else
+    {
+        return false;
+    }
+
+    if ((UINT64)cbLength + cbBlob > cbAvailable)
+    {
+        return false;
+    }
+
+    pBlob->assign(p + cbLength, p + cbLength + cbBlob);
+    return true;
+}
+
+const char * MetadataReader::getString(UINT32 index)
+{
+    if (index >= m_cbStrings || memchr(m_pStrings + index, 0, m_cbStrings - index) == nullptr)
+    {
+        return "";
+    }
+
+    return (const char *)m_pStrings + index;
+}
+
+mdToken MetadataReader::decodeCodedIndex(int codedKind, UINT32 value)
+{
+    const CodedIndexSchema &coded = s_codedIndexes[codedKind];
+
+    UINT32 tag = value & ((1u << coded.m_cTagBits) - 1);
+    if ((int)tag >= coded.m_cTables || coded.m_tables[tag] < 0)
+    {
+        return mdTokenNil;
+    }
+
+    return TokenFromRid(value >> coded.m_cTagBits, (UINT32)coded.m_tables[tag] << 24);
+}
+
+mdTypeDef MetadataReader::findOwner(mdMethodDef tkMethod)
+{
+    // Type definitions own the methods from their MethodList to the next one's
+    UINT32 rid = RidFromToken(tkMethod);
+    mdTypeDef tkOwner = mdTypeDefNil;
+
+    for (UINT32 typeRid = 1; typeRid <= m_rows[TableTypeDef]; typeRid++)
+    {
+        if (getCell(TableTypeDef, typeRid, 5) > rid)
+        {
+            break;
+        }
+
+        tkOwner = TokenFromRid(typeRid, mdtTypeDef);
+    }
+
+    return tkOwner;
+}
+
+bool MetadataReader::getTypeName(mdToken tkType, std::string * pName)
+{
+    UINT32 rid = RidFromToken(tkType);
+    int table = TypeFromToken(tkType) == mdtTypeRef ? TableTypeRef : TableTypeDef;
+    if ((TypeFromToken(tkType) != mdtTypeRef && TypeFromToken(tkType) != mdtTypeDef) ||
+        rid == 0 || rid > m_rows[table])
+    {
+        return false;
+    }
+
+    // Names without a namespace have no dot, as the runtime's metadata returns them
+    *pName = getString(getCell(table, rid, 2));
+    if (pName->empty() == false)
+    {
+        *pName += ".";
+    }
+
+    *pName += getString(getCell(table, rid, 1));
+    return true;
+}
+
+bool MetadataReader::isByRefLikeAttribute(mdToken tkCtor)
+{
+    UINT32 rid = RidFromToken(tkCtor);
+    mdToken tkType = mdTokenNil;
+
+    if (TypeFromToken(tkCtor) == mdtMemberRef && rid != 0 && rid <= m_rows[TableMemberRef])
+    {
+        tkType = decodeCodedIndex(CodedMemberRefParent, getCell(TableMemberRef, rid, 0));
+    }
+    else if (TypeFromToken(tkCtor) == mdtMethodDef && rid != 0 && rid <= m_rows[TableMethodDef])
+    {
+        tkType = findOwner(tkCtor);
+    }
+
+    std::string name;
+    return getTypeName(tkType, &name) == true && name == "System.Runtime.CompilerServices.IsByRefLikeAttribute";
+}
+
+bool MetadataReader::Fill(MockMetaData * pMetaData)
+{
+    std::vector<BYTE> blob;
+
+    std::vector<bool> byRefLike(m_rows[TableTypeDef] + 1, false);
+    for (UINT32 rid = 1; rid <= m_rows[TableCustomAttribute]; rid++)
+    {
+        mdToken tkParent = decodeCodedIndex(CodedHasCustomAttribute, getCell(TableCustomAttribute, rid, 0));
+        if (TypeFromToken(tkParent) == mdtTypeDef && RidFromToken(tkParent) < byRefLike.size() &&
+            isByRefLikeAttribute(decodeCodedIndex(CodedCustomAttributeType, getCell(TableCustomAttribute, rid, 1))))
+        {
+            byRefLike[RidFromToken(tkParent)] = true;
+        }
+    }
+
+    for (UINT32 rid = 1; rid <= m_rows[TableTypeDef]; rid++)
+    {
+        pMetaData->AddTypeDef(byRefLike[rid]);
+    }
+
+    // Methods without IL keep an empty body
+    UINT32 nextOwnerRid = 1;
+    mdTypeDef tkOwner = mdTypeDefNil;
+    for (UINT32 rid = 1; rid <= m_rows[TableMethodDef]; rid++)
+    {
+        while (nextOwnerRid <= m_rows[TableTypeDef] && getCell(TableTypeDef, nextOwnerRid, 5) <= rid)
+        {
+            tkOwner = TokenFromRid(nextOwnerRid++, mdtTypeDef);
+        }
+
+        if (getBlob(getCell(TableMethodDef, rid, 4), &blob) == false)
+        {
+            return fail("bad method signature");
+        }
+
+        std::vector<BYTE> body;
+        UINT32 rva = getCell(TableMethodDef, rid, 0);
+        UINT32 implFlags = getCell(TableMethodDef, rid, 1);
+        if (rva != 0 && IsMiIL(implFlags))
+        {
+            UINT32 cbAvailable = 0;
+            LPCBYTE pBody = getRva(rva, &cbAvailable);
+            ULONG cbBody = pBody == nullptr ? 0 : GetMethodBodySize(pBody, cbAvailable);
+            if (cbBody != 0)
+            {
+                body.assign(pBody, pBody + cbBody);
+            }
+        }
+
+        pMetaData->AddMethod(blob, body, tkOwner);
+    }
+
+    for (UINT32 rid = 1; rid <= m_rows[TableMemberRef]; rid++)
+    {
+        getBlob(getCell(TableMemberRef, rid, 2), &blob);
+        pMetaData->AddMemberRef(blob);
+    }
+
+    for (UINT32 rid = 1; rid <= m_rows[TableStandAloneSig]; rid++)
+    {
+        getBlob(getCell(TableStandAloneSig, rid, 0), &blob);
+        pMetaData->AddSignature(blob);
+    }
+
+    for (UINT32 rid = 1; rid <= m_rows[TableTypeSpec]; rid++)
+    {
+        getBlob(getCell(TableTypeSpec, rid, 0), &blob);
+        pMetaData->AddTypeSpec(blob);
+    }
+
+    for (UINT32 rid = 1; rid <= m_rows[TableMethodSpec]; rid++)
+    {
+        getBlob(getCell(TableMethodSpec, rid, 1), &blob);
+        pMetaData->AddMethodSpec(decodeCodedIndex(CodedMethodDefOrRef, getCell(TableMethodSpec, rid, 0)), blob);
+    }
+
+    // The mock finds a reference defined already rather than adding it again, as the emitter
+    // does; compilers don't emit duplicates, so the rows keep their order
+    for (UINT32 rid = 1; rid <= m_rows[TableAssemblyRef]; rid++)
+    {
+        pMetaData->AddAssemblyRef(fromUtf8(getString(getCell(TableAssemblyRef, rid, 6))));
+    }
+
+    for (UINT32 rid = 1; rid <= m_rows[TableTypeRef]; rid++)
+    {
+        std::string name;
+        getTypeName(TokenFromRid(rid, mdtTypeRef), &name);
+        pMetaData->AddTypeRef(decodeCodedIndex(CodedResolutionScope, getCell(TableTypeRef, rid, 0)), fromUtf8(name));
+    }
+
+    return true;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "stdafx.h"
+#include "Mocks.h"
+
+// Reads what the rewriter asks the metadata for out of an assembly file: method signatures
+// and IL bodies, member references, stand-alone signatures, type and method specs, type and
+// assembly references, and which type definitions are byref-like.  Rows keep their order, so tokens in the bodies
+// match those of MockMetaData.
+class MetadataReader
+{
+public:
+    bool Load(const char * szPath);
+
+    // Fills an empty MockMetaData
+    bool Fill(MockMetaData * pMetaData);
+
+    const std::string &GetError()
+    {
+        return m_error;
+    }
+
+private:
+    enum
+    {
+        TableCount = 0x2D,
+    };
+
+    struct Section
+    {
+        UINT32 m_virtualAddress;
+        UINT32 m_virtualSize;
+        UINT32 m_rawOffset;
+        UINT32 m_rawSize;
+    };
+
+    bool fail(const char * szError);
+    bool readPE();
+    bool readMetadataRoot(UINT32 rva, UINT32 cbMetadata);
+    bool readTables(LPCBYTE pStream, UINT32 cbStream);
+
+    LPCBYTE getRva(UINT32 rva, UINT32 * pcbAvailable);
+    UINT32 readUInt(LPCBYTE p, unsigned cb);
+
+    unsigned getColumnSize(int column);
+    UINT32 getCell(int table, UINT32 rid, int column);
+    bool getBlob(UINT32 index, std::vector<BYTE> * pBlob);
+    const char * getString(UINT32 index);
+
+    // The table and row a coded index refers to
+    mdToken decodeCodedIndex(int codedKind, UINT32 value);
+
+    mdTypeDef findOwner(mdMethodDef tkMethod);
+    bool isByRefLikeAttribute(mdToken tkCtor);
+    bool getTypeName(mdToken tkType, std::string * pName);
+
+    std::vector<BYTE> m_file;
+    std::vector<Section> m_sections;
+    std::string m_error;
+
+    LPCBYTE m_pStrings = nullptr;
+    UINT32 m_cbStrings = 0;
+    LPCBYTE m_pBlobs = nullptr;
+    UINT32 m_cbBlobs = 0;
+
+    BYTE m_heapSizes = 0;
+    UINT32 m_rows[TableCount] = {};
+    LPCBYTE m_pTables[TableCount] = {};
+    unsigned m_cbRows[TableCount] = {};
+};
@@ -0,0 +1,1089 @@
+#include "stdafx.h"
+#include "Mocks.h"
+
+// Cursor behind an HCORENUM of MockMetaData
+struct MockEnum
+{
+    std::vector<mdToken> m_tokens;
+    size_t m_position = 0;
+};
+
+static HRESULT enumTokens(HCORENUM * phEnum, const std::vector<mdToken> &tokens, mdToken rTokens[], ULONG cMax, ULONG * pcTokens)
+{
+    if (*phEnum == NULL)
+    {
+        MockEnum * pEnum = new MockEnum;
+        pEnum->m_tokens = tokens;
+        *phEnum = (HCORENUM)pEnum;
+    }
+
+    MockEnum * pEnum = (MockEnum *)*phEnum;
+
+    ULONG cTokens = 0;
+    while (cTokens < cMax && pEnum->m_position < pEnum->m_tokens.size())
+    {
+        rTokens[cTokens++] = pEnum->m_tokens[pEnum->m_position++];
+    }
+
+    if (pcTokens != NULL)
+    {
+        *pcTokens = cTokens;
+    }
+
+    return cTokens == 0 ? S_FALSE : S_OK;
+}
+
+static void copyName(LPWSTR szName, ULONG cchName, ULONG * pchName)
+{
+    // Nothing the rewriter does depends on names
+    if (szName != NULL && cchName > 0)
+    {
+        szName[0] = 0;
+    }
+
+    if (pchName != NULL)
+    {
+        *pchName = 1;
+    }
+}
+
+static void copyString(const WSTRING &value, LPWSTR szName, ULONG cchName, ULONG * pchName)
+{
+    if (szName != NULL && cchName > 0)
+    {
+        ULONG cchCopy = min((ULONG)value.size(), cchName - 1);
+        memcpy(szName, value.c_str(), cchCopy * sizeof(WCHAR));
+        szName[cchCopy] = 0;
+    }
+
+    if (pchName != NULL)
+    {
+        *pchName = (ULONG)value.size() + 1;
+    }
+}
+
+static HRESULT getSig(const std::vector<std::vector<BYTE>> &sigs, mdToken token, PCCOR_SIGNATURE * ppvSig, ULONG * pcbSig)
+{
+    ULONG rid = RidFromToken(token);
+    if (rid == 0 || rid > sigs.size())
+    {
+        return CLDB_E_RECORD_NOTFOUND;
+    }
+
+    if (ppvSig != NULL)
+    {
+        *ppvSig = sigs[rid - 1].data();
+    }
+
+    if (pcbSig != NULL)
+    {
+        *pcbSig = (ULONG)sigs[rid - 1].size();
+    }
+
+    return S_OK;
+}
+
+//
+// MockCallCounter
+//
+
+MockCallCounter g_mockCalls;
+
+void MockCallCounter::Enable(bool fEnabled)
+{
+    m_fEnabled.store(fEnabled, std::memory_order_relaxed);
+}
+
+void MockCallCounter::Count(const char * szClass, const char * szMethod)
+{
+    if (m_fEnabled.load(std::memory_order_relaxed) == false)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_counts[std::string(szClass) + "::" + szMethod]++;
+}
+
+std::map<std::string, ULONG> MockCallCounter::TakeCounts()
+{
+    std::map<std::string, ULONG> counts;
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    counts.swap(m_counts);
+    return counts;
+}
+
+//
+// MockMethodMalloc
+//
+
+MockMethodMalloc::~MockMethodMalloc()
+{
+    Reset();
+}
+
+HRESULT MockMethodMalloc::QueryInterface(REFIID riid, void ** ppvObject)
+{
+    COUNT_MOCK_CALL("MockMethodMalloc");
+
+    if (riid == IID_IMethodMalloc)
+    {
+        *ppvObject = this;
+        AddRef();
+        return S_OK;
+    }
+
+    *ppvObject = NULL;
+    return E_NOINTERFACE;
+}
+
+ULONG MockMethodMalloc::AddRef()
+{
+    COUNT_MOCK_CALL("MockMethodMalloc");
+
+    return ++m_cRef;
+}
+
+ULONG MockMethodMalloc::Release()
+{
+    COUNT_MOCK_CALL("MockMethodMalloc");
+
+    // Owned by the test; never deleted through its interface
+    return --m_cRef;
+}
+
+PVOID MockMethodMalloc::Alloc(ULONG cb)
+{
+    COUNT_MOCK_CALL("MockMethodMalloc");
+
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    BYTE * pBlock = new BYTE[cb];
+    m_blocks.push_back(pBlock);
+    m_cbAllocated += cb;
+    return pBlock;
+}
+
+void MockMethodMalloc::Reset()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    for (BYTE * pBlock : m_blocks)
+    {
+        delete[] pBlock;
+    }
+
+    m_blocks.clear();
+}
+
+//
+// MockMetaData
+//
+
+MockMetaData::MockMetaData()
+{
+}
+
+MockMetaData::~MockMetaData()
+{
+}
+
+mdMethodDef MockMetaData::AddMethod(const std::vector<BYTE> &sig, const std::vector<BYTE> &body, mdTypeDef tkClass,
+    const WSTRING &name)
+{
+    std::unique_lock<std::shared_mutex> lock(m_lock);
+
+    mdMethodDef tkMethod = TokenFromRid((ULONG)m_methods.size() + 1, mdtMethodDef);
+
+    MockMethod &method = m_methods[tkMethod];
+    method.m_sig = sig;
+    method.m_body = body;
+    method.m_tkClass = tkClass;
+    method.m_name = name;
+
+    return tkMethod;
+}
+
+mdMemberRef MockMetaData::AddMemberRef(const std::vector<BYTE> &sig)
+{
+    std::unique_lock<std::shared_mutex> lock(m_lock);
+
+    m_memberRefs.push_back(sig);
+    return TokenFromRid((ULONG)m_memberRefs.size(), mdtMemberRef);
+}
+
+mdSignature MockMetaData::AddSignature(const std::vector<BYTE> &sig)
+{
+    std::unique_lock<std::shared_mutex> lock(m_lock);
+    return addSig(m_signatures, m_signatureIndex, mdtSignature, sig);
+}
+
+mdTypeSpec MockMetaData::AddTypeSpec(const std::vector<BYTE> &sig)
+{
+    std::unique_lock<std::shared_mutex> lock(m_lock);
+    return addSig(m_typeSpecs, m_typeSpecIndex, mdtTypeSpec, sig);
+}
+
+mdMethodSpec MockMetaData::AddMethodSpec(mdToken tkParent, const std::vector<BYTE> &sig)
+{
+    std::unique_lock<std::shared_mutex> lock(m_lock);
+    return addMethodSpec(tkParent, sig);
+}
+
+mdTypeDef MockMetaData::AddTypeDef(bool fByRefLike, const WSTRING &name, mdTypeDef tkEnclosing)
+{
+    std::unique_lock<std::shared_mutex> lock(m_lock);
+
+    m_typeDefs.push_back({ fByRefLike, name, tkEnclosing });
+    return TokenFromRid((ULONG)m_typeDefs.size(), mdtTypeDef);
+}
+
+mdAssemblyRef MockMetaData::AddAssemblyRef(const WSTRING &name)
+{
+    std::unique_lock<std::shared_mutex> lock(m_lock);
+    return addAssemblyRef(name);
+}
+
+mdTypeRef MockMetaData::AddTypeRef(mdToken tkResolutionScope, const WSTRING &name)
+{
+    std::unique_lock<std::shared_mutex> lock(m_lock);
+    return addTypeRef(tkResolutionScope, name);
+}
+
+MockMethod * MockMetaData::GetMethod(mdMethodDef tkMethod)
+{
+    std::shared_lock<std::shared_mutex> lock(m_lock);
+    return findMethod(tkMethod);
+}
+
+MockMethod * MockMetaData::findMethod(mdMethodDef tkMethod)
+{
+    auto it = m_methods.find(tkMethod);
+    return it == m_methods.end() ? NULL : &it->second;
+}
+
+mdMethodSpec MockMetaData::addMethodSpec(mdToken tkParent, const std::vector<BYTE> &sig)
+{
+    m_methodSpecs.push_back({ tkParent, sig });
+
+    mdMethodSpec tkSpec = TokenFromRid((ULONG)m_methodSpecs.size(), mdtMethodSpec);
+    m_methodSpecIndex.emplace(std::make_pair(tkParent, sig), tkSpec);
+    return tkSpec;
+}
+
+// Like the emitter, these two find the reference defined already before adding another
+mdAssemblyRef MockMetaData::addAssemblyRef(const WSTRING &name)
+{
+    auto it = std::find(m_assemblyRefs.begin(), m_assemblyRefs.end(), name);
+    if (it == m_assemblyRefs.end())
+    {
+        it = m_assemblyRefs.insert(it, name);
+    }
+
+    return TokenFromRid((ULONG)(it - m_assemblyRefs.begin()) + 1, mdtAssemblyRef);
+}
+
+mdTypeRef MockMetaData::addTypeRef(mdToken tkResolutionScope, const WSTRING &name)
+{
+    for (size_t i = 0; i < m_typeRefs.size(); i++)
+    {
+        if (m_typeRefs[i].m_tkResolutionScope == tkResolutionScope && m_typeRefs[i].m_name == name)
+        {
+            return TokenFromRid((ULONG)i + 1, mdtTypeRef);
+        }
+    }
+
+    m_typeRefs.push_back({ tkResolutionScope, name });
+    return TokenFromRid((ULONG)m_typeRefs.size(), mdtTypeRef);
+}
+
+mdToken MockMetaData::addSig(std::vector<std::vector<BYTE>> &sigs, SigIndex &index, CorTokenType tokenType,
+    const std::vector<BYTE> &sig)
+{
+    sigs.push_back(sig);
+
+    mdToken token = TokenFromRid((ULONG)sigs.size(), tokenType);
+    index.emplace(sig, token);
+    return token;
+}
+
+mdToken MockMetaData::findOrAddSig(std::vector<std::vector<BYTE>> &sigs, SigIndex &index, CorTokenType tokenType,
+    PCCOR_SIGNATURE pSig, ULONG cbSig, bool * pfAdded)
+{
+    std::vector<BYTE> sig(pSig, pSig + cbSig);
+
+    auto it = index.find(sig);
+    if (it != index.end())
+    {
+        *pfAdded = false;
+        return it->second;
+    }
+
+    *pfAdded = true;
+    return addSig(sigs, index, tokenType, sig);
+}
+
+HRESULT MockMetaData::QueryInterface(REFIID riid, void ** ppvObject)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    if (riid == IID_IMetaDataImport || riid == IID_IMetaDataImport2)
+    {
+        *ppvObject = static_cast<IMetaDataImport2 *>(this);
+    }
+    else if (riid == IID_IMetaDataEmit || riid == IID_IMetaDataEmit2)
+    {
+        *ppvObject = static_cast<IMetaDataEmit2 *>(this);
+    }
+    else if (riid == IID_IMetaDataAssemblyImport)
+    {
+        *ppvObject = static_cast<IMetaDataAssemblyImport *>(this);
+    }
+    else if (riid == IID_IMetaDataAssemblyEmit)
+    {
+        *ppvObject = static_cast<IMetaDataAssemblyEmit *>(this);
+    }
+    else if (riid == IID_IMetaDataTables)
+    {
+        *ppvObject = static_cast<IMetaDataTables *>(this);
+    }
+    else
+    {
+        *ppvObject = NULL;
+        return E_NOINTERFACE;
+    }
+
+    AddRef();
+    return S_OK;
+}
+
+ULONG MockMetaData::AddRef()
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    return ++m_cRef;
+}
+
+ULONG MockMetaData::Release()
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    return --m_cRef;
+}
+
+void MockMetaData::CloseEnum(HCORENUM hEnum)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    delete (MockEnum *)hEnum;
+}
+
+HRESULT MockMetaData::CountEnum(HCORENUM hEnum, ULONG * pulCount)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    *pulCount = hEnum == NULL ? 0 : (ULONG)((MockEnum *)hEnum)->m_tokens.size();
+    return S_OK;
+}
+
+HRESULT MockMetaData::ResetEnum(HCORENUM hEnum, ULONG ulPos)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    if (hEnum != NULL)
+    {
+        ((MockEnum *)hEnum)->m_position = ulPos;
+    }
+
+    return S_OK;
+}
+
+HRESULT MockMetaData::EnumTypeDefs(HCORENUM * phEnum, mdTypeDef rTypeDefs[], ULONG cMax, ULONG * pcTypeDefs)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::vector<mdToken> tokens;
+    if (*phEnum == NULL)
+    {
+        std::shared_lock<std::shared_mutex> lock(m_lock);
+        for (size_t i = 0; i < m_typeDefs.size(); i++)
+        {
+            tokens.push_back(TokenFromRid((ULONG)i + 1, mdtTypeDef));
+        }
+    }
+
+    return enumTokens(phEnum, tokens, rTypeDefs, cMax, pcTypeDefs);
+}
+
+HRESULT MockMetaData::EnumTypeRefs(HCORENUM * phEnum, mdTypeRef rTypeRefs[], ULONG cMax, ULONG * pcTypeRefs)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::vector<mdToken> tokens;
+    if (*phEnum == NULL)
+    {
+        std::shared_lock<std::shared_mutex> lock(m_lock);
+        for (size_t i = 0; i < m_typeRefs.size(); i++)
+        {
+            tokens.push_back(TokenFromRid((ULONG)i + 1, mdtTypeRef));
+        }
+    }
+
+    return enumTokens(phEnum, tokens, rTypeRefs, cMax, pcTypeRefs);
+}
+
+HRESULT MockMetaData::FindTypeDefByName(LPCWSTR szTypeDef, mdToken tkEnclosingClass, mdTypeDef * ptd)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    // Type definitions aren't looked up by name here, so references stand for every type
+    *ptd = mdTypeDefNil;
+    return CLDB_E_RECORD_NOTFOUND;
+}
+
+HRESULT MockMetaData::GetScopeProps(LPWSTR szName, ULONG cchName, ULONG * pchName, GUID * pmvid)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    copyName(szName, cchName, pchName);
+    if (pmvid != NULL)
+    {
+        *pmvid = {};
+    }
+
+    return S_OK;
+}
+
+HRESULT MockMetaData::GetTypeDefProps(mdTypeDef td, LPWSTR szTypeDef, ULONG cchTypeDef, ULONG * pchTypeDef, DWORD * pdwTypeDefFlags, mdToken * ptkExtends)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::shared_lock<std::shared_mutex> lock(m_lock);
+
+    ULONG rid = RidFromToken(td);
+    if (TypeFromToken(td) != mdtTypeDef || rid == 0 || rid > m_typeDefs.size())
+    {
+        return CLDB_E_RECORD_NOTFOUND;
+    }
+
+    copyString(m_typeDefs[rid - 1].m_name, szTypeDef, cchTypeDef, pchTypeDef);
+
+    if (pdwTypeDefFlags != NULL)
+    {
+        *pdwTypeDefFlags = IsNilToken(m_typeDefs[rid - 1].m_tkEnclosing) ? 0 : tdNestedPublic;
+    }
+
+    if (ptkExtends != NULL)
+    {
+        *ptkExtends = mdTypeRefNil;
+    }
+
+    return S_OK;
+}
+
+HRESULT MockMetaData::GetTypeRefProps(mdTypeRef tr, mdToken * ptkResolutionScope, LPWSTR szName, ULONG cchName, ULONG * pchName)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::shared_lock<std::shared_mutex> lock(m_lock);
+
+    ULONG rid = RidFromToken(tr);
+    if (TypeFromToken(tr) != mdtTypeRef || rid == 0 || rid > m_typeRefs.size())
+    {
+        return CLDB_E_RECORD_NOTFOUND;
+    }
+
+    if (ptkResolutionScope != NULL)
+    {
+        *ptkResolutionScope = m_typeRefs[rid - 1].m_tkResolutionScope;
+    }
+
+    copyString(m_typeRefs[rid - 1].m_name, szName, cchName, pchName);
+    return S_OK;
+}
+
+HRESULT MockMetaData::GetMethodProps(mdMethodDef mb, mdTypeDef * pClass, LPWSTR szMethod, ULONG cchMethod, ULONG * pchMethod, DWORD * pdwAttr, PCCOR_SIGNATURE * ppvSigBlob, ULONG * pcbSigBlob, ULONG * pulCodeRVA, DWORD * pdwImplFlags)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::shared_lock<std::shared_mutex> lock(m_lock);
+
+    MockMethod * pMethod = findMethod(mb);
+    if (pMethod == NULL)
+    {
+        return CLDB_E_RECORD_NOTFOUND;
+    }
+
+    copyString(pMethod->m_name, szMethod, cchMethod, pchMethod);
+
+    if (pClass != NULL)
+    {
+        *pClass = pMethod->m_tkClass;
+    }
+
+    if (pdwAttr != NULL)
+    {
+        bool fHasThis = pMethod->m_sig.empty() == false && (pMethod->m_sig[0] & IMAGE_CEE_CS_CALLCONV_HASTHIS) != 0;
+        *pdwAttr = fHasThis ? 0 : mdStatic;
+    }
+
+    if (ppvSigBlob != NULL)
+    {
+        *ppvSigBlob = pMethod->m_sig.data();
+    }
+
+    if (pcbSigBlob != NULL)
+    {
+        *pcbSigBlob = (ULONG)pMethod->m_sig.size();
+    }
+
+    if (pulCodeRVA != NULL)
+    {
+        *pulCodeRVA = 0;
+    }
+
+    if (pdwImplFlags != NULL)
+    {
+        *pdwImplFlags = 0;
+    }
+
+    return S_OK;
+}
+
+HRESULT MockMetaData::EnumMethods(HCORENUM * phEnum, mdTypeDef cl, mdMethodDef rMethods[], ULONG cMax, ULONG * pcTokens)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::vector<mdToken> tokens;
+    if (*phEnum == NULL)
+    {
+        std::shared_lock<std::shared_mutex> lock(m_lock);
+        for (const auto &entry : m_methods)
+        {
+            if (entry.second.m_tkClass == cl)
+            {
+                tokens.push_back(entry.first);
+            }
+        }
+    }
+
+    return enumTokens(phEnum, tokens, rMethods, cMax, pcTokens);
+}
+
+HRESULT MockMetaData::GetMemberRefProps(mdMemberRef mr, mdToken * ptk, LPWSTR szMember, ULONG cchMember, ULONG * pchMember, PCCOR_SIGNATURE * ppvSigBlob, ULONG * pbSig)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::shared_lock<std::shared_mutex> lock(m_lock);
+
+    copyName(szMember, cchMember, pchMember);
+
+    if (ptk != NULL)
+    {
+        *ptk = mdTypeRefNil;
+    }
+
+    return getSig(m_memberRefs, mr, ppvSigBlob, pbSig);
+}
+
+HRESULT MockMetaData::GetSigFromToken(mdSignature mdSig, PCCOR_SIGNATURE * ppvSig, ULONG * pcbSig)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::shared_lock<std::shared_mutex> lock(m_lock);
+    return getSig(m_signatures, mdSig, ppvSig, pcbSig);
+}
+
+HRESULT MockMetaData::GetTypeSpecFromToken(mdTypeSpec typespec, PCCOR_SIGNATURE * ppvSig, ULONG * pcbSig)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::shared_lock<std::shared_mutex> lock(m_lock);
+    return getSig(m_typeSpecs, typespec, ppvSig, pcbSig);
+}
+
+HRESULT MockMetaData::EnumTypeSpecs(HCORENUM * phEnum, mdTypeSpec rTypeSpecs[], ULONG cmax, ULONG * pcTypeSpecs)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::vector<mdToken> tokens;
+    if (*phEnum == NULL)
+    {
+        std::shared_lock<std::shared_mutex> lock(m_lock);
+        for (size_t i = 0; i < m_typeSpecs.size(); i++)
+        {
+            tokens.push_back(TokenFromRid((ULONG)i + 1, mdtTypeSpec));
+        }
+    }
+
+    return enumTokens(phEnum, tokens, rTypeSpecs, cmax, pcTypeSpecs);
+}
+
+HRESULT MockMetaData::GetMethodSpecProps(mdMethodSpec mi, mdToken * tkParent, PCCOR_SIGNATURE * ppvSigBlob, ULONG * pcbSigBlob)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::shared_lock<std::shared_mutex> lock(m_lock);
+
+    ULONG rid = RidFromToken(mi);
+    if (rid == 0 || rid > m_methodSpecs.size())
+    {
+        return CLDB_E_RECORD_NOTFOUND;
+    }
+
+    const MockMethodSpec &spec = m_methodSpecs[rid - 1];
+
+    if (tkParent != NULL)
+    {
+        *tkParent = spec.m_tkParent;
+    }
+
+    if (ppvSigBlob != NULL)
+    {
+        *ppvSigBlob = spec.m_sig.data();
+    }
+
+    if (pcbSigBlob != NULL)
+    {
+        *pcbSigBlob = (ULONG)spec.m_sig.size();
+    }
+
+    return S_OK;
+}
+
+HRESULT MockMetaData::GetCustomAttributeByName(mdToken tkObj, LPCWSTR szName, const void ** ppData, ULONG * pcbData)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::shared_lock<std::shared_mutex> lock(m_lock);
+
+    // Only IsByRefLikeAttribute is asked for
+    ULONG rid = RidFromToken(tkObj);
+    if (TypeFromToken(tkObj) != mdtTypeDef || rid == 0 || rid > m_typeDefs.size() ||
+        m_typeDefs[rid - 1].m_fByRefLike == false)
+    {
+        return S_FALSE;
+    }
+
+    if (ppData != NULL)
+    {
+        *ppData = NULL;
+    }
+
+    if (pcbData != NULL)
+    {
+        *pcbData = 0;
+    }
+
+    return S_OK;
+}
+
+BOOL MockMetaData::IsValidToken(mdToken tk)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    return RidFromToken(tk) != 0;
+}
+
+HRESULT MockMetaData::GetNestedClassProps(mdTypeDef tdNestedClass, mdTypeDef * ptdEnclosingClass)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::shared_lock<std::shared_mutex> lock(m_lock);
+
+    ULONG rid = RidFromToken(tdNestedClass);
+    if (TypeFromToken(tdNestedClass) != mdtTypeDef || rid == 0 || rid > m_typeDefs.size() ||
+        IsNilToken(m_typeDefs[rid - 1].m_tkEnclosing) == true)
+    {
+        *ptdEnclosingClass = mdTypeDefNil;
+        return CLDB_E_RECORD_NOTFOUND;
+    }
+
+    *ptdEnclosingClass = m_typeDefs[rid - 1].m_tkEnclosing;
+    return S_OK;
+}
+
+HRESULT MockMetaData::GetTokenFromSig(PCCOR_SIGNATURE pvSig, ULONG cbSig, mdSignature * pmsig)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::unique_lock<std::shared_mutex> lock(m_lock);
+
+    bool fAdded;
+    *pmsig = findOrAddSig(m_signatures, m_signatureIndex, mdtSignature, pvSig, cbSig, &fAdded);
+    if (fAdded == true)
+    {
+        m_cDefinedSignatures++;
+    }
+
+    return S_OK;
+}
+
+HRESULT MockMetaData::GetTokenFromTypeSpec(PCCOR_SIGNATURE pvSig, ULONG cbSig, mdTypeSpec * ptypespec)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::unique_lock<std::shared_mutex> lock(m_lock);
+
+    bool fAdded;
+    *ptypespec = findOrAddSig(m_typeSpecs, m_typeSpecIndex, mdtTypeSpec, pvSig, cbSig, &fAdded);
+    return S_OK;
+}
+
+HRESULT MockMetaData::DefineTypeRefByName(mdToken tkResolutionScope, LPCWSTR szName, mdTypeRef * ptr)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::unique_lock<std::shared_mutex> lock(m_lock);
+
+    *ptr = addTypeRef(tkResolutionScope, szName);
+    return S_OK;
+}
+
+HRESULT MockMetaData::DefineMemberRef(mdToken tkImport, LPCWSTR szName, PCCOR_SIGNATURE pvSigBlob, ULONG cbSigBlob, mdMemberRef * pmr)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::unique_lock<std::shared_mutex> lock(m_lock);
+
+    std::vector<BYTE> sig(pvSigBlob, pvSigBlob + cbSigBlob);
+    auto key = std::make_tuple(tkImport, WSTRING(szName), sig);
+
+    auto it = m_memberRefIndex.find(key);
+    if (it == m_memberRefIndex.end())
+    {
+        m_memberRefs.push_back(sig);
+        it = m_memberRefIndex.emplace(key, TokenFromRid((ULONG)m_memberRefs.size(), mdtMemberRef)).first;
+    }
+
+    *pmr = it->second;
+    return S_OK;
+}
+
+HRESULT MockMetaData::DefineMethodSpec(mdToken tkParent, PCCOR_SIGNATURE pvSigBlob, ULONG cbSigBlob, mdMethodSpec * pmi)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::unique_lock<std::shared_mutex> lock(m_lock);
+
+    std::vector<BYTE> sig(pvSigBlob, pvSigBlob + cbSigBlob);
+
+    auto it = m_methodSpecIndex.find(std::make_pair(tkParent, sig));
+    if (it != m_methodSpecIndex.end())
+    {
+        *pmi = it->second;
+        return S_OK;
+    }
+
+    *pmi = addMethodSpec(tkParent, sig);
+    m_cDefinedMethodSpecs++;
+    return S_OK;
+}
+
+HRESULT MockMetaData::GetAssemblyRefProps(mdAssemblyRef mdar, const void ** ppbPublicKeyOrToken, ULONG * pcbPublicKeyOrToken, LPWSTR szName, ULONG cchName, ULONG * pchName, ASSEMBLYMETADATA * pMetaData, const void ** ppbHashValue, ULONG * pcbHashValue, DWORD * pdwAssemblyRefFlags)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::shared_lock<std::shared_mutex> lock(m_lock);
+
+    ULONG rid = RidFromToken(mdar);
+    if (TypeFromToken(mdar) != mdtAssemblyRef || rid == 0 || rid > m_assemblyRefs.size())
+    {
+        return CLDB_E_RECORD_NOTFOUND;
+    }
+
+    // Only the name is kept
+    if (ppbPublicKeyOrToken != NULL)
+    {
+        *ppbPublicKeyOrToken = NULL;
+    }
+
+    if (pcbPublicKeyOrToken != NULL)
+    {
+        *pcbPublicKeyOrToken = 0;
+    }
+
+    if (ppbHashValue != NULL)
+    {
+        *ppbHashValue = NULL;
+    }
+
+    if (pcbHashValue != NULL)
+    {
+        *pcbHashValue = 0;
+    }
+
+    if (pdwAssemblyRefFlags != NULL)
+    {
+        *pdwAssemblyRefFlags = 0;
+    }
+
+    copyString(m_assemblyRefs[rid - 1], szName, cchName, pchName);
+    return S_OK;
+}
+
+HRESULT MockMetaData::EnumAssemblyRefs(HCORENUM * phEnum, mdAssemblyRef rAssemblyRefs[], ULONG cMax, ULONG * pcTokens)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::vector<mdToken> tokens;
+    if (*phEnum == NULL)
+    {
+        std::shared_lock<std::shared_mutex> lock(m_lock);
+        for (size_t i = 0; i < m_assemblyRefs.size(); i++)
+        {
+            tokens.push_back(TokenFromRid((ULONG)i + 1, mdtAssemblyRef));
+        }
+    }
+
+    return enumTokens(phEnum, tokens, rAssemblyRefs, cMax, pcTokens);
+}
+
+HRESULT MockMetaData::GetAssemblyFromScope(mdAssembly * ptkAssembly)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    // Without a manifest, a module goes by its file name
+    *ptkAssembly = mdAssemblyNil;
+    return CLDB_E_RECORD_NOTFOUND;
+}
+
+HRESULT MockMetaData::DefineAssemblyRef(const void * pbPublicKeyOrToken, ULONG cbPublicKeyOrToken, LPCWSTR szName, const ASSEMBLYMETADATA * pMetaData, const void * pbHashValue, ULONG cbHashValue, DWORD dwAssemblyRefFlags, mdAssemblyRef * pmdar)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::unique_lock<std::shared_mutex> lock(m_lock);
+
+    *pmdar = addAssemblyRef(szName);
+    return S_OK;
+}
+
+HRESULT MockMetaData::GetTableInfo(ULONG ixTbl, ULONG * pcbRow, ULONG * pcRows, ULONG * pcCols, ULONG * piKey, const char ** ppName)
+{
+    COUNT_MOCK_CALL("MockMetaData");
+
+    std::shared_lock<std::shared_mutex> lock(m_lock);
+
+    // Only the number of methods is asked for
+    if (ixTbl != TypeFromToken(mdtMethodDef) >> 24)
+    {
+        return E_INVALIDARG;
+    }
+
+    *pcbRow = 0;
+    *pcRows = (ULONG)m_methods.size();
+    *pcCols = 0;
+    *piKey = (ULONG)-1;
+    *ppName = "MethodDef";
+    return S_OK;
+}
+
+//
+// MockProfilerInfo
+//
+
+MockProfilerInfo::MockProfilerInfo(MockMetaData * pMetaData, MockMethodMalloc * pMethodMalloc) :
+    m_pMetaData(pMetaData),
+    m_pMethodMalloc(pMethodMalloc)
+{
+}
+
+void MockProfilerInfo::AddModule(ModuleID moduleId, MockMetaData * pMetaData, MockMethodMalloc * pMethodMalloc, const WSTRING &path)
+{
+    std::unique_lock<std::shared_mutex> lock(m_modulesLock);
+    m_modules[moduleId] = { pMetaData, pMethodMalloc, path };
+}
+
+MockProfilerInfo::MockModule MockProfilerInfo::findModule(ModuleID moduleId)
+{
+    std::shared_lock<std::shared_mutex> lock(m_modulesLock);
+
+    auto it = m_modules.find(moduleId);
+    if (it == m_modules.end())
+    {
+        return { m_pMetaData, m_pMethodMalloc, WSTRING() };
+    }
+
+    return it->second;
+}
+
+LPCBYTE MockProfilerInfo::GetNewBody(mdMethodDef tkMethod)
+{
+    std::lock_guard<std::mutex> lock(m_newBodiesLock);
+
+    auto it = m_newBodies.find(tkMethod);
+    return it == m_newBodies.end() ? NULL : it->second;
+}
+
+HRESULT MockProfilerInfo::QueryInterface(REFIID riid, void ** ppvObject)
+{
+    COUNT_MOCK_CALL("MockProfilerInfo");
+
+    if (riid == IID_ICorProfilerInfo || riid == IID_ICorProfilerInfo2)
+    {
+        *ppvObject = static_cast<ICorProfilerInfo2 *>(this);
+        AddRef();
+        return S_OK;
+    }
+
+    // Without ICorProfilerInfo3, type references can't be resolved and count as byref-like
+    *ppvObject = NULL;
+    return E_NOINTERFACE;
+}
+
+ULONG MockProfilerInfo::AddRef()
+{
+    COUNT_MOCK_CALL("MockProfilerInfo");
+
+    return ++m_cRef;
+}
+
+ULONG MockProfilerInfo::Release()
+{
+    COUNT_MOCK_CALL("MockProfilerInfo");
+
+    return --m_cRef;
+}
+
+HRESULT MockProfilerInfo::GetFunctionInfo(FunctionID functionId, ClassID * pClassId, ModuleID * pModuleId, mdToken * pToken)
+{
+    COUNT_MOCK_CALL("MockProfilerInfo");
+
+    if (pClassId != NULL)
+    {
+        *pClassId = 0;
+    }
+
+    if (pModuleId != NULL)
+    {
+        *pModuleId = (ModuleID)(functionId >> 32);
+    }
+
+    if (pToken != NULL)
+    {
+        *pToken = (mdToken)functionId;
+    }
+
+    return S_OK;
+}
+
+HRESULT MockProfilerInfo::GetModuleInfo(ModuleID moduleId, LPCBYTE * ppBaseLoadAddress, ULONG cchName, ULONG * pcchName, WCHAR szName[], AssemblyID * pAssemblyId)
+{
+    COUNT_MOCK_CALL("MockProfilerInfo");
+
+    MockModule module = findModule(moduleId);
+
+    // The bodies aren't laid out in an image
+    if (ppBaseLoadAddress != NULL)
+    {
+        *ppBaseLoadAddress = NULL;
+    }
+
+    if (pAssemblyId != NULL)
+    {
+        *pAssemblyId = 0;
+    }
+
+    copyString(module.m_path, szName, cchName, pcchName);
+    return S_OK;
+}
+
+HRESULT MockProfilerInfo::GetModuleMetaData(ModuleID moduleId, DWORD dwOpenFlags, REFIID riid, IUnknown ** ppOut)
+{
+    COUNT_MOCK_CALL("MockProfilerInfo");
+
+    return findModule(moduleId).m_pMetaData->QueryInterface(riid, (void **)ppOut);
+}
+
+HRESULT MockProfilerInfo::GetILFunctionBody(ModuleID moduleId, mdMethodDef methodId, LPCBYTE * ppMethodHeader, ULONG * pcbMethodSize)
+{
+    COUNT_MOCK_CALL("MockProfilerInfo");
+
+    MockMethod * pMethod = findModule(moduleId).m_pMetaData->GetMethod(methodId);
+    if (pMethod == NULL || pMethod->m_body.empty() == true)
+    {
+        return CORPROF_E_FUNCTION_NOT_IL;
+    }
+
+    *ppMethodHeader = pMethod->m_body.data();
+    if (pcbMethodSize != NULL)
+    {
+        *pcbMethodSize = (ULONG)pMethod->m_body.size();
+    }
+
+    return S_OK;
+}
+
+HRESULT MockProfilerInfo::GetILFunctionBodyAllocator(ModuleID moduleId, IMethodMalloc ** ppMalloc)
+{
+    COUNT_MOCK_CALL("MockProfilerInfo");
+
+    return findModule(moduleId).m_pMethodMalloc->QueryInterface(IID_IMethodMalloc, (void **)ppMalloc);
+}
+
+HRESULT MockProfilerInfo::SetILFunctionBody(ModuleID moduleId, mdMethodDef methodid, LPCBYTE pbNewILMethodHeader)
+{
+    COUNT_MOCK_CALL("MockProfilerInfo");
+
+    std::lock_guard<std::mutex> lock(m_newBodiesLock);
+
+    m_newBodies[methodid] = pbNewILMethodHeader;
+    m_cSetBodies.fetch_add(1, std::memory_order_relaxed);
+    return S_OK;
+}
+
+//
+// Helpers
+//
+
+FunctionID MakeMockFunctionID(ModuleID moduleId, mdMethodDef tkMethod)
+{
+    return ((FunctionID)moduleId << 32) | tkMethod;
+}
+
+void PrepareMockModuleContext(MockMetaData * pMetaData, MockMethodMalloc * pMethodMalloc, ModuleContext &context)
+{
+    // Enter(object, object[])
+    context.m_mdEnterProbeRef = pMetaData->AddMemberRef({ IMAGE_CEE_CS_CALLCONV_DEFAULT, 2,
+        ELEMENT_TYPE_VOID, ELEMENT_TYPE_OBJECT, ELEMENT_TYPE_SZARRAY, ELEMENT_TYPE_OBJECT });
+
+    // Enter(int, int, object) and Enter<T1, ..., Tn>(int, int, object, T1, ..., Tn)
+    context.m_mdTypedEnterProbeRefs[0] = pMetaData->AddMemberRef({ IMAGE_CEE_CS_CALLCONV_DEFAULT, 3,
+        ELEMENT_TYPE_VOID, ELEMENT_TYPE_I4, ELEMENT_TYPE_I4, ELEMENT_TYPE_OBJECT });
+
+    for (int argCount = 1; argCount <= TYPED_PROBE_MAX_ARGS; argCount++)
+    {
+        std::vector<BYTE> sig = { IMAGE_CEE_CS_CALLCONV_GENERIC, (BYTE)argCount, (BYTE)(argCount + 3),
+            ELEMENT_TYPE_VOID, ELEMENT_TYPE_I4, ELEMENT_TYPE_I4, ELEMENT_TYPE_OBJECT };
+
+        for (int i = 0; i < argCount; i++)
+        {
+            sig.push_back(ELEMENT_TYPE_MVAR);
+            sig.push_back((BYTE)i);
+        }
+
+        context.m_mdTypedEnterProbeRefs[argCount] = pMetaData->AddMemberRef(sig);
+    }
+
+    // long EnterTimestamp() and Exit(int, int, long); used only once a test gives the
+    // module a cookie
+    context.m_mdEnterTimestampRef = pMetaData->AddMemberRef({ IMAGE_CEE_CS_CALLCONV_DEFAULT, 0, ELEMENT_TYPE_I8 });
+    context.m_mdExitProbeRef = pMetaData->AddMemberRef({ IMAGE_CEE_CS_CALLCONV_DEFAULT, 3,
+        ELEMENT_TYPE_VOID, ELEMENT_TYPE_I4, ELEMENT_TYPE_I4, ELEMENT_TYPE_I8 });
+
+    // Type references of the module; the rewriter only copies them into the code
+    context.m_mdObjectToken = TokenFromRid(1, mdtTypeRef);
+    for (int i = 0; i < ELEMENT_TYPE_MAX; i++)
+    {
+        context.m_primitives[i] = TokenFromRid(i + 2, mdtTypeRef);
+    }
+
+    context.m_pMetaDataImport = static_cast<IMetaDataImport2 *>(pMetaData);
+    context.m_pMetaDataImport2 = static_cast<IMetaDataImport2 *>(pMetaData);
+    context.m_pMetaDataEmit = static_cast<IMetaDataEmit2 *>(pMetaData);
+    context.m_pMetaDataEmit2 = static_cast<IMetaDataEmit2 *>(pMetaData);
+    context.m_pMethodMalloc = pMethodMalloc;
+
+    context.m_prepareState.store(ModuleContext::Prepared, std::memory_order_release);
+}
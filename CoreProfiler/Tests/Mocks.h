@@ -0,0 +1,458 @@
+#pragma once
+
+#include "stdafx.h"
+#include "ProfilerData.h"
+
+#include <shared_mutex>
+
+// In-memory stand-ins for the runtime interfaces the rewriter talks to, so that CoreProfilerCore
+// can be driven without a process to profile.  MockMetaData keeps the methods, references and
+// signatures of one module and defines new ones the way the runtime's metadata emitter would;
+// MockProfilerInfo serves the bodies from it and records the bodies set in their place.
+//
+// Like the runtime's, they can be called from any thread: MockMetaData takes a reader/writer
+// lock as the metadata emitter does, so that the profiler's callbacks can be stressed on them.
+
+// Counts the calls made to the mocks' interfaces, by method, while enabled; the calls the mocks
+// make to themselves are counted too, as a QueryInterface's AddRef
+class MockCallCounter
+{
+public:
+    void Enable(bool fEnabled);
+    void Count(const char * szClass, const char * szMethod);
+
+    // Returns the counts since the last call and clears them
+    std::map<std::string, ULONG> TakeCounts();
+
+private:
+    std::atomic<bool> m_fEnabled { false };
+    std::mutex m_lock;
+    std::map<std::string, ULONG> m_counts;
+};
+
+extern MockCallCounter g_mockCalls;
+
+#define COUNT_MOCK_CALL(szClass) g_mockCalls.Count(szClass, __func__)
+
+class MockMethodMalloc : public IMethodMalloc
+{
+public:
+    ~MockMethodMalloc();
+
+    STDMETHOD(QueryInterface)(REFIID riid, void ** ppvObject) override;
+    STDMETHOD_(ULONG, AddRef)() override;
+    STDMETHOD_(ULONG, Release)() override;
+
+    PVOID STDMETHODCALLTYPE Alloc(ULONG cb) override;
+
+    // Frees every block handed out so far
+    void Reset();
+
+    UINT64 GetBytesAllocated()
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        return m_cbAllocated;
+    }
+
+private:
+    std::mutex m_lock;
+    std::vector<BYTE *> m_blocks;
+    UINT64 m_cbAllocated = 0;
+    std::atomic<ULONG> m_cRef { 0 };
+};
+
+struct MockMethod
+{
+    std::vector<BYTE> m_sig;
+    std::vector<BYTE> m_body;
+    mdTypeDef m_tkClass = mdTypeDefNil;
+    WSTRING m_name;
+};
+
+class MockMetaData : public IMetaDataImport2, public IMetaDataEmit2, public IMetaDataAssemblyImport,
+    public IMetaDataAssemblyEmit, public IMetaDataTables
+{
+public:
+    MockMetaData();
+    ~MockMetaData();
+
+    // Builders; each returns the token of what it added
+    mdMethodDef AddMethod(const std::vector<BYTE> &sig, const std::vector<BYTE> &body, mdTypeDef tkClass = mdTypeDefNil,
+        const WSTRING &name = WSTRING());
+    mdMemberRef AddMemberRef(const std::vector<BYTE> &sig);
+    mdSignature AddSignature(const std::vector<BYTE> &sig);
+    mdTypeSpec AddTypeSpec(const std::vector<BYTE> &sig);
+    mdMethodSpec AddMethodSpec(mdToken tkParent, const std::vector<BYTE> &sig);
+    mdTypeDef AddTypeDef(bool fByRefLike, const WSTRING &name = WSTRING(), mdTypeDef tkEnclosing = mdTypeDefNil);
+    mdAssemblyRef AddAssemblyRef(const WSTRING &name);
+    mdTypeRef AddTypeRef(mdToken tkResolutionScope, const WSTRING &name);
+
+    MockMethod * GetMethod(mdMethodDef tkMethod);
+
+    // Not locked; for setting up and checking a module no one else is using
+    const std::map<mdMethodDef, MockMethod> &GetMethods()
+    {
+        return m_methods;
+    }
+
+    // Counts of what the rewrites defined, for checking them
+    ULONG GetDefinedSignatureCount()
+    {
+        std::shared_lock<std::shared_mutex> lock(m_lock);
+        return m_cDefinedSignatures;
+    }
+
+    ULONG GetDefinedMethodSpecCount()
+    {
+        std::shared_lock<std::shared_mutex> lock(m_lock);
+        return m_cDefinedMethodSpecs;
+    }
+
+    // IUnknown, shared by all sides
+    STDMETHOD(QueryInterface)(REFIID riid, void ** ppvObject) override;
+    STDMETHOD_(ULONG, AddRef)() override;
+    STDMETHOD_(ULONG, Release)() override;
+
+    // IMetaDataImport
+    STDMETHOD_(void, CloseEnum)(HCORENUM hEnum) override;
+    STDMETHOD(CountEnum)(HCORENUM hEnum, ULONG * pulCount) override;
+    STDMETHOD(ResetEnum)(HCORENUM hEnum, ULONG ulPos) override;
+    STDMETHOD(EnumTypeDefs)(HCORENUM * phEnum, mdTypeDef rTypeDefs[], ULONG cMax, ULONG * pcTypeDefs) override;
+    STDMETHOD(EnumInterfaceImpls)(HCORENUM * phEnum, mdTypeDef td, mdInterfaceImpl rImpls[], ULONG cMax, ULONG * pcImpls) override { return E_NOTIMPL; }
+    STDMETHOD(EnumTypeRefs)(HCORENUM * phEnum, mdTypeRef rTypeRefs[], ULONG cMax, ULONG * pcTypeRefs) override;
+    STDMETHOD(FindTypeDefByName)(LPCWSTR szTypeDef, mdToken tkEnclosingClass, mdTypeDef * ptd) override;
+    STDMETHOD(GetScopeProps)(LPWSTR szName, ULONG cchName, ULONG * pchName, GUID * pmvid) override;
+    STDMETHOD(GetModuleFromScope)(mdModule * pmd) override { return E_NOTIMPL; }
+    STDMETHOD(GetTypeDefProps)(mdTypeDef td, LPWSTR szTypeDef, ULONG cchTypeDef, ULONG * pchTypeDef, DWORD * pdwTypeDefFlags, mdToken * ptkExtends) override;
+    STDMETHOD(GetInterfaceImplProps)(mdInterfaceImpl iiImpl, mdTypeDef * pClass, mdToken * ptkIface) override { return E_NOTIMPL; }
+    STDMETHOD(GetTypeRefProps)(mdTypeRef tr, mdToken * ptkResolutionScope, LPWSTR szName, ULONG cchName, ULONG * pchName) override;
+    STDMETHOD(ResolveTypeRef)(mdTypeRef tr, REFIID riid, IUnknown ** ppIScope, mdTypeDef * ptd) override { return E_NOTIMPL; }
+    STDMETHOD(EnumMembers)(HCORENUM * phEnum, mdTypeDef cl, mdToken rMembers[], ULONG cMax, ULONG * pcTokens) override { return E_NOTIMPL; }
+    STDMETHOD(EnumMembersWithName)(HCORENUM * phEnum, mdTypeDef cl, LPCWSTR szName, mdToken rMembers[], ULONG cMax, ULONG * pcTokens) override { return E_NOTIMPL; }
+    STDMETHOD(EnumMethods)(HCORENUM * phEnum, mdTypeDef cl, mdMethodDef rMethods[], ULONG cMax, ULONG * pcTokens) override;
+    STDMETHOD(EnumMethodsWithName)(HCORENUM * phEnum, mdTypeDef cl, LPCWSTR szName, mdMethodDef rMethods[], ULONG cMax, ULONG * pcTokens) override { return E_NOTIMPL; }
+    STDMETHOD(EnumFields)(HCORENUM * phEnum, mdTypeDef cl, mdFieldDef rFields[], ULONG cMax, ULONG * pcTokens) override { return E_NOTIMPL; }
+    STDMETHOD(EnumFieldsWithName)(HCORENUM * phEnum, mdTypeDef cl, LPCWSTR szName, mdFieldDef rFields[], ULONG cMax, ULONG * pcTokens) override { return E_NOTIMPL; }
+    STDMETHOD(EnumParams)(HCORENUM * phEnum, mdMethodDef mb, mdParamDef rParams[], ULONG cMax, ULONG * pcTokens) override { return E_NOTIMPL; }
+    STDMETHOD(EnumMemberRefs)(HCORENUM * phEnum, mdToken tkParent, mdMemberRef rMemberRefs[], ULONG cMax, ULONG * pcTokens) override { return E_NOTIMPL; }
+    STDMETHOD(EnumMethodImpls)(HCORENUM * phEnum, mdTypeDef td, mdToken rMethodBody[], mdToken rMethodDecl[], ULONG cMax, ULONG * pcTokens) override { return E_NOTIMPL; }
+    STDMETHOD(EnumPermissionSets)(HCORENUM * phEnum, mdToken tk, DWORD dwActions, mdPermission rPermission[], ULONG cMax, ULONG * pcTokens) override { return E_NOTIMPL; }
+    STDMETHOD(FindMember)(mdTypeDef td, LPCWSTR szName, PCCOR_SIGNATURE pvSigBlob, ULONG cbSigBlob, mdToken * pmb) override { return E_NOTIMPL; }
+    STDMETHOD(FindMethod)(mdTypeDef td, LPCWSTR szName, PCCOR_SIGNATURE pvSigBlob, ULONG cbSigBlob, mdMethodDef * pmb) override { return E_NOTIMPL; }
+    STDMETHOD(FindField)(mdTypeDef td, LPCWSTR szName, PCCOR_SIGNATURE pvSigBlob, ULONG cbSigBlob, mdFieldDef * pmb) override { return E_NOTIMPL; }
+    STDMETHOD(FindMemberRef)(mdTypeRef td, LPCWSTR szName, PCCOR_SIGNATURE pvSigBlob, ULONG cbSigBlob, mdMemberRef * pmr) override { return E_NOTIMPL; }
+    STDMETHOD(GetMethodProps)(mdMethodDef mb, mdTypeDef * pClass, LPWSTR szMethod, ULONG cchMethod, ULONG * pchMethod, DWORD * pdwAttr, PCCOR_SIGNATURE * ppvSigBlob, ULONG * pcbSigBlob, ULONG * pulCodeRVA, DWORD * pdwImplFlags) override;
+    STDMETHOD(GetMemberRefProps)(mdMemberRef mr, mdToken * ptk, LPWSTR szMember, ULONG cchMember, ULONG * pchMember, PCCOR_SIGNATURE * ppvSigBlob, ULONG * pbSig) override;
+    STDMETHOD(EnumProperties)(HCORENUM * phEnum, mdTypeDef td, mdProperty rProperties[], ULONG cMax, ULONG * pcProperties) override { return E_NOTIMPL; }
+    STDMETHOD(EnumEvents)(HCORENUM * phEnum, mdTypeDef td, mdEvent rEvents[], ULONG cMax, ULONG * pcEvents) override { return E_NOTIMPL; }
+    STDMETHOD(GetEventProps)(mdEvent ev, mdTypeDef * pClass, LPCWSTR szEvent, ULONG cchEvent, ULONG * pchEvent, DWORD * pdwEventFlags, mdToken * ptkEventType, mdMethodDef * pmdAddOn, mdMethodDef * pmdRemoveOn, mdMethodDef * pmdFire, mdMethodDef rmdOtherMethod[], ULONG cMax, ULONG * pcOtherMethod) override { return E_NOTIMPL; }
+    STDMETHOD(EnumMethodSemantics)(HCORENUM * phEnum, mdMethodDef mb, mdToken rEventProp[], ULONG cMax, ULONG * pcEventProp) override { return E_NOTIMPL; }
+    STDMETHOD(GetMethodSemantics)(mdMethodDef mb, mdToken tkEventProp, DWORD * pdwSemanticsFlags) override { return E_NOTIMPL; }
+    STDMETHOD(GetClassLayout)(mdTypeDef td, DWORD * pdwPackSize, COR_FIELD_OFFSET rFieldOffset[], ULONG cMax, ULONG * pcFieldOffset, ULONG * pulClassSize) override { return E_NOTIMPL; }
+    STDMETHOD(GetFieldMarshal)(mdToken tk, PCCOR_SIGNATURE * ppvNativeType, ULONG * pcbNativeType) override { return E_NOTIMPL; }
+    STDMETHOD(GetRVA)(mdToken tk, ULONG * pulCodeRVA, DWORD * pdwImplFlags) override { return E_NOTIMPL; }
+    STDMETHOD(GetPermissionSetProps)(mdPermission pm, DWORD * pdwAction, void const ** ppvPermission, ULONG * pcbPermission) override { return E_NOTIMPL; }
+    STDMETHOD(GetSigFromToken)(mdSignature mdSig, PCCOR_SIGNATURE * ppvSig, ULONG * pcbSig) override;
+    STDMETHOD(GetModuleRefProps)(mdModuleRef mur, LPWSTR szName, ULONG cchName, ULONG * pchName) override { return E_NOTIMPL; }
+    STDMETHOD(EnumModuleRefs)(HCORENUM * phEnum, mdModuleRef rModuleRefs[], ULONG cmax, ULONG * pcModuleRefs) override { return E_NOTIMPL; }
+    STDMETHOD(GetTypeSpecFromToken)(mdTypeSpec typespec, PCCOR_SIGNATURE * ppvSig, ULONG * pcbSig) override;
+    STDMETHOD(GetNameFromToken)(mdToken tk, MDUTF8CSTR * pszUtf8NamePtr) override { return E_NOTIMPL; }
+    STDMETHOD(EnumUnresolvedMethods)(HCORENUM * phEnum, mdToken rMethods[], ULONG cMax, ULONG * pcTokens) override { return E_NOTIMPL; }
+    STDMETHOD(GetUserString)(mdString stk, LPWSTR szString, ULONG cchString, ULONG * pchString) override { return E_NOTIMPL; }
+    STDMETHOD(GetPinvokeMap)(mdToken tk, DWORD * pdwMappingFlags, LPWSTR szImportName, ULONG cchImportName, ULONG * pchImportName, mdModuleRef * pmrImportDLL) override { return E_NOTIMPL; }
+    STDMETHOD(EnumSignatures)(HCORENUM * phEnum, mdSignature rSignatures[], ULONG cmax, ULONG * pcSignatures) override { return E_NOTIMPL; }
+    STDMETHOD(EnumTypeSpecs)(HCORENUM * phEnum, mdTypeSpec rTypeSpecs[], ULONG cmax, ULONG * pcTypeSpecs) override;
+    STDMETHOD(EnumUserStrings)(HCORENUM * phEnum, mdString rStrings[], ULONG cmax, ULONG * pcStrings) override { return E_NOTIMPL; }
+    STDMETHOD(GetParamForMethodIndex)(mdMethodDef md, ULONG ulParamSeq, mdParamDef * ppd) override { return E_NOTIMPL; }
+    STDMETHOD(EnumCustomAttributes)(HCORENUM * phEnum, mdToken tk, mdToken tkType, mdCustomAttribute rCustomAttributes[], ULONG cMax, ULONG * pcCustomAttributes) override { return E_NOTIMPL; }
+    STDMETHOD(GetCustomAttributeProps)(mdCustomAttribute cv, mdToken * ptkObj, mdToken * ptkType, void const ** ppBlob, ULONG * pcbSize) override { return E_NOTIMPL; }
+    STDMETHOD(FindTypeRef)(mdToken tkResolutionScope, LPCWSTR szName, mdTypeRef * ptr) override { return E_NOTIMPL; }
+    STDMETHOD(GetMemberProps)(mdToken mb, mdTypeDef * pClass, LPWSTR szMember, ULONG cchMember, ULONG * pchMember, DWORD * pdwAttr, PCCOR_SIGNATURE * ppvSigBlob, ULONG * pcbSigBlob, ULONG * pulCodeRVA, DWORD * pdwImplFlags, DWORD * pdwCPlusTypeFlag, UVCP_CONSTANT * ppValue, ULONG * pcchValue) override { return E_NOTIMPL; }
+    STDMETHOD(GetFieldProps)(mdFieldDef mb, mdTypeDef * pClass, LPWSTR szField, ULONG cchField, ULONG * pchField, DWORD * pdwAttr, PCCOR_SIGNATURE * ppvSigBlob, ULONG * pcbSigBlob, DWORD * pdwCPlusTypeFlag, UVCP_CONSTANT * ppValue, ULONG * pcchValue) override { return E_NOTIMPL; }
+    STDMETHOD(GetPropertyProps)(mdProperty prop, mdTypeDef * pClass, LPCWSTR szProperty, ULONG cchProperty, ULONG * pchProperty, DWORD * pdwPropFlags, PCCOR_SIGNATURE * ppvSig, ULONG * pbSig, DWORD * pdwCPlusTypeFlag, UVCP_CONSTANT * ppDefaultValue, ULONG * pcchDefaultValue, mdMethodDef * pmdSetter, mdMethodDef * pmdGetter, mdMethodDef rmdOtherMethod[], ULONG cMax, ULONG * pcOtherMethod) override { return E_NOTIMPL; }
+    STDMETHOD(GetParamProps)(mdParamDef tk, mdMethodDef * pmd, ULONG * pulSequence, LPWSTR szName, ULONG cchName, ULONG * pchName, DWORD * pdwAttr, DWORD * pdwCPlusTypeFlag, UVCP_CONSTANT * ppValue, ULONG * pcchValue) override { return E_NOTIMPL; }
+    STDMETHOD(GetCustomAttributeByName)(mdToken tkObj, LPCWSTR szName, const void ** ppData, ULONG * pcbData) override;
+    STDMETHOD_(BOOL, IsValidToken)(mdToken tk) override;
+    STDMETHOD(GetNestedClassProps)(mdTypeDef tdNestedClass, mdTypeDef * ptdEnclosingClass) override;
+    STDMETHOD(GetNativeCallConvFromSig)(void const * pvSig, ULONG cbSig, ULONG * pCallConv) override { return E_NOTIMPL; }
+    STDMETHOD(IsGlobal)(mdToken pd, int * pbGlobal) override { return E_NOTIMPL; }
+
+    // IMetaDataImport2
+    STDMETHOD(EnumGenericParams)(HCORENUM * phEnum, mdToken tk, mdGenericParam rGenericParams[], ULONG cMax, ULONG * pcGenericParams) override { return E_NOTIMPL; }
+    STDMETHOD(GetGenericParamProps)(mdGenericParam gp, ULONG * pulParamSeq, DWORD * pdwParamFlags, mdToken * ptOwner, DWORD * reserved, LPWSTR wzname, ULONG cchName, ULONG * pchName) override { return E_NOTIMPL; }
+    STDMETHOD(GetMethodSpecProps)(mdMethodSpec mi, mdToken * tkParent, PCCOR_SIGNATURE * ppvSigBlob, ULONG * pcbSigBlob) override;
+    STDMETHOD(EnumGenericParamConstraints)(HCORENUM * phEnum, mdGenericParam tk, mdGenericParamConstraint rGenericParamConstraints[], ULONG cMax, ULONG * pcGenericParamConstraints) override { return E_NOTIMPL; }
+    STDMETHOD(GetGenericParamConstraintProps)(mdGenericParamConstraint gpc, mdGenericParam * ptGenericParam, mdToken * ptkConstraintType) override { return E_NOTIMPL; }
+    STDMETHOD(GetPEKind)(DWORD * pdwPEKind, DWORD * pdwMAchine) override { return E_NOTIMPL; }
+    STDMETHOD(GetVersionString)(LPWSTR pwzBuf, DWORD ccBufSize, DWORD * pccBufSize) override { return E_NOTIMPL; }
+    STDMETHOD(EnumMethodSpecs)(HCORENUM * phEnum, mdToken tk, mdMethodSpec rMethodSpecs[], ULONG cMax, ULONG * pcMethodSpecs) override { return E_NOTIMPL; }
+
+    // IMetaDataEmit
+    STDMETHOD(SetModuleProps)(LPCWSTR szName) override { return E_NOTIMPL; }
+    STDMETHOD(Save)(LPCWSTR szFile, DWORD dwSaveFlags) override { return E_NOTIMPL; }
+    STDMETHOD(SaveToStream)(IStream * pIStream, DWORD dwSaveFlags) override { return E_NOTIMPL; }
+    STDMETHOD(GetSaveSize)(CorSaveSize fSave, DWORD * pdwSaveSize) override { return E_NOTIMPL; }
+    STDMETHOD(DefineTypeDef)(LPCWSTR szTypeDef, DWORD dwTypeDefFlags, mdToken tkExtends, mdToken rtkImplements[], mdTypeDef * ptd) override { return E_NOTIMPL; }
+    STDMETHOD(DefineNestedType)(LPCWSTR szTypeDef, DWORD dwTypeDefFlags, mdToken tkExtends, mdToken rtkImplements[], mdTypeDef tdEncloser, mdTypeDef * ptd) override { return E_NOTIMPL; }
+    STDMETHOD(SetHandler)(IUnknown * pUnk) override { return E_NOTIMPL; }
+    STDMETHOD(DefineMethod)(mdTypeDef td, LPCWSTR szName, DWORD dwMethodFlags, PCCOR_SIGNATURE pvSigBlob, ULONG cbSigBlob, ULONG ulCodeRVA, DWORD dwImplFlags, mdMethodDef * pmd) override { return E_NOTIMPL; }
+    STDMETHOD(DefineMethodImpl)(mdTypeDef td, mdToken tkBody, mdToken tkDecl) override { return E_NOTIMPL; }
+    STDMETHOD(DefineTypeRefByName)(mdToken tkResolutionScope, LPCWSTR szName, mdTypeRef * ptr) override;
+    STDMETHOD(DefineImportType)(IMetaDataAssemblyImport * pAssemImport, const void * pbHashValue, ULONG cbHashValue, IMetaDataImport * pImport, mdTypeDef tdImport, IMetaDataAssemblyEmit * pAssemEmit, mdTypeRef * ptr) override { return E_NOTIMPL; }
+    STDMETHOD(DefineMemberRef)(mdToken tkImport, LPCWSTR szName, PCCOR_SIGNATURE pvSigBlob, ULONG cbSigBlob, mdMemberRef * pmr) override;
+    STDMETHOD(DefineImportMember)(IMetaDataAssemblyImport * pAssemImport, const void * pbHashValue, ULONG cbHashValue, IMetaDataImport * pImport, mdToken mbMember, IMetaDataAssemblyEmit * pAssemEmit, mdToken tkParent, mdMemberRef * pmr) override { return E_NOTIMPL; }
+    STDMETHOD(DefineEvent)(mdTypeDef td, LPCWSTR szEvent, DWORD dwEventFlags, mdToken tkEventType, mdMethodDef mdAddOn, mdMethodDef mdRemoveOn, mdMethodDef mdFire, mdMethodDef rmdOtherMethods[], mdEvent * pmdEvent) override { return E_NOTIMPL; }
+    STDMETHOD(SetClassLayout)(mdTypeDef td, DWORD dwPackSize, COR_FIELD_OFFSET rFieldOffsets[], ULONG ulClassSize) override { return E_NOTIMPL; }
+    STDMETHOD(DeleteClassLayout)(mdTypeDef td) override { return E_NOTIMPL; }
+    STDMETHOD(SetFieldMarshal)(mdToken tk, PCCOR_SIGNATURE pvNativeType, ULONG cbNativeType) override { return E_NOTIMPL; }
+    STDMETHOD(DeleteFieldMarshal)(mdToken tk) override { return E_NOTIMPL; }
+    STDMETHOD(DefinePermissionSet)(mdToken tk, DWORD dwAction, void const * pvPermission, ULONG cbPermission, mdPermission * ppm) override { return E_NOTIMPL; }
+    STDMETHOD(SetRVA)(mdMethodDef md, ULONG ulRVA) override { return E_NOTIMPL; }
+    STDMETHOD(GetTokenFromSig)(PCCOR_SIGNATURE pvSig, ULONG cbSig, mdSignature * pmsig) override;
+    STDMETHOD(DefineModuleRef)(LPCWSTR szName, mdModuleRef * pmur) override { return E_NOTIMPL; }
+    STDMETHOD(SetParent)(mdMemberRef mr, mdToken tk) override { return E_NOTIMPL; }
+    STDMETHOD(GetTokenFromTypeSpec)(PCCOR_SIGNATURE pvSig, ULONG cbSig, mdTypeSpec * ptypespec) override;
+    STDMETHOD(SaveToMemory)(void * pbData, ULONG cbData) override { return E_NOTIMPL; }
+    STDMETHOD(DefineUserString)(LPCWSTR szString, ULONG cchString, mdString * pstk) override { return E_NOTIMPL; }
+    STDMETHOD(DeleteToken)(mdToken tkObj) override { return E_NOTIMPL; }
+    STDMETHOD(SetMethodProps)(mdMethodDef md, DWORD dwMethodFlags, ULONG ulCodeRVA, DWORD dwImplFlags) override { return E_NOTIMPL; }
+    STDMETHOD(SetTypeDefProps)(mdTypeDef td, DWORD dwTypeDefFlags, mdToken tkExtends, mdToken rtkImplements[]) override { return E_NOTIMPL; }
+    STDMETHOD(SetEventProps)(mdEvent ev, DWORD dwEventFlags, mdToken tkEventType, mdMethodDef mdAddOn, mdMethodDef mdRemoveOn, mdMethodDef mdFire, mdMethodDef rmdOtherMethods[]) override { return E_NOTIMPL; }
+    STDMETHOD(SetPermissionSetProps)(mdToken tk, DWORD dwAction, void const * pvPermission, ULONG cbPermission, mdPermission * ppm) override { return E_NOTIMPL; }
+    STDMETHOD(DefinePinvokeMap)(mdToken tk, DWORD dwMappingFlags, LPCWSTR szImportName, mdModuleRef mrImportDLL) override { return E_NOTIMPL; }
+    STDMETHOD(SetPinvokeMap)(mdToken tk, DWORD dwMappingFlags, LPCWSTR szImportName, mdModuleRef mrImportDLL) override { return E_NOTIMPL; }
+    STDMETHOD(DeletePinvokeMap)(mdToken tk) override { return E_NOTIMPL; }
+    STDMETHOD(DefineCustomAttribute)(mdToken tkOwner, mdToken tkCtor, void const * pCustomAttribute, ULONG cbCustomAttribute, mdCustomAttribute * pcv) override { return E_NOTIMPL; }
+    STDMETHOD(SetCustomAttributeValue)(mdCustomAttribute pcv, void const * pCustomAttribute, ULONG cbCustomAttribute) override { return E_NOTIMPL; }
+    STDMETHOD(DefineField)(mdTypeDef td, LPCWSTR szName, DWORD dwFieldFlags, PCCOR_SIGNATURE pvSigBlob, ULONG cbSigBlob, DWORD dwCPlusTypeFlag, void const * pValue, ULONG cchValue, mdFieldDef * pmd) override { return E_NOTIMPL; }
+    STDMETHOD(DefineProperty)(mdTypeDef td, LPCWSTR szProperty, DWORD dwPropFlags, PCCOR_SIGNATURE pvSig, ULONG cbSig, DWORD dwCPlusTypeFlag, void const * pValue, ULONG cchValue, mdMethodDef mdSetter, mdMethodDef mdGetter, mdMethodDef rmdOtherMethods[], mdProperty * pmdProp) override { return E_NOTIMPL; }
+    STDMETHOD(DefineParam)(mdMethodDef md, ULONG ulParamSeq, LPCWSTR szName, DWORD dwParamFlags, DWORD dwCPlusTypeFlag, void const * pValue, ULONG cchValue, mdParamDef * ppd) override { return E_NOTIMPL; }
+    STDMETHOD(SetFieldProps)(mdFieldDef fd, DWORD dwFieldFlags, DWORD dwCPlusTypeFlag, void const * pValue, ULONG cchValue) override { return E_NOTIMPL; }
+    STDMETHOD(SetPropertyProps)(mdProperty pr, DWORD dwPropFlags, DWORD dwCPlusTypeFlag, void const * pValue, ULONG cchValue, mdMethodDef mdSetter, mdMethodDef mdGetter, mdMethodDef rmdOtherMethods[]) override { return E_NOTIMPL; }
+    STDMETHOD(SetParamProps)(mdParamDef pd, LPCWSTR szName, DWORD dwParamFlags, DWORD dwCPlusTypeFlag, void const * pValue, ULONG cchValue) override { return E_NOTIMPL; }
+    STDMETHOD(DefineSecurityAttributeSet)(mdToken tkObj, COR_SECATTR rSecAttrs[], ULONG cSecAttrs, ULONG * pulErrorAttr) override { return E_NOTIMPL; }
+    STDMETHOD(ApplyEditAndContinue)(IUnknown * pImport) override { return E_NOTIMPL; }
+    STDMETHOD(TranslateSigWithScope)(IMetaDataAssemblyImport * pAssemImport, const void * pbHashValue, ULONG cbHashValue, IMetaDataImport * import, PCCOR_SIGNATURE pbSigBlob, ULONG cbSigBlob, IMetaDataAssemblyEmit * pAssemEmit, IMetaDataEmit * emit, PCOR_SIGNATURE pvTranslatedSig, ULONG cbTranslatedSigMax, ULONG * pcbTranslatedSig) override { return E_NOTIMPL; }
+    STDMETHOD(SetMethodImplFlags)(mdMethodDef md, DWORD dwImplFlags) override { return E_NOTIMPL; }
+    STDMETHOD(SetFieldRVA)(mdFieldDef fd, ULONG ulRVA) override { return E_NOTIMPL; }
+    STDMETHOD(Merge)(IMetaDataImport * pImport, IMapToken * pHostMapToken, IUnknown * pHandler) override { return E_NOTIMPL; }
+    STDMETHOD(MergeEnd)() override { return E_NOTIMPL; }
+
+    // IMetaDataEmit2
+    STDMETHOD(DefineMethodSpec)(mdToken tkParent, PCCOR_SIGNATURE pvSigBlob, ULONG cbSigBlob, mdMethodSpec * pmi) override;
+    STDMETHOD(GetDeltaSaveSize)(CorSaveSize fSave, DWORD * pdwSaveSize) override { return E_NOTIMPL; }
+    STDMETHOD(SaveDelta)(LPCWSTR szFile, DWORD dwSaveFlags) override { return E_NOTIMPL; }
+    STDMETHOD(SaveDeltaToStream)(IStream * pIStream, DWORD dwSaveFlags) override { return E_NOTIMPL; }
+    STDMETHOD(SaveDeltaToMemory)(void * pbData, ULONG cbData) override { return E_NOTIMPL; }
+    STDMETHOD(DefineGenericParam)(mdToken tk, ULONG ulParamSeq, DWORD dwParamFlags, LPCWSTR szname, DWORD reserved, mdToken rtkConstraints[], mdGenericParam * pgp) override { return E_NOTIMPL; }
+    STDMETHOD(SetGenericParamProps)(mdGenericParam gp, DWORD dwParamFlags, LPCWSTR szName, DWORD reserved, mdToken rtkConstraints[]) override { return E_NOTIMPL; }
+    STDMETHOD(ResetENCLog)() override { return E_NOTIMPL; }
+
+    // IMetaDataAssemblyImport
+    STDMETHOD(GetAssemblyProps)(mdAssembly mda, const void ** ppbPublicKey, ULONG * pcbPublicKey, ULONG * pulHashAlgId, LPWSTR szName, ULONG cchName, ULONG * pchName, ASSEMBLYMETADATA * pMetaData, DWORD * pdwAssemblyFlags) override { return E_NOTIMPL; }
+    STDMETHOD(GetAssemblyRefProps)(mdAssemblyRef mdar, const void ** ppbPublicKeyOrToken, ULONG * pcbPublicKeyOrToken, LPWSTR szName, ULONG cchName, ULONG * pchName, ASSEMBLYMETADATA * pMetaData, const void ** ppbHashValue, ULONG * pcbHashValue, DWORD * pdwAssemblyRefFlags) override;
+    STDMETHOD(GetFileProps)(mdFile mdf, LPWSTR szName, ULONG cchName, ULONG * pchName, const void ** ppbHashValue, ULONG * pcbHashValue, DWORD * pdwFileFlags) override { return E_NOTIMPL; }
+    STDMETHOD(GetExportedTypeProps)(mdExportedType mdct, LPWSTR szName, ULONG cchName, ULONG * pchName, mdToken * ptkImplementation, mdTypeDef * ptkTypeDef, DWORD * pdwExportedTypeFlags) override { return E_NOTIMPL; }
+    STDMETHOD(GetManifestResourceProps)(mdManifestResource mdmr, LPWSTR szName, ULONG cchName, ULONG * pchName, mdToken * ptkImplementation, DWORD * pdwOffset, DWORD * pdwResourceFlags) override { return E_NOTIMPL; }
+    STDMETHOD(EnumAssemblyRefs)(HCORENUM * phEnum, mdAssemblyRef rAssemblyRefs[], ULONG cMax, ULONG * pcTokens) override;
+    STDMETHOD(EnumFiles)(HCORENUM * phEnum, mdFile rFiles[], ULONG cMax, ULONG * pcTokens) override { return E_NOTIMPL; }
+    STDMETHOD(EnumExportedTypes)(HCORENUM * phEnum, mdExportedType rExportedTypes[], ULONG cMax, ULONG * pcTokens) override { return E_NOTIMPL; }
+    STDMETHOD(EnumManifestResources)(HCORENUM * phEnum, mdManifestResource rManifestResources[], ULONG cMax, ULONG * pcTokens) override { return E_NOTIMPL; }
+    STDMETHOD(GetAssemblyFromScope)(mdAssembly * ptkAssembly) override;
+    STDMETHOD(FindExportedTypeByName)(LPCWSTR szName, mdToken mdtExportedType, mdExportedType * ptkExportedType) override { return E_NOTIMPL; }
+    STDMETHOD(FindManifestResourceByName)(LPCWSTR szName, mdManifestResource * ptkManifestResource) override { return E_NOTIMPL; }
+    STDMETHOD(FindAssembliesByName)(LPCWSTR szAppBase, LPCWSTR szPrivateBin, LPCWSTR szAssemblyName, IUnknown * ppIUnk[], ULONG cMax, ULONG * pcAssemblies) override { return E_NOTIMPL; }
+
+    // IMetaDataAssemblyEmit
+    STDMETHOD(DefineAssembly)(const void * pbPublicKey, ULONG cbPublicKey, ULONG ulHashAlgId, LPCWSTR szName, const ASSEMBLYMETADATA * pMetaData, DWORD dwAssemblyFlags, mdAssembly * pma) override { return E_NOTIMPL; }
+    STDMETHOD(DefineAssemblyRef)(const void * pbPublicKeyOrToken, ULONG cbPublicKeyOrToken, LPCWSTR szName, const ASSEMBLYMETADATA * pMetaData, const void * pbHashValue, ULONG cbHashValue, DWORD dwAssemblyRefFlags, mdAssemblyRef * pmdar) override;
+    STDMETHOD(DefineFile)(LPCWSTR szName, const void * pbHashValue, ULONG cbHashValue, DWORD dwFileFlags, mdFile * pmdf) override { return E_NOTIMPL; }
+    STDMETHOD(DefineExportedType)(LPCWSTR szName, mdToken tkImplementation, mdTypeDef tkTypeDef, DWORD dwExportedTypeFlags, mdExportedType * pmdct) override { return E_NOTIMPL; }
+    STDMETHOD(DefineManifestResource)(LPCWSTR szName, mdToken tkImplementation, DWORD dwOffset, DWORD dwResourceFlags, mdManifestResource * pmdmr) override { return E_NOTIMPL; }
+    STDMETHOD(SetAssemblyProps)(mdAssembly pma, const void * pbPublicKey, ULONG cbPublicKey, ULONG ulHashAlgId, LPCWSTR szName, const ASSEMBLYMETADATA * pMetaData, DWORD dwAssemblyFlags) override { return E_NOTIMPL; }
+    STDMETHOD(SetAssemblyRefProps)(mdAssemblyRef ar, const void * pbPublicKeyOrToken, ULONG cbPublicKeyOrToken, LPCWSTR szName, const ASSEMBLYMETADATA * pMetaData, const void * pbHashValue, ULONG cbHashValue, DWORD dwAssemblyRefFlags) override { return E_NOTIMPL; }
+    STDMETHOD(SetFileProps)(mdFile file, const void * pbHashValue, ULONG cbHashValue, DWORD dwFileFlags) override { return E_NOTIMPL; }
+    STDMETHOD(SetExportedTypeProps)(mdExportedType ct, mdToken tkImplementation, mdTypeDef tkTypeDef, DWORD dwExportedTypeFlags) override { return E_NOTIMPL; }
+    STDMETHOD(SetManifestResourceProps)(mdManifestResource mr, mdToken tkImplementation, DWORD dwOffset, DWORD dwResourceFlags) override { return E_NOTIMPL; }
+
+    // IMetaDataTables
+    STDMETHOD(GetStringHeapSize)(ULONG * pcbStrings) override { return E_NOTIMPL; }
+    STDMETHOD(GetBlobHeapSize)(ULONG * pcbBlobs) override { return E_NOTIMPL; }
+    STDMETHOD(GetGuidHeapSize)(ULONG * pcbGuids) override { return E_NOTIMPL; }
+    STDMETHOD(GetUserStringHeapSize)(ULONG * pcbBlobs) override { return E_NOTIMPL; }
+    STDMETHOD(GetNumTables)(ULONG * pcTables) override { return E_NOTIMPL; }
+    STDMETHOD(GetTableIndex)(ULONG token, ULONG * pixTbl) override { return E_NOTIMPL; }
+    STDMETHOD(GetTableInfo)(ULONG ixTbl, ULONG * pcbRow, ULONG * pcRows, ULONG * pcCols, ULONG * piKey, const char ** ppName) override;
+    STDMETHOD(GetColumnInfo)(ULONG ixTbl, ULONG ixCol, ULONG * poCol, ULONG * pcbCol, ULONG * pType, const char ** ppName) override { return E_NOTIMPL; }
+    STDMETHOD(GetCodedTokenInfo)(ULONG ixCd, ULONG * pcTokens, ULONG ** ppTokens, const char ** ppName) override { return E_NOTIMPL; }
+    STDMETHOD(GetRow)(ULONG ixTbl, ULONG rid, void ** ppRow) override { return E_NOTIMPL; }
+    STDMETHOD(GetColumn)(ULONG ixTbl, ULONG ixCol, ULONG rid, ULONG * pVal) override { return E_NOTIMPL; }
+    STDMETHOD(GetString)(ULONG ixString, const char ** ppString) override { return E_NOTIMPL; }
+    STDMETHOD(GetBlob)(ULONG ixBlob, ULONG * pcbData, const void ** ppData) override { return E_NOTIMPL; }
+    STDMETHOD(GetGuid)(ULONG ixGuid, const GUID ** ppGUID) override { return E_NOTIMPL; }
+    STDMETHOD(GetUserString)(ULONG ixUserString, ULONG * pcbData, const void ** ppData) override { return E_NOTIMPL; }
+    STDMETHOD(GetNextString)(ULONG ixString, ULONG * pNext) override { return E_NOTIMPL; }
+    STDMETHOD(GetNextBlob)(ULONG ixBlob, ULONG * pNext) override { return E_NOTIMPL; }
+    STDMETHOD(GetNextGuid)(ULONG ixGuid, ULONG * pNext) override { return E_NOTIMPL; }
+    STDMETHOD(GetNextUserString)(ULONG ixUserString, ULONG * pNext) override { return E_NOTIMPL; }
+
+private:
+    struct MockMethodSpec
+    {
+        mdToken m_tkParent;
+        std::vector<BYTE> m_sig;
+    };
+
+    struct MockTypeDef
+    {
+        bool m_fByRefLike;
+        WSTRING m_name;
+        mdTypeDef m_tkEnclosing;
+    };
+
+    struct MockTypeRef
+    {
+        mdToken m_tkResolutionScope;
+        WSTRING m_name;
+    };
+
+    typedef std::map<std::vector<BYTE>, mdToken> SigIndex;
+
+    // Unlocked; the callers hold m_lock
+    MockMethod * findMethod(mdMethodDef tkMethod);
+    mdMethodSpec addMethodSpec(mdToken tkParent, const std::vector<BYTE> &sig);
+    mdAssemblyRef addAssemblyRef(const WSTRING &name);
+    mdTypeRef addTypeRef(mdToken tkResolutionScope, const WSTRING &name);
+
+    // Appends sig to sigs, whose tokens are their 1-based positions, and indexes the first of equal ones
+    static mdToken addSig(std::vector<std::vector<BYTE>> &sigs, SigIndex &index, CorTokenType tokenType,
+        const std::vector<BYTE> &sig);
+
+    // Finds sig, or appends it and sets *pfAdded
+    static mdToken findOrAddSig(std::vector<std::vector<BYTE>> &sigs, SigIndex &index, CorTokenType tokenType,
+        PCCOR_SIGNATURE pSig, ULONG cbSig, bool * pfAdded);
+
+    std::map<mdMethodDef, MockMethod> m_methods;
+    std::vector<std::vector<BYTE>> m_memberRefs;
+    std::vector<std::vector<BYTE>> m_signatures;
+    std::vector<std::vector<BYTE>> m_typeSpecs;
+    std::vector<MockMethodSpec> m_methodSpecs;
+    SigIndex m_signatureIndex;
+    SigIndex m_typeSpecIndex;
+    std::map<std::pair<mdToken, std::vector<BYTE>>, mdMethodSpec> m_methodSpecIndex;
+    std::vector<MockTypeDef> m_typeDefs;
+    std::vector<WSTRING> m_assemblyRefs;
+    std::vector<MockTypeRef> m_typeRefs;
+    std::map<std::tuple<mdToken, WSTRING, std::vector<BYTE>>, mdMemberRef> m_memberRefIndex;
+
+    ULONG m_cDefinedSignatures = 0;
+    ULONG m_cDefinedMethodSpecs = 0;
+    std::atomic<ULONG> m_cRef { 0 };
+    std::shared_mutex m_lock;
+};
+
+class MockProfilerInfo : public ICorProfilerInfo2
+{
+public:
+    MockProfilerInfo(MockMetaData * pMetaData, MockMethodMalloc * pMethodMalloc);
+
+    // Serves another module under moduleId; the modules not added are all served from the
+    // metadata and allocator given to the constructor
+    void AddModule(ModuleID moduleId, MockMetaData * pMetaData, MockMethodMalloc * pMethodMalloc, const WSTRING &path);
+
+    // The body SetILFunctionBody set last for the method, if any, in whichever module
+    LPCBYTE GetNewBody(mdMethodDef tkMethod);
+
+    ULONG GetSetBodyCount()
+    {
+        return m_cSetBodies.load(std::memory_order_relaxed);
+    }
+
+    STDMETHOD(QueryInterface)(REFIID riid, void ** ppvObject) override;
+    STDMETHOD_(ULONG, AddRef)() override;
+    STDMETHOD_(ULONG, Release)() override;
+
+    // ICorProfilerInfo
+    STDMETHOD(GetClassFromObject)(ObjectID objectId, ClassID * pClassId) override { return E_NOTIMPL; }
+    STDMETHOD(GetClassFromToken)(ModuleID moduleId, mdTypeDef typeDef, ClassID * pClassId) override { return E_NOTIMPL; }
+    STDMETHOD(GetCodeInfo)(FunctionID functionId, LPCBYTE * pStart, ULONG * pcSize) override { return E_NOTIMPL; }
+    STDMETHOD(GetEventMask)(DWORD * pdwEvents) override { return E_NOTIMPL; }
+    STDMETHOD(GetFunctionFromIP)(LPCBYTE ip, FunctionID * pFunctionId) override { return E_NOTIMPL; }
+    STDMETHOD(GetFunctionFromToken)(ModuleID moduleId, mdToken token, FunctionID * pFunctionId) override { return E_NOTIMPL; }
+    STDMETHOD(GetHandleFromThread)(ThreadID threadId, HANDLE * phThread) override { return E_NOTIMPL; }
+    STDMETHOD(GetObjectSize)(ObjectID objectId, ULONG * pcSize) override { return E_NOTIMPL; }
+    STDMETHOD(IsArrayClass)(ClassID classId, CorElementType * pBaseElemType, ClassID * pBaseClassId, ULONG * pcRank) override { return E_NOTIMPL; }
+    STDMETHOD(GetThreadInfo)(ThreadID threadId, DWORD * pdwWin32ThreadId) override { return E_NOTIMPL; }
+    STDMETHOD(GetCurrentThreadID)(ThreadID * pThreadId) override { return E_NOTIMPL; }
+    STDMETHOD(GetClassIDInfo)(ClassID classId, ModuleID * pModuleId, mdTypeDef * pTypeDefToken) override { return E_NOTIMPL; }
+    STDMETHOD(GetFunctionInfo)(FunctionID functionId, ClassID * pClassId, ModuleID * pModuleId, mdToken * pToken) override;
+    STDMETHOD(SetEventMask)(DWORD dwEvents) override { return E_NOTIMPL; }
+    STDMETHOD(SetEnterLeaveFunctionHooks)(FunctionEnter * pFuncEnter, FunctionLeave * pFuncLeave, FunctionTailcall * pFuncTailcall) override { return E_NOTIMPL; }
+    STDMETHOD(SetFunctionIDMapper)(FunctionIDMapper * pFunc) override { return E_NOTIMPL; }
+    STDMETHOD(GetTokenAndMetaDataFromFunction)(FunctionID functionId, REFIID riid, IUnknown ** ppImport, mdToken * pToken) override { return E_NOTIMPL; }
+    STDMETHOD(GetModuleInfo)(ModuleID moduleId, LPCBYTE * ppBaseLoadAddress, ULONG cchName, ULONG * pcchName, WCHAR szName[], AssemblyID * pAssemblyId) override;
+    STDMETHOD(GetModuleMetaData)(ModuleID moduleId, DWORD dwOpenFlags, REFIID riid, IUnknown ** ppOut) override;
+    STDMETHOD(GetILFunctionBody)(ModuleID moduleId, mdMethodDef methodId, LPCBYTE * ppMethodHeader, ULONG * pcbMethodSize) override;
+    STDMETHOD(GetILFunctionBodyAllocator)(ModuleID moduleId, IMethodMalloc ** ppMalloc) override;
+    STDMETHOD(SetILFunctionBody)(ModuleID moduleId, mdMethodDef methodid, LPCBYTE pbNewILMethodHeader) override;
+    STDMETHOD(GetAppDomainInfo)(AppDomainID appDomainId, ULONG cchName, ULONG * pcchName, WCHAR szName[], ProcessID * pProcessId) override { return E_NOTIMPL; }
+    STDMETHOD(GetAssemblyInfo)(AssemblyID assemblyId, ULONG cchName, ULONG * pcchName, WCHAR szName[], AppDomainID * pAppDomainId, ModuleID * pModuleId) override { return E_NOTIMPL; }
+    STDMETHOD(SetFunctionReJIT)(FunctionID functionId) override { return E_NOTIMPL; }
+    STDMETHOD(ForceGC)() override { return E_NOTIMPL; }
+    STDMETHOD(SetILInstrumentedCodeMap)(FunctionID functionId, BOOL fStartJit, ULONG cILMapEntries, COR_IL_MAP rgILMapEntries[]) override { return E_NOTIMPL; }
+    STDMETHOD(GetInprocInspectionInterface)(IUnknown ** ppicd) override { return E_NOTIMPL; }
+    STDMETHOD(GetInprocInspectionIThisThread)(IUnknown ** ppicd) override { return E_NOTIMPL; }
+    STDMETHOD(GetThreadContext)(ThreadID threadId, ContextID * pContextId) override { return E_NOTIMPL; }
+    STDMETHOD(BeginInprocDebugging)(BOOL fThisThreadOnly, DWORD * pdwProfilerContext) override { return E_NOTIMPL; }
+    STDMETHOD(EndInprocDebugging)(DWORD dwProfilerContext) override { return E_NOTIMPL; }
+    STDMETHOD(GetILToNativeMapping)(FunctionID functionId, ULONG32 cMap, ULONG32 * pcMap, COR_DEBUG_IL_TO_NATIVE_MAP map[]) override { return E_NOTIMPL; }
+
+    // ICorProfilerInfo2
+    STDMETHOD(DoStackSnapshot)(ThreadID thread, StackSnapshotCallback * callback, ULONG32 infoFlags, void * clientData, BYTE context[], ULONG32 contextSize) override { return E_NOTIMPL; }
+    STDMETHOD(SetEnterLeaveFunctionHooks2)(FunctionEnter2 * pFuncEnter, FunctionLeave2 * pFuncLeave, FunctionTailcall2 * pFuncTailcall) override { return E_NOTIMPL; }
+    STDMETHOD(GetFunctionInfo2)(FunctionID funcId, COR_PRF_FRAME_INFO frameInfo, ClassID * pClassId, ModuleID * pModuleId, mdToken * pToken, ULONG32 cTypeArgs, ULONG32 * pcTypeArgs, ClassID typeArgs[]) override { return E_NOTIMPL; }
+    STDMETHOD(GetStringLayout)(ULONG * pBufferLengthOffset, ULONG * pStringLengthOffset, ULONG * pBufferOffset) override { return E_NOTIMPL; }
+    STDMETHOD(GetClassLayout)(ClassID classID, COR_FIELD_OFFSET rFieldOffset[], ULONG cFieldOffset, ULONG * pcFieldOffset, ULONG * pulClassSize) override { return E_NOTIMPL; }
+    STDMETHOD(GetClassIDInfo2)(ClassID classId, ModuleID * pModuleId, mdTypeDef * pTypeDefToken, ClassID * pParentClassId, ULONG32 cNumTypeArgs, ULONG32 * pcNumTypeArgs, ClassID typeArgs[]) override { return E_NOTIMPL; }
+    STDMETHOD(GetCodeInfo2)(FunctionID functionID, ULONG32 cCodeInfos, ULONG32 * pcCodeInfos, COR_PRF_CODE_INFO codeInfos[]) override { return E_NOTIMPL; }
+    STDMETHOD(GetClassFromTokenAndTypeArgs)(ModuleID moduleID, mdTypeDef typeDef, ULONG32 cTypeArgs, ClassID typeArgs[], ClassID * pClassID) override { return E_NOTIMPL; }
+    STDMETHOD(GetFunctionFromTokenAndTypeArgs)(ModuleID moduleID, mdMethodDef funcDef, ClassID classId, ULONG32 cTypeArgs, ClassID typeArgs[], FunctionID * pFunctionID) override { return E_NOTIMPL; }
+    STDMETHOD(EnumModuleFrozenObjects)(ModuleID moduleID, ICorProfilerObjectEnum ** ppEnum) override { return E_NOTIMPL; }
+    STDMETHOD(GetArrayObjectInfo)(ObjectID objectId, ULONG32 cDimensions, ULONG32 pDimensionSizes[], int pDimensionLowerBounds[], BYTE ** ppData) override { return E_NOTIMPL; }
+    STDMETHOD(GetBoxClassLayout)(ClassID classId, ULONG32 * pBufferOffset) override { return E_NOTIMPL; }
+    STDMETHOD(GetThreadAppDomain)(ThreadID threadId, AppDomainID * pAppDomainId) override { return E_NOTIMPL; }
+    STDMETHOD(GetRVAStaticAddress)(ClassID classId, mdFieldDef fieldToken, void ** ppAddress) override { return E_NOTIMPL; }
+    STDMETHOD(GetAppDomainStaticAddress)(ClassID classId, mdFieldDef fieldToken, AppDomainID appDomainId, void ** ppAddress) override { return E_NOTIMPL; }
+    STDMETHOD(GetThreadStaticAddress)(ClassID classId, mdFieldDef fieldToken, ThreadID threadId, void ** ppAddress) override { return E_NOTIMPL; }
+    STDMETHOD(GetContextStaticAddress)(ClassID classId, mdFieldDef fieldToken, ContextID contextId, void ** ppAddress) override { return E_NOTIMPL; }
+    STDMETHOD(GetStaticFieldInfo)(ClassID classId, mdFieldDef fieldToken, COR_PRF_STATIC_TYPE * pFieldInfo) override { return E_NOTIMPL; }
+    STDMETHOD(GetGenerationBounds)(ULONG cObjectRanges, ULONG * pcObjectRanges, COR_PRF_GC_GENERATION_RANGE ranges[]) override { return E_NOTIMPL; }
+    STDMETHOD(GetObjectGeneration)(ObjectID objectId, COR_PRF_GC_GENERATION_RANGE * range) override { return E_NOTIMPL; }
+    STDMETHOD(GetNotifiedExceptionClauseInfo)(COR_PRF_EX_CLAUSE_INFO * pinfo) override { return E_NOTIMPL; }
+
+private:
+    struct MockModule
+    {
+        MockMetaData * m_pMetaData;
+        MockMethodMalloc * m_pMethodMalloc;
+        WSTRING m_path;
+    };
+
+    MockModule findModule(ModuleID moduleId);
+
+    MockMetaData * m_pMetaData;
+    MockMethodMalloc * m_pMethodMalloc;
+    std::map<ModuleID, MockModule> m_modules;
+    std::shared_mutex m_modulesLock;
+    std::map<mdMethodDef, LPCBYTE> m_newBodies;
+    std::mutex m_newBodiesLock;
+    std::atomic<ULONG> m_cSetBodies { 0 };
+    std::atomic<ULONG> m_cRef { 0 };
+};
+
+// The FunctionID GetFunctionInfo maps back to the method of the module
+FunctionID MakeMockFunctionID(ModuleID moduleId, mdMethodDef tkMethod);
+
+// Sets up a ModuleContext the way ClrModule prepares one: probe references with the
+// signatures of ManagedLayer's probes, and the interfaces of pMetaData
+void PrepareMockModuleContext(MockMetaData * pMetaData, MockMethodMalloc * pMethodMalloc, ModuleContext &context);
@@ -0,0 +1,377 @@
+#include "stdafx.h"
+#include "ProfilerData.h"
+#include "ILRewriter.h"
+#include "Mocks.h"
+#include "MetadataReader.h"
+#include "ILDecoder.h"
+#include "Diagnostics.h"
+#include "Constants.h"
+#include "RewriteCache.h"
+#include "Misc.h"
+
+#include <algorithm>
+#include <new>
+
+// Measures RewriteIL offline: every IL body of the given assemblies is rewritten against
+// the mocks, first once to warm up, then --iterations times measured.  The probes are the
+// ones of a module outside the fast-probe selection, without sampling, and without exit
+// probes unless --exit-probes is given.
+//
+//     RewriteBenchmark [--iterations N] [--exit-probes] [--rewrite-cache] assembly.dll...
+//
+// --rewrite-cache then rewrites every method once more with a rewrite cache file of its own,
+// empty, as the first run of a process does, and once more from the file it flushed, as
+// every run after does.
+//
+// The dump of rewritten bodies costs nothing unless the build has COREPROFILER_DIAGNOSTICS;
+// comparing a run of each build, with and without COREPROFILER_DUMP_FILE set, shows what
+// it costs compiled in, off and on.
+
+// Heap allocations of the process: operator new is replaced below and the link wraps
+// malloc, calloc and realloc (see CMakeLists.txt)
+static UINT64 s_cbHeapAllocated = 0;
+
+extern "C" void * __real_malloc(size_t size);
+extern "C" void * __real_calloc(size_t count, size_t size);
+extern "C" void * __real_realloc(void * p, size_t size);
+
+extern "C" void * __wrap_malloc(size_t size)
+{
+    s_cbHeapAllocated += size;
+    return __real_malloc(size);
+}
+
+extern "C" void * __wrap_calloc(size_t count, size_t size)
+{
+    s_cbHeapAllocated += count * size;
+    return __real_calloc(count, size);
+}
+
+extern "C" void * __wrap_realloc(void * p, size_t size)
+{
+    s_cbHeapAllocated += size;
+    return __real_realloc(p, size);
+}
+
+void * operator new(size_t size)
+{
+    void * p = malloc(size == 0 ? 1 : size);
+    if (p == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+
+    return p;
+}
+
+void * operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void * p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void * p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void * p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void * p, size_t) noexcept
+{
+    free(p);
+}
+
+struct BenchmarkSamples
+{
+    std::vector<UINT64> m_ns;
+    std::vector<UINT64> m_heapBytes;
+    std::vector<UINT64> m_arenaBytes;
+    UINT64 m_cbMethodMalloc = 0;
+    UINT64 m_nInstrs = 0;
+    UINT64 m_cFailures = 0;
+
+    void Append(const BenchmarkSamples &other)
+    {
+        m_ns.insert(m_ns.end(), other.m_ns.begin(), other.m_ns.end());
+        m_heapBytes.insert(m_heapBytes.end(), other.m_heapBytes.begin(), other.m_heapBytes.end());
+        m_arenaBytes.insert(m_arenaBytes.end(), other.m_arenaBytes.begin(), other.m_arenaBytes.end());
+        m_cbMethodMalloc += other.m_cbMethodMalloc;
+        m_nInstrs += other.m_nInstrs;
+        m_cFailures += other.m_cFailures;
+    }
+};
+
+static void reportDistribution(const char * szName, std::vector<UINT64> samples)
+{
+    if (samples.empty() == true)
+    {
+        return;
+    }
+
+    std::sort(samples.begin(), samples.end());
+
+    UINT64 total = 0;
+    for (UINT64 sample : samples)
+    {
+        total += sample;
+    }
+
+    auto percentile = [&samples](size_t p) { return (unsigned long long)samples[(samples.size() - 1) * p / 100]; };
+
+    printf("  %-16s mean %10.1f  p50 %8llu  p90 %8llu  p99 %8llu  max %8llu\n", szName, (double)total / samples.size(),
+        percentile(50), percentile(90), percentile(99), (unsigned long long)samples.back());
+}
+
+static void report(const char * szName, const BenchmarkSamples &samples)
+{
+    UINT64 totalNs = 0;
+    for (UINT64 ns : samples.m_ns)
+    {
+        totalNs += ns;
+    }
+
+    printf("%s: %zu rewrites, %llu failed\n", szName, samples.m_ns.size(), (unsigned long long)samples.m_cFailures);
+    reportDistribution("ns/method", samples.m_ns);
+    reportDistribution("heap B/method", samples.m_heapBytes);
+    reportDistribution("arena B/method", samples.m_arenaBytes);
+
+    if (samples.m_ns.empty() == false)
+    {
+        printf("  %-16s mean %10.1f\n", "IMethodMalloc B", (double)samples.m_cbMethodMalloc / samples.m_ns.size());
+    }
+
+    printf("  %-16s %.0f\n", "instructions/s", totalNs ? samples.m_nInstrs * 1e9 / totalNs : 0.0);
+}
+
+// The number of instructions of the body, or 0 if it can't be decoded
+static unsigned countInstrs(const std::vector<BYTE> &body)
+{
+    COR_ILMETHOD_DECODER decoder((const COR_ILMETHOD *)body.data());
+
+    std::vector<ILDecodedInstr> instrs;
+    if (DecodeIL(decoder.Code, decoder.GetCodeSize(), &instrs) == false)
+    {
+        return 0;
+    }
+
+    return (unsigned)instrs.size();
+}
+
+// Rewrites every method once
+static void measurePass(MockProfilerInfo * pProfilerInfo, MockMethodMalloc * pMethodMalloc, ModuleID moduleId,
+    ModuleContext &context, const std::vector<std::pair<mdMethodDef, unsigned>> &methods, BenchmarkSamples * pSamples)
+{
+    for (const auto &method : methods)
+    {
+        UINT64 cbHeapBefore = s_cbHeapAllocated;
+        UINT64 cbArenaBefore = GetILArenaAllocatedBytes();
+        UINT64 cbMethodMallocBefore = pMethodMalloc->GetBytesAllocated();
+
+        auto start = std::chrono::steady_clock::now();
+        HRESULT hr = RewriteIL(pProfilerInfo, NULL, moduleId, method.first, context);
+        auto end = std::chrono::steady_clock::now();
+
+        if (FAILED(hr))
+        {
+            pSamples->m_cFailures++;
+            continue;
+        }
+
+        pSamples->m_ns.push_back((UINT64)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        pSamples->m_heapBytes.push_back(s_cbHeapAllocated - cbHeapBefore);
+        pSamples->m_arenaBytes.push_back(GetILArenaAllocatedBytes() - cbArenaBefore);
+        pSamples->m_cbMethodMalloc += pMethodMalloc->GetBytesAllocated() - cbMethodMallocBefore;
+        pSamples->m_nInstrs += method.second;
+    }
+
+    pMethodMalloc->Reset();
+}
+
+static UINT64 totalMs(const BenchmarkSamples &samples)
+{
+    UINT64 totalNs = 0;
+    for (UINT64 ns : samples.m_ns)
+    {
+        totalNs += ns;
+    }
+
+    return totalNs / 1000000;
+}
+
+// The passes of --rewrite-cache; the cache is left off
+static void measureCache(MockProfilerInfo * pProfilerInfo, MockMethodMalloc * pMethodMalloc,
+    ModuleID moduleId, ModuleContext &context, const std::vector<std::pair<mdMethodDef, unsigned>> &methods,
+    BenchmarkSamples * pCold, BenchmarkSamples * pWarm)
+{
+    std::filesystem::path cachePath = std::filesystem::temp_directory_path() /
+        ("RewriteBenchmark." + std::to_string(getCurrentProcessId()) + ".cache");
+    std::error_code error;
+    std::filesystem::remove(cachePath, error);
+
+    BenchmarkSamples cold;
+    g_rewriteCache.Open(fromPath(cachePath));
+    measurePass(pProfilerInfo, pMethodMalloc, moduleId, context, methods, &cold);
+    g_rewriteCache.Flush();
+
+    uintmax_t cbFile = std::filesystem::file_size(cachePath, error);
+
+    BenchmarkSamples warm;
+    bool fMapped = g_rewriteCache.Open(fromPath(cachePath));
+    measurePass(pProfilerInfo, pMethodMalloc, moduleId, context, methods, &warm);
+
+    g_rewriteCache.Open(WSTRING());
+    std::filesystem::remove(cachePath, error);
+
+    printf("rewrite cache: %s, %llu B file\n", fMapped ? "mapped" : "not mapped", (unsigned long long)(error ? 0 : cbFile));
+    report("cold cache", cold);
+    report("warm cache", warm);
+
+    pCold->Append(cold);
+    pWarm->Append(warm);
+}
+
+static bool benchmarkAssembly(const char * szPath, int cIterations, bool fExitProbes, bool fRewriteCache,
+    BenchmarkSamples * pSamples, BenchmarkSamples * pCold, BenchmarkSamples * pWarm)
+{
+    MetadataReader reader;
+    MockMetaData metaData;
+    if (reader.Load(szPath) == false || reader.Fill(&metaData) == false)
+    {
+        fprintf(stderr, "%s: %s\n", szPath, reader.GetError().c_str());
+        return false;
+    }
+
+    MockMethodMalloc methodMalloc;
+    MockProfilerInfo profilerInfo(&metaData, &methodMalloc);
+    ModuleContext context;
+    PrepareMockModuleContext(&metaData, &methodMalloc, context);
+
+    // A cookie is what turns the exit probes on
+    if (fExitProbes == true)
+    {
+        context.m_moduleCookie = 0;
+    }
+
+    std::vector<std::pair<mdMethodDef, unsigned>> methods;
+    for (const auto &method : metaData.GetMethods())
+    {
+        unsigned nInstrs = method.second.m_body.empty() ? 0 : countInstrs(method.second.m_body);
+        if (nInstrs != 0)
+        {
+            methods.push_back(std::make_pair(method.first, nInstrs));
+        }
+    }
+
+    const ModuleID moduleId = 1;
+
+    // The warm-up pass defines the method specs and local signatures the rewrites need,
+    // which a module does once
+    for (const auto &method : methods)
+    {
+        RewriteIL(&profilerInfo, NULL, moduleId, method.first, context);
+    }
+    methodMalloc.Reset();
+
+    BenchmarkSamples samples;
+    for (int iteration = 0; iteration < cIterations; iteration++)
+    {
+        measurePass(&profilerInfo, &methodMalloc, moduleId, context, methods, &samples);
+    }
+
+    report(szPath, samples);
+    pSamples->Append(samples);
+
+    if (fRewriteCache == true)
+    {
+        measureCache(&profilerInfo, &methodMalloc, moduleId, context, methods, pCold, pWarm);
+    }
+
+    return true;
+}
+
+int main(int argc, char * argv[])
+{
+    int cIterations = 5;
+    bool fExitProbes = false;
+    bool fRewriteCache = false;
+    std::vector<const char *> paths;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+        {
+            cIterations = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--exit-probes") == 0)
+        {
+            fExitProbes = true;
+        }
+        else if (strcmp(argv[i], "--rewrite-cache") == 0)
+        {
+            fRewriteCache = true;
+        }
+        else
+        {
+            paths.push_back(argv[i]);
+        }
+    }
+
+    if (paths.empty() == true || cIterations <= 0)
+    {
+        fprintf(stderr, "usage: RewriteBenchmark [--iterations N] [--exit-probes] [--rewrite-cache] assembly.dll...\n");
+        return 2;
+    }
+
+#if PROFILER_DIAGNOSTICS
+    WSTRING dumpFile;
+    if (getEnvironmentString(ENV_DUMP_FILE, dumpFile) == true)
+    {
+        printf("body dump: to %s\n", toUtf8(dumpFile).c_str());
+    }
+    else
+    {
+        printf("body dump: off\n");
+    }
+#else
+    printf("body dump: compiled out\n");
+#endif
+
+    BenchmarkSamples total;
+    BenchmarkSamples totalCold;
+    BenchmarkSamples totalWarm;
+    int cFailedAssemblies = 0;
+    for (const char * szPath : paths)
+    {
+        if (benchmarkAssembly(szPath, cIterations, fExitProbes, fRewriteCache, &total, &totalCold, &totalWarm) == false)
+        {
+            cFailedAssemblies++;
+        }
+    }
+
+    if (paths.size() > 1)
+    {
+        report("total", total);
+    }
+
+    if (fRewriteCache == true)
+    {
+        if (paths.size() > 1)
+        {
+            report("total cold cache", totalCold);
+            report("total warm cache", totalWarm);
+        }
+
+        printf("rewrite cache: %zu methods in %llu ms cold, %llu ms warm\n", totalWarm.m_ns.size(),
+            (unsigned long long)totalMs(totalCold), (unsigned long long)totalMs(totalWarm));
+    }
+
+    return cFailedAssemblies == 0 ? 0 : 1;
+}
@@ -0,0 +1,737 @@
+#include "stdafx.h"
+#include "ProfilerData.h"
+#include "ILRewriter.h"
+#include "Mocks.h"
+#include "MetadataReader.h"
+#include "ILDecoder.h"
+
+#include <dirent.h>
+#include <random>
+#include <sys/stat.h>
+
+// Round-trips method bodies through ILRewriter's Import and Export with no probes, and
+// checks what comes out against what went in:
+//
+//  - the same instructions with the same operands; only branches may change between
+//    their short and long forms, and their targets are compared as instructions
+//  - the same header flags and locals, and EH clauses that cover the same instructions
+//  - a max stack no lower than the imported one, and no higher than the code can push
+//  - a second round-trip of the output gives the same bytes
+//
+// A body the rewriter refuses is fine; one it accepts has to pass the checks.
+//
+// A fuzz input is one byte selecting the signature of the method (see CheckInput) followed
+// by the body.  With -DCOREPROFILER_LIBFUZZER=ON and clang this builds as a libFuzzer
+// target; otherwise main() takes
+//
+//     RoundTripFuzzer [--random N] [--seed S] [--write-corpus DIR] input|directory|assembly.dll...
+//
+// where --random checks N generated bodies, and assemblies have every IL body checked
+// against their own metadata.  --write-corpus writes the bodies of the assemblies as
+// fuzz inputs, to seed libFuzzer.
+
+enum RoundTripResult
+{
+    RoundTripRefused,
+    RoundTripPassed,
+    RoundTripFailed,
+};
+
+struct RoundTripStats
+{
+    UINT64 m_cPassed = 0;
+    UINT64 m_cRefused = 0;
+    UINT64 m_cFailed = 0;
+
+    void Add(RoundTripResult result)
+    {
+        if (result == RoundTripPassed)
+            m_cPassed++;
+        else if (result == RoundTripRefused)
+            m_cRefused++;
+        else
+            m_cFailed++;
+    }
+};
+
+static bool fail(std::string * pError, const char * szFormat, ...)
+{
+    char buffer[256];
+
+    va_list args;
+    va_start(args, szFormat);
+    vsnprintf(buffer, sizeof(buffer), szFormat, args);
+    va_end(args);
+
+    *pError = buffer;
+    return false;
+}
+
+// Index of the instruction at each offset, the end of the code being one past the last;
+// -1 between instructions
+static std::vector<int> mapOffsets(const std::vector<ILDecodedInstr> &instrs, unsigned cbCode)
+{
+    std::vector<int> indices(cbCode + 1, -1);
+    for (size_t i = 0; i < instrs.size(); i++)
+    {
+        indices[instrs[i].m_offset] = (int)i;
+    }
+
+    indices[cbCode] = (int)instrs.size();
+    return indices;
+}
+
+static int indexAt(const std::vector<int> &indices, UINT64 offset)
+{
+    return offset < indices.size() ? indices[offset] : -1;
+}
+
+struct DecodedBody
+{
+    unsigned m_flags;
+    unsigned m_maxStack;
+    mdToken m_tkLocals;
+    std::vector<ILDecodedInstr> m_instrs;
+    std::vector<int> m_indices;
+    std::vector<COR_ILMETHOD_SECT_EH_CLAUSE_FAT> m_clauses;
+};
+
+static bool decodeBody(LPCBYTE pBody, ULONG cbBody, DecodedBody * pDecoded, std::string * pError)
+{
+    if (GetMethodBodySize(pBody, cbBody) == 0)
+        return fail(pError, "the headers run past the body");
+
+    COR_ILMETHOD_DECODER decoder((const COR_ILMETHOD *)pBody);
+    pDecoded->m_flags = decoder.GetFlags();
+    pDecoded->m_maxStack = decoder.GetMaxStack();
+    pDecoded->m_tkLocals = decoder.GetLocalVarSigTok();
+
+    if (DecodeIL(decoder.Code, decoder.GetCodeSize(), &pDecoded->m_instrs) == false)
+        return fail(pError, "the code doesn't decode");
+
+    pDecoded->m_indices = mapOffsets(pDecoded->m_instrs, decoder.GetCodeSize());
+
+    unsigned nEH = decoder.EH != NULL ? decoder.EHCount() : 0;
+    for (unsigned iEH = 0; iEH < nEH; iEH++)
+    {
+        COR_ILMETHOD_SECT_EH_CLAUSE_FAT scratch;
+        pDecoded->m_clauses.push_back(*(const COR_ILMETHOD_SECT_EH_CLAUSE_FAT *)decoder.EH->EHClause(iEH, &scratch));
+    }
+
+    return true;
+}
+
+static bool compareInstrs(const DecodedBody &in, const DecodedBody &out, std::string * pError)
+{
+    if (in.m_instrs.size() != out.m_instrs.size())
+        return fail(pError, "%zu instructions in, %zu out", in.m_instrs.size(), out.m_instrs.size());
+
+    for (size_t i = 0; i < in.m_instrs.size(); i++)
+    {
+        const ILDecodedInstr &instrIn = in.m_instrs[i];
+        const ILDecodedInstr &instrOut = out.m_instrs[i];
+
+        if (GetShortBranchEncoding(instrIn.m_encoding) != GetShortBranchEncoding(instrOut.m_encoding))
+            return fail(pError, "instruction %zu: opcode %X in, %X out", i, instrIn.m_encoding, instrOut.m_encoding);
+
+        if (instrIn.m_operandKind == OperandBranch)
+        {
+            if (indexAt(out.m_indices, instrOut.m_operand) != indexAt(in.m_indices, instrIn.m_operand))
+                return fail(pError, "instruction %zu: branches elsewhere", i);
+        }
+        else if (instrIn.m_operandKind == OperandSwitch)
+        {
+            if (instrIn.m_switchTargets.size() != instrOut.m_switchTargets.size())
+                return fail(pError, "instruction %zu: switch has other targets", i);
+
+            for (size_t iTarget = 0; iTarget < instrIn.m_switchTargets.size(); iTarget++)
+            {
+                if (indexAt(out.m_indices, instrOut.m_switchTargets[iTarget]) != indexAt(in.m_indices, instrIn.m_switchTargets[iTarget]))
+                    return fail(pError, "instruction %zu: switch target %zu moved", i, iTarget);
+            }
+        }
+        else if (instrIn.m_encoding != instrOut.m_encoding || instrIn.m_cbOperand != instrOut.m_cbOperand ||
+            instrIn.m_operand != instrOut.m_operand)
+        {
+            return fail(pError, "instruction %zu: operand changed", i);
+        }
+    }
+
+    return true;
+}
+
+static bool compareClauses(const DecodedBody &in, const DecodedBody &out, std::string * pError)
+{
+    if (in.m_clauses.size() != out.m_clauses.size())
+        return fail(pError, "%zu EH clauses in, %zu out", in.m_clauses.size(), out.m_clauses.size());
+
+    for (size_t iEH = 0; iEH < in.m_clauses.size(); iEH++)
+    {
+        const COR_ILMETHOD_SECT_EH_CLAUSE_FAT &clauseIn = in.m_clauses[iEH];
+        const COR_ILMETHOD_SECT_EH_CLAUSE_FAT &clauseOut = out.m_clauses[iEH];
+
+        if (clauseIn.GetFlags() != clauseOut.GetFlags())
+            return fail(pError, "EH clause %zu: flags changed", iEH);
+
+        if (clauseOut.GetTryLength() == 0 || clauseOut.GetHandlerLength() == 0)
+            return fail(pError, "EH clause %zu: empty block", iEH);
+
+        // Each boundary is an instruction, and the same one as before
+        UINT64 boundariesIn[] = { clauseIn.GetTryOffset(), (UINT64)clauseIn.GetTryOffset() + clauseIn.GetTryLength(),
+            clauseIn.GetHandlerOffset(), (UINT64)clauseIn.GetHandlerOffset() + clauseIn.GetHandlerLength() };
+        UINT64 boundariesOut[] = { clauseOut.GetTryOffset(), (UINT64)clauseOut.GetTryOffset() + clauseOut.GetTryLength(),
+            clauseOut.GetHandlerOffset(), (UINT64)clauseOut.GetHandlerOffset() + clauseOut.GetHandlerLength() };
+
+        for (int i = 0; i < 4; i++)
+        {
+            int index = indexAt(out.m_indices, boundariesOut[i]);
+            if (index < 0 || index != indexAt(in.m_indices, boundariesIn[i]))
+                return fail(pError, "EH clause %zu: boundary %d moved", iEH, i);
+        }
+
+        if ((clauseIn.GetFlags() & COR_ILEXCEPTION_CLAUSE_FILTER) != 0)
+        {
+            int index = indexAt(out.m_indices, clauseOut.GetFilterOffset());
+            if (index < 0 || index != indexAt(in.m_indices, clauseIn.GetFilterOffset()))
+                return fail(pError, "EH clause %zu: filter moved", iEH);
+        }
+        else if (clauseIn.GetClassToken() != clauseOut.GetClassToken())
+        {
+            return fail(pError, "EH clause %zu: class token changed", iEH);
+        }
+    }
+
+    return true;
+}
+
+// Mocks one module: its metadata, the IL allocator and the profiler info that serves them
+class RoundTripHarness
+{
+public:
+    RoundTripHarness() : m_profilerInfo(&m_metaData, &m_methodMalloc)
+    {
+    }
+
+    // For fuzz inputs: a few methods to call, with signatures the stack simulation can
+    // read, and the method the inputs go into
+    void PrepareForInputs()
+    {
+        m_callTargets.push_back(m_metaData.AddMemberRef({ IMAGE_CEE_CS_CALLCONV_DEFAULT, 0, ELEMENT_TYPE_VOID }));
+        m_callTargets.push_back(m_metaData.AddMemberRef({ IMAGE_CEE_CS_CALLCONV_DEFAULT, 2, ELEMENT_TYPE_I4, ELEMENT_TYPE_I4, ELEMENT_TYPE_I4 }));
+        m_callTargets.push_back(m_metaData.AddMemberRef({ IMAGE_CEE_CS_CALLCONV_HASTHIS, 1, ELEMENT_TYPE_OBJECT, ELEMENT_TYPE_I4 }));
+        m_tkInputMethod = m_metaData.AddMethod({ IMAGE_CEE_CS_CALLCONV_DEFAULT, 0, ELEMENT_TYPE_VOID }, { CorILMethod_TinyFormat });
+
+        PrepareMockModuleContext(&m_metaData, &m_methodMalloc, m_context);
+    }
+
+    bool PrepareForAssembly(const char * szPath, std::string * pError)
+    {
+        MetadataReader reader;
+        if (reader.Load(szPath) == false || reader.Fill(&m_metaData) == false)
+        {
+            *pError = reader.GetError();
+            return false;
+        }
+
+        PrepareMockModuleContext(&m_metaData, &m_methodMalloc, m_context);
+        return true;
+    }
+
+    MockMetaData &GetMetaData()
+    {
+        return m_metaData;
+    }
+
+    const std::vector<mdToken> &GetCallTargets()
+    {
+        return m_callTargets;
+    }
+
+    RoundTripResult CheckInput(const BYTE * pData, size_t cbData, std::string * pError)
+    {
+        if (cbData < 2)
+            return RoundTripRefused;
+
+        MockMethod * pMethod = m_metaData.GetMethod(m_tkInputMethod);
+
+        // The selector: the number of int parameters, whether there's a this and an int return value
+        BYTE selector = pData[0];
+        ULONG cParams = selector & 7;
+        pMethod->m_sig.assign({ (BYTE)((selector & 8) ? IMAGE_CEE_CS_CALLCONV_HASTHIS : IMAGE_CEE_CS_CALLCONV_DEFAULT),
+            (BYTE)cParams, (BYTE)((selector & 0x10) ? ELEMENT_TYPE_I4 : ELEMENT_TYPE_VOID) });
+        pMethod->m_sig.insert(pMethod->m_sig.end(), cParams, ELEMENT_TYPE_I4);
+        pMethod->m_body.assign(pData + 1, pData + cbData);
+
+        return Check(m_tkInputMethod, pError);
+    }
+
+    RoundTripResult Check(mdMethodDef tkMethod, std::string * pError)
+    {
+        MockMethod * pMethod = m_metaData.GetMethod(tkMethod);
+
+        std::vector<BYTE> out;
+        if (FAILED(RoundTripIL(&m_profilerInfo, &out, k_moduleId, tkMethod, m_context)))
+            return RoundTripRefused;
+
+        std::vector<BYTE> in = pMethod->m_body;
+        if (checkBodies(in, out, pError) == false)
+            return RoundTripFailed;
+
+        // The output goes back in as it is
+        std::vector<BYTE> again;
+        pMethod->m_body = out;
+        HRESULT hr = RoundTripIL(&m_profilerInfo, &again, k_moduleId, tkMethod, m_context);
+        pMethod->m_body = in;
+
+        if (FAILED(hr))
+        {
+            fail(pError, "the output is refused: %08X", (unsigned)hr);
+            return RoundTripFailed;
+        }
+
+        if (again != out)
+        {
+            fail(pError, "the output changes on a second round-trip");
+            return RoundTripFailed;
+        }
+
+        return RoundTripPassed;
+    }
+
+private:
+    bool checkBodies(const std::vector<BYTE> &in, const std::vector<BYTE> &out, std::string * pError)
+    {
+        // Export pads the code to 4 bytes even without sections
+        ULONG cbOut = GetMethodBodySize(out.data(), (ULONG)out.size());
+        if (cbOut == 0 || out.size() - cbOut >= 4)
+            return fail(pError, "the output isn't one whole body");
+
+        // The rewriter refuses what doesn't decode, so this reads the input safely
+        DecodedBody decodedIn;
+        DecodedBody decodedOut;
+        std::string error;
+        if (decodeBody(in.data(), (ULONG)in.size(), &decodedIn, &error) == false)
+            return fail(pError, "accepted an input where %s", error.c_str());
+
+        if (decodeBody(out.data(), (ULONG)out.size(), &decodedOut, &error) == false)
+            return fail(pError, "output: %s", error.c_str());
+
+        if ((decodedIn.m_flags & CorILMethod_InitLocals) != (decodedOut.m_flags & CorILMethod_InitLocals) ||
+            decodedIn.m_tkLocals != decodedOut.m_tkLocals)
+            return fail(pError, "the locals changed");
+
+        // The imported max stack is the floor; the stack can't get deeper than one push
+        // per instruction, plus the exception of a handler
+        unsigned maxStackBound = (unsigned)decodedIn.m_instrs.size() + 1;
+        if (decodedOut.m_maxStack < decodedIn.m_maxStack ||
+            (decodedOut.m_maxStack > decodedIn.m_maxStack && decodedOut.m_maxStack > maxStackBound))
+            return fail(pError, "max stack %u in, %u out", decodedIn.m_maxStack, decodedOut.m_maxStack);
+
+        return compareInstrs(decodedIn, decodedOut, pError) && compareClauses(decodedIn, decodedOut, pError);
+    }
+
+    static const ModuleID k_moduleId = 1;
+
+    MockMetaData m_metaData;
+    MockMethodMalloc m_methodMalloc;
+    MockProfilerInfo m_profilerInfo;
+    ModuleContext m_context;
+
+    std::vector<mdToken> m_callTargets;
+    mdMethodDef m_tkInputMethod = mdMethodDefNil;
+};
+
+static RoundTripHarness * getInputHarness()
+{
+    static RoundTripHarness * s_pHarness = nullptr;
+    if (s_pHarness == nullptr)
+    {
+        s_pHarness = new RoundTripHarness();
+        s_pHarness->PrepareForInputs();
+    }
+
+    return s_pHarness;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * pData, size_t cbData)
+{
+    std::string error;
+    if (getInputHarness()->CheckInput(pData, cbData, &error) == RoundTripFailed)
+    {
+        fprintf(stderr, "round-trip failed: %s\n", error.c_str());
+        abort();
+    }
+
+    return 0;
+}
+
+#ifndef COREPROFILER_LIBFUZZER
+
+static void appendUInt16(std::vector<BYTE> &bytes, UINT16 value)
+{
+    bytes.push_back((BYTE)value);
+    bytes.push_back((BYTE)(value >> 8));
+}
+
+static void appendUInt32(std::vector<BYTE> &bytes, UINT32 value)
+{
+    appendUInt16(bytes, (UINT16)value);
+    appendUInt16(bytes, (UINT16)(value >> 16));
+}
+
+// A fuzz input of random instructions, mostly well-formed: branches and EH clauses land on
+// instructions, calls go to methods with readable signatures.  A quarter of the inputs get
+// a few bytes flipped on top.
+static std::vector<BYTE> generateInput(std::mt19937 &rng, const std::vector<mdToken> &callTargets)
+{
+    static const unsigned s_branches[] = { 0x2B, 0x2C, 0x2D, 0x38, 0x39, 0x3A, 0x3B, 0x42, 0x44, 0xDD, 0xDE, 0x45 };
+    static const BYTE s_tokenTables[] = { 0x01, 0x02, 0x04, 0x06, 0x0A, 0x11, 0x1B, 0x2B, 0x70 };
+
+    struct GeneratedInstr
+    {
+        unsigned m_encoding;
+        ILOperandKind m_operandKind;
+        unsigned m_cbOperand;
+        UINT64 m_operand;
+        std::vector<unsigned> m_targets;
+        unsigned m_cbInstr;
+    };
+
+    unsigned nInstrs = 1 + rng() % 48;
+    std::vector<GeneratedInstr> instrs(nInstrs);
+
+    // Targets are instruction indices; now and then the end of the code, which isn't valid
+    auto pickTarget = [&]() { return (rng() % 16 == 0) ? nInstrs : rng() % nInstrs; };
+
+    std::vector<unsigned> offsets(nInstrs + 1);
+    for (unsigned i = 0; i < nInstrs; i++)
+    {
+        GeneratedInstr &instr = instrs[i];
+        for (;;)
+        {
+            if (rng() % 6 == 0)
+                instr.m_encoding = s_branches[rng() % _countof(s_branches)];
+            else
+                instr.m_encoding = (rng() % 8 == 0) ? (0xFE00 | (rng() % 0x20)) : (rng() % 0xE1);
+
+            if (GetILOperand(instr.m_encoding, &instr.m_operandKind, &instr.m_cbOperand) == true)
+                break;
+        }
+
+        instr.m_operand = ((UINT64)rng() << 32) | rng();
+        if (instr.m_operandKind == OperandToken)
+        {
+            bool fCall = instr.m_encoding == 0x28 || instr.m_encoding == 0x6F || instr.m_encoding == 0x73;
+            if (fCall && rng() % 4 != 0)
+                instr.m_operand = callTargets[rng() % callTargets.size()];
+            else
+                instr.m_operand = TokenFromRid(rng() % 8, (UINT32)s_tokenTables[rng() % _countof(s_tokenTables)] << 24);
+        }
+        else if (instr.m_operandKind == OperandVar)
+        {
+            instr.m_operand %= 4;
+        }
+        else if (instr.m_operandKind == OperandBranch)
+        {
+            instr.m_targets.push_back(pickTarget());
+        }
+        else if (instr.m_operandKind == OperandSwitch)
+        {
+            unsigned nTargets = rng() % 4;
+            for (unsigned iTarget = 0; iTarget < nTargets; iTarget++)
+                instr.m_targets.push_back(pickTarget());
+        }
+
+        instr.m_cbInstr = ((instr.m_encoding > 0xFF) ? 2 : 1) + instr.m_cbOperand +
+            ((instr.m_operandKind == OperandSwitch) ? 4 * (unsigned)instr.m_targets.size() : 0);
+        offsets[i + 1] = offsets[i] + instr.m_cbInstr;
+    }
+
+    std::vector<BYTE> code;
+    for (unsigned i = 0; i < nInstrs; i++)
+    {
+        const GeneratedInstr &instr = instrs[i];
+        if (instr.m_encoding > 0xFF)
+            code.push_back(0xFE);
+        code.push_back((BYTE)instr.m_encoding);
+
+        UINT64 operand = instr.m_operand;
+        if (instr.m_operandKind == OperandSwitch)
+        {
+            appendUInt32(code, (UINT32)instr.m_targets.size());
+            for (unsigned target : instr.m_targets)
+                appendUInt32(code, offsets[target] - offsets[i + 1]);
+            continue;
+        }
+
+        // A short branch that doesn't reach gets a wrong target, which is fine too
+        if (instr.m_operandKind == OperandBranch)
+            operand = (UINT64)(INT64)((INT32)offsets[instr.m_targets[0]] - (INT32)offsets[i + 1]);
+
+        for (unsigned iByte = 0; iByte < instr.m_cbOperand; iByte++)
+            code.push_back((BYTE)(operand >> (8 * iByte)));
+    }
+
+    // Clauses run between instructions, now and then off by a byte
+    auto pickBlock = [&](UINT32 * pOffset, UINT32 * pLength)
+    {
+        unsigned begin = rng() % nInstrs;
+        unsigned end = begin + 1 + rng() % (nInstrs - begin);
+        *pOffset = offsets[begin] + ((rng() % 16 == 0) ? 1 : 0);
+        *pLength = offsets[end] - *pOffset;
+    };
+
+    static const DWORD s_ehFlags[] = { COR_ILEXCEPTION_CLAUSE_NONE, COR_ILEXCEPTION_CLAUSE_FILTER,
+        COR_ILEXCEPTION_CLAUSE_FINALLY, COR_ILEXCEPTION_CLAUSE_FAULT };
+
+    unsigned nEH = (rng() % 3 == 0) ? 1 + rng() % 2 : 0;
+    std::vector<IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT> clauses(nEH);
+    bool fSmallEH = rng() % 2 == 0;
+    for (IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT &clause : clauses)
+    {
+        UINT32 filterLength;
+        clause.Flags = (CorExceptionFlag)s_ehFlags[rng() % _countof(s_ehFlags)];
+        pickBlock(&clause.TryOffset, &clause.TryLength);
+        pickBlock(&clause.HandlerOffset, &clause.HandlerLength);
+        if (clause.Flags == COR_ILEXCEPTION_CLAUSE_FILTER)
+            pickBlock(&clause.FilterOffset, &filterLength);
+        else
+            clause.ClassToken = TokenFromRid(1 + rng() % 4, mdtTypeRef);
+
+        fSmallEH = fSmallEH && clause.TryOffset <= 0xFFFF && clause.TryLength <= 0xFF &&
+            clause.HandlerOffset <= 0xFFFF && clause.HandlerLength <= 0xFF;
+    }
+
+    std::vector<BYTE> eh;
+    for (const IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT &clause : clauses)
+    {
+        if (fSmallEH)
+        {
+            appendUInt16(eh, (UINT16)clause.Flags);
+            appendUInt16(eh, (UINT16)clause.TryOffset);
+            eh.push_back((BYTE)clause.TryLength);
+            appendUInt16(eh, (UINT16)clause.HandlerOffset);
+            eh.push_back((BYTE)clause.HandlerLength);
+        }
+        else
+        {
+            appendUInt32(eh, clause.Flags);
+            appendUInt32(eh, clause.TryOffset);
+            appendUInt32(eh, clause.TryLength);
+            appendUInt32(eh, clause.HandlerOffset);
+            appendUInt32(eh, clause.HandlerLength);
+        }
+        appendUInt32(eh, clause.ClassToken);
+    }
+
+    std::vector<BYTE> input;
+    input.push_back((BYTE)rng());
+
+    if (nEH == 0 && code.size() < 64 && rng() % 3 == 0)
+    {
+        input.push_back((BYTE)(CorILMethod_TinyFormat | (code.size() << 2)));
+        input.insert(input.end(), code.begin(), code.end());
+    }
+    else
+    {
+        WORD flags = CorILMethod_FatFormat | ((rng() % 2) ? CorILMethod_InitLocals : 0) | (nEH ? CorILMethod_MoreSects : 0);
+        appendUInt16(input, (UINT16)(flags | (3 << 12)));
+        appendUInt16(input, (UINT16)(rng() % 12));
+        appendUInt32(input, (UINT32)code.size());
+        appendUInt32(input, 0);
+        input.insert(input.end(), code.begin(), code.end());
+
+        if (nEH != 0)
+        {
+            // The section starts 4-byte aligned from the header, one byte into the input
+            while ((input.size() - 1) % 4 != 0)
+                input.push_back(0);
+
+            UINT32 cbSect = 4 + (UINT32)eh.size();
+            input.push_back(CorILMethod_Sect_EHTable | (fSmallEH ? 0 : CorILMethod_Sect_FatFormat));
+            input.push_back((BYTE)cbSect);
+            input.push_back(fSmallEH ? 0 : (BYTE)(cbSect >> 8));
+            input.push_back(fSmallEH ? 0 : (BYTE)(cbSect >> 16));
+            input.insert(input.end(), eh.begin(), eh.end());
+        }
+    }
+
+    if (rng() % 4 == 0)
+    {
+        for (unsigned cFlips = 1 + rng() % 3; cFlips > 0; cFlips--)
+            input[1 + rng() % (input.size() - 1)] ^= (BYTE)(1 << (rng() % 8));
+    }
+
+    return input;
+}
+
+static bool readFile(const char * szPath, std::vector<BYTE> * pBytes)
+{
+    FILE * pFile = fopen(szPath, "rb");
+    if (pFile == nullptr)
+        return false;
+
+    BYTE buffer[4096];
+    size_t cbRead;
+    pBytes->clear();
+    while ((cbRead = fread(buffer, 1, sizeof(buffer), pFile)) > 0)
+        pBytes->insert(pBytes->end(), buffer, buffer + cbRead);
+
+    fclose(pFile);
+    return true;
+}
+
+// The selector of a fuzz input for a real signature, as near as it gets
+static BYTE getSelector(const std::vector<BYTE> &sig)
+{
+    if (sig.size() < 3)
+        return 0;
+
+    BYTE cParams = (sig[1] < 8) ? sig[1] : 7;
+    return (BYTE)(cParams | ((sig[0] & IMAGE_CEE_CS_CALLCONV_HASTHIS) ? 8 : 0) | ((sig[2] != ELEMENT_TYPE_VOID) ? 0x10 : 0));
+}
+
+static bool checkAssembly(const char * szPath, const char * szCorpusDir, RoundTripStats * pStats)
+{
+    RoundTripHarness harness;
+    std::string error;
+    if (harness.PrepareForAssembly(szPath, &error) == false)
+    {
+        fprintf(stderr, "%s: %s\n", szPath, error.c_str());
+        return false;
+    }
+
+    const char * szName = strrchr(szPath, '/');
+    szName = (szName != nullptr) ? szName + 1 : szPath;
+
+    for (const auto &method : harness.GetMetaData().GetMethods())
+    {
+        if (method.second.m_body.empty() == true)
+            continue;
+
+        RoundTripResult result = harness.Check(method.first, &error);
+        pStats->Add(result);
+        if (result == RoundTripFailed)
+            fprintf(stderr, "%s %08X: %s\n", szPath, (unsigned)method.first, error.c_str());
+
+        if (szCorpusDir != nullptr)
+        {
+            std::string path = std::string(szCorpusDir) + "/" + szName + "-" + std::to_string(method.first);
+            FILE * pFile = fopen(path.c_str(), "wb");
+            if (pFile != nullptr)
+            {
+                BYTE selector = getSelector(method.second.m_sig);
+                fwrite(&selector, 1, 1, pFile);
+                fwrite(method.second.m_body.data(), 1, method.second.m_body.size(), pFile);
+                fclose(pFile);
+            }
+        }
+    }
+
+    return true;
+}
+
+static void checkInputFile(const char * szPath, RoundTripStats * pStats)
+{
+    std::vector<BYTE> input;
+    if (readFile(szPath, &input) == false)
+    {
+        fprintf(stderr, "%s: can't read\n", szPath);
+        pStats->m_cFailed++;
+        return;
+    }
+
+    std::string error;
+    RoundTripResult result = getInputHarness()->CheckInput(input.data(), input.size(), &error);
+    pStats->Add(result);
+    if (result == RoundTripFailed)
+        fprintf(stderr, "%s: %s\n", szPath, error.c_str());
+}
+
+static void checkPath(const char * szPath, const char * szCorpusDir, RoundTripStats * pStats)
+{
+    struct stat st;
+    if (stat(szPath, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        DIR * pDir = opendir(szPath);
+        if (pDir == nullptr)
+            return;
+
+        while (struct dirent * pEntry = readdir(pDir))
+        {
+            if (pEntry->d_name[0] != '.')
+                checkPath((std::string(szPath) + "/" + pEntry->d_name).c_str(), szCorpusDir, pStats);
+        }
+
+        closedir(pDir);
+        return;
+    }
+
+    // Assemblies start with the MZ of their PE header
+    FILE * pFile = fopen(szPath, "rb");
+    BYTE magic[2] = {};
+    bool fAssembly = pFile != nullptr && fread(magic, 1, 2, pFile) == 2 && magic[0] == 'M' && magic[1] == 'Z';
+    if (pFile != nullptr)
+        fclose(pFile);
+
+    if (fAssembly == true)
+    {
+        if (checkAssembly(szPath, szCorpusDir, pStats) == false)
+            pStats->m_cFailed++;
+    }
+    else
+    {
+        checkInputFile(szPath, pStats);
+    }
+}
+
+int main(int argc, char * argv[])
+{
+    unsigned long cRandom = 0;
+    unsigned long seed = 1;
+    const char * szCorpusDir = nullptr;
+    std::vector<const char *> paths;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--random") == 0 && i + 1 < argc)
+            cRandom = strtoul(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            seed = strtoul(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--write-corpus") == 0 && i + 1 < argc)
+            szCorpusDir = argv[++i];
+        else
+            paths.push_back(argv[i]);
+    }
+
+    if (cRandom == 0 && paths.empty() == true)
+    {
+        fprintf(stderr, "usage: RoundTripFuzzer [--random N] [--seed S] [--write-corpus DIR] input|directory|assembly.dll...\n");
+        return 2;
+    }
+
+    RoundTripStats stats;
+
+    std::mt19937 rng((std::mt19937::result_type)seed);
+    for (unsigned long i = 0; i < cRandom; i++)
+    {
+        std::vector<BYTE> input = generateInput(rng, getInputHarness()->GetCallTargets());
+
+        std::string error;
+        RoundTripResult result = getInputHarness()->CheckInput(input.data(), input.size(), &error);
+        stats.Add(result);
+        if (result == RoundTripFailed)
+            fprintf(stderr, "random input %lu (seed %lu): %s\n", i, seed, error.c_str());
+    }
+
+    for (const char * szPath : paths)
+    {
+        checkPath(szPath, szCorpusDir, &stats);
+    }
+
+    printf("%llu passed, %llu refused, %llu failed\n", (unsigned long long)stats.m_cPassed,
+        (unsigned long long)stats.m_cRefused, (unsigned long long)stats.m_cFailed);
+    return stats.m_cFailed == 0 ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,196 @@
+#include "stdafx.h"
+#include "EventTrace.h"
+#include "Constants.h"
+#include "Misc.h"
+
+#include <thread>
+
+// Throughput of the binary trace with --threads producers, 1, 2, 4, ... of them, each
+// recording --events events.  First through TraceRing alone, each producer with a consumer
+// draining its ring as fast as it can and spinning while the ring is full; then through
+// EventTrace::Record, with the drainer writing --file every TRACE_DRAIN_INTERVAL_MS or when a
+// ring is half full, where an event that finds its ring full is dropped.  On fewer cores than threads, that measures
+// contention only.
+//
+//     TraceBenchmark [--threads N] [--events N] [--file path]
+
+// Methods the events cycle through, as the probes of a small hot loop would
+#define TRACE_BENCHMARK_METHODS 64
+
+static void ringProducer(TraceRing * pRing, int cEvents)
+{
+    TraceEvent event = {};
+    event.m_threadId = getCurrentThreadId();
+    event.m_flags = TRACE_EVENT_ENTER;
+
+    for (int i = 0; i < cEvents; i++)
+    {
+        event.m_tkMethod = TokenFromRid(i % TRACE_BENCHMARK_METHODS + 1, mdtMethodDef);
+        event.m_timestamp = getTimestamp();
+
+        while (pRing->TryPush(event) == 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+static void ringConsumer(TraceRing * pRing, int cEvents)
+{
+    std::vector<TraceEvent> buffer(TRACE_RING_CAPACITY);
+
+    int cDrained = 0;
+    while (cDrained < cEvents)
+    {
+        ULONG cEventsDrained = pRing->Drain(buffer.data(), TRACE_RING_CAPACITY);
+        if (cEventsDrained == 0)
+        {
+            std::this_thread::yield();
+        }
+
+        cDrained += cEventsDrained;
+    }
+}
+
+static double measureRings(int cThreads, int cEvents)
+{
+    std::vector<std::unique_ptr<TraceRing>> rings;
+    for (int i = 0; i < cThreads; i++)
+    {
+        rings.emplace_back(new TraceRing());
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < cThreads; i++)
+    {
+        threads.emplace_back(ringConsumer, rings[i].get(), cEvents);
+        threads.emplace_back(ringProducer, rings[i].get(), cEvents);
+    }
+
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return (double)cThreads * cEvents / seconds;
+}
+
+static void recordEvents(EventTrace * pTrace, int cEvents)
+{
+    for (int i = 0; i < cEvents; i++)
+    {
+        pTrace->Record(TokenFromRid(i % TRACE_BENCHMARK_METHODS + 1, mdtMethodDef), 0, TRACE_EVENT_ENTER);
+    }
+}
+
+static double measureTrace(int cThreads, int cEvents, const std::string &path, UINT64 * pcDropped, UINT64 * pcbFile)
+{
+    // Read by the constructor
+    setenv(toUtf8(ENV_TRACE_FILE).c_str(), path.c_str(), 1);
+
+    EventTrace trace;
+    trace.Start();
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < cThreads; i++)
+    {
+        threads.emplace_back(recordEvents, &trace, cEvents);
+    }
+
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    trace.Stop();
+    *pcDropped = trace.GetDroppedCount();
+
+    std::error_code error;
+    *pcbFile = std::filesystem::file_size(path, error);
+    if (error)
+    {
+        *pcbFile = 0;
+    }
+
+    return (double)cThreads * cEvents / seconds;
+}
+
+int main(int argc, char * argv[])
+{
+    int cMaxThreads = max(4, (int)std::thread::hardware_concurrency());
+    int cEvents = 1000000;
+    std::string path = (std::filesystem::temp_directory_path() /
+        ("TraceBenchmark." + std::to_string(getCurrentProcessId()) + ".trace")).string();
+    bool fRemoveFile = true;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            cMaxThreads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--events") == 0 && i + 1 < argc)
+        {
+            cEvents = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--file") == 0 && i + 1 < argc)
+        {
+            path = argv[++i];
+            fRemoveFile = false;
+        }
+        else
+        {
+            cMaxThreads = 0;
+            break;
+        }
+    }
+
+    if (cMaxThreads <= 0 || cEvents <= 0)
+    {
+        fprintf(stderr, "usage: TraceBenchmark [--threads N] [--events N] [--file path]\n");
+        return 2;
+    }
+
+    printf("%d events per thread, %u cores\n", cEvents, std::thread::hardware_concurrency());
+
+    for (int cThreads = 1; cThreads <= cMaxThreads; cThreads *= 2)
+    {
+        double rate = measureRings(cThreads, cEvents);
+        printf("rings  %2d threads: %12.0f events/s  %12.0f per thread  %6.1f ns/event\n", cThreads, rate,
+            rate / cThreads, 1e9 * cThreads / rate);
+    }
+
+    int result = 0;
+    for (int cThreads = 1; cThreads <= cMaxThreads; cThreads *= 2)
+    {
+        UINT64 cDropped = 0;
+        UINT64 cbFile = 0;
+        double rate = measureTrace(cThreads, cEvents, path, &cDropped, &cbFile);
+
+        UINT64 cRecorded = (UINT64)cThreads * cEvents;
+        UINT64 cWritten = cRecorded - cDropped;
+        printf("record %2d threads: %12.0f events/s  %12.0f per thread  %5.1f%% dropped  %5.2f B/event written\n",
+            cThreads, rate, rate / cThreads, 100.0 * cDropped / cRecorded, cWritten ? (double)cbFile / cWritten : 0.0);
+
+        if (cbFile == 0)
+        {
+            fprintf(stderr, "%s: no trace written\n", path.c_str());
+            result = 1;
+        }
+    }
+
+    if (fRemoveFile == true)
+    {
+        std::error_code error;
+        std::filesystem::remove(path, error);
+    }
+
+    return result;
+}
@@ -0,0 +1,269 @@
+#pragma once
+
+// Layout of the COREPROFILER_TRACE_FILE trace, shared by the profiler, which writes it,
+// and TraceReader, which reads it. Kept free of Windows and CLR headers so the reader
+// builds anywhere.
+//
+// File:   TraceFileHeader, then chunks until the end of the file.
+// Chunk:  TraceChunkHeader, then m_cbStored bytes of payload; with
+//         TRACE_CHUNK_COMPRESSED the payload is a TraceCompress block of m_cbRaw bytes.
+//
+// Payload of a names chunk, m_cRecords times:
+//     TRACE_CHUNK_MODULE_NAMES    varint cookie, varint length, UTF-8 module path
+//     TRACE_CHUNK_METHOD_NAMES    varint cookie, varint token, varint length, UTF-8 Type::Method
+// A name is written once, ahead of the first events chunk that refers to it.
+//
+// Payload of a TRACE_CHUNK_EVENTS chunk, m_cRecords times:
+//     byte flags (TRACE_EVENT_*), then the zigzag varint deltas of thread id, module
+//     cookie, method token and timestamp from the previous event of the chunk
+// Every chunk starts from zero, so chunks decode independently.
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+const uint32_t TRACE_FILE_MAGIC = 0x54525043;       // "CPRT"
+const uint32_t TRACE_FILE_VERSION = 2;
+
+#define TRACE_EVENT_ENTER 0x1
+#define TRACE_EVENT_EXIT 0x2
+
+enum TraceChunkKind : uint8_t
+{
+    TRACE_CHUNK_MODULE_NAMES = 1,
+    TRACE_CHUNK_METHOD_NAMES = 2,
+    TRACE_CHUNK_EVENTS = 3,
+};
+
+#define TRACE_CHUNK_COMPRESSED 0x1
+
+// Bounds what a reader has to buffer for one chunk
+#define TRACE_CHUNK_MAX_RAW_SIZE (4 * 1024 * 1024)
+
+#pragma pack(push, 1)
+
+struct TraceFileHeader
+{
+    uint32_t m_magic;
+    uint32_t m_version;
+    uint64_t m_timestampFrequency;      // timestamp ticks per second
+};
+
+struct TraceChunkHeader
+{
+    uint8_t  m_kind;        // TraceChunkKind
+    uint8_t  m_flags;       // TRACE_CHUNK_*
+    uint16_t m_reserved;
+    uint32_t m_cbStored;
+    uint32_t m_cbRaw;
+    uint32_t m_cRecords;
+};
+
+#pragma pack(pop)
+
+inline void TracePutVarint(std::vector<uint8_t> &buffer, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        buffer.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+
+    buffer.push_back((uint8_t)value);
+}
+
+inline void TracePutSignedVarint(std::vector<uint8_t> &buffer, int64_t value)
+{
+    TracePutVarint(buffer, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+// Returns false at the end of the input or on a malformed varint
+inline bool TraceGetVarint(const uint8_t *&pCur, const uint8_t *pEnd, uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64 && pCur < pEnd; shift += 7)
+    {
+        uint8_t byte = *pCur++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+inline bool TraceGetSignedVarint(const uint8_t *&pCur, const uint8_t *pEnd, int64_t &value)
+{
+    uint64_t encoded = 0;
+    if (TraceGetVarint(pCur, pEnd, encoded) == false)
+    {
+        return false;
+    }
+
+    value = (int64_t)(encoded >> 1) ^ -(int64_t)(encoded & 1);
+    return true;
+}
+
+// Block compression in the manner of LZ4: a sequence is a token byte (literal length in
+// the high nibble, match length - TRACE_LZ_MIN_MATCH in the low one, 15 meaning more
+// follows in 255-continued bytes), the literals, then a 2 byte little-endian match
+// offset. The last sequence has literals only.
+#define TRACE_LZ_MIN_MATCH 4
+#define TRACE_LZ_HASH_BITS 12
+
+inline void tracePutLength(std::vector<uint8_t> &out, size_t length)
+{
+    while (length >= 255)
+    {
+        out.push_back(255);
+        length -= 255;
+    }
+
+    out.push_back((uint8_t)length);
+}
+
+inline void traceFlushSequence(std::vector<uint8_t> &out, const uint8_t *pLiterals, size_t cLiterals,
+    size_t offset, size_t matchLength)
+{
+    size_t matchCode = matchLength == 0 ? 0 : matchLength - TRACE_LZ_MIN_MATCH;
+
+    out.push_back((uint8_t)(((cLiterals < 15 ? cLiterals : 15) << 4) | (matchCode < 15 ? matchCode : 15)));
+    if (cLiterals >= 15)
+    {
+        tracePutLength(out, cLiterals - 15);
+    }
+
+    out.insert(out.end(), pLiterals, pLiterals + cLiterals);
+
+    if (matchLength != 0)
+    {
+        out.push_back((uint8_t)offset);
+        out.push_back((uint8_t)(offset >> 8));
+        if (matchCode >= 15)
+        {
+            tracePutLength(out, matchCode - 15);
+        }
+    }
+}
+
+inline void TraceCompress(const uint8_t *pIn, size_t cbIn, std::vector<uint8_t> &out)
+{
+    out.clear();
+
+    uint32_t table[1 << TRACE_LZ_HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+
+    size_t anchor = 0;
+    size_t pos = 0;
+
+    while (pos + TRACE_LZ_MIN_MATCH <= cbIn)
+    {
+        uint32_t sequence;
+        memcpy(&sequence, pIn + pos, sizeof(sequence));
+        uint32_t hash = (sequence * 2654435761u) >> (32 - TRACE_LZ_HASH_BITS);
+
+        uint32_t candidate = table[hash];
+        table[hash] = (uint32_t)pos;
+
+        if (candidate == 0xffffffff || pos - candidate > 0xffff || memcmp(pIn + candidate, pIn + pos, TRACE_LZ_MIN_MATCH) != 0)
+        {
+            pos++;
+            continue;
+        }
+
+        size_t matchLength = TRACE_LZ_MIN_MATCH;
+        while (pos + matchLength < cbIn && pIn[candidate + matchLength] == pIn[pos + matchLength])
+        {
+            matchLength++;
+        }
+
+        traceFlushSequence(out, pIn + anchor, pos - anchor, pos - candidate, matchLength);
+
+        pos += matchLength;
+        anchor = pos;
+    }
+
+    traceFlushSequence(out, pIn + anchor, cbIn - anchor, 0, 0);
+}
+
+inline bool traceGetLength(const uint8_t *&pCur, const uint8_t *pEnd, size_t &length)
+{
+    for (;;)
+    {
+        if (pCur >= pEnd)
+        {
+            return false;
+        }
+
+        uint8_t byte = *pCur++;
+        length += byte;
+        if (byte != 255)
+        {
+            return true;
+        }
+    }
+}
+
+// Returns false unless pIn decodes to exactly cbOut bytes
+inline bool TraceDecompress(const uint8_t *pIn, size_t cbIn, uint8_t *pOut, size_t cbOut)
+{
+    const uint8_t *pCur = pIn;
+    const uint8_t *pEnd = pIn + cbIn;
+    size_t outPos = 0;
+
+    while (pCur < pEnd)
+    {
+        uint8_t token = *pCur++;
+
+        size_t cLiterals = token >> 4;
+        if (cLiterals == 15 && traceGetLength(pCur, pEnd, cLiterals) == false)
+        {
+            return false;
+        }
+
+        if (cLiterals > (size_t)(pEnd - pCur) || cLiterals > cbOut - outPos)
+        {
+            return false;
+        }
+
+        memcpy(pOut + outPos, pCur, cLiterals);
+        pCur += cLiterals;
+        outPos += cLiterals;
+
+        if (pCur == pEnd)
+        {
+            // The last sequence has no match
+            break;
+        }
+
+        if (pEnd - pCur < 2)
+        {
+            return false;
+        }
+
+        size_t offset = pCur[0] | ((size_t)pCur[1] << 8);
+        pCur += 2;
+
+        size_t matchLength = token & 0xf;
+        if (matchLength == 15 && traceGetLength(pCur, pEnd, matchLength) == false)
+        {
+            return false;
+        }
+        matchLength += TRACE_LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > outPos || matchLength > cbOut - outPos)
+        {
+            return false;
+        }
+
+        // Byte by byte: the match may overlap what it produces
+        for (size_t i = 0; i < matchLength; i++, outPos++)
+        {
+            pOut[outPos] = pOut[outPos - offset];
+        }
+    }
+
+    return outPos == cbOut;
+}
@@ -144,6 +144,9 @@ private:
 
 protected:
 
+    // position of the next byte to be parsed, for callers that need the raw blob of a part
+    sig_byte *GetCurrentPosition() { return pbCur; }
+
     // subtype these methods to create your parser side-effects
 
     //----------------------------------------------------
@@ -4,13 +4,15 @@
 
 #pragma once
 
+#ifdef _WIN32
+
 #ifndef STRICT
 #define STRICT
 #endif
 
 #include "targetver.h"
 
-#define _ATL_APARTMENT_THREADED
+#define _ATL_FREE_THREADED
 
 #define _ATL_NO_AUTOMATIC_NAMESPACE
 
@@ -53,7 +55,39 @@
 #include <atlctl.h>
 
 #include <corprof.h>
+
+#else
+
+// The CoreCLR PAL headers declare the Windows types the profiling API uses
+#include "math.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "stdarg.h"
+#include "limits.h"
+#include "string.h"
+#include <assert.h>
+
+#include "cor.h"
+#include "corhdr.h"
+#include "corhlpr.h"
+#include "corerror.h"
+#include "corprof.h"
+
+#endif
+
 #include <iostream>
 #include <fstream>
 #include <vector>
-#include <map>
\ No newline at end of file
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <string>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <filesystem>
+
+#include "Platform.h"
\ No newline at end of file
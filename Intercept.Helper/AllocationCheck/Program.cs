@@ -0,0 +1,76 @@
+﻿using System;
+using System.Diagnostics;
+using System.IO;
+using Intercept.Helper;
+
+namespace AllocationCheck
+{
+    // Calls the typed and exit probes the way instrumented methods do, once to warm them
+    // up, then many times, and fails if the calling thread allocated anything the second
+    // time. The probes call into the profiler, so libCoreProfiler.so has to be on
+    // LD_LIBRARY_PATH (ctest sets it).
+    class Program
+    {
+        const int Iterations = 1000;
+        const int ModuleCookie = 0;
+
+        enum Color { Red, Green }
+
+        // Its fields are only read by the probe's field dumper
+#pragma warning disable 414
+        class Sample
+        {
+            static long s_total = 7;
+
+            int m_count = 3;
+            string m_name = "sample";
+            double m_ratio = 0.1;
+            Color m_color = Color.Green;
+        }
+#pragma warning restore 414
+
+        static int Main(string[] args)
+        {
+            Sample sample = new Sample();
+            Action[] probes =
+            {
+                () => ManagedLayer.Enter(0x06000001, ModuleCookie, null),
+                () => ManagedLayer.Enter(0x06000002, ModuleCookie, null, -1, long.MinValue, true, 'c'),
+                () => ManagedLayer.Enter(0x06000003, ModuleCookie, sample, 0.1, 1.5f, "text", Color.Green),
+                () => ManagedLayer.Enter(0x06000004, ModuleCookie, null, (byte)1, (sbyte)-2, (short)3, (ushort)4, 5u, ulong.MaxValue, (IntPtr)(-7), (UIntPtr)8),
+                () => ManagedLayer.Exit(0x06000005, ModuleCookie, Stopwatch.GetTimestamp()),
+                () => ManagedLayer.Exit(42, 0x06000006, ModuleCookie, Stopwatch.GetTimestamp()),
+                () => ManagedLayer.Exit("text", 0x06000007, ModuleCookie, Stopwatch.GetTimestamp()),
+            };
+
+            // The first calls show what the probes write
+            foreach (Action probe in probes)
+            {
+                probe();
+            }
+
+            TextWriter console = Console.Out;
+            Console.SetOut(new StreamWriter(Stream.Null) { AutoFlush = true });
+
+            int failures = 0;
+            for (int i = 0; i < probes.Length; i++)
+            {
+                long before = GC.GetAllocatedBytesForCurrentThread();
+                for (int iteration = 0; iteration < Iterations; iteration++)
+                {
+                    probes[i]();
+                }
+
+                long allocated = GC.GetAllocatedBytesForCurrentThread() - before;
+                console.WriteLine("probe {0}: {1} B allocated over {2} calls", i, allocated, Iterations);
+
+                if (allocated != 0)
+                {
+                    failures++;
+                }
+            }
+
+            return failures == 0 ? 0 : 1;
+        }
+    }
+}
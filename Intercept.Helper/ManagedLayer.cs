@@ -1,6 +1,8 @@
 ﻿using System;
 using System.Diagnostics;
 using System.Reflection;
+using System.Runtime.CompilerServices;
+using System.Runtime.InteropServices;
 using System.Text;
 
 [assembly: System.Security.SecurityCritical]
@@ -32,6 +34,227 @@ namespace Intercept.Helper
             Console.WriteLine(sb.ToString());
         }
 
+        // Fast probe: the profiler passes the method token and a cookie for its module,
+        // and resolves the name itself once the module unloads.
+        [System.Security.SecuritySafeCritical]
+        public static void Enter(int methodToken, int moduleCookie)
+        {
+            OnMethodEnter(methodToken, moduleCookie);
+        }
+
+        [DllImport("CoreProfiler", CallingConvention = CallingConvention.StdCall)]
+        [System.Security.SuppressUnmanagedCodeSecurity]
+        private static extern void OnMethodEnter(int methodToken, int moduleCookie);
+
+        // Exit probes, with COREPROFILER_EXIT_PROBES=1: the profiler stores EnterTimestamp() in
+        // a local at entry and passes it back when the method returns, or leaves by an
+        // exception through the fault clause wrapped around its body.  The time spent goes
+        // into the method's latency histogram in the profiler.  Only with
+        // COREPROFILER_RETURN_VALUES=1 does it call Exit<TResult> on returns, which also logs
+        // the return value; that costs a console write per return, so it's meant for tracing
+        // a few modules, not for measuring them.
+
+        [System.Security.SecuritySafeCritical]
+        public static long EnterTimestamp()
+        {
+            return Stopwatch.GetTimestamp();
+        }
+
+        [System.Security.SecuritySafeCritical]
+        public static void Exit(int methodToken, int moduleCookie, long startTimestamp)
+        {
+            OnMethodExit(methodToken, moduleCookie, Stopwatch.GetTimestamp() - startTimestamp);
+        }
+
+        [System.Security.SecuritySafeCritical]
+        [MethodImpl(MethodImplOptions.NoInlining)]
+        public static void Exit<TResult>(TResult returnValue, int methodToken, int moduleCookie, long startTimestamp)
+        {
+            long elapsedTicks = Stopwatch.GetTimestamp() - startTimestamp;
+
+            // Skip this method
+            string methodName = TraceWriter.GetMethodName(methodToken, moduleCookie, 1);
+
+            TraceWriter writer = TraceWriter.Begin();
+            writer.Append("[Profiler] ");
+            writer.Append(methodName);
+            writer.Append(" returned ");
+            writer.Append(returnValue);
+            writer.WriteLine();
+
+            OnMethodExit(methodToken, moduleCookie, elapsedTicks);
+        }
+
+        [DllImport("CoreProfiler", CallingConvention = CallingConvention.StdCall)]
+        [System.Security.SuppressUnmanagedCodeSecurity]
+        private static extern void OnMethodExit(int methodToken, int moduleCookie, long elapsedTicks);
+
+        // With COREPROFILER_SAMPLING, lets every intervalth call of a method through to the probes
+        [System.Security.SecuritySafeCritical]
+        public static void SetSamplingInterval(int interval)
+        {
+            SetSamplingIntervalNative(interval);
+        }
+
+        [DllImport("CoreProfiler", EntryPoint = "SetSamplingInterval", CallingConvention = CallingConvention.StdCall)]
+        [System.Security.SuppressUnmanagedCodeSecurity]
+        private static extern void SetSamplingIntervalNative(int interval);
+
+        // Typed probes: methods with up to 8 arguments call the overload of their arity,
+        // instantiated with their own argument types, so the call site neither allocates
+        // an object[] nor boxes value types. They also pass their token and module cookie,
+        // by which TraceWriter keeps the method's name after a first stack walk.
+
+        [System.Security.SecuritySafeCritical]
+        public static void Enter(int methodToken, int moduleCookie, object thisObject)
+        {
+            TraceWriter writer = BeginTrace(methodToken, moduleCookie, thisObject);
+            writer.Append("[No args]");
+
+            writer.WriteLine();
+        }
+
+        [System.Security.SecuritySafeCritical]
+        public static void Enter<T1>(int methodToken, int moduleCookie, object thisObject, T1 arg1)
+        {
+            TraceWriter writer = BeginTrace(methodToken, moduleCookie, thisObject);
+            writer.Append("[# of args: 1]");
+            DumpArgument(writer, arg1);
+
+            writer.WriteLine();
+        }
+
+        [System.Security.SecuritySafeCritical]
+        public static void Enter<T1, T2>(int methodToken, int moduleCookie, object thisObject, T1 arg1, T2 arg2)
+        {
+            TraceWriter writer = BeginTrace(methodToken, moduleCookie, thisObject);
+            writer.Append("[# of args: 2]");
+            DumpArgument(writer, arg1);
+            DumpArgument(writer, arg2);
+
+            writer.WriteLine();
+        }
+
+        [System.Security.SecuritySafeCritical]
+        public static void Enter<T1, T2, T3>(int methodToken, int moduleCookie, object thisObject, T1 arg1, T2 arg2, T3 arg3)
+        {
+            TraceWriter writer = BeginTrace(methodToken, moduleCookie, thisObject);
+            writer.Append("[# of args: 3]");
+            DumpArgument(writer, arg1);
+            DumpArgument(writer, arg2);
+            DumpArgument(writer, arg3);
+
+            writer.WriteLine();
+        }
+
+        [System.Security.SecuritySafeCritical]
+        public static void Enter<T1, T2, T3, T4>(int methodToken, int moduleCookie, object thisObject, T1 arg1, T2 arg2, T3 arg3, T4 arg4)
+        {
+            TraceWriter writer = BeginTrace(methodToken, moduleCookie, thisObject);
+            writer.Append("[# of args: 4]");
+            DumpArgument(writer, arg1);
+            DumpArgument(writer, arg2);
+            DumpArgument(writer, arg3);
+            DumpArgument(writer, arg4);
+
+            writer.WriteLine();
+        }
+
+        [System.Security.SecuritySafeCritical]
+        public static void Enter<T1, T2, T3, T4, T5>(int methodToken, int moduleCookie, object thisObject, T1 arg1, T2 arg2, T3 arg3, T4 arg4, T5 arg5)
+        {
+            TraceWriter writer = BeginTrace(methodToken, moduleCookie, thisObject);
+            writer.Append("[# of args: 5]");
+            DumpArgument(writer, arg1);
+            DumpArgument(writer, arg2);
+            DumpArgument(writer, arg3);
+            DumpArgument(writer, arg4);
+            DumpArgument(writer, arg5);
+
+            writer.WriteLine();
+        }
+
+        [System.Security.SecuritySafeCritical]
+        public static void Enter<T1, T2, T3, T4, T5, T6>(int methodToken, int moduleCookie, object thisObject, T1 arg1, T2 arg2, T3 arg3, T4 arg4, T5 arg5, T6 arg6)
+        {
+            TraceWriter writer = BeginTrace(methodToken, moduleCookie, thisObject);
+            writer.Append("[# of args: 6]");
+            DumpArgument(writer, arg1);
+            DumpArgument(writer, arg2);
+            DumpArgument(writer, arg3);
+            DumpArgument(writer, arg4);
+            DumpArgument(writer, arg5);
+            DumpArgument(writer, arg6);
+
+            writer.WriteLine();
+        }
+
+        [System.Security.SecuritySafeCritical]
+        public static void Enter<T1, T2, T3, T4, T5, T6, T7>(int methodToken, int moduleCookie, object thisObject, T1 arg1, T2 arg2, T3 arg3, T4 arg4, T5 arg5, T6 arg6, T7 arg7)
+        {
+            TraceWriter writer = BeginTrace(methodToken, moduleCookie, thisObject);
+            writer.Append("[# of args: 7]");
+            DumpArgument(writer, arg1);
+            DumpArgument(writer, arg2);
+            DumpArgument(writer, arg3);
+            DumpArgument(writer, arg4);
+            DumpArgument(writer, arg5);
+            DumpArgument(writer, arg6);
+            DumpArgument(writer, arg7);
+
+            writer.WriteLine();
+        }
+
+        [System.Security.SecuritySafeCritical]
+        public static void Enter<T1, T2, T3, T4, T5, T6, T7, T8>(int methodToken, int moduleCookie, object thisObject, T1 arg1, T2 arg2, T3 arg3, T4 arg4, T5 arg5, T6 arg6, T7 arg7, T8 arg8)
+        {
+            TraceWriter writer = BeginTrace(methodToken, moduleCookie, thisObject);
+            writer.Append("[# of args: 8]");
+            DumpArgument(writer, arg1);
+            DumpArgument(writer, arg2);
+            DumpArgument(writer, arg3);
+            DumpArgument(writer, arg4);
+            DumpArgument(writer, arg5);
+            DumpArgument(writer, arg6);
+            DumpArgument(writer, arg7);
+            DumpArgument(writer, arg8);
+
+            writer.WriteLine();
+        }
+
+        [MethodImpl(MethodImplOptions.NoInlining)]
+        private static TraceWriter BeginTrace(int methodToken, int moduleCookie, object thisObject)
+        {
+            // Skip this method and the Enter overload that called it
+            string methodName = TraceWriter.GetMethodName(methodToken, moduleCookie, 2);
+
+            TraceWriter writer = TraceWriter.Begin();
+            writer.Append("[Profiler] ");
+            writer.Append(methodName);
+            writer.Append(" called");
+            writer.AppendLine();
+
+            if (thisObject == null)
+            {
+                writer.Append("(static)");
+                writer.AppendLine();
+            }
+            else
+            {
+                writer.AppendFields(thisObject);
+            }
+
+            return writer;
+        }
+
+        private static void DumpArgument<T>(TraceWriter writer, T value)
+        {
+            writer.Append("[arg: ");
+            writer.Append(value);
+            writer.Append(']');
+            writer.AppendLine();
+        }
+
         private static void DumpParameters(StringBuilder sb, object[] parameters)
         {
             if (parameters == null)
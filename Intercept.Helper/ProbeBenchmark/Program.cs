@@ -0,0 +1,239 @@
+﻿using System;
+using System.Diagnostics;
+using System.IO;
+using System.Reflection;
+using System.Reflection.Emit;
+using System.Runtime.CompilerServices;
+using System.Runtime.InteropServices;
+using Intercept.Helper;
+
+namespace ProbeBenchmark
+{
+    // Calls each probe the way an instrumented method with an int and a string argument
+    // does, and prints the time and the bytes allocated per call, less those of the loop
+    // alone. The probes that call into the profiler need libCoreProfiler.so on
+    // LD_LIBRARY_PATH; outside the runtime no module is registered with it, so the native
+    // side returns before counting.
+    //
+    // Then the sampling guard of COREPROFILER_SAMPLING, emitted as the rewriter does in front
+    // of the fast probe, at several intervals and with the window shut, less a loop emitted
+    // the same way without the guard or the probe.
+    //
+    //     ProbeBenchmark [iterations]
+    class Program
+    {
+        const int MethodToken = 0x06000001;
+        const int ModuleCookie = 0;
+
+        static readonly string s_text = "text";
+
+        // The loops are kept out of line so that each is compiled on its own
+
+        [MethodImpl(MethodImplOptions.NoInlining)]
+        static void Empty(int iterations)
+        {
+            for (int i = 0; i < iterations; i++)
+            {
+                Consume(i, s_text);
+            }
+        }
+
+        // The probe of a module outside COREPROFILER_FAST_PROBE_MODULES without the typed
+        // probes: the call site boxes its arguments into an object[], and the probe finds
+        // the method's name by a stack walk and reflection on every call
+        [MethodImpl(MethodImplOptions.NoInlining)]
+        static void Reflection(int iterations)
+        {
+            for (int i = 0; i < iterations; i++)
+            {
+                ManagedLayer.Enter(null, new object[] { i, s_text });
+                Consume(i, s_text);
+            }
+        }
+
+        // The typed probe: no object[], no boxing, and the name is cached by the token
+        [MethodImpl(MethodImplOptions.NoInlining)]
+        static void Typed(int iterations)
+        {
+            for (int i = 0; i < iterations; i++)
+            {
+                ManagedLayer.Enter(MethodToken, ModuleCookie, null, i, s_text);
+                Consume(i, s_text);
+            }
+        }
+
+        // The fast probe of COREPROFILER_FAST_PROBE_MODULES: the token and the cookie only
+        [MethodImpl(MethodImplOptions.NoInlining)]
+        static void Fast(int iterations)
+        {
+            for (int i = 0; i < iterations; i++)
+            {
+                ManagedLayer.Enter(MethodToken, ModuleCookie);
+                Consume(i, s_text);
+            }
+        }
+
+        // The cells the guard reads, as SamplingControl and ProbeRegistry hold them
+        class GuardCells
+        {
+            public IntPtr WindowOpen;
+            public IntPtr Interval;
+            public IntPtr Counter;
+        }
+
+        static void EmitLdcPtr(ILGenerator il, IntPtr p)
+        {
+            il.Emit(OpCodes.Ldc_I8, p.ToInt64());
+            il.Emit(OpCodes.Conv_I);
+        }
+
+        // The loop of Fast, or with fProbe false of Empty, in IL; with cells, the probe is
+        // behind the guard of AddSamplingGuard
+        static Action<int> EmitLoop(bool fProbe, GuardCells cells)
+        {
+            DynamicMethod method = new DynamicMethod("Loop", null, new Type[] { typeof(int) }, typeof(Program), true);
+            ILGenerator il = method.GetILGenerator();
+            LocalBuilder i = il.DeclareLocal(typeof(int));
+            Label body = il.DefineLabel();
+            Label skip = il.DefineLabel();
+            Label condition = il.DefineLabel();
+
+            il.Emit(OpCodes.Ldc_I4_0);
+            il.Emit(OpCodes.Stloc, i);
+            il.Emit(OpCodes.Br, condition);
+            il.MarkLabel(body);
+
+            if (cells != null)
+            {
+                // if (*pWindowOpen == 0) goto skip;
+                EmitLdcPtr(il, cells.WindowOpen);
+                il.Emit(OpCodes.Ldind_I4);
+                il.Emit(OpCodes.Brfalse, skip);
+
+                // if (--*pCounter > 0) goto skip;
+                EmitLdcPtr(il, cells.Counter);
+                il.Emit(OpCodes.Dup);
+                il.Emit(OpCodes.Ldind_I4);
+                il.Emit(OpCodes.Ldc_I4_1);
+                il.Emit(OpCodes.Sub);
+                il.Emit(OpCodes.Stind_I4);
+                EmitLdcPtr(il, cells.Counter);
+                il.Emit(OpCodes.Ldind_I4);
+                il.Emit(OpCodes.Ldc_I4_0);
+                il.Emit(OpCodes.Bgt, skip);
+
+                // *pCounter = *pInterval;
+                EmitLdcPtr(il, cells.Counter);
+                EmitLdcPtr(il, cells.Interval);
+                il.Emit(OpCodes.Ldind_I4);
+                il.Emit(OpCodes.Stind_I4);
+            }
+
+            if (fProbe)
+            {
+                il.Emit(OpCodes.Ldc_I4, MethodToken);
+                il.Emit(OpCodes.Ldc_I4, ModuleCookie);
+                il.Emit(OpCodes.Call, typeof(ManagedLayer).GetMethod("Enter", new Type[] { typeof(int), typeof(int) }));
+            }
+
+            il.MarkLabel(skip);
+            il.Emit(OpCodes.Ldloc, i);
+            il.Emit(OpCodes.Ldsfld, typeof(Program).GetField("s_text", BindingFlags.NonPublic | BindingFlags.Static));
+            il.Emit(OpCodes.Call, typeof(Program).GetMethod("Consume", BindingFlags.NonPublic | BindingFlags.Static));
+
+            il.Emit(OpCodes.Ldloc, i);
+            il.Emit(OpCodes.Ldc_I4_1);
+            il.Emit(OpCodes.Add);
+            il.Emit(OpCodes.Stloc, i);
+            il.MarkLabel(condition);
+            il.Emit(OpCodes.Ldloc, i);
+            il.Emit(OpCodes.Ldarg_0);
+            il.Emit(OpCodes.Blt, body);
+            il.Emit(OpCodes.Ret);
+
+            return (Action<int>)method.CreateDelegate(typeof(Action<int>));
+        }
+
+        static void MeasureGuard(TextWriter output, int iterations)
+        {
+            GuardCells cells = new GuardCells();
+            cells.WindowOpen = Marshal.AllocHGlobal(sizeof(int));
+            cells.Interval = Marshal.AllocHGlobal(sizeof(int));
+            cells.Counter = Marshal.AllocHGlobal(sizeof(int));
+
+            try
+            {
+                Marshal.WriteInt32(cells.WindowOpen, 1);
+                Marshal.WriteInt32(cells.Interval, 1);
+                Marshal.WriteInt32(cells.Counter, 1);
+
+                double loopNs = Measure(output, "emitted", EmitLoop(false, null), iterations, 0);
+                Measure(output, "emitted fast", EmitLoop(true, null), iterations, loopNs);
+
+                // One loop for all, as the interval changes without a re-JIT
+                Action<int> guarded = EmitLoop(true, cells);
+                foreach (int interval in new int[] { 1, 10, 100, 1000 })
+                {
+                    Marshal.WriteInt32(cells.Interval, interval);
+                    Measure(output, "guard 1/" + interval, guarded, iterations, loopNs);
+                }
+
+                Marshal.WriteInt32(cells.WindowOpen, 0);
+                Measure(output, "guard shut", guarded, iterations, loopNs);
+            }
+            finally
+            {
+                Marshal.FreeHGlobal(cells.WindowOpen);
+                Marshal.FreeHGlobal(cells.Interval);
+                Marshal.FreeHGlobal(cells.Counter);
+            }
+        }
+
+        // Stands for the body of the instrumented method
+        [MethodImpl(MethodImplOptions.NoInlining)]
+        static void Consume(int value, string text)
+        {
+        }
+
+        // Returns the ns per call, including the loop
+        static double Measure(TextWriter output, string name, Action<int> loop, int iterations, double loopNs)
+        {
+            // Warms up the probe's caches as well as the loop
+            loop(Math.Min(iterations, 1000));
+
+            long allocatedBefore = GC.GetAllocatedBytesForCurrentThread();
+            Stopwatch stopwatch = Stopwatch.StartNew();
+            loop(iterations);
+            stopwatch.Stop();
+            long allocated = GC.GetAllocatedBytesForCurrentThread() - allocatedBefore;
+
+            double ns = stopwatch.Elapsed.TotalMilliseconds * 1e6 / iterations;
+            output.WriteLine("{0,-12} {1,10:F1} ns/call  {2,8:F1} B/call", name, ns - loopNs, (double)allocated / iterations);
+            return ns;
+        }
+
+        static int Main(string[] args)
+        {
+            int iterations = args.Length > 0 ? int.Parse(args[0]) : 1000000;
+            if (iterations <= 0)
+            {
+                Console.Error.WriteLine("usage: ProbeBenchmark [iterations]");
+                return 2;
+            }
+
+            // What the tracing probes write isn't measured
+            TextWriter output = Console.Out;
+            Console.SetOut(new StreamWriter(Stream.Null));
+
+            output.WriteLine("{0} calls each, less the loop alone; the reflection probe gets a hundredth", iterations);
+
+            double loopNs = Measure(output, "loop", Empty, iterations, 0);
+            Measure(output, "reflection", Reflection, Math.Max(iterations / 100, 1), loopNs);
+            Measure(output, "typed", Typed, iterations, loopNs);
+            Measure(output, "fast", Fast, iterations, loopNs);
+            MeasureGuard(output, iterations);
+
+            return 0;
+        }
+    }
+}
@@ -0,0 +1,383 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Linq.Expressions;
+using System.Reflection;
+using System.Reflection.Emit;
+using System.Runtime.CompilerServices;
+using System.Runtime.InteropServices;
+
+namespace Intercept.Helper
+{
+    // Builds the text of the tracing probes in a per-thread buffer and writes it with a
+    // single call to Console.Out. Values go through Append<T>, which picks a formatter once
+    // per type: primitives, strings and enums are written without boxing or temporary
+    // strings, anything else with its ToString. Method names and the field dumpers of the
+    // this-objects are cached too, so once a method has been traced its probes allocate
+    // nothing for such values.
+    internal sealed class TraceWriter
+    {
+        [ThreadStatic]
+        private static TraceWriter t_writer;
+
+        private static readonly Dictionary<long, string> s_methodNames = new Dictionary<long, string>();
+        private static readonly Dictionary<Type, Action<TraceWriter, object>> s_fieldDumpers = new Dictionary<Type, Action<TraceWriter, object>>();
+
+        private static readonly Dictionary<Type, Delegate> s_primitiveFormatters = new Dictionary<Type, Delegate>
+        {
+            { typeof(string), new Action<TraceWriter, string>((writer, value) => writer.Append(value)) },
+            { typeof(char), new Action<TraceWriter, char>((writer, value) => writer.Append(value)) },
+            { typeof(bool), new Action<TraceWriter, bool>((writer, value) => writer.Append(value ? "True" : "False")) },
+            { typeof(sbyte), new Action<TraceWriter, sbyte>((writer, value) => writer.AppendSigned(value)) },
+            { typeof(short), new Action<TraceWriter, short>((writer, value) => writer.AppendSigned(value)) },
+            { typeof(int), new Action<TraceWriter, int>((writer, value) => writer.AppendSigned(value)) },
+            { typeof(long), new Action<TraceWriter, long>((writer, value) => writer.AppendSigned(value)) },
+            { typeof(IntPtr), new Action<TraceWriter, IntPtr>((writer, value) => writer.AppendSigned((long)value)) },
+            { typeof(byte), new Action<TraceWriter, byte>((writer, value) => writer.AppendUnsigned(value)) },
+            { typeof(ushort), new Action<TraceWriter, ushort>((writer, value) => writer.AppendUnsigned(value)) },
+            { typeof(uint), new Action<TraceWriter, uint>((writer, value) => writer.AppendUnsigned(value)) },
+            { typeof(ulong), new Action<TraceWriter, ulong>((writer, value) => writer.AppendUnsigned(value)) },
+            { typeof(UIntPtr), new Action<TraceWriter, UIntPtr>((writer, value) => writer.AppendUnsigned((ulong)value)) },
+            { typeof(float), new Action<TraceWriter, float>((writer, value) => writer.AppendFloatingPoint(value, true)) },
+            { typeof(double), new Action<TraceWriter, double>((writer, value) => writer.AppendFloatingPoint(value, false)) },
+        };
+
+        private const BindingFlags DumpedFields = BindingFlags.Public | BindingFlags.NonPublic | BindingFlags.Static | BindingFlags.Instance;
+
+        private char[] m_chars = new char[256];
+        private int m_length;
+        private bool m_fInUse;
+
+        // Filled by FormatFloatingPoint
+        private readonly byte[] m_number = new byte[32];
+
+        // The ToString of a value may be instrumented too; the probe it calls gets a writer
+        // of its own
+        public static TraceWriter Begin()
+        {
+            TraceWriter writer = t_writer;
+            if (writer == null)
+            {
+                writer = new TraceWriter();
+                t_writer = writer;
+            }
+            else if (writer.m_fInUse)
+            {
+                writer = new TraceWriter();
+            }
+
+            writer.m_fInUse = true;
+            writer.m_length = 0;
+            return writer;
+        }
+
+        // Ends the text with a newline and writes it
+        public void WriteLine()
+        {
+            AppendLine();
+            Console.Out.Write(m_chars, 0, m_length);
+            m_fInUse = false;
+        }
+
+        // The name of the instrumented method, walking the stack only the first time: depth
+        // is the number of frames between the caller and the instrumented method. Cookies
+        // aren't reused, so with the token they name the method for the life of the process.
+        [MethodImpl(MethodImplOptions.NoInlining)]
+        public static string GetMethodName(int methodToken, int moduleCookie, int depth)
+        {
+            long key = ((long)moduleCookie << 32) | (uint)methodToken;
+            string name;
+
+            if (moduleCookie >= 0)
+            {
+                lock (s_methodNames)
+                {
+                    if (s_methodNames.TryGetValue(key, out name))
+                    {
+                        return name;
+                    }
+                }
+            }
+
+            // Skip this method too
+            name = new StackFrame(depth + 1).GetMethod().Name;
+
+            if (moduleCookie >= 0)
+            {
+                lock (s_methodNames)
+                {
+                    s_methodNames[key] = name;
+                }
+            }
+
+            return name;
+        }
+
+        public void Append(string value)
+        {
+            if (value == null)
+            {
+                return;
+            }
+
+            Reserve(value.Length);
+            value.CopyTo(0, m_chars, m_length, value.Length);
+            m_length += value.Length;
+        }
+
+        public void Append(char value)
+        {
+            Reserve(1);
+            m_chars[m_length++] = value;
+        }
+
+        public void AppendLine()
+        {
+            Append(Environment.NewLine);
+        }
+
+        public void Append<T>(T value)
+        {
+            Formatter<T>.Append(this, value);
+        }
+
+        // One line per field of the object, static ones included
+        public void AppendFields(object thisObject)
+        {
+            Type type = thisObject.GetType();
+            Action<TraceWriter, object> dumper;
+
+            lock (s_fieldDumpers)
+            {
+                s_fieldDumpers.TryGetValue(type, out dumper);
+            }
+
+            if (dumper == null)
+            {
+                dumper = CreateFieldDumper(type);
+                int length = m_length;
+
+                try
+                {
+                    dumper(this, thisObject);
+                }
+                catch (Exception e) when (e is InvalidProgramException || e is MemberAccessException || e is System.Security.VerificationException)
+                {
+                    // Compiled on first use, and the type turned out not to be accessible
+                    m_length = length;
+                    dumper = CreateReflectionFieldDumper(type);
+                    dumper(this, thisObject);
+                }
+
+                lock (s_fieldDumpers)
+                {
+                    s_fieldDumpers[type] = dumper;
+                }
+
+                return;
+            }
+
+            dumper(this, thisObject);
+        }
+
+        private void AppendField<TField>(string name, TField value)
+        {
+            Append("[Field ");
+            Append(name);
+            Append(": ");
+            Append(value);
+            Append(']');
+            AppendLine();
+        }
+
+        private void AppendSigned(long value)
+        {
+            if (value < 0)
+            {
+                Append('-');
+                AppendUnsigned((ulong)(-(value + 1)) + 1);
+                return;
+            }
+
+            AppendUnsigned((ulong)value);
+        }
+
+        private void AppendUnsigned(ulong value)
+        {
+            int cDigits = 1;
+            for (ulong rest = value / 10; rest != 0; rest /= 10)
+            {
+                cDigits++;
+            }
+
+            Reserve(cDigits);
+            m_length += cDigits;
+
+            int i = m_length;
+            do
+            {
+                m_chars[--i] = (char)('0' + (int)(value % 10));
+                value /= 10;
+            }
+            while (value != 0);
+        }
+
+        private void AppendFloatingPoint(double value, bool fSingle)
+        {
+            if (double.IsNaN(value))
+            {
+                Append("NaN");
+                return;
+            }
+
+            if (double.IsInfinity(value))
+            {
+                Append(value > 0 ? "Infinity" : "-Infinity");
+                return;
+            }
+
+            int cb = FormatFloatingPoint(value, fSingle ? 1 : 0, m_number, m_number.Length);
+
+            Reserve(cb);
+            for (int i = 0; i < cb; i++)
+            {
+                m_chars[m_length++] = (char)m_number[i];
+            }
+        }
+
+        [DllImport("CoreProfiler", CallingConvention = CallingConvention.StdCall)]
+        [System.Security.SuppressUnmanagedCodeSecurity]
+        private static extern int FormatFloatingPoint(double value, int fSingle, [Out] byte[] buffer, int cbBuffer);
+
+        private void Reserve(int count)
+        {
+            if (m_length + count > m_chars.Length)
+            {
+                Array.Resize(ref m_chars, Math.Max(m_chars.Length * 2, m_length + count));
+            }
+        }
+
+        private static class Formatter<T>
+        {
+            public static readonly Action<TraceWriter, T> Append = CreateFormatter<T>();
+        }
+
+        private static Action<TraceWriter, T> CreateFormatter<T>()
+        {
+            Delegate formatter;
+            if (s_primitiveFormatters.TryGetValue(typeof(T), out formatter))
+            {
+                return (Action<TraceWriter, T>)formatter;
+            }
+
+            if (typeof(T).IsEnum)
+            {
+                return CreateEnumFormatter<T>();
+            }
+
+            return (writer, value) => writer.Append(value == null ? null : value.ToString());
+        }
+
+        // Enums print the name of their value if it has one, the number otherwise
+        private static Action<TraceWriter, T> CreateEnumFormatter<T>()
+        {
+            ParameterExpression parameter = Expression.Parameter(typeof(T), "value");
+            Func<T, long> toInt64 = Expression.Lambda<Func<T, long>>(Expression.Convert(parameter, typeof(long)), parameter).Compile();
+
+            Type underlyingType = Enum.GetUnderlyingType(typeof(T));
+            bool fUnsigned = underlyingType == typeof(byte) || underlyingType == typeof(ushort) ||
+                underlyingType == typeof(uint) || underlyingType == typeof(ulong);
+
+            Dictionary<long, string> names = new Dictionary<long, string>();
+            foreach (T value in (T[])Enum.GetValues(typeof(T)))
+            {
+                names[toInt64(value)] = Enum.GetName(typeof(T), value);
+            }
+
+            return (writer, value) =>
+            {
+                long number = toInt64(value);
+                string name;
+
+                if (names.TryGetValue(number, out name))
+                {
+                    writer.Append(name);
+                }
+                else if (fUnsigned)
+                {
+                    writer.AppendUnsigned((ulong)number);
+                }
+                else
+                {
+                    writer.AppendSigned(number);
+                }
+            };
+        }
+
+        // Compiles the field loads, so that fields of value types aren't boxed by GetValue
+        private static Action<TraceWriter, object> CreateFieldDumper(Type type)
+        {
+            try
+            {
+                DynamicMethod method = new DynamicMethod("DumpFields", null, new Type[] { typeof(TraceWriter), typeof(object) },
+                    typeof(TraceWriter).Module, true);
+                ILGenerator il = method.GetILGenerator();
+                MethodInfo appendField = typeof(TraceWriter).GetMethod("AppendField", BindingFlags.NonPublic | BindingFlags.Instance);
+
+                foreach (FieldInfo fieldInfo in type.GetFields(DumpedFields))
+                {
+                    Type fieldType = fieldInfo.FieldType;
+
+                    il.Emit(OpCodes.Ldarg_0);
+                    il.Emit(OpCodes.Ldstr, fieldInfo.Name);
+
+                    if (fieldInfo.IsLiteral)
+                    {
+                        // Constants have no storage to load from
+                        object constant = fieldInfo.GetValue(null);
+                        il.Emit(OpCodes.Ldstr, constant == null ? "" : constant.ToString());
+                        fieldType = typeof(string);
+                    }
+                    else if (fieldInfo.IsStatic)
+                    {
+                        il.Emit(OpCodes.Ldsfld, fieldInfo);
+                    }
+                    else
+                    {
+                        il.Emit(OpCodes.Ldarg_1);
+                        il.Emit(type.IsValueType ? OpCodes.Unbox : OpCodes.Castclass, type);
+                        il.Emit(OpCodes.Ldfld, fieldInfo);
+                    }
+
+                    if (fieldType.IsPointer)
+                    {
+                        il.Emit(OpCodes.Conv_U);
+                        fieldType = typeof(UIntPtr);
+                    }
+
+                    il.Emit(OpCodes.Call, appendField.MakeGenericMethod(fieldType));
+                }
+
+                il.Emit(OpCodes.Ret);
+                return (Action<TraceWriter, object>)method.CreateDelegate(typeof(Action<TraceWriter, object>));
+            }
+            catch (Exception e) when (e is NotSupportedException || e is ArgumentException || e is MemberAccessException)
+            {
+                return CreateReflectionFieldDumper(type);
+            }
+        }
+
+        private static Action<TraceWriter, object> CreateReflectionFieldDumper(Type type)
+        {
+            FieldInfo[] fields = type.GetFields(DumpedFields);
+
+            return (writer, thisObject) =>
+            {
+                foreach (FieldInfo fieldInfo in fields)
+                {
+                    writer.AppendField(fieldInfo.Name, fieldInfo.GetValue(thisObject));
+                }
+            };
+        }
+    }
+}
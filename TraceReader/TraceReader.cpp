@@ -0,0 +1,421 @@
+// TraceReader : Dumps or summarizes a COREPROFILER_TRACE_FILE trace.
+//
+//     TraceReader [--summary] <trace file>
+//
+// The file is mapped and decoded one chunk at a time, so memory use doesn't grow with
+// the size of the trace, only with the number of distinct modules and methods in it.
+
+#include "../CoreProfiler/TraceFormat.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+class MappedFile
+{
+public:
+    ~MappedFile()
+    {
+#ifdef _WIN32
+        if (m_pView != nullptr)
+        {
+            UnmapViewOfFile(m_pView);
+        }
+
+        if (m_hMapping != nullptr)
+        {
+            CloseHandle(m_hMapping);
+        }
+
+        if (m_hFile != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(m_hFile);
+        }
+#else
+        if (m_pView != nullptr)
+        {
+            munmap((void *)m_pView, m_cbView);
+        }
+#endif
+    }
+
+    bool Open(const char *szPath)
+    {
+#ifdef _WIN32
+        m_hFile = CreateFileA(szPath, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (m_hFile == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(m_hFile, &size) == FALSE || size.QuadPart == 0)
+        {
+            return false;
+        }
+
+        m_hMapping = CreateFileMappingA(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_hMapping == nullptr)
+        {
+            return false;
+        }
+
+        m_pView = (const uint8_t *)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+        m_cbView = (size_t)size.QuadPart;
+#else
+        int fd = open(szPath, O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        void *pView = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (pView == MAP_FAILED)
+        {
+            return false;
+        }
+
+        // Pages are read once, front to back
+        madvise(pView, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+        m_pView = (const uint8_t *)pView;
+        m_cbView = (size_t)st.st_size;
+#endif
+        return m_pView != nullptr;
+    }
+
+    const uint8_t *Data() const
+    {
+        return m_pView;
+    }
+
+    size_t Size() const
+    {
+        return m_cbView;
+    }
+
+    // Lets the OS drop pages that were decoded already
+    void Release(size_t offset, size_t cb)
+    {
+#ifndef _WIN32
+        const size_t cbPage = 64 * 1024;
+        size_t begin = (offset + cbPage - 1) / cbPage * cbPage;
+        size_t end = (offset + cb) / cbPage * cbPage;
+        if (end > begin)
+        {
+            madvise((void *)(m_pView + begin), end - begin, MADV_DONTNEED);
+        }
+#endif
+    }
+
+private:
+#ifdef _WIN32
+    HANDLE m_hFile = INVALID_HANDLE_VALUE;
+    HANDLE m_hMapping = nullptr;
+#endif
+    const uint8_t *m_pView = nullptr;
+    size_t m_cbView = 0;
+};
+
+struct MethodStats
+{
+    uint64_t m_enters = 0;
+    uint64_t m_exits = 0;
+};
+
+class TraceReader
+{
+public:
+    TraceReader(bool fSummary) : m_fSummary(fSummary)
+    {
+    }
+
+    int Run(const char *szPath)
+    {
+        MappedFile file;
+        if (file.Open(szPath) == false)
+        {
+            fprintf(stderr, "cannot map %s\n", szPath);
+            return 1;
+        }
+
+        if (file.Size() < sizeof(TraceFileHeader))
+        {
+            fprintf(stderr, "%s: too short for a trace\n", szPath);
+            return 1;
+        }
+
+        TraceFileHeader fileHeader;
+        memcpy(&fileHeader, file.Data(), sizeof(fileHeader));
+        if (fileHeader.m_magic != TRACE_FILE_MAGIC || fileHeader.m_version != TRACE_FILE_VERSION)
+        {
+            fprintf(stderr, "%s: not a version %u trace\n", szPath, TRACE_FILE_VERSION);
+            return 1;
+        }
+
+        m_ticksPerMicrosecond = fileHeader.m_timestampFrequency / 1000000.0;
+        if (m_ticksPerMicrosecond <= 0)
+        {
+            m_ticksPerMicrosecond = 1.0;
+        }
+
+        size_t offset = sizeof(TraceFileHeader);
+        while (offset < file.Size())
+        {
+            if (file.Size() - offset < sizeof(TraceChunkHeader))
+            {
+                fprintf(stderr, "truncated chunk header at offset %zu\n", offset);
+                return 1;
+            }
+
+            TraceChunkHeader header;
+            memcpy(&header, file.Data() + offset, sizeof(header));
+            offset += sizeof(header);
+
+            if (header.m_cbStored > file.Size() - offset || header.m_cbRaw > TRACE_CHUNK_MAX_RAW_SIZE)
+            {
+                fprintf(stderr, "truncated or oversized chunk at offset %zu\n", offset - sizeof(header));
+                return 1;
+            }
+
+            if (readChunk(header, file.Data() + offset) == false)
+            {
+                fprintf(stderr, "malformed chunk at offset %zu\n", offset - sizeof(header));
+                return 1;
+            }
+
+            file.Release(offset, header.m_cbStored);
+            offset += header.m_cbStored;
+        }
+
+        if (m_fSummary == true)
+        {
+            printSummary();
+        }
+
+        return 0;
+    }
+
+private:
+    bool readChunk(const TraceChunkHeader &header, const uint8_t *pStored)
+    {
+        const uint8_t *pPayload = pStored;
+        if ((header.m_flags & TRACE_CHUNK_COMPRESSED) != 0)
+        {
+            m_raw.resize(header.m_cbRaw);
+            if (TraceDecompress(pStored, header.m_cbStored, m_raw.data(), m_raw.size()) == false)
+            {
+                return false;
+            }
+            pPayload = m_raw.data();
+        }
+        else if (header.m_cbStored != header.m_cbRaw)
+        {
+            return false;
+        }
+
+        const uint8_t *pCur = pPayload;
+        const uint8_t *pEnd = pPayload + header.m_cbRaw;
+
+        switch (header.m_kind)
+        {
+        case TRACE_CHUNK_MODULE_NAMES:
+            for (uint32_t i = 0; i < header.m_cRecords; i++)
+            {
+                uint64_t cookie = 0;
+                std::string path;
+                if (TraceGetVarint(pCur, pEnd, cookie) == false || getString(pCur, pEnd, path) == false)
+                {
+                    return false;
+                }
+
+                m_modules[cookie] = path;
+            }
+            return true;
+
+        case TRACE_CHUNK_METHOD_NAMES:
+            for (uint32_t i = 0; i < header.m_cRecords; i++)
+            {
+                uint64_t cookie = 0;
+                uint64_t token = 0;
+                std::string name;
+                if (TraceGetVarint(pCur, pEnd, cookie) == false || TraceGetVarint(pCur, pEnd, token) == false ||
+                    getString(pCur, pEnd, name) == false)
+                {
+                    return false;
+                }
+
+                m_methods[methodKey(cookie, token)] = name;
+            }
+            return true;
+
+        case TRACE_CHUNK_EVENTS:
+            return readEvents(header.m_cRecords, pCur, pEnd);
+
+        default:
+            // Written by a later profiler; skipped
+            return true;
+        }
+    }
+
+    bool readEvents(uint32_t cEvents, const uint8_t *pCur, const uint8_t *pEnd)
+    {
+        int64_t threadId = 0;
+        int64_t cookie = 0;
+        int64_t token = 0;
+        int64_t timestamp = 0;
+
+        for (uint32_t i = 0; i < cEvents; i++)
+        {
+            if (pCur >= pEnd)
+            {
+                return false;
+            }
+
+            uint8_t flags = *pCur++;
+
+            int64_t delta[4];
+            for (int j = 0; j < 4; j++)
+            {
+                if (TraceGetSignedVarint(pCur, pEnd, delta[j]) == false)
+                {
+                    return false;
+                }
+            }
+
+            threadId += delta[0];
+            cookie += delta[1];
+            token += delta[2];
+            timestamp += delta[3];
+
+            if (m_fHaveFirstTimestamp == false)
+            {
+                m_firstTimestamp = timestamp;
+                m_fHaveFirstTimestamp = true;
+            }
+
+            if (m_fSummary == true)
+            {
+                MethodStats &stats = m_stats[methodKey((uint64_t)cookie, (uint64_t)token)];
+                if ((flags & TRACE_EVENT_ENTER) != 0)
+                {
+                    stats.m_enters++;
+                }
+                if ((flags & TRACE_EVENT_EXIT) != 0)
+                {
+                    stats.m_exits++;
+                }
+                continue;
+            }
+
+            printf("%14.3f %6" PRId64 " %-5s %s\n",
+                (timestamp - m_firstTimestamp) / m_ticksPerMicrosecond, threadId,
+                (flags & TRACE_EVENT_EXIT) != 0 ? "exit" : "enter",
+                methodName((uint64_t)cookie, (uint64_t)token).c_str());
+        }
+
+        return true;
+    }
+
+    void printSummary()
+    {
+        for (const auto &entry : m_stats)
+        {
+            printf("%12" PRIu64 " %12" PRIu64 "  %s\n", entry.second.m_enters, entry.second.m_exits,
+                methodName(entry.first >> 32, entry.first & 0xffffffff).c_str());
+        }
+    }
+
+    std::string methodName(uint64_t cookie, uint64_t token)
+    {
+        auto method = m_methods.find(methodKey(cookie, token));
+        if (method != m_methods.end())
+        {
+            return method->second;
+        }
+
+        char szToken[32];
+        snprintf(szToken, sizeof(szToken), "0x%08" PRIx64, token);
+
+        auto module = m_modules.find(cookie);
+        if (module != m_modules.end())
+        {
+            return module->second + "!" + szToken;
+        }
+
+        return std::to_string(cookie) + "!" + szToken;
+    }
+
+    static uint64_t methodKey(uint64_t cookie, uint64_t token)
+    {
+        return ((cookie & 0xffffffff) << 32) | (token & 0xffffffff);
+    }
+
+    static bool getString(const uint8_t *&pCur, const uint8_t *pEnd, std::string &value)
+    {
+        uint64_t cbValue = 0;
+        if (TraceGetVarint(pCur, pEnd, cbValue) == false || cbValue > (uint64_t)(pEnd - pCur))
+        {
+            return false;
+        }
+
+        value.assign((const char *)pCur, (size_t)cbValue);
+        pCur += cbValue;
+        return true;
+    }
+
+    bool m_fSummary;
+    double m_ticksPerMicrosecond = 1.0;
+    int64_t m_firstTimestamp = 0;
+    bool m_fHaveFirstTimestamp = false;
+
+    std::vector<uint8_t> m_raw;         // the decompressed chunk
+    std::unordered_map<uint64_t, std::string> m_modules;
+    std::unordered_map<uint64_t, std::string> m_methods;
+    std::unordered_map<uint64_t, MethodStats> m_stats;
+};
+
+int main(int argc, char *argv[])
+{
+    bool fSummary = false;
+    const char *szPath = nullptr;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--summary") == 0)
+        {
+            fSummary = true;
+        }
+        else
+        {
+            szPath = argv[i];
+        }
+    }
+
+    if (szPath == nullptr)
+    {
+        fprintf(stderr, "usage: TraceReader [--summary] <trace file>\n");
+        return 2;
+    }
+
+    TraceReader reader(fSummary);
+    return reader.Run(szPath);
+}